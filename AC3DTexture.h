@@ -82,6 +82,12 @@ typedef enum {
 	kAC3DTexturePixelFormat_RGBA_PVRTC4
 } AC3DTexturePixelFormat;
 
+typedef enum {
+	kAC3DTextureMipmapFilter_None = 0,
+	kAC3DTextureMipmapFilter_Box,		//Average of each 2x2 block of the stored values
+	kAC3DTextureMipmapFilter_Gamma		//Average of each 2x2 block in linear light, for sRGB images (alpha stays linear)
+} AC3DTextureMipmapFilter;
+
 //CLASS INTERFACES:
 
 /*
@@ -100,8 +106,10 @@ Be aware that the content of the generated textures will be upside-down!
 	AC3DTexturePixelFormat		_format;
 	GLfloat						_maxS,
 								_maxT;
+	NSUInteger					_levels;
 }
 - (id) initWithData:(const void*)data pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size;
+- (id) initWithData:(const void*)data pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size mipmapFilter:(AC3DTextureMipmapFilter)filter; //The mip chain is made on the CPU, each level converted from 8 bits per channel, ignored for PVRTC data
 
 @property(readonly) AC3DTexturePixelFormat pixelFormat;
 @property(readonly) NSUInteger pixelsWide;
@@ -112,6 +120,7 @@ Be aware that the content of the generated textures will be upside-down!
 @property(readonly, nonatomic) CGSize contentSize;
 @property(readonly) GLfloat maxS;
 @property(readonly) GLfloat maxT;
+@property(readonly) NSUInteger mipmapLevels; //1 when not mipmapped
 @end
 
 /*
@@ -134,8 +143,10 @@ Note that RGBA type textures will have their alpha premultiplied - use the blend
 - (id) initWithImagePath:(NSString*)path; //If the path is not absolute, it is assumed to be relative to the main bundle's resources
 - (id) initWithImagePath:(NSString*)path sizeToFit:(BOOL)sizeToFit; //For non-power-of-two images, if "sizeToFit" is YES, the image is scaled to power-of-two dimensions, otherwise extra margins are added
 - (id) initWithImagePath:(NSString*)path sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat;
+- (id) initWithImagePath:(NSString*)path sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat mipmapFilter:(AC3DTextureMipmapFilter)filter;
 
-- (id) initWithCGImage:(CGImageRef)image orientation:(UIImageOrientation)orientation sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat; //Primitive
+- (id) initWithCGImage:(CGImageRef)image orientation:(UIImageOrientation)orientation sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat;
+- (id) initWithCGImage:(CGImageRef)image orientation:(UIImageOrientation)orientation sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat mipmapFilter:(AC3DTextureMipmapFilter)filter; //Primitive
 @end
 
 /*
@@ -69,80 +69,380 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 //CONSTANTS:
 
 #define kMaxTextureSize		1024
+#define kGammaTableSize		4096
+
+//TYPES:
+
+typedef float AC3DVec4f __attribute__((vector_size(16))); //Same GCC vector extension as the rasterizer in ac3d_reader.m
+
+//CLASS INTERFACES:
+
+@interface AC3DTexture ()
+- (id) _initWithData:(const void*)data source:(const void*)source pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size mipmapFilter:(AC3DTextureMipmapFilter)filter;
+@end
+
+//LOCAL VARIABLES:
+
+static float					_linearTable[256], //sRGB byte to linear light
+								_unitTable[256]; //Byte to [0, 1]
+static unsigned char			_sRGBTable[kGammaTableSize]; //Linear light to sRGB byte
+static BOOL						_tablesReady = NO;
+
+//FUNCTIONS:
+
+static void _InitTables()
+{
+	NSUInteger				i;
+	float					v;
+	
+	for(i = 0; i < 256; ++i) {
+		v = (float)i / 255.0;
+		_unitTable[i] = v;
+		_linearTable[i] = (v <= 0.04045 ? v / 12.92 : powf((v + 0.055) / 1.055, 2.4));
+	}
+	for(i = 0; i < kGammaTableSize; ++i) {
+		v = (float)i / (float)(kGammaTableSize - 1);
+		v = (v <= 0.0031308 ? v * 12.92 : 1.055 * powf(v, 1.0 / 2.4) - 0.055);
+		_sRGBTable[i] = v * 255.0 + 0.5;
+	}
+	_tablesReady = YES;
+}
+
+static void _TexImage(AC3DTexturePixelFormat pixelFormat, GLint level, NSUInteger width, NSUInteger height, const void* data)
+{
+	switch(pixelFormat) {
+		
+		case kAC3DTexturePixelFormat_RGBA8888:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA4444:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA5551:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGB565:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGB888:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_L8:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_A8:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_LA88:
+		glTexImage2D(GL_TEXTURE_2D, level, GL_LUMINANCE_ALPHA, width, height, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGB_PVRTC2:
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RGB_PVRTC_2BPPV1_IMG, width, height, 0, (width * height) / 4, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGB_PVRTC4:
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RGB_PVRTC_4BPPV1_IMG, width, height, 0, (width * height) / 2, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA_PVRTC2:
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RGBA_PVRTC_2BPPV1_IMG, width, height, 0, (width * height) / 4, data);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA_PVRTC4:
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RGBA_PVRTC_4BPPV1_IMG, width, height, 0, (width * height) / 2, data);
+		break;
+		
+		default:
+		[NSException raise:NSInternalInconsistencyException format:@""];
+		
+	}
+}
+
+//NOTE: The channels the mip chain is built from i.e. the unpacked 8 bits per channel layout, 0 for compressed formats
+static NSUInteger _WorkingChannels(AC3DTexturePixelFormat pixelFormat)
+{
+	switch(pixelFormat) {
+		case kAC3DTexturePixelFormat_RGBA8888:
+		case kAC3DTexturePixelFormat_RGBA4444:
+		case kAC3DTexturePixelFormat_RGBA5551:
+		case kAC3DTexturePixelFormat_RGB565:
+		return 4;
+		case kAC3DTexturePixelFormat_RGB888:
+		return 3;
+		case kAC3DTexturePixelFormat_LA88:
+		return 2;
+		case kAC3DTexturePixelFormat_L8:
+		case kAC3DTexturePixelFormat_A8:
+		return 1;
+		default:
+		return 0;
+	}
+}
+
+//NOTE: Bit N set means channel N holds sRGB encoded color, alpha and masks are always linear
+static unsigned int _GammaChannels(AC3DTexturePixelFormat pixelFormat)
+{
+	switch(pixelFormat) {
+		case kAC3DTexturePixelFormat_RGBA8888:
+		case kAC3DTexturePixelFormat_RGBA4444:
+		case kAC3DTexturePixelFormat_RGBA5551:
+		case kAC3DTexturePixelFormat_RGB565:
+		case kAC3DTexturePixelFormat_RGB888:
+		return 0x7;
+		case kAC3DTexturePixelFormat_LA88:
+		case kAC3DTexturePixelFormat_L8:
+		return 0x1;
+		default:
+		return 0x0;
+	}
+}
+
+static BOOL _IsPacked(AC3DTexturePixelFormat pixelFormat)
+{
+	return ((pixelFormat == kAC3DTexturePixelFormat_RGBA4444) || (pixelFormat == kAC3DTexturePixelFormat_RGBA5551) || (pixelFormat == kAC3DTexturePixelFormat_RGB565) ? YES : NO);
+}
+
+//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to the layout of the pixel format (RGB888, RGB565, RGBA4444, RGBA5551 or LA88)
+static void _ConvertPixels(const unsigned char* inPixel8, void* outData, NSUInteger count, AC3DTexturePixelFormat pixelFormat)
+{
+	unsigned char*			outPixel8 = (unsigned char*)outData;
+	unsigned short*			outPixel16 = (unsigned short*)outData;
+	NSUInteger				i;
+	
+	switch(pixelFormat) {
+		
+		case kAC3DTexturePixelFormat_RGB888:
+		for(i = 0; i < count; ++i, inPixel8 += 4) {
+			*outPixel8++ = inPixel8[0];
+			*outPixel8++ = inPixel8[1];
+			*outPixel8++ = inPixel8[2];
+		}
+		break;
+		
+		case kAC3DTexturePixelFormat_RGB565:
+		for(i = 0; i < count; ++i, inPixel8 += 4)
+		*outPixel16++ = ((inPixel8[0] >> 3) << 11) | ((inPixel8[1] >> 2) << 5) | ((inPixel8[2] >> 3) << 0);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA4444:
+		for(i = 0; i < count; ++i, inPixel8 += 4)
+		*outPixel16++ = ((inPixel8[0] >> 4) << 12) | ((inPixel8[1] >> 4) << 8) | ((inPixel8[2] >> 4) << 4) | ((inPixel8[3] >> 4) << 0);
+		break;
+		
+		case kAC3DTexturePixelFormat_RGBA5551:
+		for(i = 0; i < count; ++i, inPixel8 += 4)
+		*outPixel16++ = ((inPixel8[0] >> 3) << 11) | ((inPixel8[1] >> 3) << 6) | ((inPixel8[2] >> 3) << 1) | ((inPixel8[3] >> 7) << 0);
+		break;
+		
+		case kAC3DTexturePixelFormat_LA88:
+		for(i = 0; i < count; ++i, inPixel8 += 4) {
+			*outPixel8++ = inPixel8[0];
+			*outPixel8++ = inPixel8[3];
+		}
+		break;
+		
+		default:
+		[NSException raise:NSInternalInconsistencyException format:@""];
+		
+	}
+}
+
+//Convert RGB565, RGBA4444 or RGBA5551 to "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" by bit replication
+static void _UnpackPixels(const void* inData, unsigned char* outPixel8, NSUInteger count, AC3DTexturePixelFormat pixelFormat)
+{
+	const unsigned short*	inPixel16 = (const unsigned short*)inData;
+	unsigned int			r, g, b, a;
+	NSUInteger				i;
+	
+	for(i = 0; i < count; ++i, ++inPixel16) {
+		switch(pixelFormat) {
+			
+			case kAC3DTexturePixelFormat_RGB565:
+			r = (*inPixel16 >> 11) & 0x1F;
+			g = (*inPixel16 >> 5) & 0x3F;
+			b = (*inPixel16 >> 0) & 0x1F;
+			r = (r << 3) | (r >> 2);
+			g = (g << 2) | (g >> 4);
+			b = (b << 3) | (b >> 2);
+			a = 0xFF;
+			break;
+			
+			case kAC3DTexturePixelFormat_RGBA4444:
+			r = ((*inPixel16 >> 12) & 0xF) * 0x11;
+			g = ((*inPixel16 >> 8) & 0xF) * 0x11;
+			b = ((*inPixel16 >> 4) & 0xF) * 0x11;
+			a = ((*inPixel16 >> 0) & 0xF) * 0x11;
+			break;
+			
+			default: //kAC3DTexturePixelFormat_RGBA5551
+			r = (*inPixel16 >> 11) & 0x1F;
+			g = (*inPixel16 >> 6) & 0x1F;
+			b = (*inPixel16 >> 1) & 0x1F;
+			r = (r << 3) | (r >> 2);
+			g = (g << 3) | (g >> 2);
+			b = (b << 3) | (b >> 2);
+			a = (*inPixel16 & 0x1 ? 0xFF : 0x00);
+			break;
+			
+		}
+		*outPixel8++ = r;
+		*outPixel8++ = g;
+		*outPixel8++ = b;
+		*outPixel8++ = a;
+	}
+}
+
+static inline AC3DVec4f _LoadPixel(const unsigned char* pixel, NSUInteger channels, const float** tables)
+{
+	AC3DVec4f				v = {0.0, 0.0, 0.0, 0.0};
+	
+	switch(channels) {
+		case 4: v[3] = tables[3][pixel[3]];
+		case 3: v[2] = tables[2][pixel[2]];
+		case 2: v[1] = tables[1][pixel[1]];
+		case 1: v[0] = tables[0][pixel[0]];
+	}
+	
+	return v;
+}
+
+//Box filter each 2x2 block into one pixel, in linear light for the channels set in "gammaMask"
+static void _HalveImage(const unsigned char* src, NSUInteger width, NSUInteger height, unsigned char* dst, NSUInteger channels, unsigned int gammaMask)
+{
+	const AC3DVec4f			quarter = {0.25, 0.25, 0.25, 0.25};
+	const float*			tables[4];
+	NSUInteger				newWidth = (width > 1 ? width / 2 : 1),
+							newHeight = (height > 1 ? height / 2 : 1),
+							stride = width * channels,
+							x,
+							y,
+							c;
+	const unsigned char*	row0;
+	const unsigned char*	row1;
+	AC3DVec4f				sum;
+	
+	for(c = 0; c < 4; ++c)
+	tables[c] = (gammaMask & (1 << c) ? _linearTable : _unitTable);
+	
+	for(y = 0; y < newHeight; ++y) {
+		row0 = src + 2 * y * stride;
+		row1 = (height > 1 ? row0 + stride : row0);
+		for(x = 0; x < newWidth; ++x, dst += channels) {
+			c = (width > 1 ? channels : 0);
+			sum = (_LoadPixel(row0 + 2 * x * channels, channels, tables) + _LoadPixel(row0 + 2 * x * channels + c, channels, tables))
+				+ (_LoadPixel(row1 + 2 * x * channels, channels, tables) + _LoadPixel(row1 + 2 * x * channels + c, channels, tables));
+			sum *= quarter;
+			for(c = 0; c < channels; ++c)
+			dst[c] = (gammaMask & (1 << c) ? _sRGBTable[(int)(sum[c] * (float)(kGammaTableSize - 1) + 0.5)] : (unsigned char)(sum[c] * 255.0 + 0.5));
+		}
+	}
+}
+
+//NOTE: Uploads levels 1 and up to the bound texture, "source" is the level 0 image in the working layout or NULL if "data" already is
+static NSUInteger _UploadMipmaps(const void* data, const void* source, AC3DTexturePixelFormat pixelFormat, NSUInteger width, NSUInteger height, AC3DTextureMipmapFilter filter)
+{
+	NSUInteger				channels = _WorkingChannels(pixelFormat),
+							levels = 1,
+							size = (width > 1 ? width / 2 : 1) * (height > 1 ? height / 2 : 1);
+	unsigned int			gammaMask = (filter == kAC3DTextureMipmapFilter_Gamma ? _GammaChannels(pixelFormat) : 0);
+	unsigned char*			unpacked = NULL;
+	unsigned char*			buffers[2];
+	void*					packed = NULL;
+	const unsigned char*	level;
+	GLint					saveAlignment;
+	
+	if(!_tablesReady)
+	_InitTables();
+	
+	if((source == NULL) && _IsPacked(pixelFormat)) {
+		unpacked = malloc(width * height * 4);
+		if(unpacked == NULL)
+		return 1;
+		_UnpackPixels(data, unpacked, width * height, pixelFormat);
+		source = unpacked;
+	}
+	level = (source ? source : data);
+	
+	buffers[0] = malloc(size * channels);
+	buffers[1] = malloc(size * channels);
+	if(_IsPacked(pixelFormat))
+	packed = malloc(size * 2);
+	if((buffers[0] == NULL) || (buffers[1] == NULL) || (_IsPacked(pixelFormat) && (packed == NULL))) {
+		free(buffers[0]);
+		free(buffers[1]);
+		free(packed);
+		free(unpacked);
+		return 1;
+	}
+	
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &saveAlignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //NOTE: The small levels have rows that are not 4 bytes aligned
+	while((width > 1) || (height > 1)) {
+		_HalveImage(level, width, height, buffers[(levels - 1) % 2], channels, gammaMask);
+		level = buffers[(levels - 1) % 2];
+		width = (width > 1 ? width / 2 : 1);
+		height = (height > 1 ? height / 2 : 1);
+		if(packed) {
+			_ConvertPixels(level, packed, width * height, pixelFormat);
+			_TexImage(pixelFormat, levels, width, height, packed);
+		}
+		else
+		_TexImage(pixelFormat, levels, width, height, level);
+		++levels;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, saveAlignment);
+	
+	free(buffers[0]);
+	free(buffers[1]);
+	free(packed);
+	free(unpacked);
+	
+	return levels;
+}
 
 //CLASS IMPLEMENTATIONS:
 
 @implementation AC3DTexture
 
-@synthesize contentSize=_size, pixelFormat=_format, pixelsWide=_width, pixelsHigh=_height, name=_name, maxS=_maxS, maxT=_maxT;
+@synthesize contentSize=_size, pixelFormat=_format, pixelsWide=_width, pixelsHigh=_height, name=_name, maxS=_maxS, maxT=_maxT, mipmapLevels=_levels;
 
 - (id) initWithData:(const void*)data pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size
+{
+	return [self _initWithData:data source:NULL pixelFormat:pixelFormat pixelsWide:width pixelsHigh:height contentSize:size mipmapFilter:kAC3DTextureMipmapFilter_None];
+}
+
+- (id) initWithData:(const void*)data pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size mipmapFilter:(AC3DTextureMipmapFilter)filter
+{
+	return [self _initWithData:data source:NULL pixelFormat:pixelFormat pixelsWide:width pixelsHigh:height contentSize:size mipmapFilter:filter];
+}
+
+- (id) _initWithData:(const void*)data source:(const void*)source pixelFormat:(AC3DTexturePixelFormat)pixelFormat pixelsWide:(NSUInteger)width pixelsHigh:(NSUInteger)height contentSize:(CGSize)size mipmapFilter:(AC3DTextureMipmapFilter)filter
 {
 	GLint					saveName;
+	NSUInteger				levels = 1;
 	
 	if((self = [super init])) {
 		glGenTextures(1, &_name);
 		glGetIntegerv(GL_TEXTURE_BINDING_2D, &saveName);
 		glBindTexture(GL_TEXTURE_2D, _name);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		//glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);		
 		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		switch(pixelFormat) {
-			
-			case kAC3DTexturePixelFormat_RGBA8888:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGBA4444:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGBA5551:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGB565:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGB888:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_L8:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_A8:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_LA88:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, width, height, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGB_PVRTC2:
-			glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_PVRTC_2BPPV1_IMG, width, height, 0, (width * height) / 4, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGB_PVRTC4:
-			glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_PVRTC_4BPPV1_IMG, width, height, 0, (width * height) / 2, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGBA_PVRTC2:
-			glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGBA_PVRTC_2BPPV1_IMG, width, height, 0, (width * height) / 4, data);
-			break;
-			
-			case kAC3DTexturePixelFormat_RGBA_PVRTC4:
-			glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGBA_PVRTC_4BPPV1_IMG, width, height, 0, (width * height) / 2, data);
-			break;
-			
-			default:
-			[NSException raise:NSInternalInconsistencyException format:@""];
-			
+		_TexImage(pixelFormat, 0, width, height, data);
+		//NOTE: The chain is built on the CPU rather than with GL_GENERATE_MIPMAP so the filter can be chosen and 16 bits formats are filtered at 8 bits per channel
+		if((filter != kAC3DTextureMipmapFilter_None) && _WorkingChannels(pixelFormat)) {
+			levels = _UploadMipmaps(data, source, pixelFormat, width, height, filter);
+			if(levels > 1)
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
 		}
 		glBindTexture(GL_TEXTURE_2D, saveName);
 		
@@ -157,6 +457,7 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 		_format = pixelFormat;
 		_maxS = size.width / (float)width;
 		_maxT = size.height / (float)height;
+		_levels = levels;
 	}
 	
 	return self;
@@ -190,6 +491,11 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 }
 
 - (id) initWithImagePath:(NSString*)path sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat
+{
+	return [self initWithImagePath:path sizeToFit:sizeToFit pixelFormat:pixelFormat mipmapFilter:kAC3DTextureMipmapFilter_None];
+}
+
+- (id) initWithImagePath:(NSString*)path sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat mipmapFilter:(AC3DTextureMipmapFilter)filter
 {
 	UIImage*				uiImage;
 	NSString*				enterPath = path;
@@ -198,7 +504,7 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 		path = [[NSBundle mainBundle] pathForResource:path ofType:nil];
 	
 	uiImage = [[UIImage alloc] initWithContentsOfFile:path];
-	self = [self initWithCGImage:[uiImage CGImage] orientation:[uiImage imageOrientation] sizeToFit:sizeToFit pixelFormat:pixelFormat];
+	self = [self initWithCGImage:[uiImage CGImage] orientation:[uiImage imageOrientation] sizeToFit:sizeToFit pixelFormat:pixelFormat mipmapFilter:filter];
 	[uiImage release];
 	
 	if(self == nil)
@@ -208,6 +514,11 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 }
 	
 - (id) initWithCGImage:(CGImageRef)image orientation:(UIImageOrientation)orientation sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat
+{
+	return [self initWithCGImage:image orientation:orientation sizeToFit:sizeToFit pixelFormat:pixelFormat mipmapFilter:kAC3DTextureMipmapFilter_None];
+}
+
+- (id) initWithCGImage:(CGImageRef)image orientation:(UIImageOrientation)orientation sizeToFit:(BOOL)sizeToFit pixelFormat:(AC3DTexturePixelFormat)pixelFormat mipmapFilter:(AC3DTextureMipmapFilter)filter
 {
 	NSUInteger				width,
 							height,
@@ -215,11 +526,7 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 	CGContextRef			context = nil;
 	void*					data = nil;;
 	CGColorSpaceRef			colorSpace;
-	void*					tempData;
-	unsigned char*			inPixel8;
-	unsigned int*			inPixel32;
-	unsigned char*			outPixel8;
-	unsigned short*			outPixel16;
+	void*					tempData = NULL;
 	BOOL					hasAlpha;
 	CGImageAlphaInfo		info;
 	CGAffineTransform		transform;
@@ -354,19 +661,13 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 		
 		case kAC3DTexturePixelFormat_RGBA8888:
 		case kAC3DTexturePixelFormat_RGBA4444:
+		case kAC3DTexturePixelFormat_RGBA5551: //NOTE: Drawn at 8 bits per channel so the mip chain has the full precision source
 		colorSpace = CGColorSpaceCreateDeviceRGB();
 		data = malloc(height * width * 4);
 		context = CGBitmapContextCreate(data, width, height, 8, 4 * width, colorSpace, kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
 		CGColorSpaceRelease(colorSpace);
 		break;
 		
-		case kAC3DTexturePixelFormat_RGBA5551:
-		colorSpace = CGColorSpaceCreateDeviceRGB();
-		data = malloc(height * width * 2);
-		context = CGBitmapContextCreate(data, width, height, 5, 2 * width, colorSpace, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder16Little);
-		CGColorSpaceRelease(colorSpace);
-		break;
-		
 		case kAC3DTexturePixelFormat_RGB888:
 		case kAC3DTexturePixelFormat_RGB565:
 		colorSpace = CGColorSpaceCreateDeviceRGB();
@@ -415,77 +716,24 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 	CGContextConcatCTM(context, transform);
 	CGContextDrawImage(context, CGRectMake(0, 0, CGImageGetWidth(image), CGImageGetHeight(image)), image);
 	
-	//Convert "-RRRRRGGGGGBBBBB" to "RRRRRGGGGGBBBBBA"
-	if(pixelFormat == kAC3DTexturePixelFormat_RGBA5551) {
-		outPixel16 = (unsigned short*)data;
-		for(i = 0; i < width * height; ++i, ++outPixel16)
-		*outPixel16 = *outPixel16 << 1 | 0x0001;
-#if __DEBUG__
-		REPORT_ERROR(@"Falling off fast-path converting pixel data from ARGB1555 to RGBA5551", NULL);
-#endif
-	}
-	//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to "RRRRRRRRRGGGGGGGGBBBBBBBB"
-	else if(pixelFormat == kAC3DTexturePixelFormat_RGB888) {
-		tempData = malloc(height * width * 3);
-		inPixel8 = (unsigned char*)data;
-		outPixel8 = (unsigned char*)tempData;
-		for(i = 0; i < width * height; ++i) {
-			*outPixel8++ = *inPixel8++;
-			*outPixel8++ = *inPixel8++;
-			*outPixel8++ = *inPixel8++;
-			inPixel8++;
-		}
-		free(data);
-		data = tempData;
-#if __DEBUG__
-		REPORT_ERROR(@"Falling off fast-path converting pixel data from RGBA8888 to RGB888", NULL);
-#endif
-	}
-	//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to "RRRRRGGGGGGBBBBB"
-	else if(pixelFormat == kAC3DTexturePixelFormat_RGB565) {
-		tempData = malloc(height * width * 2);
-		inPixel32 = (unsigned int*)data;
-		outPixel16 = (unsigned short*)tempData;
-		for(i = 0; i < width * height; ++i, ++inPixel32)
-		*outPixel16++ = ((((*inPixel32 >> 0) & 0xFF) >> 3) << 11) | ((((*inPixel32 >> 8) & 0xFF) >> 2) << 5) | ((((*inPixel32 >> 16) & 0xFF) >> 3) << 0);
-		free(data);
-		data = tempData;
-#if __DEBUG__
-		REPORT_ERROR(@"Falling off fast-path converting pixel data from RGBA8888 to RGB565", NULL);
-#endif
-	}
-	//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to "RRRRRGGGGBBBBAAAA"
-	else if(pixelFormat == kAC3DTexturePixelFormat_RGBA4444) {
-		tempData = malloc(height * width * 2);
-		inPixel32 = (unsigned int*)data;
-		outPixel16 = (unsigned short*)tempData;
-		for(i = 0; i < width * height; ++i, ++inPixel32)
-		*outPixel16++ = ((((*inPixel32 >> 0) & 0xFF) >> 4) << 12) | ((((*inPixel32 >> 8) & 0xFF) >> 4) << 8) | ((((*inPixel32 >> 16) & 0xFF) >> 4) << 4) | ((((*inPixel32 >> 24) & 0xFF) >> 4) << 0);
-		free(data);
-		data = tempData;
-#if __DEBUG__
-		REPORT_ERROR(@"Falling off fast-path converting pixel data from RGBA8888 to RGBA4444", NULL);
-#endif
-	}
-	//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to "LLLLLLLLAAAAAAAA"
-	else if(pixelFormat == kAC3DTexturePixelFormat_LA88) {
-		tempData = malloc(height * width * 3);
-		inPixel8 = (unsigned char*)data;
-		outPixel8 = (unsigned char*)tempData;
-		for(i = 0; i < width * height; ++i) {
-			*outPixel8++ = *inPixel8++;
-			inPixel8 += 2;
-			*outPixel8++ = *inPixel8++;
+	//Convert "RRRRRRRRRGGGGGGGGBBBBBBBBAAAAAAAA" to the pixel format, the mip chain of the 16 bits formats is made from the unconverted data
+	if((pixelFormat == kAC3DTexturePixelFormat_RGB888) || _IsPacked(pixelFormat) || (pixelFormat == kAC3DTexturePixelFormat_LA88)) {
+		tempData = malloc(height * width * (pixelFormat == kAC3DTexturePixelFormat_RGB888 ? 3 : 2));
+		if(tempData == NULL) {
+			CGContextRelease(context);
+			free(data);
+			[self release];
+			return nil;
 		}
-		free(data);
-		data = tempData;
+		_ConvertPixels(data, tempData, width * height, pixelFormat);
 #if __DEBUG__
-		REPORT_ERROR(@"Falling off fast-path converting pixel data from RGBA8888 to LA88", NULL);
+		REPORT_ERROR(@"Falling off fast-path converting pixel data from RGBA8888", NULL);
 #endif
 	}
 	
-	self = [self initWithData:data pixelFormat:pixelFormat pixelsWide:width pixelsHigh:height contentSize:imageSize];
+	self = [self _initWithData:(tempData ? tempData : data) source:(_IsPacked(pixelFormat) ? data : NULL) pixelFormat:pixelFormat pixelsWide:width pixelsHigh:height contentSize:imageSize mipmapFilter:filter];
 	
+	free(tempData);
 	CGContextRelease(context);
 	free(data);
 	
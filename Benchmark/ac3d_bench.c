@@ -0,0 +1,528 @@
+/* ======================================================================
+ * Benchmark for the AC3D reader lib
+ * See license.txt (BSD license)
+ *
+ * Times parsing, each cooking step (from get_ac3d_stats) and the draw
+ * list compile separately for the models in the repo and for generated
+ * meshes, and prints the results as JSON. Builds headless, so it runs
+ * wherever there is a C compiler and pthreads. With -t it checks the
+ * regression models in Benchmark/models instead.
+ * ====================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+static
+double bench_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define AC3D_HEADLESS
+#include "../ac3d_reader.m"
+
+// ----------------------------------------------------------------------
+// Samples
+
+#define MAX_SAMPLES 1000
+
+typedef struct {
+    const char *name;
+    int         num;
+    double      ms[MAX_SAMPLES];
+} BenchSeries;
+
+static
+void add_sample(BenchSeries *s, double seconds)
+{
+    if (s->num < MAX_SAMPLES)
+        s->ms[s->num++] = seconds * 1000.0;
+}
+
+static
+void print_series(FILE *out, BenchSeries *s, int last)
+{
+    double sum = 0.0, var = 0.0, lo = 0.0, hi = 0.0, mean;
+    int i;
+
+    for (i=0; i<s->num; i++) {
+        sum += s->ms[i];
+        if (!i || s->ms[i] < lo) lo = s->ms[i];
+        if (!i || s->ms[i] > hi) hi = s->ms[i];
+    }
+    mean = s->num ? sum / s->num : 0.0;
+    for (i=0; i<s->num; i++)
+        var += (s->ms[i] - mean) * (s->ms[i] - mean);
+    // Sample variance, repeats of one run say nothing about the spread
+    var = s->num > 1 ? var / (s->num - 1) : 0.0;
+
+    fprintf(out, "        \"%s\": { \"mean\": %.4f, \"variance\": %.6f, \"stddev\": %.4f, "
+            "\"min\": %.4f, \"max\": %.4f }%s\n",
+            s->name, mean, var, sqrt(var), lo, hi, last ? "" : ",");
+}
+
+// ----------------------------------------------------------------------
+// Generated meshes
+//
+// A rippled height field in patches of at most PATCH_SIZE^2 vertices, one
+// object each, so loading has objects to spread over threads and drawing
+// has objects to batch. Every other patch is textured and the rows
+// alternate between two materials, so batching has something to do.
+
+#define PATCH_SIZE 100
+
+typedef struct {
+    char   *data;
+    size_t  size;
+    size_t  capacity;
+} BenchText;
+
+static
+void put_text(BenchText *t, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(t->data + t->size, t->capacity - t->size, fmt, ap);
+        va_end(ap);
+        if (len >= 0 && t->size + len < t->capacity)
+            break;
+        t->capacity = t->capacity ? t->capacity * 2 : 1024*1024;
+        t->data = (char*)realloc(t->data, t->capacity);
+        if (!t->data) {
+            fprintf(stderr, "out of memory generating mesh\n");
+            exit(1);
+        }
+    }
+    t->size += len;
+}
+
+static
+void put_patch(BenchText *t, int px, int py, int side, int textured)
+{
+    int x, y;
+
+    put_text(t, "OBJECT poly\nname \"patch_%d_%d\"\nloc %d 0 %d\ncrease 45\n",
+             px, py, px * (PATCH_SIZE-1), py * (PATCH_SIZE-1));
+    if (textured)
+        put_text(t, "texture \"bench.png\"\n");
+    put_text(t, "numvert %d\n", side*side);
+    for (y=0; y<side; y++)
+        for (x=0; x<side; x++)
+            put_text(t, "%d %.3f %d\n", x, sin(x*0.3) * cos(y*0.2), y);
+    put_text(t, "numsurf %d\n", (side-1)*(side-1)*2);
+    for (y=0; y<side-1; y++) {
+        for (x=0; x<side-1; x++) {
+            int a = y*side + x, b = a + 1, c = a + side, d = c + 1;
+            float u0 = (float)x/(side-1), u1 = (float)(x+1)/(side-1);
+            float v0 = (float)y/(side-1), v1 = (float)(y+1)/(side-1);
+            put_text(t, "SURF 0x10\nmat %d\nrefs 3\n%d %g %g\n%d %g %g\n%d %g %g\n",
+                     y & 1, a, u0, v0, c, u0, v1, b, u1, v0);
+            put_text(t, "SURF 0x10\nmat %d\nrefs 3\n%d %g %g\n%d %g %g\n%d %g %g\n",
+                     y & 1, b, u1, v0, c, u0, v1, d, u1, v1);
+        }
+    }
+    put_text(t, "kids 0\n");
+}
+
+// About tris triangles, whole patches above one patch
+static
+void make_mesh(BenchText *t, long tris)
+{
+    long per = (long)(PATCH_SIZE-1)*(PATCH_SIZE-1)*2;
+    int numpatches, grid, side, i;
+
+    if (tris < per) {
+        numpatches = 1;
+        side = (int)sqrt(tris / 2.0) + 1;
+        if (side < 2)
+            side = 2;
+    } else {
+        numpatches = (int)((tris + per/2) / per);
+        side = PATCH_SIZE;
+    }
+    grid = (int)ceil(sqrt((double)numpatches));
+
+    t->size = 0;
+    put_text(t, "AC3Db\n");
+    put_text(t, "MATERIAL \"grey\" rgb 0.6 0.6 0.6  amb 0.2 0.2 0.2  emis 0 0 0  spec 0.2 0.2 0.2  shi 32  trans 0\n");
+    put_text(t, "MATERIAL \"red\" rgb 0.8 0.1 0.1  amb 0.2 0.2 0.2  emis 0 0 0  spec 0.2 0.2 0.2  shi 32  trans 0\n");
+    put_text(t, "OBJECT world\nkids %d\n", numpatches);
+    for (i=0; i<numpatches; i++)
+        put_patch(t, i % grid, i / grid, side, i & 1);
+}
+
+// ----------------------------------------------------------------------
+// Runs
+
+typedef struct {
+    const char *name;
+    int         strips;
+    int         cook;
+    int         quantize;
+} BenchConfig;
+
+static const BenchConfig bench_configs[] = {
+    { "lookahead/stream",    AC3D_STRIPS_LOOKAHEAD, AC3D_COOK_STREAM,  0 },
+    { "greedy/stream",       AC3D_STRIPS_GREEDY,    AC3D_COOK_STREAM,  0 },
+    { "none/stream",         AC3D_STRIPS_NONE,      AC3D_COOK_STREAM,  0 },
+    { "naive/stream",        AC3D_STRIPS_NAIVE,     AC3D_COOK_STREAM,  0 },
+    { "lookahead/indexed",   AC3D_STRIPS_LOOKAHEAD, AC3D_COOK_INDEXED, 0 },
+    { "none/indexed",        AC3D_STRIPS_NONE,      AC3D_COOK_INDEXED, 0 },
+    { "lookahead/quantized", AC3D_STRIPS_LOOKAHEAD, AC3D_COOK_INDEXED, AC3D_QUANTIZE_ALL },
+};
+#define NUM_CONFIGS (int)(sizeof(bench_configs)/sizeof(bench_configs[0]))
+
+// The naive stripifier is quadratic, above this it takes minutes
+#define NAIVE_MAX_SIZE (2*1024*1024)
+
+static int    bench_repeats = 5;
+static double bench_budget = 10.0;  // seconds per model and config
+static int    bench_first = 1;
+
+static
+void count_packets(AC3DDrawList *list, long *tris, long *verts)
+{
+    int i;
+
+    *tris = *verts = 0;
+    for (i=0; i<list->numpackets; i++) {
+        AC3DPacket *pkt = &list->packets[i];
+        int kind = pkt->type & 0x0f;
+        *verts += pkt->count;
+        if ((pkt->type & PACKET_INDEXED) || kind == SURF_TRI_LIST)
+            *tris += pkt->count / 3;
+        else if (kind == SURF_POLYGON || kind == SURF_TRI_STRIP)
+            *tris += pkt->count - 2;
+    }
+}
+
+static
+void run_config(FILE *out, const char *model, const char *data, size_t size,
+                const BenchConfig *config)
+{
+    // The phases from get_ac3d_stats, then the draw list and the total
+    BenchSeries series[AC3D_NUM_PHASES+2];
+    BenchSeries *drawlist = &series[AC3D_NUM_PHASES], *total = &series[AC3D_NUM_PHASES+1];
+    AC3DLoadOptions opts;
+    AC3DStats stats;
+    long tris = 0, verts = 0;
+    int numpackets = 0, run, i;
+    double start = bench_time();
+
+    memset(series, 0, sizeof(series));
+    memset(&stats, 0, sizeof(stats));
+    series[AC3D_PHASE_PARSE].name = "parse";
+    series[AC3D_PHASE_NORMALS].name = "normals";
+    series[AC3D_PHASE_STRIPS].name = "strips";
+    series[AC3D_PHASE_STREAM].name = "stream";
+    series[AC3D_PHASE_INDEXED].name = "indexed";
+    series[AC3D_PHASE_BATCH].name = "batch";
+    drawlist->name = "drawlist";
+    total->name = "total";
+
+    get_ac3d_load_options(&opts);
+    opts.threads = 0;
+    opts.strips = config->strips;
+    opts.cook = config->cook;
+    opts.quantize = config->quantize;
+    opts.strip_budget = 0.0;
+    opts.dynamic_names = NULL;
+    set_ac3d_load_options(&opts);
+
+    for (run=0; run<bench_repeats; run++) {
+        AC3DFile *file;
+        char *err = NULL;
+        double t0, t1, t2;
+
+        t0 = bench_time();
+        file = read_ac3d_memory(data, size, &err);
+        t1 = bench_time();
+        if (!file) {
+            fprintf(stderr, "%s: %s\n", model, err ? err : "load failed");
+            free(err);
+            return;
+        }
+        if (!compile_ac3d_drawlist(file)) {
+            fprintf(stderr, "%s: compile_ac3d_drawlist failed\n", model);
+            free_ac3d_file(file);
+            return;
+        }
+        t2 = bench_time();
+
+        get_ac3d_stats(file, &stats);
+        for (i=0; i<AC3D_NUM_PHASES; i++)
+            add_sample(&series[i], stats.time[i]);
+        add_sample(drawlist, t2 - t1);
+        add_sample(total, t2 - t0);
+
+        numpackets = file->drawlist->numpackets;
+        count_packets(file->drawlist, &tris, &verts);
+        free_ac3d_file(file);
+
+        if (bench_time() - start > bench_budget)
+            break;
+    }
+
+    fprintf(out, "%s    {\n", bench_first ? "" : ",\n");
+    fprintf(out, "      \"model\": \"%s\",\n", model);
+    fprintf(out, "      \"config\": \"%s\",\n", config->name);
+    fprintf(out, "      \"bytes\": %lu,\n", (unsigned long)size);
+    fprintf(out, "      \"runs\": %d,\n", total->num);
+    fprintf(out, "      \"packets\": %d,\n", numpackets);
+    fprintf(out, "      \"triangles\": %d,\n", stats.triangles);
+    fprintf(out, "      \"drawn_triangles\": %ld,\n", tris);
+    fprintf(out, "      \"vertices\": %ld,\n", verts);
+    fprintf(out, "      \"strips\": %d,\n", stats.strips);
+    fprintf(out, "      \"strip_length\": %.2f,\n", stats.strip_length);
+    fprintf(out, "      \"points_removed\": %d,\n", stats.points_removed);
+    fprintf(out, "      \"cmd_bytes\": %lu,\n", (unsigned long)stats.cmd_bytes);
+    if (config->quantize)
+        fprintf(out, "      \"quantize_error\": [%g, %g, %g],\n", 
+                stats.position_error, stats.normal_error, stats.texcoord_error);
+    fprintf(out, "      \"ms\": {\n");
+    for (i=0; i<AC3D_NUM_PHASES+2; i++)
+        print_series(out, &series[i], i == AC3D_NUM_PHASES+1);
+    fprintf(out, "      }\n    }");
+    fflush(out);
+    bench_first = 0;
+}
+
+static
+void run_model(FILE *out, const char *model, const char *data, size_t size,
+               const char *only)
+{
+    int i;
+
+    for (i=0; i<NUM_CONFIGS; i++) {
+        const BenchConfig *config = &bench_configs[i];
+        if (only && !strstr(only, config->name))
+            continue;
+        if (config->strips == AC3D_STRIPS_NAIVE && size > NAIVE_MAX_SIZE)
+            continue;
+        fprintf(stderr, "%s %s\n", model, config->name);
+        run_config(out, model, data, size, config);
+    }
+}
+
+static
+char *slurp(const char *filename, size_t *size)
+{
+    FILE *f = fopen(filename, "rb");
+    char *data;
+    long len;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char*)malloc(len + 1);
+    if (data && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (data) {
+        data[len] = 0;
+        *size = len;
+    }
+    return data;
+}
+
+// ----------------------------------------------------------------------
+// Checks
+//
+// Each regression model is loaded with the options that showed a bug,
+// and its check looks at the cooked result.
+
+// A flat triangle comes before a shaded one it shares an edge with, at
+// crease 180 the shaded corners on that edge are still smoothed with it
+static
+int check_mixed_shading(AC3DFile *file)
+{
+    AC3DObject *obj = find_ac3d_object(file, "mixed");
+    AC3Doptcmd *ptr, *end;
+    int smoothed = 0, k;
+
+    if (!obj)
+        return 0;
+    for (ptr = obj->optcmds, end = obj->optcmds + obj->numcmds; ptr < end;) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+        int stride = AC3D_VERTEX_STRIDE(obj);
+
+        ptr += 2;
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED)) {
+            ptr += 3 + numrefs*(stride-3);
+            continue;
+        }
+        if ((type & 0x0f) != SURF_POLYGON && (type & 0x0f) != SURF_TRI_STRIP &&
+            (type & 0x0f) != SURF_TRI_LIST) {
+            ptr += numrefs*3;
+            continue;
+        }
+        for (k=0; k<numrefs; k++, ptr += stride) {
+            // The corners on the edge at z = 0, the face normal is +x and
+            // the one of the flat triangle +z
+            if ((type & SURF_SHADED) && ptr[2].f == 0.0 && ptr[5].f > 0.5)
+                smoothed++;
+        }
+    }
+    return smoothed == 2;
+}
+
+typedef struct {
+    const char *model;  // in Benchmark/models
+    int         strips;
+    int         cook;
+    int       (*check)(AC3DFile *file);
+} BenchCheck;
+
+static const BenchCheck bench_checks[] = {
+    { "mixed_shading.ac", AC3D_STRIPS_NONE, AC3D_COOK_STREAM, check_mixed_shading },
+};
+#define NUM_CHECKS (int)(sizeof(bench_checks)/sizeof(bench_checks[0]))
+
+// Returns the number of checks that failed
+static
+int run_checks(const char *dir)
+{
+    int failed = 0, i;
+
+    for (i=0; i<NUM_CHECKS; i++) {
+        const BenchCheck *check = &bench_checks[i];
+        AC3DLoadOptions opts;
+        AC3DFile *file = NULL;
+        char path[1024], *data, *err = NULL;
+        size_t size;
+        int ok = 0;
+
+        snprintf(path, sizeof(path), "%s/Benchmark/models/%s", dir, check->model);
+        data = slurp(path, &size);
+        if (data) {
+            get_ac3d_load_options(&opts);
+            opts.strips = check->strips;
+            opts.cook = check->cook;
+            set_ac3d_load_options(&opts);
+            file = read_ac3d_memory(data, size, &err);
+            free(data);
+        }
+        if (file)
+            ok = check->check(file);
+        printf("%s: %s\n", check->model, ok ? "ok" : 
+               !data ? "can't read" : !file ? (err ? err : "load failed") : "FAILED");
+        free(err);
+        free_ac3d_file(file);
+        failed += !ok;
+    }
+    return failed;
+}
+
+// ----------------------------------------------------------------------
+
+static const char *bench_models[] = {
+    "thumbsup.ac",
+    "Thrust Demo/lunarlander.ac",
+    "Clock Demo/clock.ac",
+    "Ball Demo/ball.ac",
+    "TrafficLight Demo/tlight.ac",
+    NULL
+};
+
+static const long bench_sizes[] = { 1000, 10000, 100000, 1000000, 10000000, 0 };
+
+static
+void usage()
+{
+    fprintf(stderr,
+            "usage: ac3d_bench [-r repeats] [-b seconds] [-m max_triangles]\n"
+            "                  [-c configs] [-d repo_dir] [-t] [model.ac ...]\n"
+            "  -r  runs per model and config, default 5\n"
+            "  -b  stop repeating a model and config after this, default 10\n"
+            "  -m  largest generated mesh, default 10000000, 0 = none\n"
+            "  -c  comma separated configs to run, e.g. greedy/stream,none/indexed\n"
+            "  -d  where the repo models are, default ..\n"
+            "  -t  check the regression models instead, exits 1 when one fails\n"
+            "Without models the repo models and the generated meshes are run.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "..", *only = NULL;
+    long maxtris = 10000000;
+    BenchText text;
+    int check = 0;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; i++) {
+        if (argv[i][1] == 't') {
+            check = 1;
+            continue;
+        }
+        if (i+1 >= argc)
+            usage();
+        switch (argv[i][1]) {
+            case 'r': bench_repeats = atoi(argv[++i]); break;
+            case 'b': bench_budget = atof(argv[++i]); break;
+            case 'm': maxtris = atol(argv[++i]); break;
+            case 'c': only = argv[++i]; break;
+            case 'd': dir = argv[++i]; break;
+            default:  usage();
+        }
+    }
+    if (bench_repeats < 1 || bench_repeats > MAX_SAMPLES)
+        usage();
+    if (check)
+        return run_checks(dir) ? 1 : 0;
+
+    printf("{\n  \"repeats\": %d,\n  \"results\": [\n", bench_repeats);
+
+    if (i < argc) {
+        for (; i<argc; i++) {
+            size_t size;
+            char *data = slurp(argv[i], &size);
+            if (!data) {
+                fprintf(stderr, "can't read %s\n", argv[i]);
+                continue;
+            }
+            run_model(stdout, argv[i], data, size, only);
+            free(data);
+        }
+    } else {
+        for (i=0; bench_models[i]; i++) {
+            char path[1024];
+            size_t size;
+            char *data;
+
+            snprintf(path, sizeof(path), "%s/%s", dir, bench_models[i]);
+            data = slurp(path, &size);
+            if (!data) {
+                fprintf(stderr, "can't read %s\n", path);
+                continue;
+            }
+            run_model(stdout, bench_models[i], data, size, only);
+            free(data);
+        }
+
+        memset(&text, 0, sizeof(text));
+        for (i=0; bench_sizes[i] && bench_sizes[i] <= maxtris; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "generated_%ld", bench_sizes[i]);
+            make_mesh(&text, bench_sizes[i]);
+            run_model(stdout, name, text.data, text.size, only);
+        }
+        free(text.data);
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
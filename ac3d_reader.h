@@ -6,6 +6,8 @@
 #ifndef __AC3D_READER_H__
 #define __AC3D_READER_H__
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -13,14 +15,207 @@ extern "C" {
   typedef struct AC3DFile_s   AC3DFile;
   typedef struct AC3DObject_s AC3DObject;
   
+  /* A context has the settings of its loads, the path resolver, load 
+     options and allocator, the loaded textures and the GL state drawing
+     keeps track of. The functions without _ctx use a default one. 
+     Loads with the same context can run on many threads at once as long
+     as its settings are not changed meanwhile. A file keeps the context 
+     it was loaded with and loads its textures into it, drawing and 
+     textures are for the thread of its GL context (or ones sharing 
+     textures and buffers with it). Free the files before the context */
+  typedef struct AC3DContext_s AC3DContext;
+  AC3DContext *new_ac3d_context(void);
+  void        free_ac3d_context(AC3DContext *ctx);
+
   /* Load .ac file */
   AC3DFile   *read_ac3d_file(const char *filename, char **err);
+  AC3DFile   *read_ac3d_file_ctx(AC3DContext *ctx, const char *filename, char **err);
+
+  /* Load .ac data from memory, the buffer is not kept after the call */
+  AC3DFile   *read_ac3d_memory(const void *data, size_t size, char **err);
+  AC3DFile   *read_ac3d_memory_ctx(AC3DContext *ctx, const void *data, size_t size, char **err);
+
+  /* Load .ac data through a callback, it should fill at most size bytes 
+     into buf and return the count, 0 at end of data and <0 on error */
+  typedef long (*AC3DReadFunc)(void *userdata, void *buf, size_t size);
+  AC3DFile   *read_ac3d_callback(AC3DReadFunc func, void *userdata, char **err);
+  AC3DFile   *read_ac3d_callback_ctx(AC3DContext *ctx, AC3DReadFunc func, void *userdata, char **err);
+
+  /* Load .ac file in the background, it is read and cooked on a thread
+     of its own. pump_ac3d_uploads, called each frame on the GL thread,
+     then loads its textures and buffers one object at a time for at 
+     most budget seconds a call and calls callback on that thread with 
+     the file, or with NULL and the error. The options are those at the
+     time of the call. Returns 0 when out of memory, callback is not 
+     called then. A NULL callback frees the file, e.g. to write the 
+     .acb cache ahead */
+  typedef void (*AC3DLoadCallback)(AC3DFile *file, const char *err, void *userdata);
+  int         read_ac3d_file_async(const char *filename, 
+                                   AC3DLoadCallback callback, 
+                                   void *userdata);
+  int         read_ac3d_file_async_ctx(AC3DContext *ctx, 
+                                       const char *filename, 
+                                       AC3DLoadCallback callback, 
+                                       void *userdata);
+  /* Returns the number of async loads not called back yet */
+  int         pump_ac3d_uploads(float budget);
+  int         pump_ac3d_uploads_ctx(AC3DContext *ctx, float budget);
+
+  /* Map the filename given to read_ac3d_file to a path, return 1 when 
+     path was filled in. Default looks in the bundle and its Models/ 
+     folder, set to NULL to restore that */
+  typedef int (*AC3DPathResolver)(const char *filename, char *path, size_t size, void *userdata);
+  void        set_ac3d_path_resolver(AC3DPathResolver resolver, void *userdata);
+  void        set_ac3d_path_resolver_ctx(AC3DContext *ctx, AC3DPathResolver resolver, void *userdata);
+
+  /* RGBA pixels of the texture name, first row at v = 0 as for 
+     glTexImage2D, width and height filled in, NULL = not found */
+  typedef const unsigned char *(*AC3DTextureFunc)(const char *name, 
+                                                  int *width, int *height,
+                                                  void *userdata);
+
+  /* Options for the loaders, apply to all loads that follow */
+  enum {
+    AC3D_STRIPS_LOOKAHEAD = 0, /* longest of three tries per strip */
+    AC3D_STRIPS_GREEDY,        /* single try per strip, faster */
+    AC3D_STRIPS_NAIVE,         /* the old quadratic search */
+    AC3D_STRIPS_NONE
+  };
+  enum {
+    AC3D_COOK_STREAM = 0,      /* unindexed fans and strips */
+    AC3D_COOK_INDEXED          /* welded vertices and cache ordered 
+                                  triangle lists, for glDrawElements */
+  };
+  enum {
+    AC3D_QUANTIZE_POSITIONS = 1, /* 16 bits per axis within the bbox */
+    AC3D_QUANTIZE_NORMALS   = 2, /* 8 bits per axis */
+    AC3D_QUANTIZE_TEXCOORDS = 4, /* 16 bits per axis within their range */
+    AC3D_QUANTIZE_ALL       = 7
+  };
+  typedef struct AC3DLoadOptions_s {
+    int   threads;      /* parse and cook objects on this many threads, 
+                           0 = serial, <0 = one per core */
+    int   strips;       /* AC3D_STRIPS_xxx, how triangles are joined */
+    float strip_budget; /* seconds per object for the lookahead and greedy 
+                           stripifiers, triangles left when it runs out 
+                           are drawn as they are, 0 = no limit. A file
+                           it cuts short is not written to the cache */
+    int   cook;         /* AC3D_COOK_xxx, the layout of the drawn data */
+    int   index32;      /* the target draws 32 bit indices, i.e. has
+                           GL_OES_element_index_uint. Indexed objects with
+                           more than 65535 vertices then use them, else
+                           they are cut into chunks of at most 65535 */
+    int   quantize;     /* AC3D_QUANTIZE_xxx bits, the vertices of indexed
+                           objects are stored that compact, 16 instead of
+                           32 bytes with all of them. The errors it gives
+                           are in AC3DStats */
+    const char * const *dynamic_names;
+                        /* NULL terminated names of the objects that are 
+                           moved, rotated or toggled after loading, all 
+                           other objects are baked into their nearest such
+                           ancestor (or the root), NULL = keep the tree. 
+                           Not copied, keep it around for the loads */
+    int   atlas;        /* side in pixels of the texture atlases, a power
+                           of two, 0 = none. The textures of a file that
+                           fit in half of it and whose texcoords stay 
+                           within 0..1 are packed into as few atlases as
+                           hold them, with the texcoords remapped. Their
+                           objects then use an "atlas:..." texture, so 
+                           set_ac3d_texture by the old name misses them */
+    AC3DTextureFunc atlas_texture;
+                        /* where the packed textures are read from, when
+                           packing and when the atlases are loaded for
+                           GL, kept by the caller. NULL = the images in
+                           the bundle and its Textures/ folder, headless
+                           loads then pack nothing */
+    void *atlas_userdata;
+  } AC3DLoadOptions;
+  void        get_ac3d_load_options(AC3DLoadOptions *opts);
+  void        set_ac3d_load_options(const AC3DLoadOptions *opts);
+  void        get_ac3d_load_options_ctx(AC3DContext *ctx, AC3DLoadOptions *opts);
+  void        set_ac3d_load_options_ctx(AC3DContext *ctx, const AC3DLoadOptions *opts);
+
+  /* Where the memory of the loaded models comes from. A file is loaded
+     into a few big blocks that free_ac3d_file gives back all at once,
+     the temporaries of cooking use blocks that are given back when the
+     load is done. A file frees its blocks with the allocator it was
+     loaded with. NULL = malloc and free */
+  typedef struct AC3DAllocator_s {
+    void *(*alloc)(size_t size, void *userdata);
+    void  (*free)(void *ptr, size_t size, void *userdata);
+    void  *userdata;
+  } AC3DAllocator;
+  void        set_ac3d_allocator(const AC3DAllocator *allocator);
+  void        set_ac3d_allocator_ctx(AC3DContext *ctx, const AC3DAllocator *allocator);
+
+  /* Counts and times of a loaded model, to see what an asset costs */
+  enum {
+    AC3D_PHASE_PARSE = 0,      /* reading the .ac text */
+    AC3D_PHASE_NORMALS,        /* smoothing normals */
+    AC3D_PHASE_STRIPS,         /* joining triangles into strips */
+    AC3D_PHASE_STREAM,         /* writing the cooked stream */
+    AC3D_PHASE_INDEXED,        /* welding and ordering, AC3D_COOK_INDEXED */
+    AC3D_PHASE_BATCH,          /* merging records into draws */
+    AC3D_NUM_PHASES
+  };
+  typedef struct AC3DStats_s {
+    int    objects;
+    int    polygons;           /* surfaces as read, by type */
+    int    closed_lines;
+    int    lines;
+    int    triangles;          /* in the polygons as read */
+    int    strips;             /* triangle strips made */
+    float  strip_length;       /* average triangles per strip */
+    int    points_removed;     /* vertices not sent thanks to the strips */
+    int    draws_in;           /* records before batching */
+    int    draws_out;          /* and after, one draw call each */
+    size_t cmd_bytes;          /* the cooked draw data, numcmds and the
+                                  indexed vertices and indices */
+    size_t texture_bytes;      /* of the loaded textures, each counted once,
+                                  0 before the first draw and when headless */
+    float  time[AC3D_NUM_PHASES]; /* seconds, summed over the objects so
+                                  more than load_time with threads */
+    float  load_time;          /* wall clock seconds of the whole load */
+    float  position_error;     /* largest errors of AC3D_QUANTIZE_xxx, in */
+    float  normal_error;       /* model units, degrees and texture units, */
+    float  texcoord_error;     /* 0 when not quantized */
+    int    cached;             /* loaded from the .acb cache, counts and
+                                  times are those of the load that wrote it */
+  } AC3DStats;
+  /* Totals of the whole model, the object one is for obj without its kids.
+     Return 0 when given NULL. Objects merged by dynamic_names count in the
+     object they were merged into */
+  int         get_ac3d_stats(AC3DFile *file, AC3DStats *stats);
+  int         get_ac3d_object_stats(AC3DObject *obj, AC3DStats *stats);
 
-  /* Lookup a node within the .ac model */
+  /* Lookup a node within the .ac model. The name can be a path such as
+     "lander/flame_1", each part after the first names a kid of the one
+     before, the first match in the tree is returned */
   AC3DObject *find_ac3d_object(AC3DFile *file, const char *name);
   void        set_rotation_ac3d_object(AC3DObject *obj, float angle);
   int         is_enabled_ac3d_object(AC3DObject *obj);
   void        set_enabled_ac3d_object(AC3DObject *obj, int flag);
+
+  /* Handles number the objects of a file depth first, from 0 to 
+     get_ac3d_object_count-1, the same for every load of the same file 
+     and options. Lookups are hashed, resolve once and keep the handle */
+  int         get_ac3d_object_handle(AC3DFile *file, const char *path); /* -1 = not found */
+  int         get_ac3d_object_handles(AC3DFile *file, 
+                                      const char *path, 
+                                      int *handles, /* all matches, in order */
+                                      int max);     /* returns the count, can 
+                                                       be more than max */
+  int         get_ac3d_object_count(AC3DFile *file);
+  AC3DObject *get_ac3d_object(AC3DFile *file, int handle); /* NULL = bad handle */
+  /* Set many objects at once, handles of -1 are skipped */
+  void        set_rotation_ac3d_objects(AC3DFile *file, 
+                                        const int *handles, 
+                                        const float *angles, 
+                                        int count);
+  void        set_enabled_ac3d_objects(AC3DFile *file, 
+                                       const int *handles, 
+                                       const int *flags, 
+                                       int count);
     
   /* Control material settings */
   void        get_ac3d_material(AC3DFile *file, 
@@ -50,17 +245,181 @@ extern "C" {
   void        reset_ac3d_texture(AC3DFile *file, 
                                  char *texture_name);
   
-  /* Draw the model */
+  /* Draw the model, the _ctx one for a GL context other than the one of
+     the context the file was loaded with */
   void        draw_ac3d_file(AC3DFile *file);
+  void        draw_ac3d_file_ctx(AC3DContext *ctx, AC3DFile *file);
+
+  /* Compile the objects into the flat list of draws that draw_ac3d_file 
+     replays, done by the first draw. Enabling and rotating objects needs 
+     nothing more, call again when the hierarchy changes, returns 0 when 
+     out of memory (drawing then walks the tree) */
+  int         compile_ac3d_drawlist(AC3DFile *file);
+
+  /* Draw only the objects in the frustum of viewproj, the projection 
+     times the modelview the file is drawn with (column major, as for
+     glLoadMatrixf). The bounding boxes are tested from the root down, a
+     subtree outside is skipped and one inside is not tested further. 
+     Returns the number of objects skipped, stats can be NULL */
+  typedef struct AC3DCullStats_s {
+    int tested;         /* boxes tested against the frustum */
+    int culled;         /* objects skipped, kids of skipped ones included */
+    int drawn;          /* objects drawn */
+  } AC3DCullStats;
+  int         draw_ac3d_file_culled(AC3DFile *file, 
+                                    const float *viewproj, 
+                                    AC3DCullStats *stats);
+  int         draw_ac3d_file_culled_ctx(AC3DContext *ctx,
+                                        AC3DFile *file, 
+                                        const float *viewproj, 
+                                        AC3DCullStats *stats);
+
+  /* An instance is a copy of a loaded file that shares its geometry,
+     hierarchy and materials and only holds what differs per copy, the
+     rotations and enabled flags of the objects by handle, the textures
+     and the materials set for it. It starts as the file is when made, 
+     the file is not changed by it. It costs about 10 bytes per object,
+     and a material each that is set. Free the instances before the file */
+  typedef struct AC3DInstance_s AC3DInstance;
+  AC3DInstance *new_ac3d_instance(AC3DFile *file); /* NULL = out of memory */
+  void        free_ac3d_instance(AC3DInstance *inst);
+  /* Handles of -1 are skipped, as for set_rotation_ac3d_objects */
+  void        set_rotation_ac3d_instance(AC3DInstance *inst, 
+                                         const int *handles, 
+                                         const float *angles, 
+                                         int count);
+  void        set_enabled_ac3d_instance(AC3DInstance *inst, 
+                                        const int *handles, 
+                                        const int *flags, 
+                                        int count);
+  int         is_enabled_ac3d_instance(AC3DInstance *inst, int handle); /* -1 = bad handle */
+  /* As set_ac3d_texture, AC3D_TEXID_OF_FILE goes back to the one of the file */
+  enum {
+    AC3D_TEXID_OF_FILE = -2
+  };
+  void        set_ac3d_instance_texture(AC3DInstance *inst, 
+                                        char *texture_name,
+                                        int texid);
+  /* As set_ac3d_material, the first change copies the one of the file,
+     later changes to that one then no longer show in the instance */
+  void        set_ac3d_instance_material(AC3DInstance *inst, 
+                                         int index, /* from .ac file */
+                                         float  *rgb, /* 3 floats, nil not set */
+                                         float  *amb, /* 3 floats, nil not set */
+                                         float  *emis, /* 3 floats, nil not set */
+                                         float  *spec, /* 3 floats, nil not set */
+                                         float  shi, /* <0 = no change */
+                                         float  trans); /* <0 = no change */
+  /* Draw as draw_ac3d_file and draw_ac3d_file_culled would with the 
+     state of the instance. Nothing is drawn when there is no memory for
+     the draw list */
+  void        draw_ac3d_instance(AC3DInstance *inst);
+  void        draw_ac3d_instance_ctx(AC3DContext *ctx, AC3DInstance *inst);
+  int         draw_ac3d_instance_culled(AC3DInstance *inst, 
+                                        const float *viewproj, 
+                                        AC3DCullStats *stats);
+  int         draw_ac3d_instance_culled_ctx(AC3DContext *ctx,
+                                            AC3DInstance *inst, 
+                                            const float *viewproj, 
+                                            AC3DCullStats *stats);
+
+  /* Draw the model count times, instance i with the 16 floats of 
+     matrices from i*16 on (column major, as for glMultMatrixf) on top of
+     the current modelview. The draws are sorted by texture and material
+     when the draw list is compiled and each is made for all instances
+     in a row, so the state is set once per draw of the model and an
+     instance costs a glLoadMatrixf and the draw calls. The objects
+     enabled and their rotations are those of the file, the same for all
+     instances. colors has the rgba per instance that replaces the 
+     diffuse colour of the materials, enabled a flag per instance, 0 = 
+     not drawn, either can be NULL. Blended materials are not sorted 
+     back to front across instances */
+  void        draw_ac3d_instances(AC3DFile *file, 
+                                  const float *matrices, 
+                                  int count,
+                                  const float *colors,
+                                  const unsigned char *enabled);
+  void        draw_ac3d_instances_ctx(AC3DContext *ctx,
+                                      AC3DFile *file, 
+                                      const float *matrices, 
+                                      int count,
+                                      const float *colors,
+                                      const unsigned char *enabled);
 
   /* Get the bounding box, returns vector of 6 floats, min x,y,z max x,y,z */
   float      *get_ac3d_bbox(AC3DFile *file);
 
+  /* Bounds of an object and its kids in the frame of its parent, they 
+     hold it at any angle of set_rotation_ac3d_object. bbox gets min x,y,z
+     max x,y,z and sphere the center x,y,z and radius, either can be NULL.
+     Returns 0 when there is nothing to bound */
+  int         get_ac3d_object_bounds(AC3DObject *obj, float *bbox, float *sphere);
+
   /* Draw the bounding box */
   void        draw_ac3d_bbox(AC3DFile *file);
 
-  /* Free memory used for all loaded textures */
+  /* Software rendering, built with USE_RASTERIZER and always when 
+     headless. Draws the model as draw_ac3d_file would with one white 
+     directional light into a width*height RGBA image, top row first. 
+     Not for the same file on two threads at once */
+  typedef struct AC3DRenderOptions_s {
+    int   width;
+    int   height;
+    float modelview[16];      /* column major, as for glLoadMatrixf */
+    float projection[16];
+    float light[3];           /* direction to the light, in eye space */
+    float clear[4];           /* rgba of the background */
+    int   threads;            /* draw the tiles on this many threads, 
+                                 0 = serial, <0 = one per core */
+    AC3DTextureFunc texture;  /* RGBA pixels of a texture, kept by the
+                                 caller, atlases are made from it too,
+                                 NULL = not textured */
+    void *userdata;
+  } AC3DRenderOptions;
+  int         render_ac3d_file(AC3DFile *file, 
+                               const AC3DRenderOptions *opts, 
+                               unsigned char *rgba);
+
+  /* Save an RGBA image, top row first, as .tga, returns 1 on success */
+  int         write_ac3d_tga(const char *filename, 
+                             const unsigned char *rgba, 
+                             int width, int height);
+
+  /* Free the loaded textures no model uses, the ones in use stay until
+     the files using them are freed */
   void        free_ac3d_textures();
+  void        free_ac3d_textures_ctx(AC3DContext *ctx);
+
+  /* The textures of a context are loaded once per image, shared by its
+     files and counted per file. The ones no file uses any more are kept
+     for later loads until the cache goes over its budget, and are then
+     freed least recently used first */
+  typedef struct AC3DTextureStats_s {
+    size_t   budget;           /* bytes, 0 = no limit, the default */
+    size_t   bytes;            /* of the cached textures */
+    size_t   unused_bytes;     /* of the ones no file uses */
+    int      textures;
+    int      unused;
+    unsigned hits;             /* lookups that found the texture cached */
+    unsigned misses;           /* lookups that loaded it */
+    unsigned evictions;        /* textures freed for the budget or by 
+                                  free_ac3d_textures */
+  } AC3DTextureStats;
+  void        set_ac3d_texture_budget(size_t bytes);
+  void        set_ac3d_texture_budget_ctx(AC3DContext *ctx, size_t bytes);
+  void        get_ac3d_texture_stats(AC3DTextureStats *stats);
+  void        get_ac3d_texture_stats_ctx(AC3DContext *ctx, AC3DTextureStats *stats);
+
+  /* Mipmaps for the textures loaded from now on, made when the texture
+     is loaded. Textures already cached keep theirs. The smallest levels
+     of an atlas blend the images packed next to each other */
+  enum {
+    AC3D_MIPMAPS_NONE = 0,     /* the default */
+    AC3D_MIPMAPS_BOX,          /* averages of the stored values */
+    AC3D_MIPMAPS_GAMMA         /* averages in linear light, for sRGB images */
+  };
+  void        set_ac3d_texture_mipmaps(int mipmaps);
+  void        set_ac3d_texture_mipmaps_ctx(AC3DContext *ctx, int mipmaps);
 
   /* Free memory used for a model */
   void        free_ac3d_file(AC3DFile *file);
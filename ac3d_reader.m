@@ -8,47 +8,109 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <sys/sysctl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
 
-#include <TargetConditionals.h>
-
-static int __unused is_iPhone3GS = 0;
-
-#if TARGET_IPHONE_SIMULATOR
-static int tris;
-static int strips;
-static int strips_pts;
-#  define INIT_STATS tris = strips = strips_pts = 0
-#  define ADD_TRIS(_v) tris += _v
-#  define ADD_STRIPS(_v) strips += _v
-#  define ADD_STRIPS_PTS(_v) strips_pts += _v
-#  define SHOW_STATS NSLog(@"\nTris: %d\nCreated tri strips: %d\nPoints removed: %d", tris, strips, strips_pts)
+// Build with AC3D_HEADLESS defined to compile this file as plain C, 
+// without GL, UIKit or the Foundation classes. Loading, cooking, the 
+// cache and the software renderer work, drawing and textures need GL.
+#ifdef AC3D_HEADLESS
+#  include <stdbool.h>
+#  define nil NULL
+#  ifndef __unused
+#    define __unused __attribute__((unused))
+#  endif
+typedef unsigned int GLuint;
 #else
-#  define INIT_STATS 
-#  define ADD_TRIS(_v) 
-#  define ADD_STRIPS(_v) 
-#  define ADD_STRIPS_PTS(_v) 
-#  define SHOW_STATS
+#  include <sys/sysctl.h>
+#  include <TargetConditionals.h>
 #endif
 
+// Counters for get_ac3d_stats, kept in the obj being cooked. An object is
+// read and cooked by one thread so no atomics are needed.
+#define ADD_STRIPS(_v) (obj->stats.strips += (_v))
+#define ADD_STRIPS_PTS(_v) (obj->stats.points_removed += (_v))
+#define ADD_STRIP_TRIS(_v) (obj->stats.strip_triangles += (_v))
+#define ADD_DRAWS(_in, _out) (obj->stats.draws_in += (_in), obj->stats.draws_out += (_out))
+#define TIME_PHASE(_phase, _stmt) do {                          \
+        double _start = ac3d_time();                            \
+        _stmt;                                                  \
+        obj->stats.time[_phase] += ac3d_time() - _start;        \
+    } while (0)
+
 //#define USE_VBO
 #define USE_FLOATS
+#define USE_CACHE
+//#define USE_RASTERIZER // software renderer, always on when headless
 
-#import "AC3DTexture.h"
+#ifdef AC3D_HEADLESS
+#  undef USE_VBO
+#  define USE_RASTERIZER
+#else
+#  import "AC3DTexture.h"
+#endif
 
 #include "ac3d_reader.h"
 
-static NSMutableDictionary *textures = nil;
-static int lastMat = -1;
+// What used to be globals. Loads only read the settings, so they can
+// share a context, the textures and the material last set are changed
+// by drawing on the thread of its GL context.
+struct AC3DContext_s {
+    AC3DLoadOptions        options;
+    AC3DAllocator          allocator;    // for the arenas of its loads
+    AC3DPathResolver       resolver;
+    void                  *resolverdata;
+    pthread_mutex_t        lock;         // of ready and numpending
+    struct AC3DLoad_s     *ready;        // read, the uploads not started
+    struct AC3DLoad_s     *uploading;    // by pump_ac3d_uploads
+    int                    numpending;   // async loads not delivered
+    AC3DTextureStats       texstats;     // of its textures, the unused
+                                         // ones are counted when asked for
+    int                    mipmaps;      // AC3D_MIPMAPS_xxx of the
+                                         // textures loaded from now on
+#ifndef AC3D_HEADLESS
+    NSMutableDictionary   *textures;     // names and paths of its textures
+    struct AC3DTextureEntry_s *lru;      // all of them, last used first
+    struct AC3DTextureEntry_s *lrutail;
+    bool                   is_iPhone3GS;
+#endif
+    struct AC3DFile_s     *lastfile;     // the material set last
+    int                    lastmat;
+    unsigned int           lastversion;
+};
+
+static void *alloc_ac3d_default(size_t size, void *userdata);
+static void  free_ac3d_default(void *ptr, size_t size, void *userdata);
+static int   resolve_ac3d_bundle_path(const char *filename, char *path, size_t size, void *userdata);
+
+// Used by the functions without _ctx
+static AC3DContext default_context = {
+    .allocator = { alloc_ac3d_default, free_ac3d_default, NULL },
+    .resolver = resolve_ac3d_bundle_path,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+#ifndef AC3D_HEADLESS
+
+static
+void load_textures_ac3d_object(AC3DObject *obj, AC3DFile *file);
+
+static
+struct AC3DTextureEntry_s *acquire_ac3d_texture(struct AC3DFile_s *file, const char *name);
 
 static
-void load_textures_ac3d_object(AC3DObject *obj, 
-                               NSMutableDictionary *textures);
+void release_ac3d_file_textures(struct AC3DFile_s *file);
 
 static
-void init_ac3d_textures()
+void init_ac3d_textures(AC3DContext *ctx)
 {
-    if (!textures) {
+    if (!ctx->textures) {
 #if TARGET_IPHONE_SIMULATOR
         /* empty */
 #else
@@ -56,18 +118,13 @@ void init_ac3d_textures()
         size_t len=32;
         sysctlbyname("hw.machine", machine, &len, NULL, 0);
         if (!strcmp(machine, "iPhone2,1")) 
-            is_iPhone3GS = 1;
+            ctx->is_iPhone3GS = true;
 #endif
-        textures = [[NSMutableDictionary alloc] init];
+        ctx->textures = [[NSMutableDictionary alloc] init];
     }
 }
 
-void free_ac3d_textures()
-{
-    if (textures)
-        [textures release];
-    textures = nil;
-}
+#endif // AC3D_HEADLESS
 
 enum {
     SURF_SHADED     = 0x10,
@@ -76,6 +133,8 @@ enum {
     SURF_CLOSEDLINE = 1,
     SURF_LINE       = 2,
     SURF_TRI_STRIP  = 3,
+    SURF_TRI_LIST   = 4, // only made by batching
+    SURF_LINES      = 5, // only made by batching
     OBJECT_WORLD    = 0,
     OBJECT_POLY,
     OBJECT_GROUP,
@@ -83,6 +142,7 @@ enum {
 };
 
 struct AC3DFile_s;
+struct AC3DArena_s;
 struct AC3DMaterial_s;
 struct AC3DObject_s;
 struct AC3DSurf_s;
@@ -92,6 +152,22 @@ struct AC3DFile_s {
     float                  *bbox;
     struct AC3DMaterial_s **mats;
     struct AC3DObject_s    *obj;
+    void                  *map;     // mmapped .acb cache, if loaded from one
+    size_t                 mapsize;
+    struct AC3DDrawList_s *drawlist; // compiled on the first draw
+    struct AC3DObject_s  **objects; // depth first, indexed by handle
+    int                    numobjects;
+    int                   *names;   // hash of the named objects, -1 = free
+    unsigned int           namemask;
+    double                 loadtime;
+    bool                   cached;  // loaded from the .acb cache
+    struct AC3DArena_s    *arena;   // holds the file and all in it
+    struct AC3DContext_s  *ctx;     // loaded with, has its textures
+    struct AC3DTextureEntry_s **textures; // of ctx it holds, malloced
+    int                    numtextures;
+    unsigned int           matversion; // changed by set_ac3d_material
+    AC3DTextureFunc        atlas_texture; // atlases are made from, NULL = bundle
+    void                  *atlas_userdata;
 };
 
 struct AC3DMaterial_s {
@@ -103,7 +179,7 @@ struct AC3DMaterial_s {
     float  shi;
 };
 
-typedef float AC3DVert[6]; // pos+normal
+typedef float AC3DVert[3]; // pos
 
 typedef union {
     float f;
@@ -114,11 +190,62 @@ typedef union {
     } b;
 } AC3Doptcmd;
 
+// Values per vertex in the stream, V,N and T if textured, and in the
+// indexed vertices unless they are quantized
+#define AC3D_VERTEX_STRIDE(_obj) ((_obj)->texture ? 8 : 6)
+
+// Refs of a record, cmd[1] is a short
+#define AC3D_MAX_REFS 32767
+
+// Vertices one 16 bit indexed chunk can use
+#define AC3D_MAX_CHUNK_VERTS 65535
+
+// Index _i of an indexed object, 16 or 32 bits
+#define AC3D_INDEX(_obj, _i) ((_obj)->indexsize == 4 ?                       \
+                              ((const uint32_t*)(_obj)->indices)[_i] :      \
+                              ((const unsigned short*)(_obj)->indices)[_i])
+
+// How the indexed vertices of an object are quantized, see
+// quantize_ac3d_vertices. Positions are 3 shorts and a pad, normals 3
+// signed bytes and a pad, texcoords 2 shorts, so all stay 4 byte aligned
+// and the strides still count AC3Doptcmd.
+struct AC3DQuant_s {
+    int32_t format; // AC3D_QUANTIZE_xxx
+    float   pos[4]; // offset x,y,z and scale, p = offset + scale*q
+    float   uv[4];  // offset u,v and scale u,v
+};
+
+#define AC3D_QUANT_FORMAT(_obj) ((_obj)->quant ? (_obj)->quant->format : 0)
+
+// Where N and T are in an indexed vertex and its size, in AC3Doptcmd
+#define AC3D_NORMAL_OFFSET(_obj)                                        \
+    ((AC3D_QUANT_FORMAT(_obj) & AC3D_QUANTIZE_POSITIONS) ? 2 : 3)
+#define AC3D_TEXCOORD_OFFSET(_obj)                                      \
+    (AC3D_NORMAL_OFFSET(_obj) + ((AC3D_QUANT_FORMAT(_obj) & AC3D_QUANTIZE_NORMALS) ? 1 : 3))
+#define AC3D_INDEXED_STRIDE(_obj)                                       \
+    (AC3D_TEXCOORD_OFFSET(_obj) + (!(_obj)->texture ? 0 :               \
+                                   (AC3D_QUANT_FORMAT(_obj) & AC3D_QUANTIZE_TEXCOORDS) ? 1 : 2))
+
+// Counted while reading and cooking an object for get_ac3d_stats, kept in
+// the .acb cache so it has fixed sizes
+struct AC3DObjectStats_s {
+    int32_t surfaces[3];    // by SURF_POLYGON, SURF_CLOSEDLINE and SURF_LINE
+    int32_t triangles;
+    int32_t strips;
+    int32_t strip_triangles;
+    int32_t points_removed;
+    int32_t draws_in;
+    int32_t draws_out;
+    float   time[AC3D_NUM_PHASES];
+    float   quant_error[3]; // position, normal in degrees and texcoord
+};
+
 struct AC3DObject_s {
     bool                   texture_loaded;
     bool                   enabled;
     int                    type;
     char                  *name;
+    int                    handle;  // index in file->objects
     char                  *texture;
     int                    texid;
     float                 *texrep; // 2
@@ -128,15 +255,28 @@ struct AC3DObject_s {
     float                  angle;
     float                 *rotvec; // 6
     float                 *bbox;   // 6
+    float                  crease; // degrees
     int                    numvert;
     AC3DVert              *verts;
     int                    numcmds;
     AC3Doptcmd            *optcmds;
     GLuint                 vbo;
+    int                    numvertices; // indexed cooking, welded V,N,T
+    AC3Doptcmd            *vertices;
+    int                    numindices;
+    void                  *indices;
+    int                    indexsize;   // 2 or 4 bytes
+    struct AC3DQuant_s    *quant;       // of the vertices, NULL = floats
+    int                    numbatches;
+    struct AC3DBatch_s    *batches;
+    GLuint                 ivbo[2]; // vertices and indices
     int                    numsurf;
     struct AC3DSurf_s    **surfs;
     int                    numkids;
     struct AC3DObject_s  **kids;
+    struct AC3DObjectStats_s stats;
+    struct AC3DArena_s    *arena;   // where its data is
+    int                    cmdsize; // room in optcmds, while flattening
     // data - not implemented
     // url - not implemented
 };
@@ -146,18 +286,111 @@ struct AC3Dtexref_s {
     float texv;
 };
 
+// A run of indexed triangles with the same state
+struct AC3DBatch_s {
+    short type;  // only SURF_TWOSIDED
+    short mat;
+    int   first; // in indices
+    int   count;
+    int   base;  // first vertex, the indices count from it
+};
+
+// Packet state bits, above the SURF_xxx type and flags
+enum {
+    PACKET_INDEXED   = 0x100, // glDrawElements of an indexed batch
+    PACKET_NORMALS   = 0x200, // normal array, else the flat normal
+    PACKET_TEXCOORDS = 0x400,
+    PACKET_INDEX32   = 0x800, // 32 bit indices
+    PACKET_QUANTIZED = 0x1000 // vertices as in obj->quant
+};
+
+// One draw call of the compiled draw list
+struct AC3DPacket_s {
+    short type;   // SURF_xxx, its flags and PACKET_xxx
+    short mat;
+    short slot;   // transform slot, -1 = the frame of the file
+    short stride; // in AC3Doptcmd
+    int   texid;  // -1 = untextured
+    int   offset; // of the first vertex in AC3Doptcmd, or first index
+    int   count;
+    int   normal; // of the flat normal in AC3Doptcmd
+    int   base;   // vertex the indices count from
+};
+
+// An object of the draw list, its own packets come first and then the
+// ones of its kids up to the packets of the node next
+struct AC3DDrawNode_s {
+    struct AC3DObject_s *obj;
+    int                  slot; // of its parent, the frame of obj->bbox
+    int                  first;
+    int                  end;  // of its own packets
+    int                  next; // node after the subtree
+};
+
+// A transform slot, the matrix of obj on top of the parent slot
+struct AC3DDrawSlot_s {
+    struct AC3DObject_s *obj;
+    int                  parent;
+    float                m[16];
+};
+
+// A packet in the order instances are drawn in, sorted by its state
+struct AC3DPacketRef_s {
+    int   texid;
+    short mat;
+    short type;
+    int   packet;
+    int   node;   // of its object
+};
+
+// What one copy of a file changes, the file stays as it is. The arrays
+// are by handle and follow it in one allocation, the materials set for
+// it are allocated on their own
+struct AC3DInstance_s {
+    struct AC3DFile_s      *file;
+    size_t                  size;
+    float                  *angles;
+    int                    *texids;  // AC3D_TEXID_OF_FILE = that of the file
+    bool                   *enabled;
+    struct AC3DMaterial_s **mats;    // nummats, NULL = that of the file
+};
+
+// One allocation, the arrays follow it
+struct AC3DDrawList_s {
+    size_t                 size;
+    int                    numnodes;
+    struct AC3DDrawNode_s *nodes;
+    int                    numpackets;
+    struct AC3DPacket_s   *packets;
+    int                    numslots;
+    struct AC3DDrawSlot_s *slots;
+    struct AC3DPacketRef_s *order; // numpackets of them
+    unsigned char         *live;  // per node, drawn by the instances
+};
+
 struct AC3DSurf_s {
     int                  type;
     int                  mat;
     float                normal[3];
     int                  numrefs;
-    short               *vrefs;
+    int                 *vrefs;
     struct AC3Dtexref_s *texrefs;
+    float              (*normals)[3]; // per ref, shaded surfaces only
 };
 
 typedef struct AC3DMaterial_s AC3DMaterial;
 typedef struct AC3DSurf_s     AC3DSurf;
+typedef struct AC3DBatch_s    AC3DBatch;
+typedef struct AC3DPacket_s   AC3DPacket;
+typedef struct AC3DDrawNode_s AC3DDrawNode;
+typedef struct AC3DDrawSlot_s AC3DDrawSlot;
+typedef struct AC3DDrawList_s AC3DDrawList;
+typedef struct AC3DPacketRef_s AC3DPacketRef;
 typedef struct AC3Dtexref_s   AC3Dtexref;
+typedef struct AC3DObjectStats_s AC3DObjectStats;
+typedef struct AC3DArena_s    AC3DArena;
+typedef struct AC3DTextureEntry_s AC3DTextureEntry;
+typedef struct AC3DQuant_s    AC3DQuant;
 
 // ----------------------------------------------------------------------
 
@@ -165,116 +398,500 @@ typedef struct AC3Dtexref_s   AC3Dtexref;
 #define THROW( _str ) do { *err = _str ; goto catch_error; } while (0)
 
 // ----------------------------------------------------------------------
+// Arenas
+//
+// A file and everything in it is bump allocated from big blocks, so it
+// is freed by giving back the blocks. Each thread that loads has an arena
+// of its own, chained to the one of the file, and two more while loading:
+// the scratch for the temporaries of reading and cooking, released to a
+// mark after each step, and one for the streams between reading and the
+// finishing of an object. The blocks come from the allocator that was
+// set when the arena was made.
+
+#define AC3D_ARENA_BLOCK  (64*1024)
+#define AC3D_ARENA_ALIGN  16
+#define AC3D_ARENA_ROUND(_n) (((_n) + AC3D_ARENA_ALIGN-1) & ~(size_t)(AC3D_ARENA_ALIGN-1))
+
+typedef struct AC3DArenaBlock_s {
+    struct AC3DArenaBlock_s *next;
+    size_t                   size; // of the data
+    size_t                   used;
+} AC3DArenaBlock;
+
+#define AC3D_ARENA_HEADER AC3D_ARENA_ROUND(sizeof(AC3DArenaBlock))
+#define AC3D_ARENA_DATA(_block) ((char*)(_block) + AC3D_ARENA_HEADER)
+
+struct AC3DArena_s {
+    AC3DAllocator        allocator; // the blocks are given back to it
+    AC3DArenaBlock      *blocks;    // newest first
+    AC3DArenaBlock      *current;   // the one small allocations come from
+    struct AC3DArena_s  *scratch;   // temporaries, while loading
+    struct AC3DArena_s  *stream;    // streams not yet finished, same
+    struct AC3DArena_s  *next;      // more arenas of the same file
+    struct AC3DContext_s *ctx;      // loaded with
+    const AC3DLoadOptions *options; // of the load, while loading
+    bool                 cut;       // strip_budget ran out, not cached
+};
+
+typedef struct {
+    AC3DArenaBlock *blocks;
+    AC3DArenaBlock *current;
+    size_t          used;
+} AC3DArenaMark;
+
+static
+void *alloc_ac3d_default(size_t size, void *userdata)
+{
+    (void)userdata;
+    return malloc(size);
+}
+
+static
+void free_ac3d_default(void *ptr, size_t size, void *userdata)
+{
+    (void)size;
+    (void)userdata;
+    free(ptr);
+}
+
+static
+AC3DArenaBlock *add_ac3d_arena_block(AC3DArena *arena, size_t size)
+{
+    AC3DArenaBlock *block = (AC3DArenaBlock*)arena->allocator.alloc(AC3D_ARENA_HEADER + size, 
+                                                                    arena->allocator.userdata);
+    if (!block)
+        return NULL;
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+    return block;
+}
 
 static
-void free_ac3d_material(AC3DMaterial *mat)
+void free_ac3d_arena_blocks(AC3DArena *arena, AC3DArenaBlock *stop)
 {
-    if (mat) {
-        if (mat->name)
-            free(mat->name);
-        free(mat);
+    while (arena->blocks != stop) {
+        AC3DArenaBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        arena->allocator.free(block, AC3D_ARENA_HEADER + block->size, arena->allocator.userdata);
     }
 }
 
 static
-void free_ac3d_surf(AC3DSurf *surf)
+void free_ac3d_arena_only(AC3DArena *arena)
 {
-    if (surf) {
-        if (surf->vrefs) 
-            free(surf->vrefs);
-        if (surf->texrefs) 
-            free(surf->texrefs);
-        free(surf);
+    if (arena) {
+        free_ac3d_arena_blocks(arena, NULL);
+        arena->allocator.free(arena, sizeof(AC3DArena), arena->allocator.userdata);
     }
 }
 
+// The blocks come from the allocator of ctx. With options set the arena
+// gets the arenas for loading, these start with a block so releasing
+// them to a mark always leaves one
 static
-void free_ac3d_object(AC3DObject *obj)
+AC3DArena *new_ac3d_arena(AC3DContext *ctx, const AC3DLoadOptions *options)
 {
-    if (obj) {
-        int i;
-#ifdef USE_VBO
-        if (obj->vbo)
-            glDeleteBuffers(1, &obj->vbo);
-#endif
-        if (obj->name)
-            free(obj->name);
-        if (obj->texture)
-            free(obj->texture);
-        if (obj->texrep)
-            free(obj->texrep);
-        if (obj->texoff)
-            free(obj->texoff);
-        if (obj->rot)
-            free(obj->rot);
-        if (obj->rotvec)
-            free(obj->rotvec);
-        if (obj->bbox)
-            free(obj->bbox);
-        if (obj->loc)
-            free(obj->loc);
-        if (obj->numvert > 0 && obj->verts) 
-            free(obj->verts);
-        if (obj->numcmds > 0 && obj->optcmds) 
-            free(obj->optcmds);
-        if (obj->numsurf > 0 && obj->surfs) {
-            for (i=0; i<obj->numsurf; i++) {
-                if (obj->surfs[i])
-                    free_ac3d_surf(obj->surfs[i]);
-            }
-            free(obj->surfs);
+    AC3DArena *arena = (AC3DArena*)ctx->allocator.alloc(sizeof(AC3DArena), ctx->allocator.userdata);
+
+    if (!arena)
+        return NULL;
+    memset(arena, 0, sizeof(AC3DArena));
+    arena->allocator = ctx->allocator;
+    arena->ctx = ctx;
+    arena->options = options;
+
+    if (options) {
+        arena->scratch = new_ac3d_arena(ctx, NULL);
+        arena->stream = new_ac3d_arena(ctx, NULL);
+        if (!arena->scratch || !arena->stream ||
+            !(arena->scratch->current = add_ac3d_arena_block(arena->scratch, AC3D_ARENA_BLOCK)) ||
+            !(arena->stream->current = add_ac3d_arena_block(arena->stream, AC3D_ARENA_BLOCK))) {
+            free_ac3d_arena_only(arena->scratch);
+            free_ac3d_arena_only(arena->stream);
+            free_ac3d_arena_only(arena);
+            return NULL;
         }
-        if (obj->numkids > 0 && obj->kids) {
-            for (i=0; i<obj->numkids; i++) {
-                if (obj->kids[i])
-                    free_ac3d_object(obj->kids[i]);
-            }
-            free(obj->kids);
+    }
+    return arena;
+}
+
+// Frees the loading arenas of arena and the ones chained to it
+static
+void free_ac3d_load_arenas(AC3DArena *arena)
+{
+    for (; arena; arena = arena->next) {
+        free_ac3d_arena_only(arena->scratch);
+        free_ac3d_arena_only(arena->stream);
+        arena->scratch = NULL;
+        arena->stream = NULL;
+        arena->options = NULL;
+    }
+}
+
+static
+void free_ac3d_arena(AC3DArena *arena)
+{
+    free_ac3d_load_arenas(arena);
+    while (arena) {
+        AC3DArena *next = arena->next;
+        free_ac3d_arena_only(arena);
+        arena = next;
+    }
+}
+
+// Takes over the blocks of more, they are freed with arena
+static
+void chain_ac3d_arena(AC3DArena *arena, AC3DArena *more)
+{
+    AC3DArena *last = more;
+    while (last->next)
+        last = last->next;
+    last->next = arena->next;
+    arena->next = more;
+}
+
+// Small allocations are bumped from the current block, big ones get a
+// block of their own so the current one is not left half used
+static
+void *alloc_ac3d_arena(AC3DArena *arena, size_t size)
+{
+    AC3DArenaBlock *block = arena->current;
+    void *ptr;
+
+    size = AC3D_ARENA_ROUND(size);
+    if (!block || block->size - block->used < size) {
+        if (size > AC3D_ARENA_BLOCK/4) {
+            block = add_ac3d_arena_block(arena, size);
+        } else {
+            block = add_ac3d_arena_block(arena, AC3D_ARENA_BLOCK);
+            arena->current = block;
+        }
+        if (!block)
+            return NULL;
+    }
+    ptr = AC3D_ARENA_DATA(block) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static
+void *calloc_ac3d_arena(AC3DArena *arena, size_t count, size_t size)
+{
+    void *ptr = alloc_ac3d_arena(arena, count*size);
+    if (ptr)
+        memset(ptr, 0, count*size);
+    return ptr;
+}
+
+// Resizes in place when ptr is the last allocation, else copies
+static
+void *grow_ac3d_arena(AC3DArena *arena, void *ptr, size_t size, size_t newsize)
+{
+    AC3DArenaBlock *block = arena->current;
+    size_t used;
+    void *dst;
+
+    if (ptr && block && block->used >= AC3D_ARENA_ROUND(size)) {
+        used = block->used - AC3D_ARENA_ROUND(size);
+        if ((char*)ptr == AC3D_ARENA_DATA(block) + used &&
+            block->size - used >= AC3D_ARENA_ROUND(newsize)) {
+            block->used = used + AC3D_ARENA_ROUND(newsize);
+            return ptr;
         }
-        free(obj);
     }
+
+    dst = alloc_ac3d_arena(arena, newsize);
+    if (dst && ptr)
+        memcpy(dst, ptr, size < newsize ? size : newsize);
+    return dst;
+}
+
+static
+void *dup_ac3d_arena(AC3DArena *arena, const void *src, size_t size)
+{
+    void *dst = alloc_ac3d_arena(arena, size);
+    if (dst)
+        memcpy(dst, src, size);
+    return dst;
+}
+
+static
+void mark_ac3d_arena(AC3DArena *arena, AC3DArenaMark *mark)
+{
+    mark->blocks = arena->blocks;
+    mark->current = arena->current;
+    mark->used = arena->current ? arena->current->used : 0;
+}
+
+// Frees everything allocated since the mark
+static
+void release_ac3d_arena(AC3DArena *arena, const AC3DArenaMark *mark)
+{
+    free_ac3d_arena_blocks(arena, mark->blocks);
+    arena->current = mark->current;
+    if (arena->current)
+        arena->current->used = mark->used;
+}
+
+// ----------------------------------------------------------------------
+
+// The buffers are the only things of an object not in its arena
+static
+void free_ac3d_object_buffers(AC3DObject *obj)
+{
+#ifdef USE_VBO
+    int i;
+    if (obj->vbo)
+        glDeleteBuffers(1, &obj->vbo);
+    if (obj->ivbo[0])
+        glDeleteBuffers(2, obj->ivbo);
+    for (i=0; i<obj->numkids; i++) 
+        free_ac3d_object_buffers(obj->kids[i]);
+#endif
+    (void)obj;
+}
+
+#ifdef USE_VBO
+
+// Uploads what is not in buffers yet, the tree walk keeps its own
+static
+void upload_ac3d_object_buffers(AC3DObject *obj)
+{
+    if (obj->numcmds > 0 && !obj->vbo) {
+        glGenBuffers(1, &obj->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(AC3Doptcmd)*obj->numcmds, obj->optcmds, GL_STATIC_DRAW); 
+    }
+    if (obj->indices && !obj->ivbo[0]) {
+        glGenBuffers(2, obj->ivbo);
+        glBindBuffer(GL_ARRAY_BUFFER, obj->ivbo[0]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(AC3Doptcmd)*AC3D_INDEXED_STRIDE(obj)*obj->numvertices, obj->vertices, GL_STATIC_DRAW); 
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->ivbo[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj->indexsize*obj->numindices, obj->indices, GL_STATIC_DRAW); 
+    }
+}
+
+#endif
+
+static
+void free_ac3d_drawlist(AC3DFile *file)
+{
+    AC3DDrawList *list = file->drawlist;
+    if (list) 
+        file->arena->allocator.free(list, list->size, file->arena->allocator.userdata);
+    file->drawlist = NULL;
 }
 
 void free_ac3d_file(AC3DFile *file)
 {
     if (file) {
+        free_ac3d_drawlist(file);
         if (file->obj)
-            free_ac3d_object(file->obj);
-        if (file->nummats && file->mats) {
-            int i;
-            for (i=0; i<file->nummats; i++) {
-                free_ac3d_material(file->mats[i]);
-            }
-            free(file->mats);
-        }
-        free(file);
+            free_ac3d_object_buffers(file->obj);
+#ifndef AC3D_HEADLESS
+        release_ac3d_file_textures(file);
+#endif
+        if (file->map)
+            munmap(file->map, file->mapsize);
+        // The file is in its arena too
+        free_ac3d_arena(file->arena);
     }
 }
 
 // ----------------------------------------------------------------------
+// Lookup
+//
+// The objects are numbered depth first at load, the number is the handle
+// of the object. Names are hashed into an open addressed table in the
+// same order, so the first match of a probe is the first object with
+// that name in the tree.
 
 static
-AC3DObject *find_ac3d_object_object(AC3DObject *obj, const char *name)
+unsigned int hash_ac3d_name(const char *name, int len)
 {
-    AC3DObject *o;
+    unsigned int h = 2166136261u;
     int i;
-    
-    if (obj->name && !strcmp(obj->name, name)) 
-        return obj;
 
-    for (i=0; i<obj->numkids; i++) 
-        if ((o = find_ac3d_object_object(obj->kids[i], name)))
-            return o;
+    for (i=0; i<len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static
+int count_ac3d_objects(AC3DObject *obj)
+{
+    int n = 1, i;
+    for (i=0; i<obj->numkids; i++)
+        n += count_ac3d_objects(obj->kids[i]);
+    return n;
+}
+
+static
+void add_ac3d_object_handles(AC3DFile *file, AC3DObject *obj)
+{
+    int i;
+
+    obj->handle = file->numobjects++;
+    file->objects[obj->handle] = obj;
+
+    if (obj->name) {
+        unsigned int h = hash_ac3d_name(obj->name, (int)strlen(obj->name));
+        for (h &= file->namemask; file->names[h] >= 0; h = (h+1) & file->namemask)
+            ;
+        file->names[h] = obj->handle;
+    }
+
+    for (i=0; i<obj->numkids; i++)
+        add_ac3d_object_handles(file, obj->kids[i]);
+}
+
+// Numbers and hashes the objects of a loaded file, returns 0 when out
+// of memory
+static
+int index_ac3d_file(AC3DFile *file)
+{
+    int count = count_ac3d_objects(file->obj);
+    unsigned int size = 1;
+
+    while (size < (unsigned int)count*2)
+        size <<= 1;
+
+    file->objects = (AC3DObject**)alloc_ac3d_arena(file->arena, sizeof(AC3DObject*)*count);
+    file->names = (int*)alloc_ac3d_arena(file->arena, sizeof(int)*size);
+    if (!file->objects || !file->names)
+        return 0;
+
+    memset(file->names, 0xff, sizeof(int)*size);
+    file->namemask = size-1;
+    file->numobjects = 0;
+    add_ac3d_object_handles(file, file->obj);
+    return 1;
+}
+
+static
+int is_ac3d_name(const AC3DObject *obj, const char *name, int len)
+{
+    return obj->name && !strncmp(obj->name, name, len) && !obj->name[len];
+}
+
+// Matches the rest of a path below obj, each part names a kid of the
+// one before. Returns the handle of the first match or -1.
+static
+int match_ac3d_path(AC3DObject *obj, const char *path)
+{
+    const char *slash;
+    int len, i, handle;
+
+    if (!*path)
+        return obj->handle;
+
+    slash = strchr(path, '/');
+    len = slash ? (int)(slash - path) : (int)strlen(path);
+
+    for (i=0; i<obj->numkids; i++)
+        if (is_ac3d_name(obj->kids[i], path, len) &&
+            (handle = match_ac3d_path(obj->kids[i], slash ? slash+1 : path+len)) >= 0)
+            return handle;
+
+    return -1;
+}
+
+// Calls back with every object named by the first part of path that
+// the rest matches below, in depth first order, until it returns 0.
+// Returns the number of matches.
+static
+int find_ac3d_path(AC3DFile *file, const char *path,
+                   int (*found)(int handle, void *userdata), void *userdata)
+{
+    const char *slash;
+    unsigned int h;
+    int len, handle, n = 0;
+
+    if (!file || !file->names || !path)
+        return 0;
+
+    // A name with a slash in it is matched whole first
+    slash = strchr(path, '/');
+    len = (int)strlen(path);
+    if (slash) {
+        for (h = hash_ac3d_name(path, len) & file->namemask; file->names[h] >= 0; h = (h+1) & file->namemask)
+            if (is_ac3d_name(file->objects[file->names[h]], path, len)) {
+                n++;
+                if (!found(file->names[h], userdata))
+                    return n;
+            }
+        if (n)
+            return n;
+        len = (int)(slash - path);
+    }
+
+    for (h = hash_ac3d_name(path, len) & file->namemask; file->names[h] >= 0; h = (h+1) & file->namemask) {
+        AC3DObject *obj = file->objects[file->names[h]];
+
+        if (!is_ac3d_name(obj, path, len))
+            continue;
+        handle = slash ? match_ac3d_path(obj, slash+1) : obj->handle;
+        if (handle >= 0) {
+            n++;
+            if (!found(handle, userdata))
+                return n;
+        }
+    }
+    return n;
+}
+
+static
+int found_ac3d_first(int handle, void *userdata)
+{
+    *(int*)userdata = handle;
+    return 0;
+}
 
-    return nil;
+typedef struct {
+    int *handles;
+    int  count;
+    int  max;
+} AC3DHandleList;
+
+static
+int found_ac3d_handle(int handle, void *userdata)
+{
+    AC3DHandleList *list = (AC3DHandleList*)userdata;
+    if (list->count < list->max)
+        list->handles[list->count++] = handle;
+    return 1;
 }
 
 AC3DObject *find_ac3d_object(AC3DFile *file, const char *name)
 {
-    if (file->obj)
-        return find_ac3d_object_object(file->obj, name);
+    return get_ac3d_object(file, get_ac3d_object_handle(file, name));
+}
 
-    return NULL;
+int get_ac3d_object_handle(AC3DFile *file, const char *path)
+{
+    int handle = -1;
+    find_ac3d_path(file, path, found_ac3d_first, &handle);
+    return handle;
+}
+
+int get_ac3d_object_handles(AC3DFile *file, const char *path, int *handles, int max)
+{
+    AC3DHandleList list = { handles, 0, handles ? max : 0 };
+    return find_ac3d_path(file, path, found_ac3d_handle, &list);
+}
+
+int get_ac3d_object_count(AC3DFile *file)
+{
+    return file ? file->numobjects : 0;
+}
+
+AC3DObject *get_ac3d_object(AC3DFile *file, int handle)
+{
+    if (!file || handle < 0 || handle >= file->numobjects)
+        return NULL;
+    return file->objects[handle];
 }
 
 void set_rotation_ac3d_object(AC3DObject *obj, float angle)
@@ -296,6 +913,24 @@ void set_enabled_ac3d_object(AC3DObject *obj, int flag)
         obj->enabled = flag ? true : false;
 }
 
+void set_rotation_ac3d_objects(AC3DFile *file, const int *handles, const float *angles, int count)
+{
+    int i;
+
+    for (i=0; i<count; i++)
+        if (handles[i] >= 0 && handles[i] < file->numobjects)
+            file->objects[handles[i]]->angle = angles[i];
+}
+
+void set_enabled_ac3d_objects(AC3DFile *file, const int *handles, const int *flags, int count)
+{
+    int i;
+
+    for (i=0; i<count; i++)
+        if (handles[i] >= 0 && handles[i] < file->numobjects)
+            file->objects[handles[i]]->enabled = flags[i] ? true : false;
+}
+
 // ----------------------------------------------------------------------
 
 void get_ac3d_material(AC3DFile *file, 
@@ -348,84 +983,210 @@ if (_field) for (j=0;j<3;j++) file->mats[index]->_field[j] = _field[j]
             file->mats[index]->rgb[3] = 1.0-trans;
             file->mats[index]->amb[3] = 1.0-trans;
         }
-        lastMat = -1;
+        file->matversion++;
 #undef COPY
     }
 }
 
 // ----------------------------------------------------------------------
+// Instances
+//
+// An instance is a copy of a file that shares everything loaded with it
+// and only has the state drawing changes per copy, the rotations and
+// flags of the objects, its textures and the materials set for it. It is
+// drawn through the draw list of the file, which takes that state from
+// the instance instead of the objects.
 
-static
-void set_ac3d_texture_object(AC3DObject *obj,
-                             char *texture_name,
-                             int texid)
+AC3DInstance *new_ac3d_instance(AC3DFile *file)
 {
+    AC3DAllocator *allocator = &file->arena->allocator;
+    AC3DInstance *inst;
+    int n = file->numobjects;
+    size_t size;
     int i;
-    if (obj->texture && !strcmp(obj->texture, texture_name)) {
-        obj->texid = texid;
-        if (texid == -1)
-            obj->texture_loaded = 0;
+
+    size = (AC3D_ARENA_ROUND(sizeof(AC3DInstance)) +
+            AC3D_ARENA_ROUND(sizeof(AC3DMaterial*)*file->nummats) +
+            AC3D_ARENA_ROUND(sizeof(float)*n) +
+            AC3D_ARENA_ROUND(sizeof(int)*n) +
+            sizeof(bool)*n);
+    inst = (AC3DInstance*)allocator->alloc(size, allocator->userdata);
+    if (!inst)
+        return NULL;
+    inst->file = file;
+    inst->size = size;
+    inst->mats = (AC3DMaterial**)((char*)inst + AC3D_ARENA_ROUND(sizeof(AC3DInstance)));
+    inst->angles = (float*)((char*)inst->mats + AC3D_ARENA_ROUND(sizeof(AC3DMaterial*)*file->nummats));
+    inst->texids = (int*)((char*)inst->angles + AC3D_ARENA_ROUND(sizeof(float)*n));
+    inst->enabled = (bool*)((char*)inst->texids + AC3D_ARENA_ROUND(sizeof(int)*n));
+
+    memset(inst->mats, 0, sizeof(AC3DMaterial*)*file->nummats);
+    for (i=0; i<n; i++) {
+        inst->angles[i] = file->objects[i]->angle;
+        inst->texids[i] = AC3D_TEXID_OF_FILE;
+        inst->enabled[i] = file->objects[i]->enabled;
     }
-    for (i=0; i<obj->numkids; i++) 
-        set_ac3d_texture_object(obj->kids[i], texture_name, texid);
+    return inst;
 }
 
-void set_ac3d_texture(AC3DFile *file, 
-                      char *texture_name,
-                      int texid)
+void free_ac3d_instance(AC3DInstance *inst)
 {
-    if (!file->obj->texture_loaded) {
-        init_ac3d_textures();
-        load_textures_ac3d_object(file->obj, textures);
-    }
-    set_ac3d_texture_object(file->obj, texture_name, texid);
+    AC3DAllocator *allocator;
+    int i;
+
+    if (!inst)
+        return;
+    allocator = &inst->file->arena->allocator;
+    for (i=0; i<inst->file->nummats; i++)
+        if (inst->mats[i])
+            allocator->free(inst->mats[i], sizeof(AC3DMaterial), allocator->userdata);
+    allocator->free(inst, inst->size, allocator->userdata);
 }
 
-void set_ac3d_texture_named(AC3DFile *file, 
-                            char *texture_name_org,
-                            char *texture_name_new)
+void set_rotation_ac3d_instance(AC3DInstance *inst, const int *handles, const float *angles, int count)
 {
-    int texid = -1;
-    
-    NSString *texname = [NSString stringWithFormat:@"%s", texture_name_new];
-    AC3DTexture *texture = [textures objectForKey:texname];
-    if (texture) {
-        texid = [texture name];
-    } else {
-        texture = [[AC3DTexture alloc] initWithImagePath:texname];
-        if (texture) {
-            texid = [texture name];
-            [textures setObject:texture forKey:texname];
-        } else {
-            texname = [NSString stringWithFormat:@"Textures/%s", texture_name_new];
-            texture = [textures objectForKey:texname];
-            if (texture) {
-                texid = [texture name];
-            } else {
-                texture = [[AC3DTexture alloc] initWithImagePath:texname];
-                if (texture) {
-                    texid = [texture name];
-                    [textures setObject:texture forKey:texname];
-                }
-            }
-        }
+    int i;
+
+    for (i=0; i<count; i++)
+        if (handles[i] >= 0 && handles[i] < inst->file->numobjects)
+            inst->angles[handles[i]] = angles[i];
+}
+
+void set_enabled_ac3d_instance(AC3DInstance *inst, const int *handles, const int *flags, int count)
+{
+    int i;
+
+    for (i=0; i<count; i++)
+        if (handles[i] >= 0 && handles[i] < inst->file->numobjects)
+            inst->enabled[handles[i]] = flags[i] ? true : false;
+}
+
+int is_enabled_ac3d_instance(AC3DInstance *inst, int handle)
+{
+    if (!inst || handle < 0 || handle >= inst->file->numobjects)
+        return -1;
+    return inst->enabled[handle] ? 1 : 0;
+}
+
+void set_ac3d_instance_texture(AC3DInstance *inst, 
+                               char *texture_name,
+                               int texid)
+{
+    int i;
+
+    for (i=0; i<inst->file->numobjects; i++) {
+        AC3DObject *obj = inst->file->objects[i];
+        if (obj->texture && !strcmp(obj->texture, texture_name))
+            inst->texids[i] = texid;
+    }
+}
+
+void set_ac3d_instance_material(AC3DInstance *inst, 
+                                int index,   
+                                float  *rgb,
+                                float  *amb,
+                                float  *emis,
+                                float  *spec,
+                                float  shi,
+                                float  trans)
+{
+    AC3DAllocator *allocator;
+    AC3DMaterial *mat;
+    int j;
+
+    if (!inst || index < 0 || index >= inst->file->nummats)
+        return;
+
+    // The first change starts from the material of the file
+    if (!(mat = inst->mats[index])) {
+        allocator = &inst->file->arena->allocator;
+        mat = (AC3DMaterial*)allocator->alloc(sizeof(AC3DMaterial), allocator->userdata);
+        if (!mat)
+            return;
+        *mat = *inst->file->mats[index];
+        inst->mats[index] = mat;
+    }
+#define COPY( _field ) \
+if (_field) for (j=0;j<3;j++) mat->_field[j] = _field[j]
+    COPY( rgb );
+    COPY( amb );
+    COPY( emis );
+    COPY( spec );
+    if (shi >= 0.0)
+        mat->shi = shi;
+    if (trans >= 0.0) {
+        mat->rgb[3] = 1.0-trans;
+        mat->amb[3] = 1.0-trans;
+    }
+#undef COPY
+}
+
+// ----------------------------------------------------------------------
+
+#ifndef AC3D_HEADLESS
+
+// Into the dictionary of the context the file was loaded with
+static
+void load_ac3d_file_textures(AC3DFile *file)
+{
+    init_ac3d_textures(file->ctx);
+    load_textures_ac3d_object(file->obj, file);
+}
+
+#endif // AC3D_HEADLESS
+
+static
+void set_ac3d_texture_object(AC3DObject *obj,
+                             char *texture_name,
+                             int texid)
+{
+    int i;
+    if (obj->texture && !strcmp(obj->texture, texture_name)) {
+        obj->texid = texid;
+        if (texid == -1)
+            obj->texture_loaded = 0;
     }
-    if (texid > -1)
-        set_ac3d_texture(file, texture_name_org, texid);
+    for (i=0; i<obj->numkids; i++) 
+        set_ac3d_texture_object(obj->kids[i], texture_name, texid);
+}
+
+void set_ac3d_texture(AC3DFile *file, 
+                      char *texture_name,
+                      int texid)
+{
+#ifndef AC3D_HEADLESS
+    if (!file->obj->texture_loaded)
+        load_ac3d_file_textures(file);
+#endif
+    set_ac3d_texture_object(file->obj, texture_name, texid);
+    // The packets hold the texids, compile them again on the next draw
+    free_ac3d_drawlist(file);
+}
+
+#ifndef AC3D_HEADLESS
+
+void set_ac3d_texture_named(AC3DFile *file, 
+                            char *texture_name_org,
+                            char *texture_name_new)
+{
+    AC3DTextureEntry *e = acquire_ac3d_texture(file, texture_name_new);
+    if (e)
+        set_ac3d_texture(file, texture_name_org, [e->texture name]);
 }
 
 void reset_ac3d_texture(AC3DFile *file, 
                         char *texture_name)
 {
-    if (!file->obj->texture_loaded) {
-        init_ac3d_textures();
-        load_textures_ac3d_object(file->obj, textures);
-    }
-    AC3DTexture *tex = [textures objectForKey:[NSString stringWithFormat:@"%s", texture_name]];
-    if (tex)
-        set_ac3d_texture(file, texture_name, tex.name);
+    AC3DTextureEntry *e;
+    if (!file->obj->texture_loaded)
+        load_ac3d_file_textures(file);
+    e = acquire_ac3d_texture(file, texture_name);
+    if (e)
+        set_ac3d_texture(file, texture_name, [e->texture name]);
 }
 
+#endif // AC3D_HEADLESS
+
 // ----------------------------------------------------------------------
 
 static 
@@ -469,11 +1230,105 @@ void make_normal(float *dst, float *a, float *b, float *c)
     normalize(dst);
 }
 
+static const float ac3d_identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+
+// dst = a * b, column major like GL
+static
+void mult_ac3d_matrix(float *dst, const float *a, const float *b)
+{
+    float m[16];
+    int i, j;
+    for (i=0; i<4; i++)
+        for (j=0; j<4; j++)
+            m[i*4+j] = (a[0*4+j]*b[i*4+0] + a[1*4+j]*b[i*4+1] +
+                        a[2*4+j]*b[i*4+2] + a[3*4+j]*b[i*4+3]);
+    memcpy(dst, m, sizeof(m));
+}
+
+// The transform draw_ac3d_object sets up for loc and rot
+static
+void get_ac3d_object_matrix(AC3DObject *obj, float *m)
+{
+    memcpy(m, obj->rot ? obj->rot : ac3d_identity, sizeof(float)*16);
+    if (obj->loc) {
+        m[12] += obj->loc[0];
+        m[13] += obj->loc[1];
+        m[14] += obj->loc[2];
+    }
+}
+
+// Replaces the box with the one around it transformed by m
+static
+void transform_ac3d_bbox(float *bbox, const float *m)
+{
+    float box[6], p[3];
+    int i, k;
+
+    for (i=0; i<8; i++) {
+        float x = bbox[(i & 1) ? 3 : 0];
+        float y = bbox[(i & 2) ? 4 : 1];
+        float z = bbox[(i & 4) ? 5 : 2];
+        p[0] = m[0]*x + m[4]*y + m[8]*z + m[12];
+        p[1] = m[1]*x + m[5]*y + m[9]*z + m[13];
+        p[2] = m[2]*x + m[6]*y + m[10]*z + m[14];
+        for (k=0; k<3; k++) {
+            if (!i || p[k] < box[k])   box[k] = p[k];
+            if (!i || p[k] > box[k+3]) box[k+3] = p[k];
+        }
+    }
+    memcpy(bbox, box, sizeof(box));
+}
+
+// Grows the box to hold everything it can be turned to around rotvec,
+// the box of the cylinder around the axis that holds all its corners
+static
+void fix_ac3d_bbox_rotation(float *bbox, const float *rotvec)
+{
+    float a[3], tmin = 0.0, tmax = 0.0, r2 = 0.0, r, len;
+    int i, k;
+
+    len = sqrtf(rotvec[0]*rotvec[0] + rotvec[1]*rotvec[1] + rotvec[2]*rotvec[2]);
+    if (len <= 0.0)
+        return;
+    for (k=0; k<3; k++)
+        a[k] = rotvec[k] / len;
+
+    for (i=0; i<8; i++) {
+        float d[3], t, e2;
+        d[0] = bbox[(i & 1) ? 3 : 0] - rotvec[3];
+        d[1] = bbox[(i & 2) ? 4 : 1] - rotvec[4];
+        d[2] = bbox[(i & 4) ? 5 : 2] - rotvec[5];
+        t = d[0]*a[0] + d[1]*a[1] + d[2]*a[2];
+        e2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2] - t*t;
+        if (!i || t < tmin) tmin = t;
+        if (!i || t > tmax) tmax = t;
+        if (e2 > r2) r2 = e2;
+    }
+    r = sqrtf(r2);
+
+    for (k=0; k<3; k++) {
+        float e = r * sqrtf(fmaxf(0.0f, 1.0f - a[k]*a[k]));
+        float p0 = rotvec[3+k] + a[k]*tmin, p1 = rotvec[3+k] + a[k]*tmax;
+        bbox[k] = fminf(p0, p1) - e;
+        bbox[k+3] = fmaxf(p0, p1) + e;
+    }
+}
+
+// Moves the box from the frame of obj into the one of its parent, so it
+// holds obj at any angle of its rotvec
 static
 void fix_object_bbox(AC3DObject *obj) 
 {
-    if (obj->bbox && obj->loc) {
-        // TODO: Apply rotmatrix
+    float m[16];
+
+    if (!obj->bbox)
+        return;
+    if (obj->rotvec)
+        fix_ac3d_bbox_rotation(obj->bbox, obj->rotvec);
+    if (obj->rot) {
+        get_ac3d_object_matrix(obj, m);
+        transform_ac3d_bbox(obj->bbox, m);
+    } else if (obj->loc) {
         obj->bbox[0] += obj->loc[0];
         obj->bbox[1] += obj->loc[1];
         obj->bbox[2] += obj->loc[2];
@@ -496,7 +1351,9 @@ void check_object_bbox(AC3DObject *obj, float *xyz)
         if (obj->bbox[4] < xyz[1]) obj->bbox[4] = xyz[1];
         if (obj->bbox[5] < xyz[2]) obj->bbox[5] = xyz[2];
     } else {
-        obj->bbox = (float*)malloc(sizeof(float)*6);
+        obj->bbox = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*6);
+        if (!obj->bbox)
+            return;
         // Min
         obj->bbox[0] = xyz[0];
         obj->bbox[1] = xyz[1];
@@ -508,12 +1365,276 @@ void check_object_bbox(AC3DObject *obj, float *xyz)
     }
 }
 
+// ----------------------------------------------------------------------
+// Tokenizer
+//
+// The .ac text is scanned in place with a cursor, tokens are never
+// copied. Numbers are parsed by hand, without locale or varargs, and
+// tags are packed into an integer so they can be dispatched by switch.
+
+typedef struct {
+    const char *ptr;
+    const char *end;
+} AC3DLexer;
+
+#define AC3D_TAG(a,b,c,d,e,f,g,h) \
+    ((uint64_t)(a)       | ((uint64_t)(b) << 8)  | ((uint64_t)(c) << 16) | ((uint64_t)(d) << 24) | \
+    ((uint64_t)(e) << 32) | ((uint64_t)(f) << 40) | ((uint64_t)(g) << 48) | ((uint64_t)(h) << 56))
+
+// Defines, enumerators can not hold 64 bits
+#define TAG_AC3DB    AC3D_TAG('A','C','3','D','b',0,0,0)
+#define TAG_MATERIAL AC3D_TAG('M','A','T','E','R','I','A','L')
+#define TAG_OBJECT   AC3D_TAG('O','B','J','E','C','T',0,0)
+#define TAG_WORLD    AC3D_TAG('w','o','r','l','d',0,0,0)
+#define TAG_POLY     AC3D_TAG('p','o','l','y',0,0,0,0)
+#define TAG_GROUP    AC3D_TAG('g','r','o','u','p',0,0,0)
+#define TAG_LIGHT    AC3D_TAG('l','i','g','h','t',0,0,0)
+#define TAG_NAME     AC3D_TAG('n','a','m','e',0,0,0,0)
+#define TAG_CREASE   AC3D_TAG('c','r','e','a','s','e',0,0)
+#define TAG_DATA     AC3D_TAG('d','a','t','a',0,0,0,0)
+#define TAG_TEXTURE  AC3D_TAG('t','e','x','t','u','r','e',0)
+#define TAG_TEXREP   AC3D_TAG('t','e','x','r','e','p',0,0)
+#define TAG_TEXOFF   AC3D_TAG('t','e','x','o','f','f',0,0)
+#define TAG_ROT      AC3D_TAG('r','o','t',0,0,0,0,0)
+#define TAG_LOC      AC3D_TAG('l','o','c',0,0,0,0,0)
+#define TAG_URL      AC3D_TAG('u','r','l',0,0,0,0,0)
+#define TAG_NUMVERT  AC3D_TAG('n','u','m','v','e','r','t',0)
+#define TAG_NUMSURF  AC3D_TAG('n','u','m','s','u','r','f',0)
+#define TAG_KIDS     AC3D_TAG('k','i','d','s',0,0,0,0)
+#define TAG_SURF     AC3D_TAG('S','U','R','F',0,0,0,0)
+#define TAG_MAT      AC3D_TAG('m','a','t',0,0,0,0,0)
+#define TAG_REFS     AC3D_TAG('r','e','f','s',0,0,0,0)
+#define TAG_RGB      AC3D_TAG('r','g','b',0,0,0,0,0)
+#define TAG_AMB      AC3D_TAG('a','m','b',0,0,0,0,0)
+#define TAG_EMIS     AC3D_TAG('e','m','i','s',0,0,0,0)
+#define TAG_SPEC     AC3D_TAG('s','p','e','c',0,0,0,0)
+#define TAG_SHI      AC3D_TAG('s','h','i',0,0,0,0,0)
+#define TAG_TRANS    AC3D_TAG('t','r','a','n','s',0,0,0)
+
+static
+void skip_ac3d_space(AC3DLexer *lex)
+{
+    const char *p = lex->ptr;
+    while (p < lex->end && (unsigned char)*p <= ' ')
+        p++;
+    lex->ptr = p;
+}
+
+// Returns the next whitespace separated token packed as a tag, 0 at end
+// of input. Tokens longer than a tag never match and give ~0.
+static
+uint64_t next_ac3d_tag(AC3DLexer *lex)
+{
+    const char *p, *start;
+    uint64_t tag = 0;
+    int shift = 0;
+    
+    skip_ac3d_space(lex);
+    p = start = lex->ptr;
+    while (p < lex->end && (unsigned char)*p > ' ') {
+        if (shift < 64)
+            tag |= (uint64_t)(unsigned char)*p << shift;
+        shift += 8;
+        p++;
+    }
+    lex->ptr = p;
+    
+    if (p - start > 8)
+        return ~(uint64_t)0;
+    return tag;
+}
+
+static const double ac3d_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static
+int parse_ac3d_int(AC3DLexer *lex, int *out)
+{
+    const char *p;
+    unsigned int val = 0;
+    int neg = 0;
+    
+    skip_ac3d_space(lex);
+    p = lex->ptr;
+    
+    if (p < lex->end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+    
+    if (p >= lex->end || (unsigned)(*p - '0') > 9)
+        return 0;
+    
+    while (p < lex->end && (unsigned)(*p - '0') <= 9)
+        val = val*10 + (*p++ - '0');
+    
+    lex->ptr = p;
+    *out = neg ? -(int)val : (int)val;
+    return 1;
+}
+
+static
+int parse_ac3d_hex(AC3DLexer *lex, int *out)
+{
+    const char *p;
+    unsigned int val = 0;
+    int digits = 0;
+    
+    skip_ac3d_space(lex);
+    p = lex->ptr;
+    
+    if (lex->end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+    
+    for (; p < lex->end; p++, digits++) {
+        unsigned int c = (unsigned char)*p;
+        if (c - '0' <= 9)
+            val = (val << 4) | (c - '0');
+        else if ((c | 0x20) - 'a' <= 5)
+            val = (val << 4) | ((c | 0x20) - 'a' + 10);
+        else
+            break;
+    }
+    
+    if (!digits)
+        return 0;
+    
+    lex->ptr = p;
+    *out = (int)val;
+    return 1;
+}
+
+// Mantissas up to 2^53 scaled by an exact power of ten are exact up to
+// the final rounding. Anything else is scaled in long double, which has
+// bits to spare for a float, rather than by strtod which would follow
+// LC_NUMERIC.
+static
+int parse_ac3d_float(AC3DLexer *lex, float *out)
+{
+    const char *p;
+    uint64_t mant = 0;
+    int digits = 0;
+    int dropped = 0;
+    int exp10 = 0;
+    int neg = 0;
+    double val;
+    
+    skip_ac3d_space(lex);
+    p = lex->ptr;
+    
+    if (p < lex->end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+    
+    for (; p < lex->end && (unsigned)(*p - '0') <= 9; p++, digits++) {
+        if (mant < 100000000000000000ULL)
+            mant = mant*10 + (*p - '0');
+        else
+            dropped++;
+    }
+    
+    if (p < lex->end && *p == '.') {
+        for (p++; p < lex->end && (unsigned)(*p - '0') <= 9; p++, digits++) {
+            if (mant < 100000000000000000ULL) {
+                mant = mant*10 + (*p - '0');
+                exp10--;
+            }
+        }
+    }
+    
+    if (!digits)
+        return 0;
+    
+    if (p < lex->end && (*p == 'e' || *p == 'E')) {
+        const char *q = p+1;
+        int eneg = 0, e = 0;
+        if (q < lex->end && (*q == '-' || *q == '+'))
+            eneg = (*q++ == '-');
+        if (q < lex->end && (unsigned)(*q - '0') <= 9) {
+            while (q < lex->end && (unsigned)(*q - '0') <= 9) {
+                if (e < 10000)
+                    e = e*10 + (*q - '0');
+                q++;
+            }
+            exp10 += eneg ? -e : e;
+            p = q;
+        }
+    }
+    
+    exp10 += dropped;
+    lex->ptr = p;
+    
+    if (mant <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        val = (double)mant;
+        if (exp10 < 0)
+            val /= ac3d_pow10[-exp10];
+        else
+            val *= ac3d_pow10[exp10];
+    } else if (mant == 0) {
+        val = 0.0;
+    } else {
+        long double scale = 1.0L, base = 10.0L, lval;
+        int e = exp10 < 0 ? -exp10 : exp10;
+        for (; e; e >>= 1, base *= base)
+            if (e & 1)
+                scale *= base;
+        // Straight to float, by way of double it could round twice
+        lval = exp10 < 0 ? (long double)mant / scale : (long double)mant * scale;
+        *out = (float)(neg ? -lval : lval);
+        return 1;
+    }
+    
+    *out = (float)(neg ? -val : val);
+    return 1;
+}
+
+static
+int parse_ac3d_floats(AC3DLexer *lex, float *out, int count)
+{
+    int i;
+    for (i=0; i<count; i++)
+        if (!parse_ac3d_float(lex, &out[i]))
+            return 0;
+    return 1;
+}
+
+// Finds the next "quoted" string, returns its length or -1
+static 
+int scan_ac3d_string(AC3DLexer *lex, const char **str)
+{
+    const char *p = memchr(lex->ptr, '"', lex->end - lex->ptr);
+    const char *q;
+    
+    if (!p) {
+        lex->ptr = lex->end;
+        return -1;
+    }
+    
+    p++;
+    q = memchr(p, '"', lex->end - p);
+    if (!q)
+        q = lex->end;
+    
+    *str = p;
+    lex->ptr = q < lex->end ? q+1 : q;
+    return (int)(q - p);
+}
+
+static
+char *dup_ac3d_string(AC3DArena *arena, const char *str, int len)
+{
+    char *dst = (char*)alloc_ac3d_arena(arena, len+1);
+    if (dst) {
+        memcpy(dst, str, len);
+        dst[len] = '\0';
+    }
+    return dst;
+}
+
 static
-AC3DSurf *read_ac3d_surf(FILE *fp, AC3DObject *obj, char **err) 
+AC3DSurf *read_ac3d_surf(AC3DLexer *lex, AC3DObject *obj, char **err) 
 {
     int do_read = 1;
-    char buf[256];
-    AC3DSurf *surf = (AC3DSurf*)malloc(sizeof(AC3DSurf));
+    AC3DSurf *surf = (AC3DSurf*)alloc_ac3d_arena(obj->arena->scratch, sizeof(AC3DSurf));
     
     if (!surf)
         THROW( "malloc failed" );
@@ -524,50 +1645,59 @@ AC3DSurf *read_ac3d_surf(FILE *fp, AC3DObject *obj, char **err)
     
     while (do_read) {
         
-        if (fscanf(fp, "%s", buf) != 1)
-            THROW( "SURF failed" );
-        
-        if (!strcmp(buf, "SURF")) {
-            if (fscanf(fp, "%x", &surf->type) != 1)
-                THROW( "SURF type failed" );
-        
-        } else if (!strcmp(buf, "mat")) {
-            if (fscanf(fp, "%d", &surf->mat) != 1) 
-                THROW( "SURF mat failed" );
+        switch (next_ac3d_tag(lex)) {
             
-        } else if (!strcmp(buf, "refs")) {
-            if (fscanf(fp, "%d", &surf->numrefs) != 1)
-                THROW( "SURF refs failed" );
+            case TAG_SURF:
+                if (!parse_ac3d_hex(lex, &surf->type))
+                    THROW( "SURF type failed" );
+                break;
             
-            if (surf->numrefs > 0) {
-                int i;
-                
-                surf->vrefs = (short*)malloc(sizeof(short)*surf->numrefs);
-                surf->texrefs = (AC3Dtexref*)malloc(sizeof(AC3Dtexref)*surf->numrefs);
-
-                if (!surf->vrefs || !surf->texrefs)
-                    THROW( "malloc failed" );
+            case TAG_MAT:
+                if (!parse_ac3d_int(lex, &surf->mat)) 
+                    THROW( "SURF mat failed" );
+                break;
+            
+            case TAG_REFS:
+                if (!parse_ac3d_int(lex, &surf->numrefs))
+                    THROW( "SURF refs failed" );
+                if (surf->numrefs > AC3D_MAX_REFS)
+                    THROW( "SURF too many refs" );
                 
-                for (i=0; i<surf->numrefs; i++) {
-                    if (fscanf(fp, 
-                               "%hd %f %f", 
-                               &surf->vrefs[i],
-                               &surf->texrefs[i].texu, 
-                               &surf->texrefs[i].texv) != 3)
-                        THROW( "SURF ref failed" );
+                if (surf->numrefs > 0) {
+                    int i;
+                    
+                    surf->vrefs = (int*)alloc_ac3d_arena(obj->arena->scratch, sizeof(int)*surf->numrefs);
+                    surf->texrefs = (AC3Dtexref*)alloc_ac3d_arena(obj->arena->scratch, sizeof(AC3Dtexref)*surf->numrefs);
+                    
+                    if (!surf->vrefs || !surf->texrefs)
+                        THROW( "malloc failed" );
+                    
+                    for (i=0; i<surf->numrefs; i++) {
+                        int ref;
+                        if (!parse_ac3d_int(lex, &ref) ||
+                            !parse_ac3d_float(lex, &surf->texrefs[i].texu) ||
+                            !parse_ac3d_float(lex, &surf->texrefs[i].texv))
+                            THROW( "SURF ref failed" );
+                        if (ref < 0 || ref >= obj->numvert)
+                            THROW( "SURF ref out of range" );
+                        surf->vrefs[i] = ref;
+                    }
+                    
+                    if (surf->numrefs > 2) {
+                        make_normal(surf->normal, 
+                                    obj->verts[surf->vrefs[0]], 
+                                    obj->verts[surf->vrefs[1]], 
+                                    obj->verts[surf->vrefs[2]]);
+                    }
                 }
+                do_read = 0; // done
+                break;
                 
-                if (surf->numrefs > 2) {
-                    make_normal(surf->normal, 
-                                obj->verts[surf->vrefs[0]], 
-                                obj->verts[surf->vrefs[1]], 
-                                obj->verts[surf->vrefs[2]]);
-                }
-            }
-            do_read = 0; // done
+            case 0:
+                THROW( "SURF failed" );
             
-        } else {
-            THROW( "SURF unknown tag" );
+            default:
+                THROW( "SURF unknown tag" );
         }
         
     }
@@ -576,85 +1706,86 @@ AC3DSurf *read_ac3d_surf(FILE *fp, AC3DObject *obj, char **err)
     
 CATCH_ERROR:
 
-    free_ac3d_surf(surf);
     return NULL;
 }
 
-static 
-void scan_string(FILE *fp, char *buf)
-{
-    int c;
-    do {
-        c = fgetc(fp);
-    } while (c != EOF && c != '"');
-    do {
-        c = fgetc(fp);
-        if (c != EOF && c != '"')
-            *buf++ = c;
-    } while (c != EOF && c != '"'); 
-    *buf = '\0';
-}
-
 static
-AC3DMaterial *read_ac3d_material(FILE *fp, char **err) 
+AC3DMaterial *read_ac3d_material(AC3DLexer *lex, AC3DArena *arena, char **err) 
 {
-    char buf[256];
-    AC3DMaterial *mat = (AC3DMaterial*)malloc(sizeof(AC3DMaterial));
+    static const uint64_t tags[] = { TAG_RGB, TAG_AMB, TAG_EMIS, TAG_SPEC, TAG_SHI, TAG_TRANS };
+    AC3DMaterial *mat = (AC3DMaterial*)alloc_ac3d_arena(arena, sizeof(AC3DMaterial));
+    float *fields[6];
+    const char *name = NULL;
+    int namelen;
     float trans;
+    int i;
     
     if (!mat)
         THROW( "malloc failed" );
     
     memset(mat, 0, sizeof(AC3DMaterial));
     
-    scan_string(fp, buf);
-    
-    if (fscanf(fp, 
-               " rgb %f %f %f "
-               "amb %f %f %f "
-               "emis %f %f %f "
-               "spec %f %f %f "
-               "shi %f "
-               "trans %f",
-               &mat->rgb[0], &mat->rgb[1], &mat->rgb[2],
-               &mat->amb[0], &mat->amb[1], &mat->amb[2],
-               &mat->emis[0], &mat->emis[1], &mat->emis[2],
-               &mat->spec[0], &mat->spec[1], &mat->spec[2],
-               &mat->shi,
-               &trans) != 14)
-        THROW( "MATERIAL error" );
+    fields[0] = mat->rgb;
+    fields[1] = mat->amb;
+    fields[2] = mat->emis;
+    fields[3] = mat->spec;
+    fields[4] = &mat->shi;
+    fields[5] = &trans;
+    
+    namelen = scan_ac3d_string(lex, &name);
+    
+    for (i=0; i<6; i++) {
+        if (next_ac3d_tag(lex) != tags[i] ||
+            !parse_ac3d_floats(lex, fields[i], i < 4 ? 3 : 1))
+            THROW( "MATERIAL error" );
+    }
     
     mat->rgb[3]=1.0-trans;
     mat->amb[3]=1.0-trans;
     mat->emis[3]=1.0;
     mat->spec[3]=1.0;
     
-    if (strlen(buf))
-        mat->name = strdup(buf);
+    if (namelen > 0)
+        mat->name = dup_ac3d_string(arena, name, namelen);
     
     return mat;
     
 CATCH_ERROR:
     
-    free_ac3d_material(mat);
     return NULL;
 }
 
+static
+int same_ac3d_normals(AC3DSurf *surf, int i, int j, float *na, float *nb)
+{
+    if (!surf->normals)
+        return 1;
+    return (fabs(surf->normals[i][0]-na[0]) < 0.0001 &&
+            fabs(surf->normals[i][1]-na[1]) < 0.0001 &&
+            fabs(surf->normals[i][2]-na[2]) < 0.0001 &&
+            fabs(surf->normals[j][0]-nb[0]) < 0.0001 &&
+            fabs(surf->normals[j][1]-nb[1]) < 0.0001 &&
+            fabs(surf->normals[j][2]-nb[2]) < 0.0001);
+}
+
 static
 int find_surf_with_vertexes(int from, 
                             int to, 
                             AC3DSurf **surfs,
                             int mat,
-                            short a, short b,
-                            AC3Dtexref texa, AC3Dtexref texb)
+                            int type,
+                            int a, int b,
+                            AC3Dtexref texa, AC3Dtexref texb,
+                            float *na, float *nb)
 {
     for (;from < to; from++) {
         AC3DSurf *surf = surfs[from];
         if (surf->numrefs == 3 &&
-            (surf->type & 0x0f) == SURF_POLYGON &&
+            surf->type == type &&
             surf->mat == mat) {
             if (surf->vrefs[0] == a &&
                 surf->vrefs[1] == b && 
+                same_ac3d_normals(surf, 0, 1, na, nb) && 
                 fabs((surf->texrefs[0].texu-texa.texu) + 
                      (surf->texrefs[0].texv-texa.texv)) < 0.0001 &&
                 fabs((surf->texrefs[1].texu-texb.texu) + 
@@ -662,6 +1793,7 @@ int find_surf_with_vertexes(int from,
                 return (from << 2) + 2;
             } else if (surf->vrefs[1] == a &&
                        surf->vrefs[2] == b && 
+                       same_ac3d_normals(surf, 1, 2, na, nb) && 
                        fabs((surf->texrefs[1].texu-texa.texu) + 
                             (surf->texrefs[1].texv-texa.texv)) < 0.0001 &&
                        fabs((surf->texrefs[2].texu-texb.texu) + 
@@ -669,6 +1801,7 @@ int find_surf_with_vertexes(int from,
                 return (from << 2) + 0;
             } else if (surf->vrefs[2] == a &&
                        surf->vrefs[0] == b && 
+                       same_ac3d_normals(surf, 2, 0, na, nb) && 
                        fabs((surf->texrefs[2].texu-texa.texu) + 
                             (surf->texrefs[2].texv-texa.texv)) < 0.0001 &&
                        fabs((surf->texrefs[0].texu-texb.texu) + 
@@ -685,21 +1818,26 @@ int find_surf_with_vertexes_notex(int from,
                                   int to, 
                                   AC3DSurf **surfs,
                                   int mat,
-                                  short a, short b)
+                                  int type,
+                                  int a, int b,
+                                  float *na, float *nb)
 {
     for (;from < to; from++) {
         AC3DSurf *surf = surfs[from];
         if (surf->numrefs == 3 &&
-            (surf->type & 0x0f) == SURF_POLYGON &&
+            surf->type == type &&
             surf->mat == mat) {
             if (surf->vrefs[0] == a &&
-                surf->vrefs[1] == b) {
+                surf->vrefs[1] == b &&
+                same_ac3d_normals(surf, 0, 1, na, nb)) {
                 return (from << 2) + 2;
             } else if (surf->vrefs[1] == a &&
-                       surf->vrefs[2] == b) {
+                       surf->vrefs[2] == b &&
+                       same_ac3d_normals(surf, 1, 2, na, nb)) {
                 return (from << 2) + 0;
             } else if (surf->vrefs[2] == a &&
-                       surf->vrefs[0] == b) {
+                       surf->vrefs[0] == b &&
+                       same_ac3d_normals(surf, 2, 0, na, nb)) {
                 return (from << 2) + 1;
             }
         }
@@ -712,47 +1850,67 @@ int find_surf_with_vertexes_notex(int from,
 static
 void optimize_ac3d_object_step_1(AC3DObject *obj)
 {
+    AC3DArena *scratch = obj->arena->scratch;
     int i;
     for (i=0; i<obj->numsurf-1; i++) {
         AC3DSurf *surf = obj->surfs[i];
         int a=2, b=1;
         if (surf->numrefs == 3 && 
             (surf->type & 0x0f) == SURF_POLYGON) {
+            int type = surf->type;
+            int size = surf->numrefs;
             int rc;
             if (obj->texture)
                 rc = find_surf_with_vertexes(0, // from 
                                              obj->numsurf, // to 
                                              obj->surfs, 
                                              surf->mat,
+                                             type,
                                              surf->vrefs[a], surf->vrefs[b],
-                                             surf->texrefs[a], surf->texrefs[b]);
+                                             surf->texrefs[a], surf->texrefs[b],
+                                             surf->normals ? surf->normals[a] : NULL,
+                                             surf->normals ? surf->normals[b] : NULL);
             else
                 rc = find_surf_with_vertexes_notex(0, // from 
                                              obj->numsurf, // to 
                                              obj->surfs, 
                                              surf->mat,
-                                             surf->vrefs[a], surf->vrefs[b]);
-            if (rc) {
+                                             type,
+                                             surf->vrefs[a], surf->vrefs[b],
+                                             surf->normals ? surf->normals[a] : NULL,
+                                             surf->normals ? surf->normals[b] : NULL);
+            if (rc)
                 ADD_STRIPS(1);
-            } else {
-                ADD_TRIS((surf->numrefs>2) ? surf->numrefs-2 : 0);
-            }
-            while (rc) {
+            // The strip ends at the most a record can hold
+            while (rc && surf->numrefs < AC3D_MAX_REFS) {
                 int idx1 = rc >> 2;
                 int idx2 = rc & 0x03;
+                // The refs grow by doubling, the old ones stay in the scratch
+                if (surf->numrefs == size) {
+                    int n = surf->numrefs;
+                    int *vrefs = (int*)grow_ac3d_arena(scratch, surf->vrefs, sizeof(int)*n, sizeof(int)*n*2);
+                    AC3Dtexref *texrefs = (AC3Dtexref*)grow_ac3d_arena(scratch, surf->texrefs, 
+                                                                       sizeof(AC3Dtexref)*n, sizeof(AC3Dtexref)*n*2);
+                    float (*normals)[3] = NULL;
+                    if (surf->normals)
+                        normals = (float(*)[3])grow_ac3d_arena(scratch, surf->normals, 
+                                                               sizeof(float)*3*n, sizeof(float)*3*n*2);
+                    if (!vrefs || !texrefs || (surf->normals && !normals))
+                        break;
+                    surf->vrefs = vrefs;
+                    surf->texrefs = texrefs;
+                    surf->normals = normals;
+                    size = n*2;
+                }
                 surf->type = (surf->type & 0xf0) | SURF_TRI_STRIP;
                 surf->numrefs++;
-                surf->vrefs = (short*)realloc(surf->vrefs, sizeof(short)*surf->numrefs);
-                surf->texrefs = (AC3Dtexref*)realloc(surf->texrefs, sizeof(AC3Dtexref)*surf->numrefs);
                 surf->vrefs[surf->numrefs-1] = obj->surfs[idx1]->vrefs[idx2];
                 surf->texrefs[surf->numrefs-1] = obj->surfs[idx1]->texrefs[idx2];
-                {
-                    AC3DSurf *tmp = obj->surfs[idx1];
-                    obj->numsurf--;
-                    obj->surfs[idx1] = obj->surfs[obj->numsurf];
-                    free_ac3d_surf(tmp);
-                    ADD_STRIPS_PTS(2);
-                }
+                if (surf->normals)
+                    memcpy(surf->normals[surf->numrefs-1], obj->surfs[idx1]->normals[idx2], sizeof(float)*3);
+                obj->numsurf--;
+                obj->surfs[idx1] = obj->surfs[obj->numsurf];
+                ADD_STRIPS_PTS(2);
                 if (a < b)
                     a += 2;
                 else
@@ -762,56 +1920,374 @@ void optimize_ac3d_object_step_1(AC3DObject *obj)
                                                  obj->numsurf, // to 
                                                  obj->surfs, 
                                                  surf->mat,
+                                                 type,
                                                  surf->vrefs[a], surf->vrefs[b],
-                                                 surf->texrefs[a], surf->texrefs[b]);
+                                                 surf->texrefs[a], surf->texrefs[b],
+                                                 surf->normals ? surf->normals[a] : NULL,
+                                                 surf->normals ? surf->normals[b] : NULL);
                 else
                     rc = find_surf_with_vertexes_notex(0, // from 
                                                        obj->numsurf, // to 
                                                        obj->surfs, 
                                                        surf->mat,
-                                                       surf->vrefs[a], surf->vrefs[b]);
+                                                       type,
+                                                       surf->vrefs[a], surf->vrefs[b],
+                                                       surf->normals ? surf->normals[a] : NULL,
+                                                       surf->normals ? surf->normals[b] : NULL);
             }
             if ((surf->type & 0x0f) == SURF_TRI_STRIP) {
-                ADD_TRIS(surf->numrefs-2);
+                ADD_STRIP_TRIS(surf->numrefs-2);
             }
         }
     }
 }
 
+// ----------------------------------------------------------------------
+// Hash based stripifier
+//
+// The triangles are linked to their neighbours once through a hash of
+// their half edges, two triangles are only neighbours when they can be
+// drawn as one strip, i.e. same material and type and the shared corners
+// have exactly the same texture coordinates and normals. Strips are then
+// started from the triangle with the fewest free neighbours left and grown
+// over the shared edges. With look-ahead all three ways to enter the start
+// triangle are tried and the longest strip is kept.
+
+typedef struct {
+    uint64_t key;   // half edge, from << 32 | to
+    int      edge;  // triangle*3 + corner it starts from
+} AC3DEdgeSlot;
+
 static
-void optimize_ac3d_object_step_2(AC3DObject *obj)
+double ac3d_time()
 {
-    int i;
-    AC3Doptcmd *ptr;
-    obj->numcmds = 0;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static
+int same_ac3d_corner(AC3DObject *obj, AC3DSurf *s1, int c1, AC3DSurf *s2, int c2)
+{
+    if (s1->vrefs[c1] != s2->vrefs[c2])
+        return 0;
+    if (obj->texture &&
+        (s1->texrefs[c1].texu != s2->texrefs[c2].texu ||
+         s1->texrefs[c1].texv != s2->texrefs[c2].texv))
+        return 0;
+    if (s1->normals && memcmp(s1->normals[c1], s2->normals[c2], sizeof(float)*3))
+        return 0;
+    return 1;
+}
+
+// Follows a strip from triangle t, entered so that its corners are
+// r, r+1, r+2, returns the number of triangles. With strip set the
+// source corner of each strip vertex is stored as triangle*3+corner and
+// the triangles are marked as used, otherwise they are only stamped.
+// Strips end at AC3D_MAX_REFS refs.
+static
+int follow_ac3d_strip(int t, int r,
+                      const int *adj,
+                      int *used,
+                      int stamp,
+                      int *strip)
+{
+    int n = 1;
+    int c = (r+1) % 3;  // edge to cross, from corner c to c+1
+    int lc = (r+2) % 3; // corner of the last strip vertex
+
+    used[t] = stamp;
+    if (strip) {
+        strip[0] = t*3 + r;
+        strip[1] = t*3 + (r+1) % 3;
+        strip[2] = t*3 + (r+2) % 3;
+    }
+
+    for (;;) {
+        int nb = adj[t*3+c];
+        int u, f;
+
+        if (nb < 0 || n+3 > AC3D_MAX_REFS)
+            break;
+        u = nb / 3;
+        f = nb % 3;
+        if (used[u] < 0 || used[u] == stamp)
+            break;
+
+        // The neighbour has the edge reversed, its corner f is our c+1
+        if (lc == (c+1) % 3)
+            c = (f+2) % 3;
+        else
+            c = (f+1) % 3;
+        lc = (f+2) % 3;
+        t = u;
+
+        used[t] = stamp;
+        if (strip)
+            strip[n+2] = t*3 + lc;
+        n++;
+    }
+
+    return n;
+}
+
+static
+void optimize_ac3d_object_strips(AC3DObject *obj, int lookahead, float budget)
+{
+    int *tris = NULL;      // surface index of each triangle
+    int *adj = NULL;       // per half edge, the neighbours half edge or -1
+    int *degree = NULL;    // free neighbours per triangle
+    int *used = NULL;      // -1 when in a strip, else a look-ahead stamp
+    int *bucket = NULL;    // triangles by degree, stale entries skipped
+    int *strip = NULL;
+    AC3DSurf **surfs = NULL;
+    AC3DEdgeSlot *hash = NULL;
+    AC3DArena *scratch = obj->arena->scratch;
+    int numtris = 0, numsurfs = 0, stamp = 0, count = 0;
+    int bstart[4], bend[4];
+    unsigned int hashsize = 1, mask;
+    double stop = budget > 0.0 ? ac3d_time() + budget : 0.0;
+    int i, j;
+
     for (i=0; i<obj->numsurf; i++) {
         AC3DSurf *surf = obj->surfs[i];
-        if ((surf->type & 0x0f) == SURF_POLYGON ||
-            (surf->type & 0x0f) == SURF_TRI_STRIP) {
+        if (surf->numrefs == 3 && (surf->type & 0x0f) == SURF_POLYGON)
+            numtris++;
+    }
+    if (numtris < 2)
+        return;
 
-            if (surf->numrefs > 2) {
-                obj->numcmds += 2;                   // type+len+mat
-                obj->numcmds += surf->numrefs*3;     // vertex
+    while (hashsize < (unsigned int)numtris*6)
+        hashsize <<= 1;
+    mask = hashsize-1;
 
-                if (obj->texture)
-                    obj->numcmds += surf->numrefs*2; // texcoord
-                
-                // single normal when...NONE SHADED and POLYGON
-                if (!(surf->type & SURF_SHADED) &&
-                    (surf->type & 0x0f) == SURF_POLYGON) {
-                    obj->numcmds += 3;               // normal
-                } else {
-                    obj->numcmds += surf->numrefs*3; // normals
-                }
-            }
+    // All in the scratch with the surfs, they go once the stream is made
+    tris = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris);
+    adj = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris*3);
+    degree = (int*)calloc_ac3d_arena(scratch, numtris, sizeof(int));
+    used = (int*)calloc_ac3d_arena(scratch, numtris, sizeof(int));
+    bucket = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris*8);
+    strip = (int*)alloc_ac3d_arena(scratch, sizeof(int)*(numtris+2));
+    surfs = (AC3DSurf**)alloc_ac3d_arena(scratch, sizeof(AC3DSurf*)*obj->numsurf);
+    hash = (AC3DEdgeSlot*)alloc_ac3d_arena(scratch, sizeof(AC3DEdgeSlot)*hashsize);
+
+    if (!tris || !adj || !degree || !used || !bucket || !strip || !surfs || !hash)
+        return;
+
+    for (i=0, j=0; i<obj->numsurf; i++) {
+        AC3DSurf *surf = obj->surfs[i];
+        if (surf->numrefs == 3 && (surf->type & 0x0f) == SURF_POLYGON)
+            tris[j++] = i;
+    }
+
+    // Link each half edge with a matching reversed one
+
+    for (i=0; i<(int)hashsize; i++)
+        hash[i].edge = -1;
+
+    for (i=0; i<numtris*3; i++) {
+        AC3DSurf *surf = obj->surfs[tris[i/3]];
+        uint32_t a = surf->vrefs[i%3];
+        uint32_t b = surf->vrefs[(i%3+1)%3];
+        uint64_t key = ((uint64_t)a << 32) | b;
+        uint64_t rkey = ((uint64_t)b << 32) | a;
+        unsigned int h;
+
+        adj[i] = -1;
+
+        for (h = (b*73856093u ^ a*19349663u) & mask;
+             hash[h].edge >= 0;
+             h = (h+1) & mask) {
+            int e = hash[h].edge;
+            AC3DSurf *other = obj->surfs[tris[e/3]];
+            if (hash[h].key != rkey || adj[e] >= 0 || e/3 == i/3)
+                continue;
+            if (other->mat != surf->mat || other->type != surf->type)
+                continue;
+            if (!same_ac3d_corner(obj, surf, i%3, other, (e%3+1)%3) ||
+                !same_ac3d_corner(obj, surf, (i%3+1)%3, other, e%3))
+                continue;
+            adj[i] = e;
+            adj[e] = i;
+            degree[i/3]++;
+            degree[e/3]++;
+            break;
+        }
+
+        if (adj[i] < 0) {
+            for (h = (a*73856093u ^ b*19349663u) & mask;
+                 hash[h].edge >= 0;
+                 h = (h+1) & mask)
+                ;
+            hash[h].key = key;
+            hash[h].edge = i;
+        }
+    }
+
+    // A triangle enters each bucket at most twice, once at the start and
+    // once when its degree drops to it
+
+    for (i=0; i<4; i++)
+        bstart[i] = bend[i] = numtris*2*i;
+    for (i=0; i<numtris; i++)
+        bucket[bend[degree[i]]++] = i;
+
+    for (;;) {
+        int t = -1, best = 0, bestlen = 0, n;
+
+        for (i=0; i<4 && t < 0; i++) {
+            while (bstart[i] < bend[i]) {
+                int cand = bucket[bstart[i]++];
+                if (used[cand] >= 0 && degree[cand] == i) {
+                    t = cand;
+                    break;
+                }
+            }
+        }
+        if (t < 0)
+            break;
+
+        if (stop > 0.0 && !(++count & 63) && ac3d_time() > stop) {
+            obj->arena->cut = true;
+            break;
+        }
+
+        if (lookahead) {
+            for (i=0; i<3; i++) {
+                int len = follow_ac3d_strip(t, i, adj, used, ++stamp, NULL);
+                if (len > bestlen) {
+                    bestlen = len;
+                    best = i;
+                }
+            }
+        } else {
+            // Enter so that the first edge crossed leads to the neighbour
+            // with the fewest free neighbours itself
+            int bestdeg = 4;
+            for (i=0; i<3; i++) {
+                int nb = adj[t*3+(i+1)%3];
+                if (nb >= 0 && used[nb/3] >= 0 && degree[nb/3] < bestdeg) {
+                    bestdeg = degree[nb/3];
+                    best = i;
+                }
+            }
+        }
+
+        n = follow_ac3d_strip(t, best, adj, used, -1, strip);
+
+        for (i=0; i<n; i++) {
+            int tri = strip[i+2] / 3;
+            for (j=0; j<3; j++) {
+                int nb = adj[tri*3+j];
+                if (nb >= 0 && used[nb/3] >= 0) {
+                    int d = --degree[nb/3];
+                    bucket[bend[d]++] = nb/3;
+                }
+            }
+        }
+
+        if (n > 1) {
+            AC3DSurf *first = obj->surfs[tris[t]];
+            AC3DSurf *surf = (AC3DSurf*)calloc_ac3d_arena(scratch, 1, sizeof(AC3DSurf));
+            if (!surf)
+                break;
+            surf->type = (first->type & 0xf0) | SURF_TRI_STRIP;
+            surf->mat = first->mat;
+            surf->numrefs = n+2;
+            memcpy(surf->normal, first->normal, sizeof(float)*3);
+            surf->vrefs = (int*)alloc_ac3d_arena(scratch, sizeof(int)*surf->numrefs);
+            surf->texrefs = (AC3Dtexref*)alloc_ac3d_arena(scratch, sizeof(AC3Dtexref)*surf->numrefs);
+            if (first->normals)
+                surf->normals = (float(*)[3])alloc_ac3d_arena(scratch, sizeof(float)*3*surf->numrefs);
+            if (!surf->vrefs || !surf->texrefs || (first->normals && !surf->normals))
+                break;
+            for (i=0; i<surf->numrefs; i++) {
+                AC3DSurf *src = obj->surfs[tris[strip[i]/3]];
+                int c = strip[i] % 3;
+                surf->vrefs[i] = src->vrefs[c];
+                surf->texrefs[i] = src->texrefs[c];
+                if (surf->normals)
+                    memcpy(surf->normals[i], src->normals[c], sizeof(float)*3);
+            }
+            // The first triangle of the strip is replaced, the rest dropped
+            for (i=1; i<n; i++) {
+                int tri = strip[i+2] / 3;
+                obj->surfs[tris[tri]] = NULL;
+            }
+            obj->surfs[tris[t]] = surf;
+            ADD_STRIPS(1);
+            ADD_STRIP_TRIS(n);
+            ADD_STRIPS_PTS(2*(n-1));
+        }
+    }
+
+    // Triangles never reached (out of time) are left as they are
+
+    for (i=0; i<obj->numsurf; i++)
+        if (obj->surfs[i])
+            surfs[numsurfs++] = obj->surfs[i];
+    memcpy(obj->surfs, surfs, sizeof(AC3DSurf*)*numsurfs);
+    obj->numsurf = numsurfs;
+}
+
+static
+void strip_ac3d_object(AC3DObject *obj)
+{
+    const AC3DLoadOptions *options = obj->arena->options;
+
+    switch (options->strips) {
+        case AC3D_STRIPS_LOOKAHEAD:
+            optimize_ac3d_object_strips(obj, 1, options->strip_budget);
+            break;
+        case AC3D_STRIPS_GREEDY:
+            optimize_ac3d_object_strips(obj, 0, options->strip_budget);
+            break;
+        case AC3D_STRIPS_NAIVE:
+            optimize_ac3d_object_step_1(obj);
+            break;
+        default:
+            break;
+    }
+}
+
+static
+void optimize_ac3d_object_step_2(AC3DObject *obj)
+{
+    int i;
+    AC3Doptcmd *ptr;
+    obj->numcmds = 0;
+    for (i=0; i<obj->numsurf; i++) {
+        AC3DSurf *surf = obj->surfs[i];
+        if ((surf->type & 0x0f) == SURF_POLYGON ||
+            (surf->type & 0x0f) == SURF_TRI_STRIP) {
+
+            if (surf->numrefs > 2) {
+                obj->numcmds += 2;                   // type+len+mat
+                obj->numcmds += surf->numrefs*3;     // vertex
+
+                if (obj->texture)
+                    obj->numcmds += surf->numrefs*2; // texcoord
+                
+                // single normal when...NONE SHADED and POLYGON
+                if (!(surf->type & SURF_SHADED) &&
+                    (surf->type & 0x0f) == SURF_POLYGON) {
+                    obj->numcmds += 3;               // normal
+                } else {
+                    obj->numcmds += surf->numrefs*3; // normals
+                }
+            }
             
         } else {
             obj->numcmds += 2;                   // type+len+mat
             obj->numcmds += surf->numrefs*3;     // vertex
         }
     }
-    ptr = obj->optcmds = (AC3Doptcmd*)malloc(sizeof(AC3Doptcmd)*obj->numcmds);
-    if (!obj) return;
+    // Kept in the stream arena until the object is finished
+    ptr = obj->optcmds = (AC3Doptcmd*)alloc_ac3d_arena(obj->arena->stream, sizeof(AC3Doptcmd)*obj->numcmds);
+    if (!ptr) {
+        obj->numcmds = 0;
+        return;
+    }
     memset(obj->optcmds, 0, sizeof(AC3Doptcmd)*obj->numcmds);
     for (i=0; i<obj->numsurf; i++) {
         int j;
@@ -864,14 +2340,15 @@ void optimize_ac3d_object_step_2(AC3DObject *obj)
 
                     // NORMAL DATA
                     if (surf->type & SURF_SHADED) {
+                        float *n = surf->normals ? surf->normals[j] : surf->normal;
 #ifdef USE_FLOATS
-                        (ptr++)->f = obj->verts[idx][3];
-                        (ptr++)->f = obj->verts[idx][4];
-                        (ptr++)->f = obj->verts[idx][5];
+                        (ptr++)->f = n[0];
+                        (ptr++)->f = n[1];
+                        (ptr++)->f = n[2];
 #else
-                        (ptr++)->i = obj->verts[idx][3] * 65536.0;
-                        (ptr++)->i = obj->verts[idx][4] * 65536.0;
-                        (ptr++)->i = obj->verts[idx][5] * 65536.0;
+                        (ptr++)->i = n[0] * 65536.0;
+                        (ptr++)->i = n[1] * 65536.0;
+                        (ptr++)->i = n[2] * 65536.0;
 #endif
                     } else if ((surf->type & 0x0f) == SURF_TRI_STRIP) {
                         float n[3];
@@ -945,735 +2422,5197 @@ void optimize_ac3d_object_step_2(AC3DObject *obj)
             }
         }       
     }
-    if (obj->numvert > 0 && obj->verts) {
-        free(obj->verts);
-            obj->verts = NULL;
+    // Those are in the scratch, released by the reader
+    obj->verts = NULL;
+    obj->surfs = NULL;
+}
+
+// ----------------------------------------------------------------------
+// Batching
+//
+// Regroups the records of the optcmd stream so there is one record, and
+// so one draw call, per material, sidedness, shading and primitive kind.
+// Fans become SURF_TRI_LIST records, strips are joined into one strip with
+// degenerate triangles and lines become SURF_LINES segments. A record can
+// hold at most AC3D_MAX_REFS refs, larger buckets are split.
+
+typedef struct {
+    int         type;
+    int         mat;
+    int         numrefs;
+    int         bucket;
+    AC3Doptcmd *flat;   // the normal of a flat polygon
+    AC3Doptcmd *data;   // first vertex
+} AC3DRecord;
+
+typedef struct {
+    AC3Doptcmd *dst;    // NULL when only counting
+    AC3Doptcmd *head;   // header of the open record
+    int         size;
+    int         count;  // refs in the open record
+    int         numrecords;
+} AC3DBatchWriter;
+
+static
+int ac3d_batch_kind(int type)
+{
+    switch (type & 0x0f) {
+        case SURF_POLYGON:    return SURF_TRI_LIST;
+        case SURF_TRI_STRIP:  return SURF_TRI_STRIP;
+        default:              return SURF_LINES;
     }
-    if (obj->numsurf > 0 && obj->surfs) {
-        for (i=0; i<obj->numsurf; i++) {
-            if (obj->surfs[i])
-                free_ac3d_surf(obj->surfs[i]);
-        }
-        free(obj->surfs);
-        obj->surfs = NULL;
+}
+
+static
+void open_ac3d_batch(AC3DBatchWriter *w, int type, int mat)
+{
+    if (w->dst) {
+        w->head = &w->dst[w->size];
+        w->head[0].cmd[0] = type;
+        w->head[0].cmd[1] = 0;
+        w->head[1].i = 0;
+        w->head[1].cmd[0] = mat;
     }
+    w->size += 2;
+    w->count = 0;
 }
 
 static
-void make_normals(AC3DObject *obj)
+void close_ac3d_batch(AC3DBatchWriter *w)
 {
-    int i, j, k;
-    for (i=0; i<obj->numvert; i++) {
-        float n[3] = {0.0, 0.0, 0.0};
-        int ns = 0;
-        for (j=0; j<obj->numsurf; j++) {
-            AC3DSurf *surf = obj->surfs[j];
-            for (k=0; k<surf->numrefs; k++) {
-                if (surf->vrefs[k] == i) {
-                    n[0] += surf->normal[0];
-                    n[1] += surf->normal[1];
-                    n[2] += surf->normal[2];
-                    ns++;
-                }
-            }
-        }
-        if (ns > 0) {
-            n[0] /= ns;
-            n[1] /= ns;
-            n[2] /= ns;
+    if (w->dst && w->count)
+        w->head[0].cmd[1] = w->count;
+    if (w->count)
+        w->numrecords++;
+    else
+        w->size -= 2;
+    w->count = 0;
+}
+
+// Appends one vertex, V then N (when normal is set) then the rest of src
+static
+void put_ac3d_batch_vertex(AC3DBatchWriter *w,
+                           const AC3Doptcmd *src, int len,
+                           const AC3Doptcmd *normal)
+{
+    int n = len + (normal ? 3 : 0);
+    if (w->dst) {
+        AC3Doptcmd *dst = &w->dst[w->size];
+        memcpy(dst, src, sizeof(AC3Doptcmd)*3);
+        if (normal) {
+            memcpy(dst+3, normal, sizeof(AC3Doptcmd)*3);
+            memcpy(dst+6, src+3, sizeof(AC3Doptcmd)*(len-3));
+        } else {
+            memcpy(dst+3, src+3, sizeof(AC3Doptcmd)*(len-3));
         }
-        obj->verts[i][3] = n[0];
-        obj->verts[i][4] = n[1];
-        obj->verts[i][5] = n[2];
     }
+    w->size += n;
+    w->count++;
 }
 
 static
-AC3DObject *read_ac3d_object(FILE *fp, char **err) 
+void write_ac3d_bucket(AC3DObject *obj, AC3DRecord *recs, int numrecs, int bucket,
+                       AC3DBatchWriter *w)
 {
-    char buf[256];
-    AC3DObject *obj = (AC3DObject*)malloc(sizeof(AC3DObject));
-    int do_read = 1;
-    
-    memset(obj, 0, sizeof(AC3DObject));
-    obj->texid = -1;
-    obj->enabled = true;
-    
-    if (fscanf(fp, "%s", buf) != 1)
-        THROW( "OBJECT header failed" );
-    
-    if      (!strcmp(buf, "world")) obj->type = OBJECT_WORLD;
-    else if (!strcmp(buf, "poly"))  obj->type = OBJECT_POLY;
-    else if (!strcmp(buf, "group")) obj->type = OBJECT_GROUP;
-    else if (!strcmp(buf, "light")) obj->type = OBJECT_LIGHT;
-    else 
-        THROW( "OBJECT header type failed" );
-    
-    while (do_read) {
-        
-        if (fscanf(fp, "%s", buf) != 1)
-            THROW( "OBJECT tag failed" );
-        
-        // ---------------------------------------
-        // NAME
-        
-        if (!strcmp(buf, "name")) {
-            scan_string(fp, buf);
-            
-            if (strlen(buf))
-                obj->name = strdup(buf);
-            
-            // ---------------------------------------
-            // DATA
-            
-        } else if (!strcmp(buf, "crease")) {
-            float crease;
-            if (fscanf(fp, "%f", &crease) != 1)
-                THROW( "OBJECT crease failed" );
-                        
-            // ---------------------------------------
-            // TEXTURE
-            
-        } else if (!strcmp(buf, "data")) {
-            int i, len;
-            char *ptr;
-            
-            if (fscanf(fp, "%d", &len) != 1)
-                THROW( "OBJECT data len failed" );
-            
-            if (len > 0) {
-                int c;
-                ptr = (char*)malloc(len+1);
-                if (!ptr)
-                    THROW( "malloc failed" );
-                do {
-                    c = fgetc(fp);
-                    if (c == EOF)
-                        THROW( "data failed" );
-                } while (c != '\n');
-                for (i=0; i<len; i++) {
-                    c = fgetc(fp);
-                    if (c == EOF)
-                        THROW( "data failed" );                 
-                    ptr[i] = c;
-                }
-                ptr[i] = '\0';
-#if TARGET_IPHONE_SIMULATOR
-                NSLog(@"data: %s", ptr);
-#endif
-                free(ptr);
-            }
+    int vlen = AC3D_VERTEX_STRIDE(obj); // V,N,T of polygons and strips
+    int kind = -1;
+    int i, j, k;
 
-            // ---------------------------------------
-            // TEXTURE
-            
-        } else if (!strcmp(buf, "texture")) {
-            char *ptr1, *ptr2;
-            
-            scan_string(fp, buf);
-            ptr1 = buf;
-            
-            while ((ptr2 = strchr(ptr1, '/'))) {
-                ptr1 = ++ptr2;
-            }
-            
-            if (strlen(ptr1))
-                obj->texture = strdup(ptr1);
-            
-            // ---------------------------------------
-            // TEXREP
-            
-        } else if (!strcmp(buf, "texrep")) {
-            float texrep[2];
-            
-            if (fscanf(fp, "%f %f", &texrep[0], &texrep[1]) != 2)
-                THROW( "OBJECT texrep failed" );
-            
-            obj->texrep = (float*)malloc(sizeof(float)*2);
-            
-            if (!obj->texrep)
-                THROW( "malloc failed" );
-            
-            memcpy(obj->texrep, &texrep, sizeof(float)*2);
-            
-            // ---------------------------------------
-            // TEXOFF
-            
-        } else if (!strcmp(buf, "texoff")) {
-            float texoff[2];
-            
-            if (fscanf(fp, "%f %f", &texoff[0], &texoff[1]) != 2)
-                THROW( "OBJECT texoff failed" );
-            
-            obj->texoff = (float*)malloc(sizeof(float)*2);
-            
-            if (!obj->texoff)
-                THROW( "malloc failed" );
-            
-            memcpy(obj->texoff, &texoff, sizeof(float)*2);
-            
-            // ---------------------------------------
-            // ROT
-            
-        } else if (!strcmp(buf, "rot")) {
-            float rot[16];
-            
-            rot[3] = 0.0;
-            rot[7] = 0.0;
-            rot[11] = 0.0;
-            rot[12] = 0.0;
-            rot[13] = 0.0;
-            rot[14] = 0.0;
-            rot[15] = 1.0;
-            
-            if (fscanf(fp, 
-                       "%f %f %f "
-                       "%f %f %f "
-                       "%f %f %f", 
-                       &rot[0], &rot[1], &rot[2],
-                       &rot[4], &rot[5], &rot[6],
-                       &rot[8], &rot[9], &rot[10]) != 9)
-                THROW( "OBJECT rot failed" );
-            
-            obj->rot = (float*)malloc(sizeof(float)*16);
-            
-            if (!obj->rot)
-                THROW( "malloc failed" );
-            
-            memcpy(obj->rot, &rot, sizeof(float)*16);
-            
-            // ---------------------------------------
-            // LOC
-            
-        } else if (!strcmp(buf, "loc")) {
-            float loc[3];
-            
-            if (fscanf(fp, "%f %f %f", &loc[0], &loc[1], &loc[2]) != 3)
-                THROW( "OBJECT loc failed" );
-            
-            obj->loc = (float*)malloc(sizeof(float)*3);
-            
-            if (!obj->loc)
-                THROW( "malloc failed" );
-            
-            memcpy(obj->loc, &loc, sizeof(float)*3);
-            
-            // ---------------------------------------
-            // URL
-            
-        } else if (!strcmp(buf, "url")) {
-            scan_string(fp, buf);
-            
-#if TARGET_IPHONE_SIMULATOR
-            NSLog(@"url: %s", buf);
-#endif          
-            // ---------------------------------------
-            // NUMVERT
-            
-        } else if (!strcmp(buf, "numvert")) {
-            int i;
-            
-            if (fscanf(fp, "%d", &obj->numvert) != 1)
-                THROW( "OBJECT numvert failed" );
-            
-            if (obj->numvert > 0) {
-                obj->verts = (AC3DVert*)malloc(sizeof(AC3DVert)*obj->numvert);
-                
-                if (!obj->verts)
-                    THROW( "malloc failed" );
-                
-                for (i=0; i<obj->numvert; i++) {
-                    if (fscanf(fp, 
-                               "%f %f %f", 
-                               &obj->verts[i][0], 
-                               &obj->verts[i][1], 
-                               &obj->verts[i][2]) != 3)
-                        THROW( "OBJECT vert failed" );
-                    obj->verts[i][3] = obj->verts[i][4] = 0.0;
+    for (i=0; i<numrecs; i++) {
+        AC3DRecord *rec = &recs[i];
+        if (rec->bucket != bucket)
+            continue;
+
+        if (kind < 0) {
+            kind = ac3d_batch_kind(rec->type);
+            open_ac3d_batch(w, (rec->type & 0xf0) | kind, rec->mat);
+        }
+
+        switch (kind) {
+            case SURF_TRI_LIST: {
+                int len = rec->flat ? vlen-3 : vlen;
+                for (j=0; j<rec->numrefs-2; j++) {
+                    if (w->count + 3 > AC3D_MAX_REFS) {
+                        close_ac3d_batch(w);
+                        open_ac3d_batch(w, (rec->type & 0xf0) | kind, rec->mat);
+                    }
+                    put_ac3d_batch_vertex(w, &rec->data[0], len, rec->flat);
+                    put_ac3d_batch_vertex(w, &rec->data[(j+1)*len], len, rec->flat);
+                    put_ac3d_batch_vertex(w, &rec->data[(j+2)*len], len, rec->flat);
                 }
+                break;
             }
-            
-            // ---------------------------------------
-            // NUMSURF
-            
-        } else if (!strcmp(buf, "numsurf")) {
-            int i;
-            
-            if (fscanf(fp, "%d", &obj->numsurf) != 1)
-                THROW( "OBJECT numsurf failed" );      
-            
-            if (obj->numsurf > 0) {
-                obj->surfs = (AC3DSurf**)malloc(sizeof(AC3DSurf*)*obj->numsurf);
-                
-                if (!obj->surfs)
-                    THROW( "malloc failed" );
-                
-                memset(obj->surfs, 0, sizeof(AC3DSurf*)*obj->numsurf);
-                
-                for (i=0; i<obj->numsurf; i++) {
-                    AC3DSurf *surf = read_ac3d_surf(fp, obj, err);
-                    
-                    if (!surf)
-                        THROW( *err );
-                    
-                    obj->surfs[i] = surf;
+
+            case SURF_TRI_STRIP: {
+                // Repeat the last vertex and the first of the new strip, and
+                // the last once more if needed to keep the winding
+                int extra = w->count ? ((w->count & 1) ? 3 : 2) : 0;
+                if (w->count + extra + rec->numrefs > AC3D_MAX_REFS) {
+                    close_ac3d_batch(w);
+                    open_ac3d_batch(w, (rec->type & 0xf0) | kind, rec->mat);
+                    extra = 0;
                 }
-                
-                if (!obj->name || strcmp(obj->name, "rotate")) {
-                    make_normals(obj);
-                    optimize_ac3d_object_step_1(obj);
-                    optimize_ac3d_object_step_2(obj);
+                if (extra) {
+                    AC3Doptcmd *last = w->dst ? &w->dst[w->size - vlen] : NULL;
+                    for (k=0; k<extra-1; k++) {
+                        if (w->dst)
+                            memmove(&w->dst[w->size], last, sizeof(AC3Doptcmd)*vlen);
+                        w->size += vlen;
+                        w->count++;
+                    }
+                    put_ac3d_batch_vertex(w, &rec->data[0], vlen, NULL);
                 }
+                for (j=0; j<rec->numrefs; j++)
+                    put_ac3d_batch_vertex(w, &rec->data[j*vlen], vlen, NULL);
+                break;
             }
-            
-            // ---------------------------------------
-            // KIDS
-            
-        } else if (!strcmp(buf, "kids")) {
-            
-            if (fscanf(fp, "%d", &obj->numkids) != 1)
-                THROW( "OBJECT kids failed" );
-            
-            if (obj->numkids > 0) {
-                int i;
-                
-                obj->kids = (AC3DObject**)malloc(sizeof(AC3DObject*)*obj->numkids);
-                
-                if (!obj->kids)
-                    THROW( "malloc failed" );
-                
-                memset(obj->kids, 0, sizeof(AC3DObject*)*obj->numkids);
-                
-                for (i=0; i<obj->numkids; i++) {
-                    AC3DObject *kid;
-                    
-                    if (fscanf(fp, "%s", buf) != 1 || strcmp(buf, "OBJECT"))
-                        THROW( "OBJECT kid object failed" );
-                    
-                    kid = read_ac3d_object(fp, err);
-                    
-                    if (kid)
-                        ;//printf("Read object %s\n", kid->name ? kid->name : "unamed");
-                    else
-                        THROW( *err );
-                    
-                    if (kid->name && !strcmp(kid->name, "rotate")) {
-                        if (!obj->rotvec) {
-                            obj->rotvec = (float*)malloc(sizeof(float)*6);
-                            obj->rotvec[0] = kid->verts[1][0] - kid->verts[0][0];
-                            obj->rotvec[1] = kid->verts[1][1] - kid->verts[0][1];
-                            obj->rotvec[2] = kid->verts[1][2] - kid->verts[0][2];
-                            if (kid->loc) {
-                                obj->rotvec[3] = kid->loc[0] + kid->verts[0][0];
-                                obj->rotvec[4] = kid->loc[1] + kid->verts[0][1];
-                                obj->rotvec[5] = kid->loc[2] + kid->verts[0][2];
-                            } else {
-                                obj->rotvec[3] = kid->verts[0][0];
-                                obj->rotvec[4] = kid->verts[0][1];
-                                obj->rotvec[5] = kid->verts[0][2];
-                            }
-                        }
-                        free_ac3d_object(kid);
-                        i--;
-                        obj->numkids--;
-                    } else if (kid->type == OBJECT_LIGHT) {
-                        free_ac3d_object(kid);
-                        i--;
-                        obj->numkids--;
-                    } else {
-                        obj->kids[i] = kid;
-                        if (kid->bbox) {
-                            check_object_bbox(obj, &kid->bbox[0]);
-                            check_object_bbox(obj, &kid->bbox[3]);
-                        }
+
+            default: {
+                int segs = rec->numrefs - ((rec->type & 0x0f) == SURF_LINE ? 1 : 0);
+                for (j=0; j<segs; j++) {
+                    if (w->count + 2 > AC3D_MAX_REFS) {
+                        close_ac3d_batch(w);
+                        open_ac3d_batch(w, (rec->type & 0xf0) | kind, rec->mat);
                     }
+                    put_ac3d_batch_vertex(w, &rec->data[j*3], 3, NULL);
+                    put_ac3d_batch_vertex(w, &rec->data[((j+1) % rec->numrefs)*3], 3, NULL);
                 }
+                break;
             }
-            fix_object_bbox(obj);
-            do_read = 0; // done
-            
-        } else {
-            THROW( "OBJECT unknown tag" );
         }
-        
     }
-    
-    return obj;
-    
-CATCH_ERROR:
-    
-    free_ac3d_object(obj);
-    return NULL;
-}
 
-// ----------------------------------------------------------------------
+    close_ac3d_batch(w);
+}
 
+// The batched stream is written to the arena of obj, the stream as it
+// is when that fails
 static
-void load_textures_ac3d_object(AC3DObject *obj, 
-                               NSMutableDictionary *textures)
+void batch_ac3d_object(AC3DObject *obj)
 {
-    int i;
-    if (obj->texture && !obj->texture_loaded) {
-        NSString *texname = [NSString stringWithFormat:@"%s", obj->texture];
-        AC3DTexture *texture = [textures objectForKey:texname];
-        if (texture) {
-            obj->texid = [texture name];
-        } else {
-            texture = [[AC3DTexture alloc] initWithImagePath:texname];
-            if (texture) {
-                obj->texid = [texture name];
-                [textures setObject:texture forKey:texname];
-            } else {
-                texname = [NSString stringWithFormat:@"Textures/%s", obj->texture];
-                texture = [textures objectForKey:texname];
-                if (texture) {
-                    obj->texid = [texture name];
-                } else {
-                    texture = [[AC3DTexture alloc] initWithImagePath:texname];
-                    if (texture) {
-                        obj->texid = [texture name];
-                        [textures setObject:texture forKey:texname];
-                    }
-                }
-            }
-        }
-        obj->texture_loaded = 1;
+    int vlen = AC3D_VERTEX_STRIDE(obj);
+    AC3DArena *scratch = obj->arena->scratch;
+    AC3DArenaMark mark;
+    AC3DRecord *recs = NULL;
+    int *keys = NULL;
+    int numrecs = 0, numbuckets = 0, batched = 0;
+    AC3DBatchWriter w;
+    AC3Doptcmd *ptr, *end;
+    int i, b;
+
+    if (!obj->optcmds || obj->numcmds == 0) {
+        obj->optcmds = NULL;
+        obj->numcmds = 0;
+        return;
+    }
+
+    mark_ac3d_arena(scratch, &mark);
+
+    for (ptr = obj->optcmds, end = obj->optcmds + obj->numcmds; ptr < end;) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED))
+            ptr += 2 + 3 + numrefs*(vlen-3);
+        else if ((type & 0x0f) == SURF_POLYGON || (type & 0x0f) == SURF_TRI_STRIP)
+            ptr += 2 + numrefs*vlen;
+        else
+            ptr += 2 + numrefs*3;
+        numrecs++;
+    }
+
+    recs = (AC3DRecord*)alloc_ac3d_arena(scratch, sizeof(AC3DRecord)*numrecs);
+    keys = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numrecs);
+    if (!recs || !keys)
+        goto done;
+
+    for (ptr = obj->optcmds, i = 0; ptr < end; i++) {
+        AC3DRecord *rec = &recs[i];
+        int key;
+
+        rec->type = ptr[0].cmd[0];
+        rec->numrefs = ptr[0].cmd[1];
+        rec->mat = ptr[1].cmd[0];
+        rec->flat = NULL;
+        ptr += 2;
+        if ((rec->type & 0x0f) == SURF_POLYGON && !(rec->type & SURF_SHADED)) {
+            rec->flat = ptr;
+            ptr += 3;
+            rec->data = ptr;
+            ptr += rec->numrefs*(vlen-3);
+        } else if ((rec->type & 0x0f) == SURF_POLYGON || (rec->type & 0x0f) == SURF_TRI_STRIP) {
+            rec->data = ptr;
+            ptr += rec->numrefs*vlen;
+        } else {
+            rec->data = ptr;
+            ptr += rec->numrefs*3;
+        }
+
+        // mat in the high bits, then the kind and the shaded/twosided flags
+        key = ((rec->mat & 0xffff) << 16) | (ac3d_batch_kind(rec->type) << 8) | (rec->type & 0xf0);
+        for (b=0; b<numbuckets; b++)
+            if (keys[b] == key)
+                break;
+        if (b == numbuckets)
+            keys[numbuckets++] = key;
+        rec->bucket = b;
+    }
+
+    // Count, then write
+
+    memset(&w, 0, sizeof(w));
+    for (b=0; b<numbuckets; b++)
+        write_ac3d_bucket(obj, recs, numrecs, b, &w);
+
+    w.dst = (AC3Doptcmd*)alloc_ac3d_arena(obj->arena, sizeof(AC3Doptcmd)*w.size);
+    if (!w.dst)
+        goto done;
+    w.size = 0;
+    w.numrecords = 0;
+    for (b=0; b<numbuckets; b++)
+        write_ac3d_bucket(obj, recs, numrecs, b, &w);
+
+    ADD_DRAWS(numrecs, w.numrecords);
+
+    obj->optcmds = w.dst;
+    obj->numcmds = w.size;
+    batched = 1;
+
+done:
+
+    if (!batched) {
+        obj->optcmds = (AC3Doptcmd*)dup_ac3d_arena(obj->arena, obj->optcmds, sizeof(AC3Doptcmd)*obj->numcmds);
+        if (!obj->optcmds)
+            obj->numcmds = 0;
+    }
+    release_ac3d_arena(scratch, &mark);
+}
+
+// ----------------------------------------------------------------------
+// Indexed cooking
+//
+// Turns the triangles of the optcmd stream into a welded vertex array
+// (V,N,T per vertex, same types as the stream unless the quantize option
+// asks for a compact layout) and one GL_TRIANGLES index list per material
+// and sidedness. Flat surfaces get their face normal on all three
+// corners, so they only weld with coplanar neighbours and can be drawn
+// smooth like the rest. Line records are left in the stream.
+//
+// Each index list is ordered with Tipsify (Sander, Nehab and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw")
+// for the post-transform cache, the clusters it ends at dead-ends are
+// then sorted so that the ones facing out from the center come first,
+// which lets the depth test reject more of what is behind them.
+
+#define AC3D_VCACHE_SIZE 16
+
+#ifdef USE_FLOATS
+#  define CMD_FLOAT(_c) ((_c).f)
+#  define SET_CMD_FLOAT(_c, _v) ((_c).f = (_v))
+#else
+#  define CMD_FLOAT(_c) ((_c).i / 65536.0f)
+#  define SET_CMD_FLOAT(_c, _v) ((_c).i = (_v) * 65536.0)
+#endif
+
+typedef struct {
+    float key;
+    int   first; // triangle
+    int   count;
+} AC3DCluster;
+
+static
+int compare_ac3d_clusters(const void *a, const void *b)
+{
+    const AC3DCluster *ca = (const AC3DCluster*)a;
+    const AC3DCluster *cb = (const AC3DCluster*)b;
+    if (ca->key > cb->key) return -1;
+    if (ca->key < cb->key) return 1;
+    return ca->first - cb->first;
+}
+
+// Reorders the n triangles in tris (3 vertex indices each) into out
+static
+int order_ac3d_triangles(AC3DArena *scratch, const int *tris, int n,
+                         const AC3Doptcmd *verts, int numverts, int stride,
+                         int *out)
+{
+    int *live = NULL, *offs = NULL, *vtris = NULL, *ts = NULL;
+    int *dead = NULL, *cand = NULL, *cstart = NULL;
+    char *emitted = NULL;
+    float *cdata = NULL;   // centroid and normal per cluster
+    AC3DCluster *clusters = NULL;
+    int *tmp = NULL;
+    int time = AC3D_VCACHE_SIZE+1, cursor = 0, numdead = 0, numclusters = 0;
+    int f, i, j, k, m = 0, ok = 0;
+    float center[3] = { 0.0, 0.0, 0.0 }, area = 0.0;
+    AC3DArenaMark mark;
+
+    mark_ac3d_arena(scratch, &mark);
+    live = (int*)calloc_ac3d_arena(scratch, numverts, sizeof(int));
+    offs = (int*)calloc_ac3d_arena(scratch, numverts+1, sizeof(int));
+    ts = (int*)calloc_ac3d_arena(scratch, numverts, sizeof(int));
+    vtris = (int*)alloc_ac3d_arena(scratch, sizeof(int)*n*3);
+    dead = (int*)alloc_ac3d_arena(scratch, sizeof(int)*n*3);
+    cand = (int*)alloc_ac3d_arena(scratch, sizeof(int)*n*3);
+    cstart = (int*)alloc_ac3d_arena(scratch, sizeof(int)*(n+1));
+    emitted = (char*)calloc_ac3d_arena(scratch, n, 1);
+
+    if (!live || !offs || !ts || !vtris || !dead || !cand || !cstart || !emitted)
+        goto done;
+
+    for (i=0; i<n*3; i++)
+        live[tris[i]]++;
+    for (i=0; i<numverts; i++)
+        offs[i+1] = offs[i] + live[i];
+    for (i=0; i<n*3; i++)
+        vtris[offs[tris[i]]++] = i/3;
+    for (i=numverts; i>0; i--)
+        offs[i] = offs[i-1];
+    offs[0] = 0;
+
+    f = tris[0];
+    cstart[numclusters++] = 0;
+
+    while (f >= 0) {
+        int numcand = 0, best = -1, bestp = -1;
+
+        for (i=offs[f]; i<offs[f+1]; i++) {
+            int t = vtris[i];
+            if (emitted[t])
+                continue;
+            for (k=0; k<3; k++) {
+                int v = tris[t*3+k];
+                out[m*3+k] = v;
+                dead[numdead++] = v;
+                cand[numcand++] = v;
+                live[v]--;
+                if (time - ts[v] > AC3D_VCACHE_SIZE)
+                    ts[v] = time++;
+            }
+            emitted[t] = 1;
+            m++;
+        }
+
+        // Prefer a vertex still in the cache that will not fall out of it
+        // before its remaining triangles are done
+        for (i=0; i<numcand; i++) {
+            int v = cand[i];
+            if (live[v] > 0) {
+                int p = 0;
+                if (time - ts[v] + 2*live[v] <= AC3D_VCACHE_SIZE)
+                    p = time - ts[v];
+                if (p > bestp) {
+                    bestp = p;
+                    best = v;
+                }
+            }
+        }
+
+        // Dead-end, start a new cluster from a recent vertex or the next
+        // triangle not yet emitted
+        if (best < 0) {
+            while (numdead > 0 && best < 0) {
+                int v = dead[--numdead];
+                if (live[v] > 0)
+                    best = v;
+            }
+            while (best < 0 && cursor < n) {
+                if (!emitted[cursor])
+                    best = tris[cursor*3];
+                else
+                    cursor++;
+            }
+            if (best >= 0 && cstart[numclusters-1] != m)
+                cstart[numclusters++] = m;
+        }
+
+        f = best;
+    }
+    cstart[numclusters] = m;
+
+    if (m != n)
+        goto done;
+
+    // Overdraw, clusters facing away from the center of the batch first
+
+    clusters = (AC3DCluster*)alloc_ac3d_arena(scratch, sizeof(AC3DCluster)*numclusters);
+    cdata = (float*)alloc_ac3d_arena(scratch, sizeof(float)*6*numclusters);
+    tmp = (int*)alloc_ac3d_arena(scratch, sizeof(int)*n*3);
+    if (!clusters || !cdata || !tmp)
+        goto done;
+
+    for (i=0; i<numclusters; i++) {
+        float c[3] = { 0.0, 0.0, 0.0 }, nrm[3] = { 0.0, 0.0, 0.0 }, a = 0.0;
+
+        for (j=cstart[i]; j<cstart[i+1]; j++) {
+            const AC3Doptcmd *p0 = &verts[out[j*3+0]*stride];
+            const AC3Doptcmd *p1 = &verts[out[j*3+1]*stride];
+            const AC3Doptcmd *p2 = &verts[out[j*3+2]*stride];
+            float e1[3], e2[3], fn[3], fa;
+
+            for (k=0; k<3; k++) {
+                e1[k] = CMD_FLOAT(p1[k]) - CMD_FLOAT(p0[k]);
+                e2[k] = CMD_FLOAT(p2[k]) - CMD_FLOAT(p0[k]);
+            }
+            fn[0] = e1[1]*e2[2] - e1[2]*e2[1];
+            fn[1] = e1[2]*e2[0] - e1[0]*e2[2];
+            fn[2] = e1[0]*e2[1] - e1[1]*e2[0];
+            fa = sqrt(fn[0]*fn[0] + fn[1]*fn[1] + fn[2]*fn[2]);
+
+            for (k=0; k<3; k++) {
+                nrm[k] += fn[k];
+                c[k] += fa * (CMD_FLOAT(p0[k]) + CMD_FLOAT(p1[k]) + CMD_FLOAT(p2[k])) / 3.0;
+            }
+            a += fa;
+        }
+
+        if (a > 0.0) {
+            for (k=0; k<3; k++) {
+                center[k] += c[k];
+                c[k] /= a;
+            }
+            area += a;
+        }
+        normalize(nrm);
+
+        clusters[i].first = cstart[i];
+        clusters[i].count = cstart[i+1] - cstart[i];
+        memcpy(&cdata[i*6], c, sizeof(float)*3);
+        memcpy(&cdata[i*6+3], nrm, sizeof(float)*3);
+    }
+
+    if (area > 0.0)
+        for (k=0; k<3; k++)
+            center[k] /= area;
+
+    for (i=0; i<numclusters; i++) {
+        float *c = &cdata[i*6], *nrm = &cdata[i*6+3];
+        clusters[i].key = ((c[0]-center[0])*nrm[0] +
+                           (c[1]-center[1])*nrm[1] +
+                           (c[2]-center[2])*nrm[2]);
+    }
+
+    qsort(clusters, numclusters, sizeof(AC3DCluster), compare_ac3d_clusters);
+
+    for (i=0, m=0; i<numclusters; i++) {
+        memcpy(&tmp[m*3], &out[clusters[i].first*3], sizeof(int)*3*clusters[i].count);
+        m += clusters[i].count;
+    }
+    memcpy(out, tmp, sizeof(int)*3*n);
+    ok = 1;
+
+done:
+
+    if (!ok)
+        memcpy(out, tris, sizeof(int)*3*n);
+    release_ac3d_arena(scratch, &mark);
+    return ok;
+}
+
+// Adds a vertex of stride values, returns the index of an equal one
+// if there already is one
+static
+int weld_ac3d_vertex(const AC3Doptcmd *v, int stride,
+                     AC3Doptcmd *verts, int *numverts,
+                     int *hash, unsigned int mask)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i=0; i<stride; i++)
+        h = (h ^ (unsigned int)v[i].i) * 16777619u;
+
+    for (h &= mask; hash[h] >= 0; h = (h+1) & mask)
+        if (!memcmp(&verts[hash[h]*stride], v, sizeof(AC3Doptcmd)*stride))
+            return hash[h];
+
+    memcpy(&verts[*numverts*stride], v, sizeof(AC3Doptcmd)*stride);
+    hash[h] = *numverts;
+    return (*numverts)++;
+}
+
+// Reads back vertex i of the indexed vertices of obj, uv only when
+// textured. Quantized normals are decoded as GL ES 1 does signed bytes.
+static
+void decode_ac3d_vertex(const AC3DObject *obj, int i, float *p, float *n, float *uv)
+{
+    const AC3DQuant *q = obj->quant;
+    const AC3Doptcmd *src = obj->vertices + i*AC3D_INDEXED_STRIDE(obj);
+    const AC3Doptcmd *nsrc = src + AC3D_NORMAL_OFFSET(obj);
+    const AC3Doptcmd *tsrc = src + AC3D_TEXCOORD_OFFSET(obj);
+    int format = AC3D_QUANT_FORMAT(obj);
+    int k;
+
+    if (format & AC3D_QUANTIZE_POSITIONS) {
+        p[0] = q->pos[0] + q->pos[3]*src[0].cmd[0];
+        p[1] = q->pos[1] + q->pos[3]*src[0].cmd[1];
+        p[2] = q->pos[2] + q->pos[3]*src[1].cmd[0];
+    } else {
+        for (k=0; k<3; k++)
+            p[k] = CMD_FLOAT(src[k]);
+    }
+
+    if (format & AC3D_QUANTIZE_NORMALS) {
+        for (k=0; k<3; k++)
+            n[k] = (2*(signed char)nsrc->b.params[k] + 1) / 255.0f;
+    } else {
+        for (k=0; k<3; k++)
+            n[k] = CMD_FLOAT(nsrc[k]);
+    }
+
+    if (!obj->texture)
+        return;
+    if (format & AC3D_QUANTIZE_TEXCOORDS) {
+        uv[0] = q->uv[0] + q->uv[2]*tsrc->cmd[0];
+        uv[1] = q->uv[1] + q->uv[3]*tsrc->cmd[1];
+    } else {
+        uv[0] = CMD_FLOAT(tsrc[0]);
+        uv[1] = CMD_FLOAT(tsrc[1]);
+    }
+}
+
+static
+short quantize_ac3d_value(float v, float offset, float scale)
+{
+    long q = lrintf((v - offset) / scale);
+    return q < -32767 ? -32767 : q > 32767 ? 32767 : (short)q;
+}
+
+// Rewrites the numverts float vertices in the compact layout that
+// the quantize option asks for and makes them the vertices of obj.
+// Positions are shorts around the center of their box with one scale for
+// all axes, so GL decodes them with a glTranslatef and glScalef and the
+// normals only need GL_NORMALIZE. Texcoords are shorts around the center
+// of their range, decoded by the texture matrix. The largest errors go in
+// the stats. Returns 0 when out of memory.
+static
+int quantize_ac3d_vertices(AC3DObject *obj, const AC3Doptcmd *verts, int numverts)
+{
+    int stride = AC3D_VERTEX_STRIDE(obj), qstride, noff;
+    float lo[5], hi[5], half, *err = obj->stats.quant_error;
+    AC3DQuant *q;
+    AC3Doptcmd *out;
+    int i, k;
+
+    q = (AC3DQuant*)calloc_ac3d_arena(obj->arena, 1, sizeof(AC3DQuant));
+    if (!q)
+        return 0;
+    q->format = obj->arena->options->quantize & AC3D_QUANTIZE_ALL;
+    if (!obj->texture)
+        q->format &= ~AC3D_QUANTIZE_TEXCOORDS;
+
+    obj->quant = q;
+    qstride = AC3D_INDEXED_STRIDE(obj);
+    noff = AC3D_NORMAL_OFFSET(obj);
+    out = (AC3Doptcmd*)alloc_ac3d_arena(obj->arena, sizeof(AC3Doptcmd)*qstride*numverts);
+    if (!out) {
+        obj->quant = NULL;
+        return 0;
+    }
+
+    // The box of the positions and the range of the texcoords
+
+    for (i=0; i<numverts; i++) {
+        const AC3Doptcmd *v = &verts[i*stride];
+        for (k=0; k<5 && k<stride-3; k++) {
+            float x = CMD_FLOAT(v[k < 3 ? k : k+3]);
+            if (!i || x < lo[k]) lo[k] = x;
+            if (!i || x > hi[k]) hi[k] = x;
+        }
+    }
+
+    half = 0.0;
+    for (k=0; k<3; k++) {
+        q->pos[k] = (lo[k] + hi[k]) * 0.5f;
+        if ((hi[k] - lo[k]) * 0.5f > half)
+            half = (hi[k] - lo[k]) * 0.5f;
+    }
+    q->pos[3] = half > 0.0 ? half / 32767 : 1.0f;
+    for (k=0; k<2 && obj->texture; k++) {
+        q->uv[k] = (lo[3+k] + hi[3+k]) * 0.5f;
+        q->uv[2+k] = hi[3+k] > lo[3+k] ? (hi[3+k] - lo[3+k]) * 0.5f / 32767 : 1.0f;
+    }
+
+    for (i=0; i<numverts; i++) {
+        const AC3Doptcmd *v = &verts[i*stride];
+        AC3Doptcmd *dst = &out[i*qstride];
+
+        if (q->format & AC3D_QUANTIZE_POSITIONS) {
+            dst[0].cmd[0] = quantize_ac3d_value(CMD_FLOAT(v[0]), q->pos[0], q->pos[3]);
+            dst[0].cmd[1] = quantize_ac3d_value(CMD_FLOAT(v[1]), q->pos[1], q->pos[3]);
+            dst[1].cmd[0] = quantize_ac3d_value(CMD_FLOAT(v[2]), q->pos[2], q->pos[3]);
+            dst[1].cmd[1] = 0;
+        } else {
+            memcpy(dst, v, sizeof(AC3Doptcmd)*3);
+        }
+
+        dst += noff;
+        if (q->format & AC3D_QUANTIZE_NORMALS) {
+            // Rounded for the (2c+1)/255 that GL ES 1 reads them with
+            for (k=0; k<3; k++) {
+                long c = lrintf((CMD_FLOAT(v[3+k])*255.0f - 1.0f) * 0.5f);
+                dst->b.params[k] = (unsigned char)(signed char)(c < -128 ? -128 : c > 127 ? 127 : c);
+            }
+            dst->b.params[3] = 0;
+            dst += 1;
+        } else {
+            memcpy(dst, &v[3], sizeof(AC3Doptcmd)*3);
+            dst += 3;
+        }
+
+        if (!obj->texture)
+            continue;
+        if (q->format & AC3D_QUANTIZE_TEXCOORDS) {
+            dst->cmd[0] = quantize_ac3d_value(CMD_FLOAT(v[6]), q->uv[0], q->uv[2]);
+            dst->cmd[1] = quantize_ac3d_value(CMD_FLOAT(v[7]), q->uv[1], q->uv[3]);
+        } else {
+            memcpy(dst, &v[6], sizeof(AC3Doptcmd)*2);
+        }
+    }
+
+    obj->vertices = out;
+
+    // Measure what was lost
+
+    for (i=0; i<numverts; i++) {
+        const AC3Doptcmd *v = &verts[i*stride];
+        float p[3], n[3], uv[2], a[3], len, dot;
+
+        decode_ac3d_vertex(obj, i, p, n, uv);
+        for (k=0; k<3; k++) {
+            float e = fabsf(p[k] - CMD_FLOAT(v[k]));
+            if (e > err[0])
+                err[0] = e;
+            a[k] = CMD_FLOAT(v[3+k]);
+        }
+        len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]) * sqrtf(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+        if (len > 0.0) {
+            dot = (n[0]*a[0] + n[1]*a[1] + n[2]*a[2]) / len;
+            dot = acosf(dot > 1.0f ? 1.0f : dot < -1.0f ? -1.0f : dot) * (float)(180.0 / M_PI);
+            if (dot > err[1])
+                err[1] = dot;
+        }
+        for (k=0; k<2 && obj->texture; k++) {
+            float e = fabsf(uv[k] - CMD_FLOAT(v[6+k]));
+            if (e > err[2])
+                err[2] = e;
+        }
+    }
+
+    return 1;
+}
+
+static
+void make_ac3d_indexed(AC3DObject *obj)
+{
+    int stride = AC3D_VERTEX_STRIDE(obj);
+    AC3Doptcmd *verts = NULL, *vtx = NULL, *final = NULL;
+    AC3DBatch *batches = NULL, *chunks = NULL;
+    int *tris = NULL, *tbatch = NULL, *sorted = NULL, *remap = NULL, *owner = NULL, *hash = NULL;
+    void *indices = NULL;
+    AC3DArena *scratch = obj->arena->scratch;
+    AC3DArenaMark mark;
+    int numtris = 0, numverts = 0, numbatches = 0, numlines = 0, numstream = 0;
+    int numchunks = 0, numfinal = 0, indexsize, split, pass;
+    unsigned int hashsize = 1;
+    int i, j, k, t;
+    AC3Doptcmd *ptr, *end;
+
+    // Count the triangles
+
+    for (ptr = obj->optcmds, end = obj->optcmds + obj->numcmds; ptr < end;) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1], s = 3;
+        ptr += 2;
+        if ((type & 0x0f) == SURF_POLYGON || (type & 0x0f) == SURF_TRI_STRIP) {
+            s = stride;
+            if (!(type & SURF_SHADED) && (type & 0x0f) == SURF_POLYGON) {
+                ptr += 3;
+                s -= 3;
+            }
+            numtris += numrefs-2;
+            numstream += numrefs;
+        } else {
+            numlines += 2 + numrefs*3;
+        }
+        ptr += numrefs*s;
+    }
+
+    if (numtris == 0)
+        return;
+
+    while (hashsize < (unsigned int)numtris*6)
+        hashsize <<= 1;
+
+    mark_ac3d_arena(scratch, &mark);
+    verts = (AC3Doptcmd*)alloc_ac3d_arena(scratch, sizeof(AC3Doptcmd)*stride*numtris*3);
+    vtx = (AC3Doptcmd*)alloc_ac3d_arena(scratch, sizeof(AC3Doptcmd)*stride*3);
+    batches = (AC3DBatch*)alloc_ac3d_arena(scratch, sizeof(AC3DBatch)*numtris);
+    tris = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris*3);
+    tbatch = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris);
+    sorted = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numtris*3);
+    hash = (int*)alloc_ac3d_arena(scratch, sizeof(int)*hashsize);
+
+    if (!verts || !vtx || !batches || !tris || !tbatch || !sorted || !hash)
+        goto done;
+
+    memset(hash, 0xff, sizeof(int)*hashsize);
+
+    // Weld the corners of every triangle
+
+    for (ptr = obj->optcmds, t = 0; ptr < end;) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1], mat = ptr[1].cmd[0];
+        AC3Doptcmd *flat = NULL;
+        int b;
+
+        ptr += 2;
+        if ((type & 0x0f) != SURF_POLYGON && (type & 0x0f) != SURF_TRI_STRIP) {
+            ptr += numrefs*3;
+            continue;
+        }
+        if (!(type & SURF_SHADED) && (type & 0x0f) == SURF_POLYGON) {
+            flat = ptr;
+            ptr += 3;
+        }
+
+        for (b=0; b<numbatches; b++)
+            if (batches[b].mat == mat &&
+                batches[b].type == (type & SURF_TWOSIDED))
+                break;
+        if (b == numbatches) {
+            batches[b].type = type & SURF_TWOSIDED;
+            batches[b].mat = mat;
+            batches[b].count = 0;
+            numbatches++;
+        }
+
+        for (j=0; j<numrefs-2; j++, t++) {
+            int c[3];
+
+            if ((type & 0x0f) == SURF_POLYGON) {
+                c[0] = 0; c[1] = j+1; c[2] = j+2;
+            } else if (j & 1) {
+                c[0] = j+1; c[1] = j; c[2] = j+2;
+            } else {
+                c[0] = j; c[1] = j+1; c[2] = j+2;
+            }
+
+            for (k=0; k<3; k++) {
+                AC3Doptcmd *src = &ptr[c[k]*(stride - (flat ? 3 : 0))];
+                AC3Doptcmd *dst = &vtx[k*stride];
+                dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+                if (flat) {
+                    dst[3] = flat[0]; dst[4] = flat[1]; dst[5] = flat[2];
+                    if (stride > 6) {
+                        dst[6] = src[3]; dst[7] = src[4];
+                    }
+                } else {
+                    memcpy(&dst[3], &src[3], sizeof(AC3Doptcmd)*(stride-3));
+                }
+            }
+            // Flat strips carry the normal of each triangle on its last vertex
+            if (!(type & SURF_SHADED) && (type & 0x0f) == SURF_TRI_STRIP)
+                for (k=0; k<2; k++)
+                    memcpy(&vtx[k*stride+3], &ptr[(j+2)*stride+3], sizeof(AC3Doptcmd)*3);
+
+            for (k=0; k<3; k++)
+                tris[t*3+k] = weld_ac3d_vertex(&vtx[k*stride], stride,
+                                               verts, &numverts,
+                                               hash, hashsize-1);
+            tbatch[t] = b;
+            batches[b].count++;
+        }
+
+        ptr += numrefs*(stride - (flat ? 3 : 0));
+    }
+
+    // A stream that is not larger stays, e.g. long strips of flat
+    // triangles where every triangle needs its own three vertices.
+
+    if (numverts >= numstream)
+        goto done;
+
+    for (i=0, k=0; i<numbatches; i++) {
+        batches[i].first = k;
+        k += batches[i].count;
+    }
+
+    // Order each batch for the vertex cache and overdraw
+
+    for (i=0; i<numbatches; i++)
+        batches[i].count = 0;
+    for (t=0; t<numtris; t++) {
+        AC3DBatch *batch = &batches[tbatch[t]];
+        memcpy(&sorted[(batch->first + batch->count++)*3], &tris[t*3], sizeof(int)*3);
+    }
+    for (i=0; i<numbatches; i++)
+        order_ac3d_triangles(scratch, &sorted[batches[i].first*3], batches[i].count, 
+                             verts, numverts, stride,
+                             &tris[batches[i].first*3]);
+
+    // Number the vertices in the order they are first used. The indices
+    // are 16 bits when they fit, else 32 bits when the target draws those.
+    // Otherwise the triangles are cut into chunks of at most
+    // AC3D_MAX_CHUNK_VERTS vertices, each with its own copies of the
+    // vertices it uses and a batch of its own that starts at them. The
+    // first pass counts, the second writes.
+
+    split = numverts > AC3D_MAX_CHUNK_VERTS && !obj->arena->options->index32;
+    indexsize = numverts > AC3D_MAX_CHUNK_VERTS && !split ? 4 : 2;
+
+    remap = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numverts);
+    owner = (int*)alloc_ac3d_arena(scratch, sizeof(int)*numverts);
+    if (!remap || !owner)
+        goto done;
+
+    for (pass=0; pass<2; pass++) {
+        int chunk = 0, base = 0, curbase = 0, n = -1;
+
+        memset(owner, 0xff, sizeof(int)*numverts);
+        for (i=0, k=0; i<numbatches; i++) {
+            AC3DBatch *batch = &batches[i];
+
+            for (t=batch->first; t<batch->first+batch->count; t++) {
+                const int *c = &tris[t*3];
+
+                if (split) {
+                    int fresh = ((owner[c[0]] != chunk) +
+                                 (owner[c[1]] != chunk && c[1] != c[0]) +
+                                 (owner[c[2]] != chunk && c[2] != c[0] && c[2] != c[1]));
+                    if (k - base + fresh > AC3D_MAX_CHUNK_VERTS) {
+                        chunk++;
+                        base = k;
+                    }
+                }
+
+                // Each chunk of a batch is a batch of its own
+                if (t == batch->first || base != curbase) {
+                    n++;
+                    curbase = base;
+                    if (chunks) {
+                        chunks[n] = *batch;
+                        chunks[n].first = t*3;
+                        chunks[n].count = 0;
+                        chunks[n].base = base;
+                    }
+                }
+
+                for (j=0; j<3; j++) {
+                    int v = c[j];
+                    if (owner[v] != chunk) {
+                        owner[v] = chunk;
+                        remap[v] = k - base;
+                        if (final)
+                            memcpy(&final[k*stride], &verts[v*stride], sizeof(AC3Doptcmd)*stride);
+                        k++;
+                    }
+                    if (indexsize == 4 && indices)
+                        ((uint32_t*)indices)[t*3+j] = remap[v];
+                    else if (indices)
+                        ((unsigned short*)indices)[t*3+j] = remap[v];
+                }
+                if (chunks)
+                    chunks[n].count += 3;
+            }
+        }
+
+        if (pass == 0) {
+            // Cutting can make the vertices outgrow the stream
+            if (k >= numstream)
+                goto done;
+            numchunks = n+1;
+            // Only a temporary when the kept vertices are quantized
+            final = (AC3Doptcmd*)alloc_ac3d_arena(obj->arena->options->quantize ? scratch : obj->arena,
+                                                  sizeof(AC3Doptcmd)*stride*k);
+            indices = alloc_ac3d_arena(obj->arena, indexsize*numtris*3);
+            chunks = (AC3DBatch*)alloc_ac3d_arena(obj->arena, sizeof(AC3DBatch)*numchunks);
+            if (!final || !indices || !chunks)
+                goto done;
+        }
+        numfinal = k;
+    }
+
+    if (!obj->arena->options->quantize)
+        obj->vertices = final;
+    else if (!quantize_ac3d_vertices(obj, final, numfinal))
+        goto done;
+    obj->numvertices = numfinal;
+    obj->indices = indices;
+    obj->indexsize = indexsize;
+    obj->numindices = numtris*3;
+    obj->batches = chunks;
+    obj->numbatches = numchunks;
+
+    // Only the lines are left in the stream
+
+    if (numlines) {
+        AC3Doptcmd *lines = (AC3Doptcmd*)alloc_ac3d_arena(obj->arena->stream, sizeof(AC3Doptcmd)*numlines);
+        AC3Doptcmd *dst = lines;
+        if (lines) {
+            for (ptr = obj->optcmds; ptr < end;) {
+                int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+                if ((type & 0x0f) == SURF_POLYGON || (type & 0x0f) == SURF_TRI_STRIP) {
+                    if (!(type & SURF_SHADED) && (type & 0x0f) == SURF_POLYGON)
+                        ptr += 2 + 3 + numrefs*(stride-3);
+                    else
+                        ptr += 2 + numrefs*stride;
+                } else {
+                    memcpy(dst, ptr, sizeof(AC3Doptcmd)*(2 + numrefs*3));
+                    dst += 2 + numrefs*3;
+                    ptr += 2 + numrefs*3;
+                }
+            }
+            obj->optcmds = lines;
+            obj->numcmds = numlines;
+        }
+    } else {
+        obj->optcmds = NULL;
+        obj->numcmds = 0;
+    }
+
+done:
+
+    release_ac3d_arena(scratch, &mark);
+}
+
+// ----------------------------------------------------------------------
+// Texture atlases
+//
+// With the atlas option the small textures of a file are packed into a
+// few atlases once its objects are cooked, before flattening so objects
+// that end up on the same atlas can be merged. A texture is only packed
+// when every texcoord of every object using it is within 0..1, texrep
+// and texoff are already in them by then, so repeating ones keep their
+// own texture. Each image gets a one pixel gutter of its edge pixels, so
+// filtering at its borders does not pick up its neighbours. The layout
+// is the texture name of the objects, "atlas:WxH;x,y,w,h,name;...", so
+// it goes in the .acb as any other name and the atlas is put together
+// from the images when it is loaded, for GL or the software renderer.
+
+#define AC3D_ATLAS_PREFIX  "atlas:"
+#define AC3D_ATLAS_NAMELEN 256   // longest image name packed, with the 0
+#define AC3D_ATLAS_MAXSIZE 8192  // side of the largest atlas put together
+#define AC3D_ATLAS_SLACK   0.001 // texcoords this far outside 0..1 still pack
+
+// An image of an atlas, as listed in its name
+typedef struct {
+    int  x, y;          // of its pixels, inside the gutter
+    int  width, height;
+    char name[AC3D_ATLAS_NAMELEN];
+} AC3DAtlasRect;
+
+// A texture of the file being packed
+typedef struct {
+    const char *name;
+    int         width, height;
+    int         x, y;
+    int         atlas;    // -1 = not packed
+    bool        packable;
+} AC3DAtlasEntry;
+
+typedef struct {
+    AC3DAtlasEntry *entries;
+    int             numentries;
+    int             size;
+    AC3DArena      *scratch;
+    char          **names;    // of the atlases, in the file arena
+} AC3DAtlasPacker;
+
+static
+int is_ac3d_atlas(const char *texture)
+{
+    return texture && !strncmp(texture, AC3D_ATLAS_PREFIX, sizeof(AC3D_ATLAS_PREFIX)-1);
+}
+
+// Reads the rect at s, returns where the next one starts or NULL when
+// it is not one
+static
+const char *next_ac3d_atlas_rect(const char *s, AC3DAtlasRect *rect)
+{
+    const char *end;
+    int len = 0;
+
+    if (sscanf(s, "%d,%d,%d,%d,%n", &rect->x, &rect->y, 
+               &rect->width, &rect->height, &len) != 4 || !len)
+        return NULL;
+    s += len;
+    end = strchr(s, ';');
+    len = end ? (int)(end - s) : (int)strlen(s);
+    if (len >= AC3D_ATLAS_NAMELEN)
+        return NULL;
+    memcpy(rect->name, s, len);
+    rect->name[len] = 0;
+    return end ? end+1 : s+len;
+}
+
+// Puts the atlas named texture together from its images, each scaled to
+// its rect if it has changed size since it was packed. Images that are
+// not found are left clear. Returns malloced pixels, first row at v = 0,
+// or NULL when texture is not an atlas.
+static
+unsigned char *compose_ac3d_atlas(const char *texture, AC3DTextureFunc source, 
+                                  void *userdata, int *width, int *height)
+{
+    AC3DAtlasRect rect;
+    unsigned char *rgba;
+    const char *s;
+    int w, h;
+
+    if (!is_ac3d_atlas(texture) ||
+        sscanf(texture + sizeof(AC3D_ATLAS_PREFIX)-1, "%dx%d", &w, &h) != 2 ||
+        w <= 0 || h <= 0 || w > AC3D_ATLAS_MAXSIZE || h > AC3D_ATLAS_MAXSIZE)
+        return NULL;
+
+    rgba = (unsigned char*)calloc((size_t)w*h, 4);
+    if (!rgba)
+        return NULL;
+
+    s = strchr(texture, ';');
+    if (s)
+        s++;
+    while (s && *s && source) {
+        const unsigned char *src;
+        int sw = 0, sh = 0, x, y;
+
+        s = next_ac3d_atlas_rect(s, &rect);
+        if (!s)
+            break;
+        if (rect.x < 1 || rect.y < 1 || rect.width <= 0 || rect.height <= 0 ||
+            rect.x + rect.width + 1 > w || rect.y + rect.height + 1 > h)
+            continue;
+        src = source(rect.name, &sw, &sh, userdata);
+        if (!src || sw <= 0 || sh <= 0)
+            continue;
+
+        // The gutter repeats the edge pixels
+        for (y=-1; y<=rect.height; y++) {
+            int cy = y < 0 ? 0 : y >= rect.height ? rect.height-1 : y;
+            const unsigned char *row = src + (size_t)(cy*sh/rect.height)*sw*4;
+            unsigned char *dst = rgba + ((size_t)(rect.y+y)*w + rect.x-1)*4;
+            for (x=-1; x<=rect.width; x++, dst+=4) {
+                int cx = x < 0 ? 0 : x >= rect.width ? rect.width-1 : x;
+                memcpy(dst, row + (cx*sw/rect.width)*4, 4);
+            }
+        }
+    }
+
+    *width = w;
+    *height = h;
+    return rgba;
+}
+
+#ifndef AC3D_HEADLESS
+
+// The bundle path of the image name, looked for as AC3DTexture does and
+// then in the Textures/ folder, returns 0 when there is none
+static
+int resolve_ac3d_texture_path(const char *name, char *path, size_t size)
+{
+    static const char *folders[] = { "", "Textures/" };
+    NSString *resources = [[NSBundle mainBundle] resourcePath];
+    int i;
+
+    for (i=0; i<2; i++) {
+        NSString *file = [NSString stringWithFormat:@"%s%s", folders[i], name];
+        const char *lpath;
+        if (![file isAbsolutePath])
+            file = [resources stringByAppendingPathComponent:file];
+        lpath = [file fileSystemRepresentation];
+        if (lpath && !access(lpath, R_OK)) {
+            snprintf(path, size, "%s", lpath);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The images atlases are made from without an atlas_texture, found as
+// the textures are. The pixels are kept in *userdata, an unsigned char 
+// pointer, until the next call, free it after the last.
+static
+const unsigned char *read_ac3d_bundle_image(const char *name, int *width, int *height, void *userdata)
+{
+    unsigned char **pixels = (unsigned char**)userdata;
+    char path[1024];
+    UIImage *image = nil;
+    CGColorSpaceRef colorSpace;
+    CGContextRef context;
+    size_t w, h;
+
+    free(*pixels);
+    *pixels = NULL;
+
+    if (resolve_ac3d_texture_path(name, path, sizeof(path)))
+        image = [UIImage imageWithContentsOfFile:[NSString stringWithFormat:@"%s", path]];
+    if (!image)
+        return NULL;
+
+    w = CGImageGetWidth(image.CGImage);
+    h = CGImageGetHeight(image.CGImage);
+    *pixels = (unsigned char*)calloc(w*h, 4);
+    if (!*pixels)
+        return NULL;
+
+    colorSpace = CGColorSpaceCreateDeviceRGB();
+    context = CGBitmapContextCreate(*pixels, w, h, 8, 4*w, colorSpace, 
+                                    kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+    CGColorSpaceRelease(colorSpace);
+    if (!context) {
+        free(*pixels);
+        *pixels = NULL;
+        return NULL;
+    }
+    CGContextDrawImage(context, CGRectMake(0, 0, w, h), image.CGImage);
+    CGContextRelease(context);
+
+    *width = (int)w;
+    *height = (int)h;
+    return *pixels;
+}
+
+#endif // AC3D_HEADLESS
+
+// Grows lo..hi with the texcoords of obj, in the stream and the indexed
+// vertices, then maps them to offset + scale*t when scale is set.
+// Quantized texcoords are mapped through their scale and offset.
+static
+void map_ac3d_texcoords(AC3DObject *obj, const float *scale, const float *offset, 
+                        float *lo, float *hi)
+{
+    int stride = AC3D_VERTEX_STRIDE(obj);
+    AC3Doptcmd *ptr = obj->optcmds, *end = obj->optcmds + obj->numcmds;
+    int i, k;
+
+    while (ptr < end) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+        int vlen = stride;
+
+        ptr += 2;
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED)) {
+            ptr += 3;
+            vlen = stride-3;
+        } else if ((type & 0x0f) == SURF_CLOSEDLINE ||
+                   (type & 0x0f) == SURF_LINE ||
+                   (type & 0x0f) == SURF_LINES) {
+            ptr += 3*numrefs;
+            continue;
+        }
+
+        for (i=0; i<numrefs; i++, ptr += vlen) {
+            AC3Doptcmd *t = ptr + vlen-2;
+            for (k=0; k<2; k++) {
+                float v = CMD_FLOAT(t[k]);
+                if (v < lo[k]) lo[k] = v;
+                if (v > hi[k]) hi[k] = v;
+                if (scale)
+                    SET_CMD_FLOAT(t[k], offset[k] + scale[k]*v);
+            }
+        }
+    }
+
+    if (obj->vertices) {
+        int quantized = AC3D_QUANT_FORMAT(obj) & AC3D_QUANTIZE_TEXCOORDS;
+        AC3Doptcmd *t = obj->vertices + AC3D_TEXCOORD_OFFSET(obj);
+
+        for (i=0; i<obj->numvertices; i++, t += AC3D_INDEXED_STRIDE(obj)) {
+            float p[3], n[3], uv[2];
+            decode_ac3d_vertex(obj, i, p, n, uv);
+            for (k=0; k<2; k++) {
+                if (uv[k] < lo[k]) lo[k] = uv[k];
+                if (uv[k] > hi[k]) hi[k] = uv[k];
+                if (scale && !quantized)
+                    SET_CMD_FLOAT(t[k], offset[k] + scale[k]*uv[k]);
+            }
+        }
+        if (scale && quantized) {
+            for (k=0; k<2; k++) {
+                obj->quant->uv[k] = offset[k] + scale[k]*obj->quant->uv[k];
+                obj->quant->uv[2+k] *= scale[k];
+            }
+        }
+    }
+}
+
+static
+AC3DAtlasEntry *get_ac3d_atlas_entry(AC3DAtlasPacker *p, const char *name)
+{
+    AC3DAtlasEntry *e;
+    int i;
+
+    for (i=0; i<p->numentries; i++)
+        if (!strcmp(p->entries[i].name, name))
+            return &p->entries[i];
+
+    if (p->numentries == p->size) {
+        int size = p->size ? p->size*2 : 16;
+        e = (AC3DAtlasEntry*)grow_ac3d_arena(p->scratch, p->entries, 
+                                             sizeof(AC3DAtlasEntry)*p->numentries, 
+                                             sizeof(AC3DAtlasEntry)*size);
+        if (!e)
+            return NULL;
+        p->entries = e;
+        p->size = size;
+    }
+    e = &p->entries[p->numentries++];
+    memset(e, 0, sizeof(AC3DAtlasEntry));
+    e->name = name;
+    e->atlas = -1;
+    e->packable = (strlen(name) < AC3D_ATLAS_NAMELEN && !strchr(name, ';') &&
+                   !is_ac3d_atlas(name));
+    return e;
+}
+
+// Finds the textures of the tree and whether their texcoords allow them
+// to be packed
+static
+int collect_ac3d_atlas_entries(AC3DAtlasPacker *p, AC3DObject *obj)
+{
+    int i;
+
+    if (obj->texture && (obj->numcmds > 0 || obj->numvertices > 0)) {
+        AC3DAtlasEntry *e = get_ac3d_atlas_entry(p, obj->texture);
+        float lo[2] = { 0.0, 0.0 }, hi[2] = { 1.0, 1.0 };
+
+        if (!e)
+            return 0;
+        map_ac3d_texcoords(obj, NULL, NULL, lo, hi);
+        if (lo[0] < -AC3D_ATLAS_SLACK || lo[1] < -AC3D_ATLAS_SLACK ||
+            hi[0] > 1.0+AC3D_ATLAS_SLACK || hi[1] > 1.0+AC3D_ATLAS_SLACK)
+            e->packable = false;
+    }
+
+    for (i=0; i<obj->numkids; i++)
+        if (!collect_ac3d_atlas_entries(p, obj->kids[i]))
+            return 0;
+    return 1;
+}
+
+// Moves the texcoords of the packed objects into their rects
+static
+void remap_ac3d_atlas_objects(AC3DAtlasPacker *p, AC3DObject *obj, 
+                              const int *widths, const int *heights)
+{
+    int i;
+
+    if (obj->texture) {
+        AC3DAtlasEntry *e = get_ac3d_atlas_entry(p, obj->texture);
+        if (e && e->atlas >= 0) {
+            float w = widths[e->atlas], h = heights[e->atlas];
+            float scale[2] = { e->width / w, e->height / h };
+            float offset[2] = { e->x / w, e->y / h };
+            float lo[2], hi[2];
+            map_ac3d_texcoords(obj, scale, offset, lo, hi);
+            obj->texture = p->names[e->atlas];
+        }
+    }
+
+    for (i=0; i<obj->numkids; i++)
+        remap_ac3d_atlas_objects(p, obj->kids[i], widths, heights);
+}
+
+static
+int compare_ac3d_atlas_entries(const void *a, const void *b)
+{
+    const AC3DAtlasEntry *ea = *(const AC3DAtlasEntry**)a;
+    const AC3DAtlasEntry *eb = *(const AC3DAtlasEntry**)b;
+
+    if (ea->height != eb->height)
+        return eb->height - ea->height;
+    if (ea->width != eb->width)
+        return eb->width - ea->width;
+    return strcmp(ea->name, eb->name);
+}
+
+// Packs the textures of file that allow it, tallest first on shelves
+// across the atlases, and remaps the objects using them. An atlas that
+// only got one image is dropped again. Returns 0 when out of memory.
+static
+int atlas_ac3d_file(AC3DFile *file, const AC3DLoadOptions *options)
+{
+    AC3DAtlasPacker packer;
+    AC3DAtlasPacker *p = &packer;
+    AC3DTextureFunc source = options->atlas_texture;
+    void *userdata = options->atlas_userdata;
+    AC3DAtlasEntry **sorted = NULL;
+    int *widths = NULL, *heights = NULL, *counts = NULL;
+    int side = options->atlas, numsorted = 0, numatlases = 0;
+    int x = 0, y = 0, shelf = 0, i, ok = 0;
+#ifndef AC3D_HEADLESS
+    unsigned char *pixels = NULL;
+
+    if (!source) {
+        source = read_ac3d_bundle_image;
+        userdata = &pixels;
+    }
+#endif
+
+    if (!source || side < 4)
+        return 1;
+    while (side & (side-1))
+        side &= side-1;
+    if (side > AC3D_ATLAS_MAXSIZE)
+        side = AC3D_ATLAS_MAXSIZE;
+
+    memset(p, 0, sizeof(AC3DAtlasPacker));
+    p->scratch = file->arena->scratch;
+    if (!collect_ac3d_atlas_entries(p, file->obj))
+        goto done;
+
+    sorted = (AC3DAtlasEntry**)alloc_ac3d_arena(p->scratch, sizeof(AC3DAtlasEntry*)*(p->numentries+1));
+    if (!sorted)
+        goto done;
+
+    for (i=0; i<p->numentries; i++) {
+        AC3DAtlasEntry *e = &p->entries[i];
+        if (!e->packable || !source(e->name, &e->width, &e->height, userdata) ||
+            e->width <= 0 || e->height <= 0 || 
+            e->width > side/2 || e->height > side/2)
+            continue;
+        sorted[numsorted++] = e;
+    }
+    if (numsorted < 2) {
+        ok = 1;
+        goto done;
+    }
+    qsort(sorted, numsorted, sizeof(AC3DAtlasEntry*), compare_ac3d_atlas_entries);
+
+    // At most one atlas per image, widths and heights are the used sizes
+    widths = (int*)calloc_ac3d_arena(p->scratch, numsorted, sizeof(int));
+    heights = (int*)calloc_ac3d_arena(p->scratch, numsorted, sizeof(int));
+    counts = (int*)calloc_ac3d_arena(p->scratch, numsorted, sizeof(int));
+    p->names = (char**)calloc_ac3d_arena(p->scratch, numsorted, sizeof(char*));
+    if (!widths || !heights || !counts || !p->names)
+        goto done;
+
+    for (i=0; i<numsorted; i++) {
+        AC3DAtlasEntry *e = sorted[i];
+        int pw = e->width+2, ph = e->height+2;
+
+        if (x + pw > side) {
+            y += shelf;
+            x = shelf = 0;
+        }
+        if (y + ph > side) {
+            numatlases++;
+            x = y = shelf = 0;
+        }
+        e->atlas = numatlases;
+        e->x = x+1;
+        e->y = y+1;
+        x += pw;
+        if (ph > shelf)
+            shelf = ph;
+        if (x > widths[numatlases])
+            widths[numatlases] = x;
+        if (y + ph > heights[numatlases])
+            heights[numatlases] = y + ph;
+        counts[numatlases]++;
+    }
+    numatlases++;
+
+    // Power of two sizes, as GL ES 1 wants them
+    for (i=0; i<numatlases; i++) {
+        int w = 1, h = 1;
+        while (w < widths[i]) w *= 2;
+        while (h < heights[i]) h *= 2;
+        widths[i] = w;
+        heights[i] = h;
+    }
+
+    // The names, with the layout
+    for (i=0; i<numatlases; i++) {
+        size_t size = 32, len;
+        char *name;
+        int k;
+
+        if (counts[i] < 2)
+            continue;
+        for (k=0; k<numsorted; k++)
+            if (sorted[k]->atlas == i)
+                size += strlen(sorted[k]->name) + 48;
+        name = (char*)alloc_ac3d_arena(p->scratch, size);
+        if (!name)
+            goto done;
+        len = snprintf(name, size, AC3D_ATLAS_PREFIX "%dx%d", widths[i], heights[i]);
+        for (k=0; k<numsorted; k++) {
+            AC3DAtlasEntry *e = sorted[k];
+            if (e->atlas == i)
+                len += snprintf(name+len, size-len, ";%d,%d,%d,%d,%s", 
+                                e->x, e->y, e->width, e->height, e->name);
+        }
+        p->names[i] = dup_ac3d_string(file->arena, name, (int)len);
+        if (!p->names[i])
+            goto done;
+    }
+    for (i=0; i<numsorted; i++)
+        if (counts[sorted[i]->atlas] < 2)
+            sorted[i]->atlas = -1;
+
+    remap_ac3d_atlas_objects(p, file->obj, widths, heights);
+    ok = 1;
+
+done:
+
+#ifndef AC3D_HEADLESS
+    free(pixels);
+#endif
+    return ok;
+}
+
+// ----------------------------------------------------------------------
+// Flattening
+//
+// With dynamic names set only the objects named there, the ones with a
+// "rotate" child and the root stay in the tree. Every other object has
+// its loc and rot baked into its vertices and is merged into its nearest
+// kept ancestor, into the ancestor itself when the texture is the same
+// and otherwise into an unnamed kid per texture. A kept object below a
+// flattened one gets the transforms in between added to its own. The
+// kept objects are batched after that, so the merged geometry ends up in
+// as few draws as the states allow, and drawing only walks and
+// transforms the objects that can move.
+
+// Indexing and batching, the last steps of cooking an object
+static
+void finish_ac3d_object(AC3DObject *obj)
+{
+    if (obj->arena->options->cook == AC3D_COOK_INDEXED)
+        TIME_PHASE(AC3D_PHASE_INDEXED, make_ac3d_indexed(obj));
+    TIME_PHASE(AC3D_PHASE_BATCH, batch_ac3d_object(obj));
+}
+
+static
+int is_ac3d_object_dynamic(AC3DObject *obj)
+{
+    const char * const *name;
+
+    if (obj->rotvec)
+        return 1;
+    if (!obj->name)
+        return 0;
+    for (name = obj->arena->options->dynamic_names; *name; name++)
+        if (!strcmp(*name, obj->name))
+            return 1;
+    return 0;
+}
+
+static
+void add_ac3d_object_stats(AC3DObjectStats *dst, const AC3DObjectStats *src)
+{
+    int i;
+    for (i=0; i<3; i++)
+        dst->surfaces[i] += src->surfaces[i];
+    dst->triangles += src->triangles;
+    dst->strips += src->strips;
+    dst->strip_triangles += src->strip_triangles;
+    dst->points_removed += src->points_removed;
+    dst->draws_in += src->draws_in;
+    dst->draws_out += src->draws_out;
+    for (i=0; i<AC3D_NUM_PHASES; i++)
+        dst->time[i] += src->time[i];
+}
+
+static
+int same_ac3d_texture(AC3DObject *a, AC3DObject *b)
+{
+    if (!a->texture || !b->texture)
+        return a->texture == b->texture;
+    return !strcmp(a->texture, b->texture);
+}
+
+static
+void transform_ac3d_point(float *dst, const float *m, const AC3Doptcmd *src)
+{
+    float x = CMD_FLOAT(src[0]), y = CMD_FLOAT(src[1]), z = CMD_FLOAT(src[2]);
+    dst[0] = m[0]*x + m[4]*y + m[8]*z + m[12];
+    dst[1] = m[1]*x + m[5]*y + m[9]*z + m[13];
+    dst[2] = m[2]*x + m[6]*y + m[10]*z + m[14];
+}
+
+// Normals go through the inverse transpose, nm, and are renormalized
+static
+void transform_ac3d_normal(AC3Doptcmd *n, const float *nm)
+{
+    float x = CMD_FLOAT(n[0]), y = CMD_FLOAT(n[1]), z = CMD_FLOAT(n[2]);
+    float v[3];
+    v[0] = nm[0]*x + nm[3]*y + nm[6]*z;
+    v[1] = nm[1]*x + nm[4]*y + nm[7]*z;
+    v[2] = nm[2]*x + nm[5]*y + nm[8]*z;
+    normalize(v);
+    SET_CMD_FLOAT(n[0], v[0]);
+    SET_CMD_FLOAT(n[1], v[1]);
+    SET_CMD_FLOAT(n[2], v[2]);
+}
+
+// Appends the stream of src transformed by m to the stream of dst, with
+// grow set the bbox of dst is grown to fit. The stream of dst grows by
+// doubling in the stream arena, the old ones stay there until the load
+// is done
+static
+int merge_ac3d_stream(AC3DObject *dst, AC3DObject *src, const float *m, int grow)
+{
+    int stride = AC3D_VERTEX_STRIDE(src);
+    AC3Doptcmd *cmds, *ptr, *end;
+    float nm[9], det;
+    int i;
+
+    if (src->numcmds == 0)
+        return 1;
+
+    if (dst->numcmds + src->numcmds > dst->cmdsize) {
+        int size = dst->cmdsize*2;
+        if (size < dst->numcmds + src->numcmds)
+            size = dst->numcmds + src->numcmds;
+        cmds = (AC3Doptcmd*)grow_ac3d_arena(dst->arena->stream, dst->optcmds, 
+                                            sizeof(AC3Doptcmd)*dst->numcmds, sizeof(AC3Doptcmd)*size);
+        if (!cmds)
+            return 0;
+        dst->optcmds = cmds;
+        dst->cmdsize = size;
+    }
+    cmds = dst->optcmds;
+    ptr = &cmds[dst->numcmds];
+    memcpy(ptr, src->optcmds, sizeof(AC3Doptcmd)*src->numcmds);
+    dst->numcmds += src->numcmds;
+    end = &cmds[dst->numcmds];
+
+    // Inverse transpose of the upper 3x3, from the cofactors
+    nm[0] = m[5]*m[10] - m[6]*m[9];
+    nm[1] = m[6]*m[8] - m[4]*m[10];
+    nm[2] = m[4]*m[9] - m[5]*m[8];
+    nm[3] = m[2]*m[9] - m[1]*m[10];
+    nm[4] = m[0]*m[10] - m[2]*m[8];
+    nm[5] = m[1]*m[8] - m[0]*m[9];
+    nm[6] = m[1]*m[6] - m[2]*m[5];
+    nm[7] = m[2]*m[4] - m[0]*m[6];
+    nm[8] = m[0]*m[5] - m[1]*m[4];
+    det = m[0]*nm[0] + m[1]*nm[1] + m[2]*nm[2];
+    // The cofactors are the inverse transpose scaled by det, so a
+    // mirroring transform needs them flipped. The winding needs nothing,
+    // GL culls in window space and the baked vertices end up there the
+    // same as before.
+    if (det < 0.0)
+        for (i=0; i<9; i++)
+            nm[i] = -nm[i];
+
+    while (ptr < end) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+        int vlen = stride, hasnormal = 1;
+        float p[3];
+
+        ptr += 2;
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED)) {
+            transform_ac3d_normal(ptr, nm);
+            ptr += 3;
+            vlen = stride-3;
+            hasnormal = 0;
+        } else if ((type & 0x0f) != SURF_POLYGON && (type & 0x0f) != SURF_TRI_STRIP) {
+            vlen = 3;
+            hasnormal = 0;
+        }
+
+        for (i=0; i<numrefs; i++, ptr += vlen) {
+            transform_ac3d_point(p, m, ptr);
+            SET_CMD_FLOAT(ptr[0], p[0]);
+            SET_CMD_FLOAT(ptr[1], p[1]);
+            SET_CMD_FLOAT(ptr[2], p[2]);
+            if (grow)
+                check_object_bbox(dst, p);
+            if (hasnormal)
+                transform_ac3d_normal(ptr+3, nm);
+        }
+    }
+
+    return 1;
+}
+
+typedef struct {
+    AC3DObject  *obj;       // the kept object everything is merged into
+    AC3DObject **kids;      // its new kids, merged ones first, in the scratch
+    int          numkids;
+    int          nummerged;
+    int          size;
+} AC3DFlattener;
+
+static
+int flatten_ac3d_object(AC3DObject *obj);
+
+static
+int add_ac3d_flattened_kid(AC3DFlattener *f, AC3DObject *kid, int merged)
+{
+    AC3DObject **kids = f->kids;
+    if (f->numkids == f->size) {
+        int size = f->size ? f->size*2 : 8;
+        kids = (AC3DObject**)grow_ac3d_arena(f->obj->arena->scratch, f->kids, 
+                                             sizeof(AC3DObject*)*f->numkids, sizeof(AC3DObject*)*size);
+        if (!kids)
+            return 0;
+        f->kids = kids;
+        f->size = size;
+    }
+    if (merged) {
+        memmove(&kids[f->nummerged+1], &kids[f->nummerged],
+                sizeof(AC3DObject*)*(f->numkids - f->nummerged));
+        kids[f->nummerged++] = kid;
+    } else {
+        kids[f->numkids] = kid;
+    }
+    f->numkids++;
+    return 1;
+}
+
+// Finds or makes the object to merge a static object with this texture in
+static
+AC3DObject *get_ac3d_merge_target(AC3DFlattener *f, AC3DObject *src)
+{
+    AC3DObject *obj;
+    int i;
+
+    if (same_ac3d_texture(f->obj, src))
+        return f->obj;
+    for (i=0; i<f->nummerged; i++)
+        if (same_ac3d_texture(f->kids[i], src))
+            return f->kids[i];
+
+    obj = (AC3DObject*)calloc_ac3d_arena(f->obj->arena, 1, sizeof(AC3DObject));
+    if (!obj)
+        return NULL;
+    obj->arena = f->obj->arena;
+    obj->type = OBJECT_POLY;
+    obj->texid = -1;
+    obj->enabled = true;
+    obj->crease = 180.0;
+    if (src->texture)
+        obj->texture = dup_ac3d_string(obj->arena, src->texture, (int)strlen(src->texture));
+
+    if (!add_ac3d_flattened_kid(f, obj, 1))
+        return NULL;
+    return obj;
+}
+
+// Walks a kid of f->obj, m is the transform from f->obj to its parent
+static
+int flatten_ac3d_kid(AC3DFlattener *f, AC3DObject *kid, const float *m)
+{
+    float local[16], mk[16];
+    int i, ok = 1;
+
+    get_ac3d_object_matrix(kid, local);
+    mult_ac3d_matrix(mk, m, local);
+
+    if (is_ac3d_object_dynamic(kid)) {
+        // Keep it, with the transforms of the flattened objects above it
+        if (memcmp(m, ac3d_identity, sizeof(ac3d_identity))) {
+            if (!kid->rot)
+                kid->rot = (float*)alloc_ac3d_arena(kid->arena, sizeof(float)*16);
+            if (!kid->loc)
+                kid->loc = (float*)alloc_ac3d_arena(kid->arena, sizeof(float)*3);
+            if (!kid->rot || !kid->loc)
+                return 0;
+            memcpy(kid->rot, mk, sizeof(float)*16);
+            memcpy(kid->loc, &mk[12], sizeof(float)*3);
+            kid->rot[12] = kid->rot[13] = kid->rot[14] = 0.0;
+            if (kid->bbox)
+                transform_ac3d_bbox(kid->bbox, m);
+        }
+        if (!flatten_ac3d_object(kid))
+            return 0;
+        return add_ac3d_flattened_kid(f, kid, 0);
+    }
+
+    if (kid->numcmds > 0) {
+        AC3DObject *dst = get_ac3d_merge_target(f, kid);
+        if (!dst || !merge_ac3d_stream(dst, kid, mk, dst != f->obj))
+            ok = 0;
+        else
+            add_ac3d_object_stats(&dst->stats, &kid->stats);
+    } else {
+        add_ac3d_object_stats(&f->obj->stats, &kid->stats);
+    }
+
+    // The kid itself is left in its arena
+    for (i=0; i<kid->numkids && ok; i++)
+        ok = flatten_ac3d_kid(f, kid->kids[i], mk);
+
+    return ok;
+}
+
+// Flattens the static objects below obj into it and finishes the cooking
+// of obj and everything kept below it. Returns 0 when out of memory,
+// obj is then left half flattened
+static
+int flatten_ac3d_object(AC3DObject *obj)
+{
+    AC3DFlattener f;
+    AC3DObject **kids = NULL;
+    int i;
+
+    memset(&f, 0, sizeof(f));
+    f.obj = obj;
+
+    for (i=0; i<obj->numkids; i++)
+        if (!flatten_ac3d_kid(&f, obj->kids[i], ac3d_identity))
+            return 0;
+
+    if (f.numkids > 0) {
+        kids = (AC3DObject**)dup_ac3d_arena(obj->arena, f.kids, sizeof(AC3DObject*)*f.numkids);
+        if (!kids)
+            return 0;
+    }
+    obj->kids = kids;
+    obj->numkids = f.numkids;
+
+    for (i=0; i<f.nummerged; i++)
+        finish_ac3d_object(f.kids[i]);
+    finish_ac3d_object(obj);
+    return 1;
+}
+
+// ----------------------------------------------------------------------
+
+// Smooth normals per surface corner. Every corner gets the sum of the 
+// face normals around its vertex that are within the crease angle of 
+// its own face, weighted by the angle each face has at that vertex. The
+// corners of each vertex are found through a counting sort, so the work
+// is linear in the number of refs for ordinary meshes.
+static
+void make_normals(AC3DObject *obj)
+{
+    int *first = NULL;      // numvert+1, first corner of each vertex
+    int *csurf = NULL;      // surface and ref of each corner, grouped by vertex
+    int *cref = NULL;
+    float *weights = NULL;
+    AC3DArena *scratch = obj->arena->scratch;
+    AC3DArenaMark mark;
+    float mincos = cos(obj->crease * M_PI / 180.0);
+    int smooth_all = obj->crease >= 180.0;
+    int numcorners = 0;
+    int i, j, k;
+    
+    for (i=0; i<obj->numsurf; i++) {
+        AC3DSurf *surf = obj->surfs[i];
+        if ((surf->type & 0x0f) == SURF_POLYGON && surf->numrefs > 2) {
+            numcorners += surf->numrefs;
+            if ((surf->type & SURF_SHADED) && !surf->normals) 
+                surf->normals = (float(*)[3])alloc_ac3d_arena(scratch, sizeof(float)*3*surf->numrefs);
+        }
+    }
+    
+    // The normals stay with the surfs, the rest is released
+    mark_ac3d_arena(scratch, &mark);
+    first = (int*)calloc_ac3d_arena(scratch, obj->numvert+1, sizeof(int));
+    csurf = (int*)alloc_ac3d_arena(scratch, sizeof(int)*(numcorners ? numcorners : 1));
+    cref = (int*)alloc_ac3d_arena(scratch, sizeof(int)*(numcorners ? numcorners : 1));
+    weights = (float*)alloc_ac3d_arena(scratch, sizeof(float)*(numcorners ? numcorners : 1));
+    
+    if (!first || !csurf || !cref || !weights) 
+        goto done;
+    
+    for (i=0; i<obj->numsurf; i++) {
+        AC3DSurf *surf = obj->surfs[i];
+        if ((surf->type & 0x0f) == SURF_POLYGON && surf->numrefs > 2) 
+            for (j=0; j<surf->numrefs; j++)
+                first[surf->vrefs[j]+1]++;
+    }
+    for (i=0; i<obj->numvert; i++)
+        first[i+1] += first[i];
+    
+    for (i=0; i<obj->numsurf; i++) {
+        AC3DSurf *surf = obj->surfs[i];
+        if ((surf->type & 0x0f) != SURF_POLYGON || surf->numrefs < 3) 
+            continue;
+        for (j=0; j<surf->numrefs; j++) {
+            float *p = obj->verts[surf->vrefs[j]];
+            float *a = obj->verts[surf->vrefs[(j+surf->numrefs-1) % surf->numrefs]];
+            float *b = obj->verts[surf->vrefs[(j+1) % surf->numrefs]];
+            float pa[3], pb[3], d;
+            
+            pa[0] = a[0]-p[0]; pa[1] = a[1]-p[1]; pa[2] = a[2]-p[2];
+            pb[0] = b[0]-p[0]; pb[1] = b[1]-p[1]; pb[2] = b[2]-p[2];
+            normalize(pa);
+            normalize(pb);
+            d = pa[0]*pb[0] + pa[1]*pb[1] + pa[2]*pb[2];
+            if (d > 1.0) d = 1.0;
+            if (d < -1.0) d = -1.0;
+            
+            k = first[surf->vrefs[j]]++;
+            csurf[k] = i;
+            cref[k] = j;
+            weights[k] = acos(d);
+        }
+    }
+    
+    // The fill above moved every first[] to the start of the next vertex
+    for (i=obj->numvert; i>0; i--)
+        first[i] = first[i-1];
+    first[0] = 0;
+    
+    for (i=0; i<obj->numvert; i++) {
+        float sum[3] = { 0.0, 0.0, 0.0 };
+        
+        // Of all the corners at the vertex, flat ones included, so it is
+        // built before the loop below skips those
+        if (smooth_all) {
+            for (k=first[i]; k<first[i+1]; k++) {
+                float *fn = obj->surfs[csurf[k]]->normal;
+                sum[0] += fn[0] * weights[k];
+                sum[1] += fn[1] * weights[k];
+                sum[2] += fn[2] * weights[k];
+            }
+        }
+        
+        for (j=first[i]; j<first[i+1]; j++) {
+            AC3DSurf *surf = obj->surfs[csurf[j]];
+            float n[3];
+            
+            if (!surf->normals)
+                continue;
+            
+            if (smooth_all) {
+                n[0] = sum[0]; n[1] = sum[1]; n[2] = sum[2];
+            } else {
+                n[0] = n[1] = n[2] = 0.0;
+                for (k=first[i]; k<first[i+1]; k++) {
+                    float *fn = obj->surfs[csurf[k]]->normal;
+                    if (fn[0]*surf->normal[0] + 
+                        fn[1]*surf->normal[1] + 
+                        fn[2]*surf->normal[2] >= mincos) {
+                        n[0] += fn[0] * weights[k];
+                        n[1] += fn[1] * weights[k];
+                        n[2] += fn[2] * weights[k];
+                    }
+                }
+            }
+            
+            if (n[0]*n[0] + n[1]*n[1] + n[2]*n[2] < 0.00000001) {
+                n[0] = surf->normal[0];
+                n[1] = surf->normal[1];
+                n[2] = surf->normal[2];
+            }
+            normalize(n);
+            memcpy(surf->normals[cref[j]], n, sizeof(float)*3);
+        }
+    }
+    
+done:
+    
+    // Without the tables, fall back to flat normals
+    if (!first || !csurf || !cref || !weights) {
+        for (i=0; i<obj->numsurf; i++) {
+            AC3DSurf *surf = obj->surfs[i];
+            if (surf->normals)
+                for (j=0; j<surf->numrefs; j++)
+                    memcpy(surf->normals[j], surf->normal, sizeof(float)*3);
+        }
+    }
+    release_ac3d_arena(scratch, &mark);
+}
+
+// Reads the object header and its tags up to and including "kids", 
+// numkids is left at the count declared in the file
+static
+int read_ac3d_object_tags(AC3DLexer *lex, AC3DObject *obj, char **err) 
+{
+    double start = ac3d_time(); // of the parsing not timed yet
+    AC3DArena *scratch = obj->arena->scratch;
+    AC3DArenaMark mark, streammark;
+    int do_read = 1;
+    
+    mark_ac3d_arena(scratch, &mark);
+    mark_ac3d_arena(obj->arena->stream, &streammark);
+    
+    switch (next_ac3d_tag(lex)) {
+        case TAG_WORLD: obj->type = OBJECT_WORLD; break;
+        case TAG_POLY:  obj->type = OBJECT_POLY;  break;
+        case TAG_GROUP: obj->type = OBJECT_GROUP; break;
+        case TAG_LIGHT: obj->type = OBJECT_LIGHT; break;
+        case 0:
+            THROW( "OBJECT header failed" );
+        default:
+            THROW( "OBJECT header type failed" );
+    }
+    
+    while (do_read) {
+        
+        switch (next_ac3d_tag(lex)) {
+        
+            // ---------------------------------------
+            // NAME
+            
+            case TAG_NAME: {
+                const char *str;
+                int len = scan_ac3d_string(lex, &str);
+                
+                if (len > 0)
+                    obj->name = dup_ac3d_string(obj->arena, str, len);
+                break;
+            }
+            
+            // ---------------------------------------
+            // CREASE
+            
+            case TAG_CREASE:
+                if (!parse_ac3d_float(lex, &obj->crease))
+                    THROW( "OBJECT crease failed" );
+                break;
+            
+            // ---------------------------------------
+            // DATA
+            
+            case TAG_DATA: {
+                const char *ptr;
+                int len;
+                
+                if (!parse_ac3d_int(lex, &len))
+                    THROW( "OBJECT data len failed" );
+                
+                if (len > 0) {
+                    ptr = memchr(lex->ptr, '\n', lex->end - lex->ptr);
+                    if (!ptr || lex->end - (ptr+1) < len)
+                        THROW( "data failed" );
+                    ptr++;
+#if TARGET_IPHONE_SIMULATOR
+                    NSLog(@"data: %.*s", len, ptr);
+#endif
+                    lex->ptr = ptr + len;
+                }
+                break;
+            }
+
+            // ---------------------------------------
+            // TEXTURE
+            
+            case TAG_TEXTURE: {
+                const char *str, *ptr;
+                int len = scan_ac3d_string(lex, &str);
+                
+                if (len < 0)
+                    len = 0;
+                
+                for (ptr = str+len; ptr > str && ptr[-1] != '/'; ptr--)
+                    ;
+                len -= ptr - str;
+                
+                if (len > 0)
+                    obj->texture = dup_ac3d_string(obj->arena, ptr, len);
+                break;
+            }
+            
+            // ---------------------------------------
+            // TEXREP
+            
+            case TAG_TEXREP: {
+                float texrep[2];
+                
+                if (!parse_ac3d_floats(lex, texrep, 2))
+                    THROW( "OBJECT texrep failed" );
+                
+                obj->texrep = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*2);
+                
+                if (!obj->texrep)
+                    THROW( "malloc failed" );
+                
+                memcpy(obj->texrep, &texrep, sizeof(float)*2);
+                break;
+            }
+            
+            // ---------------------------------------
+            // TEXOFF
+            
+            case TAG_TEXOFF: {
+                float texoff[2];
+                
+                if (!parse_ac3d_floats(lex, texoff, 2))
+                    THROW( "OBJECT texoff failed" );
+                
+                obj->texoff = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*2);
+                
+                if (!obj->texoff)
+                    THROW( "malloc failed" );
+                
+                memcpy(obj->texoff, &texoff, sizeof(float)*2);
+                break;
+            }
+            
+            // ---------------------------------------
+            // ROT
+            
+            case TAG_ROT: {
+                float rot[16];
+                
+                rot[3] = 0.0;
+                rot[7] = 0.0;
+                rot[11] = 0.0;
+                rot[12] = 0.0;
+                rot[13] = 0.0;
+                rot[14] = 0.0;
+                rot[15] = 1.0;
+                
+                if (!parse_ac3d_floats(lex, &rot[0], 3) ||
+                    !parse_ac3d_floats(lex, &rot[4], 3) ||
+                    !parse_ac3d_floats(lex, &rot[8], 3))
+                    THROW( "OBJECT rot failed" );
+                
+                obj->rot = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*16);
+                
+                if (!obj->rot)
+                    THROW( "malloc failed" );
+                
+                memcpy(obj->rot, &rot, sizeof(float)*16);
+                break;
+            }
+            
+            // ---------------------------------------
+            // LOC
+            
+            case TAG_LOC: {
+                float loc[3];
+                
+                if (!parse_ac3d_floats(lex, loc, 3))
+                    THROW( "OBJECT loc failed" );
+                
+                obj->loc = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*3);
+                
+                if (!obj->loc)
+                    THROW( "malloc failed" );
+                
+                memcpy(obj->loc, &loc, sizeof(float)*3);
+                break;
+            }
+            
+            // ---------------------------------------
+            // URL
+            
+            case TAG_URL: {
+                const char *str;
+                int len = scan_ac3d_string(lex, &str);
+                
+#if TARGET_IPHONE_SIMULATOR
+                if (len >= 0)
+                    NSLog(@"url: %.*s", len, str);
+#else
+                (void)len;
+#endif          
+                break;
+            }
+            
+            // ---------------------------------------
+            // NUMVERT
+            
+            case TAG_NUMVERT: {
+                int i;
+                
+                if (!parse_ac3d_int(lex, &obj->numvert))
+                    THROW( "OBJECT numvert failed" );
+                
+                if (obj->numvert > 0) {
+                    obj->verts = (AC3DVert*)alloc_ac3d_arena(scratch, sizeof(AC3DVert)*obj->numvert);
+                    
+                    if (!obj->verts)
+                        THROW( "malloc failed" );
+                    
+                    for (i=0; i<obj->numvert; i++) {
+                        if (!parse_ac3d_floats(lex, obj->verts[i], 3))
+                            THROW( "OBJECT vert failed" );
+                    }
+                }
+                break;
+            }
+            
+            // ---------------------------------------
+            // NUMSURF
+            
+            case TAG_NUMSURF: {
+                int i;
+                
+                if (!parse_ac3d_int(lex, &obj->numsurf))
+                    THROW( "OBJECT numsurf failed" );      
+                
+                if (obj->numsurf > 0) {
+                    obj->surfs = (AC3DSurf**)alloc_ac3d_arena(scratch, sizeof(AC3DSurf*)*obj->numsurf);
+                    
+                    if (!obj->surfs)
+                        THROW( "malloc failed" );
+                    
+                    memset(obj->surfs, 0, sizeof(AC3DSurf*)*obj->numsurf);
+                    
+                    for (i=0; i<obj->numsurf; i++) {
+                        AC3DSurf *surf = read_ac3d_surf(lex, obj, err);
+                        
+                        if (!surf)
+                            THROW( *err );
+                        
+                        obj->surfs[i] = surf;
+                        
+                        if ((surf->type & 0x0f) <= SURF_LINE)
+                            obj->stats.surfaces[surf->type & 0x0f]++;
+                        if ((surf->type & 0x0f) == SURF_POLYGON && surf->numrefs > 2)
+                            obj->stats.triangles += surf->numrefs-2;
+                    }
+                    
+                    if (!obj->name || strcmp(obj->name, "rotate")) {
+                        obj->stats.time[AC3D_PHASE_PARSE] += ac3d_time() - start;
+                        TIME_PHASE(AC3D_PHASE_NORMALS, make_normals(obj));
+                        TIME_PHASE(AC3D_PHASE_STRIPS, strip_ac3d_object(obj));
+                        TIME_PHASE(AC3D_PHASE_STREAM, optimize_ac3d_object_step_2(obj));
+                        release_ac3d_arena(scratch, &mark);
+                        // Flattened trees are finished once merged, their
+                        // streams are kept until then
+                        if (!obj->arena->options->dynamic_names) {
+                            finish_ac3d_object(obj);
+                            release_ac3d_arena(obj->arena->stream, &streammark);
+                        }
+                        start = ac3d_time();
+                    }
+                }
+                break;
+            }
+            
+            // ---------------------------------------
+            // KIDS
+            
+            case TAG_KIDS:
+                
+                if (!parse_ac3d_int(lex, &obj->numkids) || obj->numkids < 0)
+                    THROW( "OBJECT kids failed" );
+                
+                // Objects not cooked, as "rotate", keep their verts
+                if (obj->verts) {
+                    obj->verts = (AC3DVert*)dup_ac3d_arena(obj->arena, obj->verts, sizeof(AC3DVert)*obj->numvert);
+                    if (!obj->verts)
+                        THROW( "malloc failed" );
+                }
+                obj->surfs = NULL;
+                release_ac3d_arena(scratch, &mark);
+                
+                obj->stats.time[AC3D_PHASE_PARSE] += ac3d_time() - start;
+                do_read = 0; // done
+                break;
+            
+            case 0:
+                THROW( "OBJECT tag failed" );
+            
+            default:
+                THROW( "OBJECT unknown tag" );
+        }
+        
+    }
+    
+    return 1;
+    
+CATCH_ERROR:
+    
+    return 0;
+}
+
+// Takes over a parsed kid, the magic "rotate" child becomes the rotation
+// axis of obj and lights are dropped
+static
+void add_ac3d_kid(AC3DObject *obj, AC3DObject *kid)
+{
+    if (kid->name && !strcmp(kid->name, "rotate")) {
+        if (!obj->rotvec && (obj->rotvec = (float*)alloc_ac3d_arena(obj->arena, sizeof(float)*6))) {
+            obj->rotvec[0] = kid->verts[1][0] - kid->verts[0][0];
+            obj->rotvec[1] = kid->verts[1][1] - kid->verts[0][1];
+            obj->rotvec[2] = kid->verts[1][2] - kid->verts[0][2];
+            if (kid->loc) {
+                obj->rotvec[3] = kid->loc[0] + kid->verts[0][0];
+                obj->rotvec[4] = kid->loc[1] + kid->verts[0][1];
+                obj->rotvec[5] = kid->loc[2] + kid->verts[0][2];
+            } else {
+                obj->rotvec[3] = kid->verts[0][0];
+                obj->rotvec[4] = kid->verts[0][1];
+                obj->rotvec[5] = kid->verts[0][2];
+            }
+        }
+    } else if (kid->type != OBJECT_LIGHT) {
+        obj->kids[obj->numkids++] = kid;
+        if (kid->bbox) {
+            check_object_bbox(obj, &kid->bbox[0]);
+            check_object_bbox(obj, &kid->bbox[3]);
+        }
+    }
+}
+
+static
+AC3DObject *read_ac3d_object(AC3DLexer *lex, AC3DArena *arena, char **err) 
+{
+    AC3DObject *obj = (AC3DObject*)alloc_ac3d_arena(arena, sizeof(AC3DObject));
+    int numkids;
+    
+    if (!obj)
+        THROW( "malloc failed" );
+    
+    memset(obj, 0, sizeof(AC3DObject));
+    obj->arena = arena;
+    obj->texid = -1;
+    obj->enabled = true;
+    obj->crease = 180.0;
+    
+    if (!read_ac3d_object_tags(lex, obj, err))
+        THROW( *err );
+    
+    numkids = obj->numkids;
+    obj->numkids = 0;
+    
+    if (numkids > 0) {
+        int i;
+        
+        obj->kids = (AC3DObject**)calloc_ac3d_arena(arena, numkids, sizeof(AC3DObject*));
+        
+        if (!obj->kids)
+            THROW( "malloc failed" );
+        
+        for (i=0; i<numkids; i++) {
+            AC3DObject *kid;
+            
+            if (next_ac3d_tag(lex) != TAG_OBJECT)
+                THROW( "OBJECT kid object failed" );
+            
+            kid = read_ac3d_object(lex, arena, err);
+            
+            if (kid)
+                ;//printf("Read object %s\n", kid->name ? kid->name : "unamed");
+            else
+                THROW( *err );
+            
+            add_ac3d_kid(obj, kid);
+        }
+    }
+    fix_object_bbox(obj);
+    
+    return obj;
+    
+CATCH_ERROR:
+    
+    return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Parallel loading
+//
+// A quick pre-scan splits the object tree into one job per OBJECT. The
+// jobs only parse and cook their own object (up to "kids"), so they are
+// independent and are run on a pool of threads, biggest first. The tree
+// is then put together on the calling thread in the same order as the
+// serial reader, so the result does not depend on the scheduling.
+
+typedef struct {
+    const char *start;   // just after the OBJECT tag
+    const char *stop;    // where parsing of this object ended
+    size_t      size;    // bytes up to the next OBJECT, for scheduling
+    int         parent;
+    int         numkids;
+    int         firstkid;
+    AC3DObject *obj;
+    char       *err;
+} AC3DObjectJob;
+
+typedef struct {
+    AC3DObjectJob  *jobs;
+    AC3DObjectJob **order;
+    int            numjobs;
+    volatile int   next;
+    const char    *end;
+} AC3DJobQueue;
+
+// Each thread reads into an arena of its own
+typedef struct {
+    AC3DJobQueue *queue;
+    AC3DArena    *arena;
+    pthread_t     thread;
+} AC3DJobWorker;
+
+// Skips the rest of the current line and count more lines
+static
+int skip_ac3d_lines(AC3DLexer *lex, int count)
+{
+    const char *p = lex->ptr;
+    
+    for (; count >= 0; count--) {
+        p = memchr(p, '\n', lex->end - p);
+        if (!p) {
+            if (count > 0)
+                return 0;
+            p = lex->end;
+            break;
+        }
+        p++;
+    }
+    lex->ptr = p;
+    return 1;
+}
+
+// Skims over an object up to "kids" without parsing its data, vertices
+// and refs are taken to be one per line as written by AC3D
+static
+int scan_ac3d_object(AC3DLexer *lex, int *numkids)
+{
+    const char *str;
+    int i, n;
+    
+    for (;;) {
+        switch (next_ac3d_tag(lex)) {
+            case TAG_NAME:
+            case TAG_TEXTURE:
+            case TAG_URL:
+                if (scan_ac3d_string(lex, &str) < 0)
+                    return 0;
+                break;
+                
+            case TAG_DATA:
+                if (!parse_ac3d_int(lex, &n))
+                    return 0;
+                if (n > 0) {
+                    str = memchr(lex->ptr, '\n', lex->end - lex->ptr);
+                    if (!str || lex->end - (str+1) < n)
+                        return 0;
+                    lex->ptr = str + 1 + n;
+                }
+                break;
+                
+            case TAG_NUMVERT:
+                if (!parse_ac3d_int(lex, &n) || !skip_ac3d_lines(lex, n))
+                    return 0;
+                break;
+                
+            case TAG_NUMSURF:
+                if (!parse_ac3d_int(lex, &n))
+                    return 0;
+                for (i=0; i<n; i++) {
+                    uint64_t tag;
+                    int refs;
+                    while ((tag = next_ac3d_tag(lex)) != TAG_REFS)
+                        if (!tag || tag == TAG_KIDS || tag == TAG_OBJECT)
+                            return 0;
+                    if (!parse_ac3d_int(lex, &refs) || !skip_ac3d_lines(lex, refs))
+                        return 0;
+                }
+                break;
+                
+            case TAG_KIDS:
+                return parse_ac3d_int(lex, numkids) && *numkids >= 0;
+                
+            case 0:
+                return 0;
+                
+            default:
+                break;
+        }
+    }
+}
+
+static
+AC3DObjectJob *scan_ac3d_objects(AC3DLexer *lex, int *numjobs)
+{
+    AC3DObjectJob *jobs = NULL;
+    int *stack = NULL;       // jobs with kids left to scan
+    int *left = NULL;
+    int depth = 0;
+    int count = 0;
+    int capacity = 0;
+    
+    for (;;) {
+        AC3DObjectJob *job;
+        
+        if (count == capacity) {
+            AC3DObjectJob *tmp1;
+            int *tmp2, *tmp3;
+            capacity = capacity ? capacity*2 : 64;
+            tmp1 = (AC3DObjectJob*)realloc(jobs, sizeof(AC3DObjectJob)*capacity);
+            if (tmp1) jobs = tmp1;
+            tmp2 = (int*)realloc(stack, sizeof(int)*capacity);
+            if (tmp2) stack = tmp2;
+            tmp3 = (int*)realloc(left, sizeof(int)*capacity);
+            if (tmp3) left = tmp3;
+            if (!tmp1 || !tmp2 || !tmp3)
+                goto fail;
+        }
+        
+        job = &jobs[count];
+        memset(job, 0, sizeof(AC3DObjectJob));
+        job->start = lex->ptr;
+        job->parent = depth ? stack[depth-1] : -1;
+        
+        if (!scan_ac3d_object(lex, &job->numkids))
+            goto fail;
+        
+        if (depth)
+            left[depth-1]--;
+        
+        if (job->numkids > 0) {
+            stack[depth] = count;
+            left[depth] = job->numkids;
+            depth++;
+        }
+        count++;
+        
+        while (depth && !left[depth-1])
+            depth--;
+        
+        if (!depth)
+            break;
+        
+        if (next_ac3d_tag(lex) != TAG_OBJECT)
+            goto fail;
+    }
+    
+    free(stack);
+    free(left);
+    *numjobs = count;
+    return jobs;
+    
+fail:
+    
+    free(jobs);
+    free(stack);
+    free(left);
+    return NULL;
+}
+
+static
+void *run_ac3d_object_jobs(void *arg)
+{
+    AC3DJobWorker *worker = (AC3DJobWorker*)arg;
+    AC3DJobQueue *queue = worker->queue;
+    int i;
+    
+    while ((i = __sync_fetch_and_add(&queue->next, 1)) < queue->numjobs) {
+        AC3DObjectJob *job = queue->order[i];
+        AC3DLexer lexer;
+        AC3DObject *obj = (AC3DObject*)alloc_ac3d_arena(worker->arena, sizeof(AC3DObject));
+        
+        if (!obj) {
+            job->err = "malloc failed";
+            continue;
+        }
+        
+        memset(obj, 0, sizeof(AC3DObject));
+        obj->arena = worker->arena;
+        obj->texid = -1;
+        obj->enabled = true;
+        obj->crease = 180.0;
+        
+        lexer.ptr = job->start;
+        lexer.end = queue->end;
+        
+        if (read_ac3d_object_tags(&lexer, obj, &job->err)) 
+            job->stop = lexer.ptr;
+        else if (!job->err)
+            job->err = "OBJECT failed";
+        
+        job->obj = obj;
+    }
+    
+    return NULL;
+}
+
+static
+int compare_ac3d_jobs(const void *a, const void *b)
+{
+    const AC3DObjectJob *ja = *(AC3DObjectJob* const*)a;
+    const AC3DObjectJob *jb = *(AC3DObjectJob* const*)b;
+    if (ja->size != jb->size)
+        return ja->size < jb->size ? 1 : -1;
+    return ja < jb ? -1 : 1;
+}
+
+// Returns NULL with *err unset when the file could not be split up, the
+// caller then falls back to the serial reader. The arenas of the threads
+// are chained to arena once it worked out
+static
+AC3DObject *read_ac3d_object_parallel(AC3DLexer *lex, AC3DArena *arena, int threads, char **err)
+{
+    AC3DLexer scan = *lex;
+    AC3DJobQueue queue;
+    AC3DJobWorker *workers = NULL;
+    AC3DObject *root = NULL;
+    int numworkers = 0, numthreads = 0;
+    int i, j;
+    
+    memset(&queue, 0, sizeof(queue));
+    queue.end = lex->end;
+    queue.jobs = scan_ac3d_objects(&scan, &queue.numjobs);
+    
+    if (!queue.jobs)
+        return NULL;
+    
+    if (queue.numjobs < 2)
+        goto done;
+    
+    queue.order = (AC3DObjectJob**)malloc(sizeof(AC3DObjectJob*)*queue.numjobs);
+    if (!queue.order)
+        goto done;
+    
+    for (i=0; i<queue.numjobs; i++) {
+        const char *next = i+1 < queue.numjobs ? queue.jobs[i+1].start : scan.ptr;
+        queue.jobs[i].size = next - queue.jobs[i].start;
+        queue.order[i] = &queue.jobs[i];
+    }
+    
+    qsort(queue.order, queue.numjobs, sizeof(AC3DObjectJob*), compare_ac3d_jobs);
+    
+    if (threads > queue.numjobs)
+        threads = queue.numjobs;
+    
+    workers = (AC3DJobWorker*)calloc(threads, sizeof(AC3DJobWorker));
+    if (!workers)
+        goto done;
+    for (numworkers=0; numworkers<threads; numworkers++) {
+        workers[numworkers].queue = &queue;
+        workers[numworkers].arena = new_ac3d_arena(arena->ctx, arena->options);
+        if (!workers[numworkers].arena)
+            break;
+    }
+    if (!numworkers)
+        goto done;
+    
+    for (i=1; i<numworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_ac3d_object_jobs, &workers[i]))
+            break;
+        numthreads++;
+    }
+    
+    run_ac3d_object_jobs(&workers[0]);
+    
+    for (i=1; i<=numthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    
+    // The first error in file order wins, as with the serial reader
+    for (i=0; i<queue.numjobs; i++) {
+        if (queue.jobs[i].err) {
+            *err = queue.jobs[i].err;
+            goto done;
+        }
+    }
+    
+    // The scan guessed the object boundaries, check that every object 
+    // ended right where the next OBJECT begins
+    for (i=0; i<queue.numjobs; i++) {
+        AC3DObjectJob *job = &queue.jobs[i];
+        if (job->obj->numkids != job->numkids)
+            goto done;
+        if (i+1 < queue.numjobs) {
+            AC3DLexer check;
+            check.ptr = job->stop;
+            check.end = lex->end;
+            if (next_ac3d_tag(&check) != TAG_OBJECT || check.ptr != queue.jobs[i+1].start)
+                goto done;
+        }
+    }
+    
+    // Kids of job i are the jobs that name it as parent, in file order.
+    // Going backwards every subtree is complete before its parent takes
+    // it over.
+    for (i=0; i<queue.numjobs; i++) 
+        queue.jobs[i].firstkid = -1;
+    for (i=queue.numjobs-1; i>0; i--) 
+        queue.jobs[queue.jobs[i].parent].firstkid = i;
+    
+    for (i=queue.numjobs-1; i>=0; i--) {
+        AC3DObjectJob *job = &queue.jobs[i];
+        AC3DObject *obj = job->obj;
+        
+        obj->numkids = 0;
+        if (job->numkids > 0) {
+            obj->kids = (AC3DObject**)calloc_ac3d_arena(obj->arena, job->numkids, sizeof(AC3DObject*));
+            if (!obj->kids) {
+                *err = "malloc failed";
+                goto done;
+            }
+            for (j=job->firstkid; j<queue.numjobs && queue.jobs[j].parent >= i; j++) {
+                if (queue.jobs[j].parent == i) {
+                    add_ac3d_kid(obj, queue.jobs[j].obj);
+                    queue.jobs[j].obj = NULL;
+                }
+            }
+        }
+        fix_object_bbox(obj);
+    }
+    
+    root = queue.jobs[0].obj;
+    lex->ptr = queue.jobs[queue.numjobs-1].stop;
+    
+done:
+    
+    for (i=0; i<numworkers; i++) {
+        if (root)
+            chain_ac3d_arena(arena, workers[i].arena);
+        else
+            free_ac3d_arena(workers[i].arena);
+    }
+    free(queue.jobs);
+    free(queue.order);
+    free(workers);
+    return root;
+}
+
+// ----------------------------------------------------------------------
+// Texture cache
+//
+// The textures of a context are kept by the path they were loaded from,
+// so a name and its Textures/ fallback are one texture, and by the name
+// first asked for, so later lookups skip the search. Atlases are kept by
+// their name. A file holds one reference on each texture it uses until
+// it is freed. The list has the most recently used or released first,
+// textures no file uses are freed from its tail while the cache is over
+// its budget, and by free_ac3d_textures.
+
+#ifndef AC3D_HEADLESS
+
+struct AC3DTextureEntry_s {
+    char                      *name;    // first asked for
+    char                      *path;    // loaded from, NULL for atlases
+    AC3DTexture               *texture;
+    size_t                     bytes;
+    int                        refs;    // files using it
+    struct AC3DTextureEntry_s *prev;
+    struct AC3DTextureEntry_s *next;
+};
+
+static
+size_t get_ac3d_texture_size(AC3DTexture *texture)
+{
+    size_t bits;
+
+    switch ([texture pixelFormat]) {
+        case kAC3DTexturePixelFormat_RGBA8888:    bits = 32; break;
+        case kAC3DTexturePixelFormat_RGB888:      bits = 24; break;
+        case kAC3DTexturePixelFormat_L8:
+        case kAC3DTexturePixelFormat_A8:          bits = 8;  break;
+        case kAC3DTexturePixelFormat_RGB_PVRTC2:
+        case kAC3DTexturePixelFormat_RGBA_PVRTC2: bits = 2;  break;
+        case kAC3DTexturePixelFormat_RGB_PVRTC4:
+        case kAC3DTexturePixelFormat_RGBA_PVRTC4: bits = 4;  break;
+        default:                                  bits = 16; break;
+    }
+    bits *= (size_t)[texture pixelsWide] * [texture pixelsHigh];
+    if ([texture mipmapLevels] > 1)
+        bits += bits / 3;
+    return bits / 8;
+}
+
+static
+void unlink_ac3d_texture(AC3DContext *ctx, AC3DTextureEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        ctx->lru = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        ctx->lrutail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static
+void touch_ac3d_texture(AC3DContext *ctx, AC3DTextureEntry *e)
+{
+    if (ctx->lru == e)
+        return;
+    if (e->prev || e->next || ctx->lrutail == e)
+        unlink_ac3d_texture(ctx, e);
+    e->next = ctx->lru;
+    if (ctx->lru)
+        ctx->lru->prev = e;
+    ctx->lru = e;
+    if (!ctx->lrutail)
+        ctx->lrutail = e;
+}
+
+// Drops a key only when it is the one of e
+static
+void remove_ac3d_texture_key(AC3DContext *ctx, const char *key, AC3DTextureEntry *e)
+{
+    NSString *k;
+
+    if (!key)
+        return;
+    k = [NSString stringWithFormat:@"%s", key];
+    if ([[ctx->textures objectForKey:k] pointerValue] == e)
+        [ctx->textures removeObjectForKey:k];
+}
+
+static
+void evict_ac3d_texture(AC3DContext *ctx, AC3DTextureEntry *e)
+{
+    unlink_ac3d_texture(ctx, e);
+    remove_ac3d_texture_key(ctx, e->name, e);
+    remove_ac3d_texture_key(ctx, e->path, e);
+    ctx->texstats.bytes -= e->bytes;
+    ctx->texstats.textures--;
+    ctx->texstats.evictions++;
+    [e->texture release];
+    free(e->name);
+    free(e->path);
+    free(e);
+}
+
+// Frees the textures no file uses, least recently used first, until the
+// cache is within budget bytes
+static
+void trim_ac3d_textures(AC3DContext *ctx, size_t budget)
+{
+    AC3DTextureEntry *e = ctx->lrutail;
+
+    while (e && ctx->texstats.bytes > budget) {
+        AC3DTextureEntry *prev = e->prev;
+        if (!e->refs)
+            evict_ac3d_texture(ctx, e);
+        e = prev;
+    }
+}
+
+// The cached texture of name, NULL when it is not loaded
+static
+AC3DTextureEntry *find_ac3d_texture(AC3DContext *ctx, const char *name)
+{
+    char path[1024];
+    AC3DTextureEntry *e;
+
+    if (!ctx->textures || !name)
+        return NULL;
+    e = (AC3DTextureEntry*)[[ctx->textures objectForKey:[NSString stringWithFormat:@"%s", name]] pointerValue];
+    if (!e && !is_ac3d_atlas(name) && resolve_ac3d_texture_path(name, path, sizeof(path)))
+        e = (AC3DTextureEntry*)[[ctx->textures objectForKey:[NSString stringWithFormat:@"%s", path]] pointerValue];
+    return e;
+}
+
+// Puts an atlas together from the images it was packed from
+static
+AC3DTexture *new_ac3d_atlas_texture(AC3DFile *file, const char *name)
+{
+    AC3DTextureFunc source = file->atlas_texture;
+    void *userdata = file->atlas_userdata;
+    unsigned char *pixels = NULL, *rgba;
+    AC3DTexture *texture = nil;
+    int width, height;
+
+    if (!source) {
+        source = read_ac3d_bundle_image;
+        userdata = &pixels;
+    }
+    rgba = compose_ac3d_atlas(name, source, userdata, &width, &height);
+    free(pixels);
+    if (rgba)
+        texture = [[AC3DTexture alloc] initWithData:rgba 
+                                        pixelFormat:kAC3DTexturePixelFormat_RGBA8888
+                                         pixelsWide:width 
+                                         pixelsHigh:height 
+                                        contentSize:CGSizeMake(width, height)
+                                       mipmapFilter:(AC3DTextureMipmapFilter)file->ctx->mipmaps];
+    free(rgba);
+    return texture;
+}
+
+// Finds or loads the texture name for file and holds a reference on it
+// for the file, NULL when it can not be loaded
+static
+AC3DTextureEntry *acquire_ac3d_texture(AC3DFile *file, const char *name)
+{
+    AC3DContext *ctx = file->ctx;
+    AC3DTextureEntry *e, **textures;
+    char path[1024];
+    int i;
+
+    init_ac3d_textures(ctx);
+
+    e = (AC3DTextureEntry*)[[ctx->textures objectForKey:[NSString stringWithFormat:@"%s", name]] pointerValue];
+    if (!e) {
+        AC3DTexture *texture = nil;
+        int atlas = is_ac3d_atlas(name);
+
+        if (!atlas) {
+            if (!resolve_ac3d_texture_path(name, path, sizeof(path)))
+                return NULL;
+            e = (AC3DTextureEntry*)[[ctx->textures objectForKey:[NSString stringWithFormat:@"%s", path]] pointerValue];
+        }
+        if (!e) {
+            if (atlas)
+                texture = new_ac3d_atlas_texture(file, name);
+            else
+                texture = [[AC3DTexture alloc] initWithImagePath:[NSString stringWithFormat:@"%s", path]
+                                                       sizeToFit:NO
+                                                     pixelFormat:kAC3DTexturePixelFormat_Automatic
+                                                    mipmapFilter:(AC3DTextureMipmapFilter)ctx->mipmaps];
+            if (!texture)
+                return NULL;
+
+            e = (AC3DTextureEntry*)calloc(1, sizeof(AC3DTextureEntry));
+            if (!e || !(e->name = strdup(name)) || (!atlas && !(e->path = strdup(path)))) {
+                if (e)
+                    free(e->name);
+                free(e);
+                [texture release];
+                return NULL;
+            }
+            e->texture = texture;
+            e->bytes = get_ac3d_texture_size(texture);
+            [ctx->textures setObject:[NSValue valueWithPointer:e] 
+                              forKey:[NSString stringWithFormat:@"%s", name]];
+            if (e->path)
+                [ctx->textures setObject:[NSValue valueWithPointer:e] 
+                                  forKey:[NSString stringWithFormat:@"%s", path]];
+            ctx->texstats.bytes += e->bytes;
+            ctx->texstats.textures++;
+            ctx->texstats.misses++;
+        } else {
+            ctx->texstats.hits++;
+        }
+    } else {
+        ctx->texstats.hits++;
+    }
+    touch_ac3d_texture(ctx, e);
+
+    for (i=0; i<file->numtextures; i++)
+        if (file->textures[i] == e)
+            break;
+    if (i == file->numtextures) {
+        // Grown a power of two at a time
+        if (!(file->numtextures & (file->numtextures-1))) {
+            textures = (AC3DTextureEntry**)realloc(file->textures, sizeof(AC3DTextureEntry*) * 
+                                                   (file->numtextures ? file->numtextures*2 : 1));
+            if (!textures)
+                return NULL;
+            file->textures = textures;
+        }
+        file->textures[file->numtextures++] = e;
+        e->refs++;
+    }
+
+    if (ctx->texstats.budget)
+        trim_ac3d_textures(ctx, ctx->texstats.budget);
+    return e;
+}
+
+// Called by free_ac3d_file, the textures it used go to the front of the
+// list as just used
+static
+void release_ac3d_file_textures(AC3DFile *file)
+{
+    AC3DContext *ctx = file->ctx;
+    int i;
+
+    for (i=0; i<file->numtextures; i++) {
+        file->textures[i]->refs--;
+        touch_ac3d_texture(ctx, file->textures[i]);
+    }
+    free(file->textures);
+    file->textures = NULL;
+    file->numtextures = 0;
+
+    if (ctx->texstats.budget)
+        trim_ac3d_textures(ctx, ctx->texstats.budget);
+}
+
+void free_ac3d_textures_ctx(AC3DContext *ctx)
+{
+    trim_ac3d_textures(ctx, 0);
+}
+
+void free_ac3d_textures()
+{
+    free_ac3d_textures_ctx(&default_context);
+}
+
+// The texture of obj alone, for file
+static
+void load_texture_ac3d_object(AC3DObject *obj, AC3DFile *file)
+{
+    if (obj->texture && !obj->texture_loaded) {
+        AC3DTextureEntry *e = acquire_ac3d_texture(file, obj->texture);
+        if (e)
+            obj->texid = [e->texture name];
+        obj->texture_loaded = 1;
+    }
+}
+
+static
+void load_textures_ac3d_object(AC3DObject *obj, AC3DFile *file)
+{
+    int i;
+    load_texture_ac3d_object(obj, file);
+    for (i=0; i<obj->numkids; i++) 
+        load_textures_ac3d_object(obj->kids[i], file);
+}
+
+#endif // AC3D_HEADLESS
+
+void set_ac3d_texture_budget_ctx(AC3DContext *ctx, size_t bytes)
+{
+    ctx->texstats.budget = bytes;
+#ifndef AC3D_HEADLESS
+    if (bytes)
+        trim_ac3d_textures(ctx, bytes);
+#endif
+}
+
+void set_ac3d_texture_budget(size_t bytes)
+{
+    set_ac3d_texture_budget_ctx(&default_context, bytes);
+}
+
+void set_ac3d_texture_mipmaps_ctx(AC3DContext *ctx, int mipmaps)
+{
+    ctx->mipmaps = mipmaps;
+}
+
+void set_ac3d_texture_mipmaps(int mipmaps)
+{
+    set_ac3d_texture_mipmaps_ctx(&default_context, mipmaps);
+}
+
+void get_ac3d_texture_stats_ctx(AC3DContext *ctx, AC3DTextureStats *stats)
+{
+    *stats = ctx->texstats;
+    stats->unused = 0;
+    stats->unused_bytes = 0;
+#ifndef AC3D_HEADLESS
+    {
+        AC3DTextureEntry *e;
+        for (e = ctx->lru; e; e = e->next) {
+            if (!e->refs) {
+                stats->unused++;
+                stats->unused_bytes += e->bytes;
+            }
+        }
+    }
+#endif
+}
+
+void get_ac3d_texture_stats(AC3DTextureStats *stats)
+{
+    get_ac3d_texture_stats_ctx(&default_context, stats);
+}
+
+// ----------------------------------------------------------------------
+// Cooked model cache (.acb)
+//
+// The cache holds the finished optcmd streams, the object hierarchy and
+// the materials, so a load is a single mmap and a walk over the chunks
+// below. The optcmd streams are used in place from the mapping.
+//
+// Layout: AC3DCacheHeader followed by chunks of {tag, len, data} where
+// data is padded to 4 bytes. Materials come first as MATL chunks, then
+// the object tree in depth first order. Each object is OBJB (type and
+// number of kids), its attribute chunks, OBJE, then its kids. Unknown
+// chunks are skipped.
+
+#define AC3D_CACHE_VERSION 8
+#define AC3D_FOURCC(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+
+enum {
+    CHUNK_MATL = AC3D_FOURCC('M','A','T','L'),
+    CHUNK_OBJB = AC3D_FOURCC('O','B','J','B'),
+    CHUNK_OBJE = AC3D_FOURCC('O','B','J','E'),
+    CHUNK_NAME = AC3D_FOURCC('N','A','M','E'),
+    CHUNK_TEXN = AC3D_FOURCC('T','E','X','N'),
+    CHUNK_TREP = AC3D_FOURCC('T','R','E','P'),
+    CHUNK_TOFF = AC3D_FOURCC('T','O','F','F'),
+    CHUNK_ROT  = AC3D_FOURCC('R','O','T',' '),
+    CHUNK_LOC  = AC3D_FOURCC('L','O','C',' '),
+    CHUNK_RVEC = AC3D_FOURCC('R','V','E','C'),
+    CHUNK_BBOX = AC3D_FOURCC('B','B','O','X'),
+    CHUNK_CMDS = AC3D_FOURCC('C','M','D','S'),
+    CHUNK_QUAN = AC3D_FOURCC('Q','U','A','N'),
+    CHUNK_VERT = AC3D_FOURCC('V','E','R','T'),
+    CHUNK_INDX = AC3D_FOURCC('I','N','D','X'),
+    CHUNK_IDX4 = AC3D_FOURCC('I','D','X','4'),
+    CHUNK_BTCH = AC3D_FOURCC('B','T','C','H'),
+    CHUNK_STAT = AC3D_FOURCC('S','T','A','T')
+};
+
+typedef struct {
+    char    magic[4];   // "ACB\0"
+    int32_t version;
+    int32_t byteorder;  // 0x01020304 in the writers byte order
+    int32_t cmdsize;    // sizeof(AC3Doptcmd)
+    int64_t srcmtime;   // mtime of the .ac file the cache was cooked from
+    int64_t srcsize;    // size of the .ac file the cache was cooked from
+    int32_t nummats;
+    int32_t cookkey;    // load options the streams were cooked with
+} AC3DCacheHeader;
+
+typedef struct {
+    int32_t tag;
+    int32_t len;
+} AC3DCacheChunk;
+
+// Only the options that change the cooked streams go in here, the
+// strip_budget not, a file it cut short is not cached
+static
+int32_t make_ac3d_cook_key(const AC3DLoadOptions *options)
+{
+    uint32_t key = options->strips | (options->cook << 8);
+    
+    if (options->index32)
+        key |= 0x8000;
+    key |= (options->quantize & AC3D_QUANTIZE_ALL) << 12;
+    
+    if (options->dynamic_names || options->atlas) {
+        const char * const *name;
+        uint32_t h = 2166136261u;
+        for (name = options->dynamic_names; name && *name; name++) {
+            const char *c;
+            for (c = *name; *c; c++)
+                h = (h ^ (uint8_t)*c) * 16777619u;
+            h = (h ^ 0xff) * 16777619u;
+        }
+        if (options->atlas)
+            h = (h ^ (uint32_t)options->atlas) * 16777619u;
+        key |= (h << 17) | 0x10000;
+    }
+    return (int32_t)key;
+}
+
+// Returns 0 when the name does not fit, truncated it could be the .ac
+static
+int make_ac3d_cache_path(char *dst, size_t size, const char *filename)
+{
+    size_t len = strlen(filename);
+    int n;
+    if (len > 3 && !strcmp(filename+len-3, ".ac"))
+        n = snprintf(dst, size, "%sb", filename);
+    else
+        n = snprintf(dst, size, "%s.acb", filename);
+    return n >= 0 && (size_t)n < size;
+}
+
+static
+int write_ac3d_cache_chunk(FILE *fp, int tag, const void *data, int len)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    AC3DCacheChunk chunk;
+    int pad = (4 - (len & 3)) & 3;
+    
+    chunk.tag = tag;
+    chunk.len = len;
+    
+    if (fwrite(&chunk, sizeof(chunk), 1, fp) != 1)
+        return 0;
+    if (len > 0 && fwrite(data, len, 1, fp) != 1)
+        return 0;
+    if (pad && fwrite(zeros, pad, 1, fp) != 1)
+        return 0;
+    return 1;
+}
+
+static
+int write_ac3d_cache_object(FILE *fp, AC3DObject *obj)
+{
+    int32_t head[2];
+    int i;
+    
+    head[0] = obj->type;
+    head[1] = obj->numkids;
+    
+    if (!write_ac3d_cache_chunk(fp, CHUNK_OBJB, head, sizeof(head)))
+        return 0;
+
+#define WRITE_CHUNK( _tag, _ptr, _len ) \
+    if ((_ptr) && !write_ac3d_cache_chunk(fp, _tag, _ptr, _len)) return 0
+    WRITE_CHUNK( CHUNK_NAME, obj->name, obj->name ? (int)strlen(obj->name)+1 : 0 );
+    WRITE_CHUNK( CHUNK_TEXN, obj->texture, obj->texture ? (int)strlen(obj->texture)+1 : 0 );
+    WRITE_CHUNK( CHUNK_TREP, obj->texrep, sizeof(float)*2 );
+    WRITE_CHUNK( CHUNK_TOFF, obj->texoff, sizeof(float)*2 );
+    WRITE_CHUNK( CHUNK_ROT,  obj->rot,    sizeof(float)*16 );
+    WRITE_CHUNK( CHUNK_LOC,  obj->loc,    sizeof(float)*3 );
+    WRITE_CHUNK( CHUNK_RVEC, obj->rotvec, sizeof(float)*6 );
+    WRITE_CHUNK( CHUNK_BBOX, obj->bbox,   sizeof(float)*6 );
+    WRITE_CHUNK( CHUNK_CMDS, obj->numcmds > 0 ? obj->optcmds : NULL, sizeof(AC3Doptcmd)*obj->numcmds );
+    WRITE_CHUNK( CHUNK_QUAN, obj->quant,  sizeof(AC3DQuant) );
+    WRITE_CHUNK( CHUNK_VERT, obj->vertices, sizeof(AC3Doptcmd)*AC3D_INDEXED_STRIDE(obj)*obj->numvertices );
+    WRITE_CHUNK( obj->indexsize == 4 ? CHUNK_IDX4 : CHUNK_INDX, obj->indices, obj->indexsize*obj->numindices );
+    WRITE_CHUNK( CHUNK_BTCH, obj->batches, sizeof(AC3DBatch)*obj->numbatches );
+    WRITE_CHUNK( CHUNK_STAT, &obj->stats, sizeof(AC3DObjectStats) );
+#undef WRITE_CHUNK
+    
+    if (!write_ac3d_cache_chunk(fp, CHUNK_OBJE, NULL, 0))
+        return 0;
+    
+    for (i=0; i<obj->numkids; i++)
+        if (!write_ac3d_cache_object(fp, obj->kids[i]))
+            return 0;
+    
+    return 1;
+}
+
+static
+void write_ac3d_cache(AC3DFile *file, const char *cachename, struct stat *src,
+                      const AC3DLoadOptions *options)
+{
+    char tmpname[1024];
+    AC3DCacheHeader header;
+    FILE *fp;
+    int i, n, ok = 1;
+    
+    // Write to a temporary and rename it in place so a reader never sees
+    // a half written cache, named after the file as well for loads of
+    // the same model on other threads. Failing is fine, e.g. a read only
+    // bundle, and so is a name too long for tmpname.
+    n = snprintf(tmpname, sizeof(tmpname), "%s.%d.%p", cachename, (int)getpid(), (void*)file);
+    if (n < 0 || (size_t)n >= sizeof(tmpname))
+        return;
+    fp = fopen(tmpname, "wb");
+    if (!fp)
+        return;
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ACB", 4);
+    header.version = AC3D_CACHE_VERSION;
+    header.byteorder = 0x01020304;
+    header.cmdsize = sizeof(AC3Doptcmd);
+    header.srcmtime = src->st_mtime;
+    header.srcsize = src->st_size;
+    header.nummats = file->nummats;
+    header.cookkey = make_ac3d_cook_key(options);
+    
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        ok = 0;
+    
+    for (i=0; ok && i<file->nummats; i++) {
+        AC3DMaterial *mat = file->mats[i];
+        int namelen = mat->name ? (int)strlen(mat->name)+1 : 0;
+        char buf[sizeof(float)*17 + 256];
+        
+        if (namelen > 256)
+            namelen = 0;
+        memcpy(buf, mat->rgb, sizeof(float)*4);
+        memcpy(buf+sizeof(float)*4, mat->amb, sizeof(float)*4);
+        memcpy(buf+sizeof(float)*8, mat->emis, sizeof(float)*4);
+        memcpy(buf+sizeof(float)*12, mat->spec, sizeof(float)*4);
+        memcpy(buf+sizeof(float)*16, &mat->shi, sizeof(float));
+        if (namelen)
+            memcpy(buf+sizeof(float)*17, mat->name, namelen);
+        ok = write_ac3d_cache_chunk(fp, CHUNK_MATL, buf, sizeof(float)*17 + namelen);
+    }
+    
+    if (ok)
+        ok = write_ac3d_cache_object(fp, file->obj);
+    
+    if (fclose(fp) || !ok || rename(tmpname, cachename))
+        unlink(tmpname);
+}
+
+static
+const AC3DCacheChunk *next_ac3d_cache_chunk(const char **ptr, const char *end)
+{
+    const AC3DCacheChunk *chunk = (const AC3DCacheChunk*)*ptr;
+    
+    if (end - *ptr < (ptrdiff_t)sizeof(AC3DCacheChunk))
+        return NULL;
+    if (chunk->len < 0 || end - *ptr - (ptrdiff_t)sizeof(AC3DCacheChunk) < chunk->len)
+        return NULL;
+    
+    *ptr += sizeof(AC3DCacheChunk) + ((chunk->len + 3) & ~3);
+    return chunk;
+}
+
+static
+float *dup_ac3d_cache_floats(AC3DArena *arena, const AC3DCacheChunk *chunk, int count)
+{
+    if (chunk->len != (int)sizeof(float)*count)
+        return NULL;
+    
+    return (float*)dup_ac3d_arena(arena, chunk+1, sizeof(float)*count);
+}
+
+static
+AC3DObject *read_ac3d_cache_object(const char **ptr, const char *end, AC3DArena *arena)
+{
+    const AC3DCacheChunk *chunk = next_ac3d_cache_chunk(ptr, end);
+    AC3DObject *obj;
+    int i;
+    
+    if (!chunk || chunk->tag != CHUNK_OBJB || chunk->len != sizeof(int32_t)*2)
+        return NULL;
+    
+    obj = (AC3DObject*)calloc_ac3d_arena(arena, 1, sizeof(AC3DObject));
+    if (!obj)
+        return NULL;
+    
+    obj->arena = arena;
+    obj->texid = -1;
+    obj->enabled = true;
+    obj->type = ((const int32_t*)(chunk+1))[0];
+    obj->numkids = ((const int32_t*)(chunk+1))[1];
+    
+    while ((chunk = next_ac3d_cache_chunk(ptr, end)) && chunk->tag != CHUNK_OBJE) {
+        const char *data = (const char*)(chunk+1);
+        switch (chunk->tag) {
+            case CHUNK_NAME:
+                if (chunk->len > 0 && !data[chunk->len-1]) 
+                    obj->name = dup_ac3d_string(arena, data, (int)strlen(data));
+                break;
+            case CHUNK_TEXN:
+                if (chunk->len > 0 && !data[chunk->len-1]) 
+                    obj->texture = dup_ac3d_string(arena, data, (int)strlen(data));
+                break;
+            case CHUNK_TREP: obj->texrep = dup_ac3d_cache_floats(arena, chunk, 2);  break;
+            case CHUNK_TOFF: obj->texoff = dup_ac3d_cache_floats(arena, chunk, 2);  break;
+            case CHUNK_ROT:  obj->rot    = dup_ac3d_cache_floats(arena, chunk, 16); break;
+            case CHUNK_LOC:  obj->loc    = dup_ac3d_cache_floats(arena, chunk, 3);  break;
+            case CHUNK_RVEC: obj->rotvec = dup_ac3d_cache_floats(arena, chunk, 6);  break;
+            case CHUNK_BBOX: obj->bbox   = dup_ac3d_cache_floats(arena, chunk, 6);  break;
+            case CHUNK_CMDS:
+                obj->numcmds = chunk->len / sizeof(AC3Doptcmd);
+                obj->optcmds = (AC3Doptcmd*)data;
+                break;
+            case CHUNK_QUAN:
+                // Comes before CHUNK_VERT, the stride depends on it
+                if (chunk->len == sizeof(AC3DQuant))
+                    obj->quant = (AC3DQuant*)dup_ac3d_arena(arena, data, sizeof(AC3DQuant));
+                break;
+            case CHUNK_VERT:
+                obj->numvertices = chunk->len / (sizeof(AC3Doptcmd)*AC3D_INDEXED_STRIDE(obj));
+                obj->vertices = (AC3Doptcmd*)data;
+                break;
+            case CHUNK_INDX:
+            case CHUNK_IDX4:
+                obj->indexsize = chunk->tag == CHUNK_IDX4 ? 4 : 2;
+                obj->numindices = chunk->len / obj->indexsize;
+                obj->indices = (void*)data;
+                break;
+            case CHUNK_BTCH:
+                obj->numbatches = chunk->len / sizeof(AC3DBatch);
+                obj->batches = (AC3DBatch*)data;
+                break;
+            case CHUNK_STAT:
+                if (chunk->len == sizeof(AC3DObjectStats))
+                    memcpy(&obj->stats, data, sizeof(AC3DObjectStats));
+                break;
+            default:
+                break;
+        }
+    }
+    
+    if (!chunk || obj->numkids < 0)
+        return NULL;
+    
+    if (obj->numkids > 0) {
+        obj->kids = (AC3DObject**)calloc_ac3d_arena(arena, obj->numkids, sizeof(AC3DObject*));
+        if (!obj->kids)
+            return NULL;
+        for (i=0; i<obj->numkids; i++) 
+            if (!(obj->kids[i] = read_ac3d_cache_object(ptr, end, arena)))
+                return NULL;
+    }
+    
+    return obj;
+}
+
+static
+AC3DFile *read_ac3d_cache(const char *cachename, struct stat *src,
+                          AC3DContext *ctx, const AC3DLoadOptions *options)
+{
+    AC3DArena *arena = NULL;
+    AC3DFile *file = NULL;
+    const AC3DCacheHeader *header;
+    const AC3DCacheChunk *chunk;
+    const char *ptr, *end;
+    struct stat st;
+    void *map;
+    int fd, i;
+    
+    fd = open(cachename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(AC3DCacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    
+    header = (const AC3DCacheHeader*)map;
+    if (memcmp(header->magic, "ACB", 4) ||
+        header->version != AC3D_CACHE_VERSION ||
+        header->byteorder != 0x01020304 ||
+        header->cmdsize != sizeof(AC3Doptcmd) ||
+        header->srcmtime != (int64_t)src->st_mtime ||
+        header->srcsize != (int64_t)src->st_size ||
+        header->nummats < 0 ||
+        header->cookkey != make_ac3d_cook_key(options))
+        goto fail;
+    
+    arena = new_ac3d_arena(ctx, NULL);
+    if (!arena)
+        goto fail;
+    file = (AC3DFile*)calloc_ac3d_arena(arena, 1, sizeof(AC3DFile));
+    if (!file)
+        goto fail;
+    
+    file->arena = arena;
+    file->ctx = ctx;
+    file->atlas_texture = options->atlas_texture;
+    file->atlas_userdata = options->atlas_userdata;
+    file->map = map;
+    file->mapsize = st.st_size;
+    
+    ptr = (const char*)(header+1);
+    end = (const char*)map + st.st_size;
+    
+    if (header->nummats > 0) {
+        file->mats = (AC3DMaterial**)alloc_ac3d_arena(arena, sizeof(AC3DMaterial*)*header->nummats);
+        if (!file->mats)
+            goto fail;
+    }
+    
+    for (i=0; i<header->nummats; i++) {
+        AC3DMaterial *mat;
+        const char *data;
+        
+        chunk = next_ac3d_cache_chunk(&ptr, end);
+        if (!chunk || chunk->tag != CHUNK_MATL || chunk->len < (int)sizeof(float)*17)
+            goto fail;
+        
+        mat = (AC3DMaterial*)calloc_ac3d_arena(arena, 1, sizeof(AC3DMaterial));
+        if (!mat)
+            goto fail;
+        
+        file->mats[file->nummats++] = mat;
+        
+        data = (const char*)(chunk+1);
+        memcpy(mat->rgb,  data, sizeof(float)*4);
+        memcpy(mat->amb,  data+sizeof(float)*4, sizeof(float)*4);
+        memcpy(mat->emis, data+sizeof(float)*8, sizeof(float)*4);
+        memcpy(mat->spec, data+sizeof(float)*12, sizeof(float)*4);
+        memcpy(&mat->shi, data+sizeof(float)*16, sizeof(float));
+        if (chunk->len > (int)sizeof(float)*17 && !data[chunk->len-1])
+            mat->name = dup_ac3d_string(arena, data+sizeof(float)*17, (int)strlen(data+sizeof(float)*17));
+    }
+    
+    file->obj = read_ac3d_cache_object(&ptr, end, arena);
+    if (!file->obj)
+        goto fail;
+    
+    file->bbox = file->obj->bbox;
+    
+    if (!index_ac3d_file(file))
+        goto fail;
+    
+    return file;
+    
+fail:
+    
+    munmap(map, st.st_size);
+    free_ac3d_arena(arena);
+    return NULL;
+}
+
+static
+AC3DFile *read_ac3d_buffer(AC3DContext *ctx, const AC3DLoadOptions *options,
+                           const char *data, size_t size, char **err)
+{
+    AC3DLexer lexer;
+    AC3DLexer *lex = &lexer;
+    AC3DArena *arena = NULL;
+    AC3DFile *file = NULL;
+    double start = ac3d_time();
+    int numobjs = 1;
+    int matsize = 0;
+    
+    lex->ptr = data;
+    lex->end = data + size;
+    
+    arena = new_ac3d_arena(ctx, options);
+    if (!arena)
+        THROW( "malloc failed" );
+    
+    file = (AC3DFile*)calloc_ac3d_arena(arena, 1, sizeof(AC3DFile));
+    if (!file)
+        THROW( "malloc failed" );
+    
+    file->arena = arena;
+    file->ctx = ctx;
+    file->atlas_texture = options->atlas_texture;
+    file->atlas_userdata = options->atlas_userdata;
+    
+    if (next_ac3d_tag(lex) != TAG_AC3DB)
+        THROW( "Wrong header" );
+    
+    while (numobjs) {
+        switch (next_ac3d_tag(lex)) {
+        
+            case TAG_MATERIAL: {
+                AC3DMaterial *mat = read_ac3d_material(lex, arena, err);
+                
+                if (mat)
+                    ; //printf("Read %s\n", mat->name);
+                else
+                    THROW( *err );
+                
+                if (file->nummats == matsize) {
+                    matsize = matsize ? matsize*2 : 16;
+                    file->mats = (AC3DMaterial**)grow_ac3d_arena(arena, file->mats,
+                                                                 sizeof(AC3DMaterial*) * file->nummats,
+                                                                 sizeof(AC3DMaterial*) * matsize);
+                    if (!file->mats)
+                        THROW( "realloc failed" );
+                }
+                
+                file->mats[file->nummats++] = mat;
+                break;
+            }
+            
+            case TAG_OBJECT: {
+                int threads = options->threads;
+                
+                if (threads < 0)
+                    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                
+                if (threads > 1) {
+                    char *perr = NULL;
+                    file->obj = read_ac3d_object_parallel(lex, arena, threads, &perr);
+                    if (perr)
+                        THROW( perr );
+                }
+                
+                if (!file->obj)
+                    file->obj = read_ac3d_object(lex, arena, err);
+                
+                if (file->obj) {
+                    if (options->atlas && !atlas_ac3d_file(file, options))
+                        THROW( "malloc failed" );
+                    if (options->dynamic_names && !flatten_ac3d_object(file->obj))
+                        THROW( "malloc failed" );
+                    file->bbox = file->obj->bbox; 
+                    if (!index_ac3d_file(file))
+                        THROW( "malloc failed" );
+                    //printf("Read object %s\n", file->obj->name ? file->obj->name : "unamed");
+                } else {
+                    THROW( *err );
+                }
+                
+                numobjs--;
+                break;
+            }
+            
+            default:
+                THROW( "Missing MATERIAL or OBJECT" );
+        }
+    } 
+    
+    free_ac3d_load_arenas(arena);
+    file->loadtime = ac3d_time() - start;
+    
+#if TARGET_IPHONE_SIMULATOR
+    {
+        AC3DStats stats;
+        get_ac3d_stats(file, &stats);
+        NSLog(@"\nTris: %d\nCreated tri strips: %d\nPoints removed: %d\nTris per strip: %.1f\nDraws: %d -> %d\nLoad: %.1f ms", 
+              stats.triangles, stats.strips, stats.points_removed, stats.strip_length, 
+              stats.draws_in, stats.draws_out, stats.load_time*1000.0);
+    }
+#endif
+    
+    return file;
+    
+CATCH_ERROR:
+    
+    free_ac3d_arena(arena);
+    return NULL;
+}
+
+#ifdef AC3D_HEADLESS
+
+// Without a bundle the filename is the path
+static
+int resolve_ac3d_bundle_path(const char *filename, char *path, size_t size, void *userdata)
+{
+    (void)userdata;
+    snprintf(path, size, "%s", filename);
+    return 1;
+}
+
+#else
+
+static
+int resolve_ac3d_bundle_path(const char *filename, char *path, size_t size, void *userdata)
+{
+    static const char *folders[] = { "", "Models/" };
+    NSString *resources = [[NSBundle mainBundle] resourcePath];
+    int i;
+    
+    (void)userdata;
+    for (i=0; i<2; i++) {
+        NSString *name = [NSString stringWithFormat:@"%s%s", folders[i], filename];
+        const char *lfilename = [[resources stringByAppendingPathComponent:name] 
+                                 cStringUsingEncoding:NSUTF8StringEncoding];
+        if (lfilename && !access(lfilename, R_OK)) {
+            snprintf(path, size, "%s", lfilename);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif // AC3D_HEADLESS
+
+// ----------------------------------------------------------------------
+// Contexts
+
+AC3DContext *new_ac3d_context(void)
+{
+    AC3DContext *ctx = (AC3DContext*)calloc(1, sizeof(AC3DContext));
+
+    if (ctx) {
+        ctx->allocator.alloc = alloc_ac3d_default;
+        ctx->allocator.free = free_ac3d_default;
+        ctx->resolver = resolve_ac3d_bundle_path;
+        pthread_mutex_init(&ctx->lock, NULL);
     }
-    for (i=0; i<obj->numkids; i++) 
-        load_textures_ac3d_object(obj->kids[i], textures);
+    return ctx;
+}
+
+void free_ac3d_context(AC3DContext *ctx)
+{
+    if (ctx && ctx != &default_context) {
+#ifndef AC3D_HEADLESS
+        free_ac3d_textures_ctx(ctx);
+        [ctx->textures release];
+#endif
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+    }
+}
+
+void get_ac3d_load_options_ctx(AC3DContext *ctx, AC3DLoadOptions *opts)
+{
+    *opts = ctx->options;
+}
+
+void set_ac3d_load_options_ctx(AC3DContext *ctx, const AC3DLoadOptions *opts)
+{
+    ctx->options = *opts;
+}
+
+void get_ac3d_load_options(AC3DLoadOptions *opts)
+{
+    get_ac3d_load_options_ctx(&default_context, opts);
+}
+
+void set_ac3d_load_options(const AC3DLoadOptions *opts)
+{
+    set_ac3d_load_options_ctx(&default_context, opts);
+}
+
+void set_ac3d_allocator_ctx(AC3DContext *ctx, const AC3DAllocator *allocator)
+{
+    if (allocator)
+        ctx->allocator = *allocator;
+    else {
+        ctx->allocator.alloc = alloc_ac3d_default;
+        ctx->allocator.free = free_ac3d_default;
+        ctx->allocator.userdata = NULL;
+    }
+}
+
+void set_ac3d_allocator(const AC3DAllocator *allocator)
+{
+    set_ac3d_allocator_ctx(&default_context, allocator);
+}
+
+void set_ac3d_path_resolver_ctx(AC3DContext *ctx, AC3DPathResolver resolver, void *userdata)
+{
+    ctx->resolver = resolver ? resolver : resolve_ac3d_bundle_path;
+    ctx->resolverdata = resolver ? userdata : NULL;
+}
+
+void set_ac3d_path_resolver(AC3DPathResolver resolver, void *userdata)
+{
+    set_ac3d_path_resolver_ctx(&default_context, resolver, userdata);
+}
+
+// ----------------------------------------------------------------------
+
+// The options are copied for the load, set_ac3d_load_options_ctx while
+// it runs does not change it
+AC3DFile *read_ac3d_memory_ctx(AC3DContext *ctx, const void *data, size_t size, char **err)
+{
+    AC3DLoadOptions options = ctx->options;
+    return read_ac3d_buffer(ctx, &options, (const char*)data, size, err);
+}
+
+AC3DFile *read_ac3d_memory(const void *data, size_t size, char **err)
+{
+    return read_ac3d_memory_ctx(&default_context, data, size, err);
+}
+
+AC3DFile *read_ac3d_callback_ctx(AC3DContext *ctx, AC3DReadFunc func, void *userdata, char **err)
+{
+    AC3DFile *file;
+    size_t size = 0;
+    size_t capacity = 64*1024;
+    char *data = (char*)malloc(capacity);
+    long len;
+    
+    if (!data)
+        THROW( "malloc failed" );
+    
+    while ((len = func(userdata, data+size, capacity-size)) > 0) {
+        size += len;
+        if (size == capacity) {
+            char *tmp = (char*)realloc(data, capacity*2);
+            if (!tmp)
+                THROW( "realloc failed" );
+            data = tmp;
+            capacity *= 2;
+        }
+    }
+    
+    if (len < 0)
+        THROW( "read failed" );
+    
+    file = read_ac3d_memory_ctx(ctx, data, size, err);
+    free(data);
+    return file;
+    
+CATCH_ERROR:
+    
+    free(data);
+    return NULL;
+}
+
+AC3DFile *read_ac3d_callback(AC3DReadFunc func, void *userdata, char **err)
+{
+    return read_ac3d_callback_ctx(&default_context, func, userdata, err);
+}
+
+static
+AC3DFile *read_ac3d_path(AC3DContext *ctx, const AC3DLoadOptions *options, 
+                         const char *filename, char **err) 
+{
+#if TARGET_IPHONE_SIMULATOR
+    NSLog(@"File %s", filename);
+#endif
+    
+    char lfilename[1024];
+    AC3DFile *file = NULL;
+    double start = ac3d_time();
+    struct stat st;
+    void *map;
+    int fd = -1;
+#ifdef USE_CACHE
+    char cachename[1024];
+    int cacheable;
+#endif
+    
+    if (!ctx->resolver(filename, lfilename, sizeof(lfilename), ctx->resolverdata))
+        THROW( "fopen failed" );
+    
+    fd = open(lfilename, O_RDONLY);
+    if (fd < 0)
+        THROW( "fopen failed" );
+    
+    if (fstat(fd, &st) || st.st_size <= 0)
+        THROW( "Wrong header" );
+    
+#ifdef USE_CACHE
+    cacheable = make_ac3d_cache_path(cachename, sizeof(cachename), lfilename);
+    
+    file = cacheable ? read_ac3d_cache(cachename, &st, ctx, options) : NULL;
+    if (file) {
+        close(fd);
+        file->cached = true;
+        file->loadtime = ac3d_time() - start;
+        return file;
+    }
+#endif
+    
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        THROW( "mmap failed" );
+    
+    close(fd);
+    fd = -1;
+    
+    file = read_ac3d_buffer(ctx, options, (const char*)map, st.st_size, err);
+    
+    munmap(map, st.st_size);
+    
+    if (file)
+        file->loadtime = ac3d_time() - start;
+    
+#ifdef USE_CACHE
+    // The strip_budget is not in the cook key, what it cut short depends
+    // on the machine and its load, so only finished strips are cached
+    if (file && cacheable) {
+        AC3DArena *arena;
+        for (arena = file->arena; arena && !arena->cut; arena = arena->next)
+            ;
+        if (!arena)
+            write_ac3d_cache(file, cachename, &st, options);
+    }
+#endif
+    
+    return file;
+    
+CATCH_ERROR:
+    
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+AC3DFile *read_ac3d_file_ctx(AC3DContext *ctx, const char *filename, char **err) 
+{
+    AC3DLoadOptions options = ctx->options;
+    return read_ac3d_path(ctx, &options, filename, err);
+}
+
+AC3DFile *read_ac3d_file(const char *filename, char **err) 
+{
+    return read_ac3d_file_ctx(&default_context, filename, err);
+}
+
+// ----------------------------------------------------------------------
+// Async loading
+//
+// Each load reads and cooks on a thread of its own and is then put on
+// the ready list of its context. pump_ac3d_uploads on the GL thread
+// takes them from there and does what the first draw would have done,
+// the textures and buffers one object at a time and then the draw list,
+// for as long as its budget lasts. The callback is called once a file
+// is done, so it is drawn without a hitch.
+
+typedef struct AC3DLoad_s {
+    AC3DContext       *ctx;
+    AC3DLoadOptions    options;  // as when the load was started
+    char              *filename;
+    AC3DLoadCallback   callback;
+    void              *userdata;
+    AC3DFile          *file;
+    char              *err;
+    int                upload;   // handle of the next object to upload
+    struct AC3DLoad_s *next;
+} AC3DLoad;
+
+static
+void *run_ac3d_load(void *arg)
+{
+    AC3DLoad *load = (AC3DLoad*)arg;
+    AC3DContext *ctx = load->ctx;
+    AC3DLoad **tail;
+#ifndef AC3D_HEADLESS
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+#endif
+
+    load->file = read_ac3d_path(ctx, &load->options, load->filename, &load->err);
+#ifndef AC3D_HEADLESS
+    [pool release];
+#endif
+
+    // In the order they finish
+    pthread_mutex_lock(&ctx->lock);
+    for (tail = &ctx->ready; *tail; tail = &(*tail)->next)
+        ;
+    *tail = load;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+int read_ac3d_file_async_ctx(AC3DContext *ctx, const char *filename, 
+                             AC3DLoadCallback callback, void *userdata)
+{
+    AC3DLoad *load = (AC3DLoad*)calloc(1, sizeof(AC3DLoad));
+    pthread_t thread;
+
+    if (!load || !(load->filename = strdup(filename))) {
+        free(load);
+        return 0;
+    }
+    load->ctx = ctx;
+    load->options = ctx->options;
+    load->callback = callback;
+    load->userdata = userdata;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->numpending++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    // Without a thread it is read now, it still comes through the pump
+    if (pthread_create(&thread, NULL, run_ac3d_load, load))
+        run_ac3d_load(load);
+    else
+        pthread_detach(thread);
+    return 1;
+}
+
+int read_ac3d_file_async(const char *filename, AC3DLoadCallback callback, void *userdata)
+{
+    return read_ac3d_file_async_ctx(&default_context, filename, callback, userdata);
+}
+
+// One step of the uploads of a load, returns 1 when they are all done
+static
+int upload_ac3d_load(AC3DLoad *load)
+{
+    AC3DFile *file = load->file;
+
+    if (!file)
+        return 1;
+
+    if (load->upload < file->numobjects) {
+#ifndef AC3D_HEADLESS
+        AC3DObject *obj = file->objects[load->upload];
+        init_ac3d_textures(file->ctx);
+        load_texture_ac3d_object(obj, file);
+#ifdef USE_VBO
+        upload_ac3d_object_buffers(obj);
+#endif
+#endif
+        load->upload++;
+        return 0;
+    }
+
+    if (!file->drawlist)
+        compile_ac3d_drawlist(file);
+    return 1;
+}
+
+int pump_ac3d_uploads_ctx(AC3DContext *ctx, float budget)
+{
+    double start = ac3d_time();
+    int pending;
+
+    // At least one step a call, so a small budget still gets there
+    do {
+        AC3DLoad *load = ctx->uploading;
+
+        if (!load) {
+            pthread_mutex_lock(&ctx->lock);
+            load = ctx->ready;
+            if (load)
+                ctx->ready = load->next;
+            pthread_mutex_unlock(&ctx->lock);
+            if (!load)
+                break;
+            ctx->uploading = load;
+        }
+
+        if (upload_ac3d_load(load)) {
+            ctx->uploading = NULL;
+            pthread_mutex_lock(&ctx->lock);
+            ctx->numpending--;
+            pthread_mutex_unlock(&ctx->lock);
+            if (load->callback)
+                load->callback(load->file, load->err, load->userdata);
+            else
+                free_ac3d_file(load->file);
+            free(load->filename);
+            free(load);
+        }
+    } while (ac3d_time() - start < budget);
+
+    pthread_mutex_lock(&ctx->lock);
+    pending = ctx->numpending;
+    pthread_mutex_unlock(&ctx->lock);
+    return pending;
+}
+
+int pump_ac3d_uploads(float budget)
+{
+    return pump_ac3d_uploads_ctx(&default_context, budget);
+}
+
+// ----------------------------------------------------------------------
+// Statistics
+//
+// The counts and phase times are kept per object while it is read and
+// cooked and come along in the .acb cache. Byte counts are worked out
+// when asked for, textures from what is loaded at that point.
+
+static
+void sum_ac3d_object_stats(AC3DStats *stats, AC3DObject *obj, int *striptris)
+{
+    const AC3DObjectStats *src = &obj->stats;
+    int i;
+
+    stats->objects++;
+    stats->polygons += src->surfaces[SURF_POLYGON];
+    stats->closed_lines += src->surfaces[SURF_CLOSEDLINE];
+    stats->lines += src->surfaces[SURF_LINE];
+    stats->triangles += src->triangles;
+    stats->strips += src->strips;
+    stats->points_removed += src->points_removed;
+    stats->draws_in += src->draws_in;
+    stats->draws_out += src->draws_out;
+    stats->cmd_bytes += (sizeof(AC3Doptcmd)*obj->numcmds +
+                         sizeof(AC3Doptcmd)*AC3D_INDEXED_STRIDE(obj)*obj->numvertices +
+                         obj->indexsize*obj->numindices +
+                         sizeof(AC3DBatch)*obj->numbatches);
+    for (i=0; i<AC3D_NUM_PHASES; i++)
+        stats->time[i] += src->time[i];
+    if (src->quant_error[0] > stats->position_error)
+        stats->position_error = src->quant_error[0];
+    if (src->quant_error[1] > stats->normal_error)
+        stats->normal_error = src->quant_error[1];
+    if (src->quant_error[2] > stats->texcoord_error)
+        stats->texcoord_error = src->quant_error[2];
+    *striptris += src->strip_triangles;
+}
+
+static
+void sum_ac3d_tree_stats(AC3DStats *stats, AC3DObject *obj, int *striptris)
+{
+    int i;
+    sum_ac3d_object_stats(stats, obj, striptris);
+    for (i=0; i<obj->numkids; i++)
+        sum_ac3d_tree_stats(stats, obj->kids[i], striptris);
+}
+
+int get_ac3d_stats(AC3DFile *file, AC3DStats *stats)
+{
+    int striptris = 0;
+
+    if (!file || !stats)
+        return 0;
+
+    memset(stats, 0, sizeof(AC3DStats));
+    if (file->obj)
+        sum_ac3d_tree_stats(stats, file->obj, &striptris);
+    if (stats->strips)
+        stats->strip_length = (float)striptris / stats->strips;
+    stats->load_time = file->loadtime;
+    stats->cached = file->cached;
+
+#ifndef AC3D_HEADLESS
+    {
+        int i;
+        for (i=0; i<file->numtextures; i++)
+            stats->texture_bytes += file->textures[i]->bytes;
+    }
+#endif
+
+    return 1;
+}
+
+int get_ac3d_object_stats(AC3DObject *obj, AC3DStats *stats)
+{
+    int striptris = 0;
+
+    if (!obj || !stats)
+        return 0;
+
+    memset(stats, 0, sizeof(AC3DStats));
+    sum_ac3d_object_stats(stats, obj, &striptris);
+    if (stats->strips)
+        stats->strip_length = (float)striptris / stats->strips;
+#ifndef AC3D_HEADLESS
+    if (obj->texture) {
+        AC3DTextureEntry *e = find_ac3d_texture(obj->arena->ctx, obj->texture);
+        if (e)
+            stats->texture_bytes = e->bytes;
+    }
+#endif
+
+    return 1;
+}
+
+// ----------------------------------------------------------------------
+
+
+#ifndef AC3D_HEADLESS
+
+static
+void apply_ac3d_material(const AC3DMaterial *mat)
+{
+    glColor4f(mat->rgb[0],
+              mat->rgb[1],
+              mat->rgb[2],
+              mat->rgb[3]);
+    
+    glMaterialfv( GL_FRONT_AND_BACK, GL_DIFFUSE,   mat->rgb  );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_AMBIENT,   mat->amb  );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_EMISSION,  mat->emis );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR,  mat->spec );
+    glMaterialf(  GL_FRONT_AND_BACK, GL_SHININESS, mat->shi  );
+}
+
+// Skipped when ctx set the same one last and set_ac3d_material did not
+// change it since
+static
+void set_ac3d_material_priv(int idx, AC3DFile *file, AC3DContext *ctx)
+{
+    if (idx < 0 || idx >= file->nummats)
+        return;
+
+    if (ctx->lastmat == idx &&
+        ctx->lastfile == file &&
+        ctx->lastversion == file->matversion)
+        return;
+    
+    ctx->lastmat = idx;
+    ctx->lastfile = file;
+    ctx->lastversion = file->matversion;
+    
+    apply_ac3d_material(file->mats[idx]);
+}
+
+// Points the arrays at the indexed vertices from vptr on
+static
+void set_ac3d_indexed_arrays(AC3DObject *obj, const char *vptr)
+{
+    int stride = sizeof(AC3Doptcmd) * AC3D_INDEXED_STRIDE(obj);
+    int format = AC3D_QUANT_FORMAT(obj);
+    const char *nptr = vptr + AC3D_NORMAL_OFFSET(obj)*sizeof(AC3Doptcmd);
+    const char *tptr = vptr + AC3D_TEXCOORD_OFFSET(obj)*sizeof(AC3Doptcmd);
+    
+#ifdef USE_FLOATS
+    GLenum type = GL_FLOAT;
+#else
+    GLenum type = GL_FIXED;
+#endif
+    glVertexPointer(3, (format & AC3D_QUANTIZE_POSITIONS) ? GL_SHORT : type, stride, vptr);
+    glNormalPointer((format & AC3D_QUANTIZE_NORMALS) ? GL_BYTE : type, stride, nptr);
+    if (obj->texture)
+        glTexCoordPointer(2, (format & AC3D_QUANTIZE_TEXCOORDS) ? GL_SHORT : type, stride, tptr);
+}
+
+// The scales that decode quantized positions and texcoords, undone by
+// pop_ac3d_quant. GL_NORMALIZE has to be on for the normals.
+static
+void push_ac3d_quant(AC3DObject *obj)
+{
+    const AC3DQuant *q = obj->quant;
+    
+    if (q->format & AC3D_QUANTIZE_POSITIONS) {
+        glPushMatrix();
+        glTranslatef(q->pos[0], q->pos[1], q->pos[2]);
+        glScalef(q->pos[3], q->pos[3], q->pos[3]);
+    }
+    if (q->format & AC3D_QUANTIZE_TEXCOORDS) {
+        glMatrixMode(GL_TEXTURE);
+        glPushMatrix();
+        glTranslatef(q->uv[0], q->uv[1], 0.0);
+        glScalef(q->uv[2], q->uv[3], 1.0);
+        glMatrixMode(GL_MODELVIEW);
+    }
+}
+
+static
+void pop_ac3d_quant(AC3DObject *obj)
+{
+    if (obj->quant->format & AC3D_QUANTIZE_TEXCOORDS) {
+        glMatrixMode(GL_TEXTURE);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+    }
+    if (obj->quant->format & AC3D_QUANTIZE_POSITIONS)
+        glPopMatrix();
+}
+
+static
+void draw_ac3d_object_indexed(AC3DObject *obj, AC3DFile *file, AC3DContext *ctx)
+{
+    int stride = sizeof(AC3Doptcmd) * AC3D_INDEXED_STRIDE(obj);
+    const char *vptr = (const char*)obj->vertices;
+    const char *iptr = (const char*)obj->indices;
+    GLenum itype = obj->indexsize == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    bool normalize = false;
+    int base = 0;
+    int i;
+    
+#ifdef USE_VBO
+    if (!obj->ivbo[0]) {
+        glGenBuffers(2, obj->ivbo);
+        glBindBuffer(GL_ARRAY_BUFFER, obj->ivbo[0]);
+        glBufferData(GL_ARRAY_BUFFER, stride*obj->numvertices, obj->vertices, GL_STATIC_DRAW); 
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->ivbo[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj->indexsize*obj->numindices, obj->indices, GL_STATIC_DRAW); 
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, obj->ivbo[0]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->ivbo[1]);
+    }
+    vptr = NULL;
+    iptr = NULL;
+#endif
+    
+    glShadeModel(GL_SMOOTH);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    if (obj->texture)
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    set_ac3d_indexed_arrays(obj, vptr);
+    if (obj->quant) {
+        if (!glIsEnabled(GL_NORMALIZE)) {
+            glEnable(GL_NORMALIZE);
+            normalize = true;
+        }
+        push_ac3d_quant(obj);
+    }
+    
+    for (i=0; i<obj->numbatches; i++) {
+        AC3DBatch *batch = &obj->batches[i];
+        
+        set_ac3d_material_priv(batch->mat, file, ctx);
+        
+        if (batch->type & SURF_TWOSIDED) {
+            glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+            glDisable(GL_CULL_FACE);
+        } else {
+            glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+            glEnable(GL_CULL_FACE);
+        }
+        
+        // Cut objects have a chunk of vertices per batch
+        if (batch->base != base) {
+            base = batch->base;
+            set_ac3d_indexed_arrays(obj, vptr + base*stride);
+        }
+        
+        glDrawElements(GL_TRIANGLES, batch->count, itype, iptr + batch->first*obj->indexsize);
+    }
+    
+    if (obj->quant)
+        pop_ac3d_quant(obj);
+    if (normalize)
+        glDisable(GL_NORMALIZE);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    
+#ifdef USE_VBO
+    glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
 }
 
-AC3DFile *read_ac3d_file(const char *filename, char **err) 
+void draw_ac3d_object(AC3DObject *obj, AC3DFile *file, AC3DContext *ctx)
 {
-#if TARGET_IPHONE_SIMULATOR
-    NSLog(@"File %s", filename);
-#endif
-    
-    const char *lfilename = [[[[NSBundle mainBundle] resourcePath] 
-                              stringByAppendingPathComponent:[NSString stringWithFormat:@"%s", filename]] 
-                             cStringUsingEncoding:NSUTF8StringEncoding];
-    
-    INIT_STATS;
+    int i, j;
 
-    char buf[256];
-    FILE *fp = fopen(lfilename, "rt");
-    AC3DFile *file = NULL;
-    int numobjs = 1;
+    if (!obj->enabled) 
+        return;
     
-    if (!fp) {
-        lfilename = [[[[NSBundle mainBundle] resourcePath] 
-                      stringByAppendingPathComponent:[NSString stringWithFormat:@"Models/%s", filename]] 
-                     cStringUsingEncoding:NSUTF8StringEncoding];
-        fp = fopen(lfilename, "rt");
-        if (!fp)
-            THROW( "fopen failed" );
+#ifdef USE_VBO
+    if (!obj->vbo) {
+        glGenBuffers(1, &obj->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(AC3Doptcmd)*obj->numcmds, obj->optcmds, GL_STATIC_DRAW); 
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
     }
+#endif
     
-    file = (AC3DFile*)malloc(sizeof(AC3DFile));
-    if (!file)
-        THROW( "malloc failed" );
+    if (!obj->texture_loaded)
+        load_ac3d_file_textures(file);
     
-    memset(file, 0, sizeof(AC3DFile));
+    if (obj->texid == -1) {
+        glDisable(GL_TEXTURE_2D);
+    } else {
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, obj->texid);
+    }
     
-    if (fscanf(fp, "%s", buf) != 1 || strcmp(buf, "AC3Db"))
-        THROW( "Wrong header" );
+    if (obj->loc || obj->rot || obj->rotvec) {
+        glPushMatrix();
+        
+        if (obj->loc)
+            glTranslatef(obj->loc[0], obj->loc[1], obj->loc[2]);
+
+        if (obj->rot) 
+            glMultMatrixf(obj->rot);
+        
+        if (obj->rotvec) {
+            glTranslatef(obj->rotvec[3], obj->rotvec[4], obj->rotvec[5]);
+            glRotatef(obj->angle, obj->rotvec[0], obj->rotvec[1], obj->rotvec[2]);
+            glTranslatef(-obj->rotvec[3], -obj->rotvec[4], -obj->rotvec[5]);
+        }
+    }
     
-    while (numobjs) {
-        if (fscanf(fp, "%s", buf) == -1 || (strcmp(buf, "MATERIAL") && 
-                                            strcmp(buf, "OBJECT")))
-            THROW( "Missing MATERIAL or OBJECT" );
+    if (obj->indices)
+        draw_ac3d_object_indexed(obj, file, ctx);
+    
+    {
+        i=0;
+        AC3Doptcmd *ptr = obj->optcmds;
+        AC3Doptcmd *ptrNext;
+        int lastType = -1;
+        int hadLighting = -1;
+        bool unlit = false;
+        bool normalArray = false;
+        bool texArray = false;
         
-        if (!strcmp(buf, "MATERIAL")) {
-            AC3DMaterial *mat = read_ac3d_material(fp, err);
-            
-            if (mat)
-                ; //printf("Read %s\n", mat->name);
-            else
-                THROW( *err );
-            
-            file->nummats++;
-            file->mats = (AC3DMaterial**)realloc(file->mats,
-                                                 sizeof(AC3DMaterial*) * 
-                                                 file->nummats);
-            if (!file->mats)
-                THROW( "realloc failed" );
+        if (obj->numcmds > 0)
+            glEnableClientState(GL_VERTEX_ARRAY);
+        
+        while (i < obj->numcmds) {
+            int type;
+            int numrefs;
+            int mat;
+            int stride = 3;
+            bool useNormalArray = false;
             
-            file->mats[file->nummats-1] = mat;
+            type = ptr->cmd[0];
+            numrefs = ptr->cmd[1];
+            ptr++; i++;
+            mat = ptr->cmd[0];
+            ptr++; i++;
             
-        } else if (!strcmp(buf, "OBJECT")) {
+            set_ac3d_material_priv(mat, file, ctx);
+#if 0
+/*
+ 2009-08-10 00:46:44.722 AC3D test[2480:20b] 2
+ 2009-08-10 00:46:44.723 AC3D test[2480:20b] 16
+ 2009-08-10 00:46:44.735 AC3D test[2480:20b] 120
+ 2009-08-10 00:46:44.736 AC3D test[2480:20b] 134
+ 2009-08-10 00:46:44.739 AC3D test[2480:20b] 238
+ 2009-08-10 00:46:44.743 AC3D test[2480:20b] 318
+ 2009-08-10 00:46:44.745 AC3D test[2480:20b] 362
+ 2009-08-10 00:46:44.748 AC3D test[2480:20b] 442
+ 2009-08-10 00:46:44.749 AC3D test[2480:20b] 486
+ 2009-08-10 00:46:44.750 AC3D test[2480:20b] 530
+ 2009-08-10 00:46:44.751 AC3D test[2480:20b] 610
+ 2009-08-10 00:46:44.752 AC3D test[2480:20b] 642
+ 2009-08-10 00:46:44.753 AC3D test[2480:20b] 734
+ 2009-08-10 00:46:44.753 AC3D test[2480:20b] 826
+ 2009-08-10 00:46:44.754 AC3D test[2480:20b] 858
+ 2009-08-10 00:46:44.755 AC3D test[2480:20b] 962
+            if (i==362) {
+                srand(ptr);
+                float rgb[4];
+                rgb[0] = (rand()%32768)/32768.0;
+                rgb[1] = (rand()%32768)/32768.0;
+                rgb[2] = (rand()%32768)/32768.0;            
+                rgb[3] = 1.0;
+                glMaterialfv( GL_FRONT_AND_BACK, GL_DIFFUSE,   rgb  );
+            }
+ */
+#endif
+            if ((type & 0x0f) != SURF_CLOSEDLINE &&
+                (type & 0x0f) != SURF_LINE &&
+                (type & 0x0f) != SURF_LINES) {
+                
+                if (obj->texture)
+                    stride += 2;
+                
+                if (unlit) {
+                    glEnable(GL_LIGHTING);
+                    unlit = false;
+                }
+                
+                // Only touch the state that differs from the last record
+                if ((type & SURF_TWOSIDED) != (lastType & SURF_TWOSIDED) || lastType < 0) {
+                    if (type & SURF_TWOSIDED) {
+                        glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+                        glDisable(GL_CULL_FACE);
+                    } else {
+                        glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+                        glEnable(GL_CULL_FACE);
+                    }
+                }
+                if ((type & SURF_SHADED) != (lastType & SURF_SHADED) || lastType < 0) 
+                    glShadeModel((type & SURF_SHADED) ? GL_SMOOTH : GL_FLAT);
+                lastType = type;
+                
+                if ((type & SURF_SHADED) ||
+                    (type & 0x0f) != SURF_POLYGON) {
+                    stride += 3;
+                    useNormalArray = true;
+                } else {
+#ifdef USE_FLOATS
+                    glNormal3f(ptr[0].f, ptr[1].f, ptr[2].f);
+#else
+                    glNormal3x(ptr[0].i, ptr[1].i, ptr[2].i);
+#endif
+                    ptr+=3; i+=3;
+                }
+            }
             
-            file->obj = read_ac3d_object(fp, err);
+            ptrNext = &ptr[stride*numrefs];
+            j = i;
+            i += stride*numrefs;
+            stride *= sizeof(float);
 
-            if (file->obj) {
-                file->bbox = file->obj->bbox; 
-                //printf("Read object %s\n", file->obj->name ? file->obj->name : "unamed");
-            } else {
-                THROW( *err );
+#ifdef USE_FLOATS
+            glVertexPointer(3, GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+#else
+            glVertexPointer(3, GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+#endif
+            ptr+=3; j+=3;
+            
+            if (useNormalArray != normalArray) {
+                if (useNormalArray)
+                    glEnableClientState(GL_NORMAL_ARRAY);
+                else
+                    glDisableClientState(GL_NORMAL_ARRAY);
+                normalArray = useNormalArray;
+            }
+            if (useNormalArray) {
+#ifdef USE_FLOATS
+                glNormalPointer(GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+#else
+                glNormalPointer(GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+#endif
+                ptr+=3; j+=3;
             }
             
-            numobjs--;
+            switch (type & 0x0f) {
+                case SURF_POLYGON:
+                case SURF_TRI_STRIP:
+                case SURF_TRI_LIST:
+                    
+                    if (obj->texture && !texArray) {
+                        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+                        texArray = true;
+                    }
+                    if (obj->texture) {
+#ifdef USE_FLOATS
+                        glTexCoordPointer(2, GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+#else
+                        glTexCoordPointer(2, GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+#endif
+                        ptr+=2; j+=2;
+                    }
+                    
+                    if ((type & 0x0f) == SURF_TRI_STRIP)
+                        glDrawArrays(GL_TRIANGLE_STRIP, 0, numrefs);
+                    else if ((type & 0x0f) == SURF_TRI_LIST)
+                        glDrawArrays(GL_TRIANGLES, 0, numrefs);
+                    else
+                        glDrawArrays(GL_TRIANGLE_FAN, 0, numrefs);
+                    break;
+                    
+                default:
+                    
+                    if (texArray) {
+                        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+                        texArray = false;
+                    }
+                    
+                    // Ask for the lighting once per object, lines are unlit
+                    if (!unlit) {
+                        if (hadLighting < 0)
+                            hadLighting = glIsEnabled(GL_LIGHTING);
+                        if (hadLighting) {
+                            glDisable(GL_LIGHTING);
+                            unlit = true;
+                        }
+                    }
+                    
+                    switch (type & 0x0f) {
+                        case SURF_CLOSEDLINE:
+                            glDrawArrays(GL_LINE_LOOP, 0, numrefs);
+                            break;
+                            
+                        case SURF_LINE:
+                            glDrawArrays(GL_LINE_STRIP, 0, numrefs);
+                            break;
+                            
+                        case SURF_LINES:
+                            glDrawArrays(GL_LINES, 0, numrefs);
+                            break;
+                    }
+                    break;
+            }
+            ptr = ptrNext;
         }
-    } 
-
-    fclose(fp);
         
-    SHOW_STATS;
-    
-    return file;
+        if (unlit)
+            glEnable(GL_LIGHTING);
+        if (normalArray)
+            glDisableClientState(GL_NORMAL_ARRAY);
+        if (texArray)
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        if (obj->numcmds > 0)
+            glDisableClientState(GL_VERTEX_ARRAY);
+    }
     
-CATCH_ERROR:
+    for (i=0; i<obj->numkids; i++) 
+        draw_ac3d_object(obj->kids[i], file, ctx);
     
-    fclose(fp);
-    free_ac3d_file(file);
-    return NULL;
+    if (obj->loc || obj->rot || obj->rotvec) {
+        glPopMatrix();
+    }
+}
+
+#endif // AC3D_HEADLESS
+
+// ----------------------------------------------------------------------
+// Draw list
+//
+// The object tree is compiled once into nodes in depth first order, one
+// packet per draw call and one transform slot per object that sets up a
+// matrix. Drawing then walks the nodes linearly, a disabled object skips
+// to the node after its subtree, and only the slot matrices are built
+// again each frame since the rotations can change. Culled drawing does
+// the same for an object whose bbox is outside the frustum, and stops
+// testing below one that is inside it. Instanced drawing goes over the
+// packets sorted by state instead, and draws each one for all instances
+// before moving on to the next.
+
+static
+int is_ac3d_object_transformed(AC3DObject *obj)
+{
+    return obj->loc || obj->rot || obj->rotvec;
+}
+
+static
+void count_ac3d_drawlist(AC3DObject *obj, AC3DDrawList *list)
+{
+    AC3Doptcmd *ptr, *end;
+    int i;
+
+    list->numnodes++;
+    if (is_ac3d_object_transformed(obj))
+        list->numslots++;
+    if (obj->indices)
+        list->numpackets += obj->numbatches;
+    for (ptr = obj->optcmds, end = obj->optcmds + obj->numcmds; ptr < end; list->numpackets++) {
+        int type = ptr->cmd[0], numrefs = ptr->cmd[1];
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED))
+            ptr += 2 + 3 + numrefs*(AC3D_VERTEX_STRIDE(obj)-3);
+        else if ((type & 0x0f) == SURF_POLYGON || (type & 0x0f) == SURF_TRI_STRIP ||
+                 (type & 0x0f) == SURF_TRI_LIST)
+            ptr += 2 + numrefs*AC3D_VERTEX_STRIDE(obj);
+        else
+            ptr += 2 + numrefs*3;
+    }
+    for (i=0; i<obj->numkids; i++)
+        count_ac3d_drawlist(obj->kids[i], list);
+}
+
+static
+void fill_ac3d_drawlist(AC3DObject *obj, AC3DDrawList *list, int slot)
+{
+    AC3DDrawNode *node = &list->nodes[list->numnodes++];
+    int texcoords = obj->texture ? PACKET_TEXCOORDS : 0;
+    int i;
+
+    node->slot = slot;
+    if (is_ac3d_object_transformed(obj)) {
+        list->slots[list->numslots].obj = obj;
+        list->slots[list->numslots].parent = slot;
+        slot = list->numslots++;
+    }
+
+    node->obj = obj;
+    node->first = list->numpackets;
+
+    if (obj->indices) {
+        for (i=0; i<obj->numbatches; i++) {
+            AC3DPacket *pkt = &list->packets[list->numpackets++];
+            pkt->type = (PACKET_INDEXED | PACKET_NORMALS | texcoords | SURF_SHADED |
+                         SURF_TRI_LIST | (obj->batches[i].type & SURF_TWOSIDED) |
+                         (obj->indexsize == 4 ? PACKET_INDEX32 : 0) |
+                         (obj->quant ? PACKET_QUANTIZED : 0));
+            pkt->mat = obj->batches[i].mat;
+            pkt->slot = slot;
+            pkt->stride = AC3D_INDEXED_STRIDE(obj);
+            pkt->texid = obj->texid;
+            pkt->offset = obj->batches[i].first;
+            pkt->count = obj->batches[i].count;
+            pkt->normal = -1;
+            pkt->base = obj->batches[i].base;
+        }
+    }
+
+    for (i=0; i<obj->numcmds; list->numpackets++) {
+        AC3DPacket *pkt = &list->packets[list->numpackets];
+        int type = obj->optcmds[i].cmd[0];
+
+        pkt->type = type;
+        pkt->count = obj->optcmds[i].cmd[1];
+        pkt->mat = obj->optcmds[i+1].cmd[0];
+        pkt->slot = slot;
+        pkt->texid = obj->texid;
+        pkt->normal = -1;
+        pkt->base = 0;
+        i += 2;
+
+        if ((type & 0x0f) == SURF_POLYGON && !(type & SURF_SHADED)) {
+            pkt->type |= texcoords;
+            pkt->stride = AC3D_VERTEX_STRIDE(obj)-3;
+            pkt->normal = i;
+            i += 3;
+        } else if ((type & 0x0f) == SURF_POLYGON || (type & 0x0f) == SURF_TRI_STRIP ||
+                   (type & 0x0f) == SURF_TRI_LIST) {
+            pkt->type |= PACKET_NORMALS | texcoords;
+            pkt->stride = AC3D_VERTEX_STRIDE(obj);
+        } else {
+            pkt->stride = 3;
+        }
+        pkt->offset = i;
+        i += pkt->count*pkt->stride;
+    }
+    node->end = list->numpackets;
+
+    for (i=0; i<obj->numkids; i++)
+        fill_ac3d_drawlist(obj->kids[i], list, slot);
+
+    node->next = list->numnodes;
+}
+
+static
+int compare_ac3d_packet_refs(const void *a, const void *b)
+{
+    const AC3DPacketRef *ra = (const AC3DPacketRef*)a;
+    const AC3DPacketRef *rb = (const AC3DPacketRef*)b;
+
+    if (ra->texid != rb->texid)
+        return ra->texid < rb->texid ? -1 : 1;
+    if (ra->mat != rb->mat)
+        return ra->mat - rb->mat;
+    if (ra->type != rb->type)
+        return ra->type - rb->type;
+    return ra->packet - rb->packet;
+}
+
+// The packets by texture, material and type, so instanced drawing sets
+// each state once
+static
+void sort_ac3d_drawlist(AC3DDrawList *list)
+{
+    int n, p;
+
+    for (n=0; n<list->numnodes; n++) {
+        for (p=list->nodes[n].first; p<list->nodes[n].end; p++) {
+            AC3DPacketRef *ref = &list->order[p];
+            ref->texid = list->packets[p].texid;
+            ref->mat = list->packets[p].mat;
+            ref->type = list->packets[p].type;
+            ref->packet = p;
+            ref->node = n;
+        }
+    }
+    qsort(list->order, list->numpackets, sizeof(AC3DPacketRef), compare_ac3d_packet_refs);
+}
+
+int compile_ac3d_drawlist(AC3DFile *file)
+{
+    AC3DAllocator *allocator = &file->arena->allocator;
+    AC3DDrawList *list, count;
+    size_t size;
+
+    if (!file->obj)
+        return 0;
+
+#ifndef AC3D_HEADLESS
+    // The packets take the texids as they are now
+    load_ac3d_file_textures(file);
+#endif
+
+    memset(&count, 0, sizeof(AC3DDrawList));
+    count_ac3d_drawlist(file->obj, &count);
+
+    // From the allocator of the file, it is compiled again as needed
+    size = (AC3D_ARENA_ROUND(sizeof(AC3DDrawList)) +
+            AC3D_ARENA_ROUND(sizeof(AC3DDrawNode)*count.numnodes) +
+            AC3D_ARENA_ROUND(sizeof(AC3DPacket)*(count.numpackets+1)) +
+            AC3D_ARENA_ROUND(sizeof(AC3DDrawSlot)*(count.numslots+1)) +
+            AC3D_ARENA_ROUND(sizeof(AC3DPacketRef)*(count.numpackets+1)) +
+            count.numnodes);
+    list = (AC3DDrawList*)allocator->alloc(size, allocator->userdata);
+    if (!list)
+        return 0;
+    memset(list, 0, sizeof(AC3DDrawList));
+    list->size = size;
+    list->nodes = (AC3DDrawNode*)((char*)list + AC3D_ARENA_ROUND(sizeof(AC3DDrawList)));
+    list->packets = (AC3DPacket*)((char*)list->nodes + AC3D_ARENA_ROUND(sizeof(AC3DDrawNode)*count.numnodes));
+    list->slots = (AC3DDrawSlot*)((char*)list->packets + AC3D_ARENA_ROUND(sizeof(AC3DPacket)*(count.numpackets+1)));
+    list->order = (AC3DPacketRef*)((char*)list->slots + AC3D_ARENA_ROUND(sizeof(AC3DDrawSlot)*(count.numslots+1)));
+    list->live = (unsigned char*)list->order + AC3D_ARENA_ROUND(sizeof(AC3DPacketRef)*(count.numpackets+1));
+
+    fill_ac3d_drawlist(file->obj, list, -1);
+    sort_ac3d_drawlist(list);
+
+    free_ac3d_drawlist(file);
+    file->drawlist = list;
+    return 1;
+}
+
+// Same as glTranslatef, glMultMatrixf and the rotation around rotvec,
+// with the angles of an instance by handle or NULL for the objects' own
+static
+void update_ac3d_drawlist_slots(AC3DDrawList *list, const float *angles)
+{
+    int i;
+
+    for (i=0; i<list->numslots; i++) {
+        AC3DDrawSlot *slot = &list->slots[i];
+        AC3DObject *obj = slot->obj;
+        float m[16];
+
+        get_ac3d_object_matrix(obj, m);
+
+        if (obj->rotvec) {
+            float r[16], *v = obj->rotvec;
+            float a = (angles ? angles[obj->handle] : obj->angle) * M_PI / 180.0;
+            float c = cos(a), s = sin(a), t = 1.0 - c;
+            float x = v[0], y = v[1], z = v[2];
+            float len = sqrt(x*x + y*y + z*z);
+
+            if (len > 0.0) {
+                x /= len; y /= len; z /= len;
+            }
+            r[0] = t*x*x + c;   r[4] = t*x*y - s*z; r[8]  = t*x*z + s*y;
+            r[1] = t*x*y + s*z; r[5] = t*y*y + c;   r[9]  = t*y*z - s*x;
+            r[2] = t*x*z - s*y; r[6] = t*y*z + s*x; r[10] = t*z*z + c;
+            r[3] = r[7] = r[11] = 0.0;
+            r[15] = 1.0;
+            // T(p) R T(-p)
+            r[12] = v[3] - (r[0]*v[3] + r[4]*v[4] + r[8]*v[5]);
+            r[13] = v[4] - (r[1]*v[3] + r[5]*v[4] + r[9]*v[5]);
+            r[14] = v[5] - (r[2]*v[3] + r[6]*v[4] + r[10]*v[5]);
+            mult_ac3d_matrix(m, m, r);
+        }
+
+        if (slot->parent >= 0)
+            mult_ac3d_matrix(slot->m, list->slots[slot->parent].m, m);
+        else
+            memcpy(slot->m, m, sizeof(m));
+    }
+}
+
+typedef struct {
+    const float  *viewproj; // NULL = draw all
+    int           inside;   // the nodes before it are in the frustum
+    AC3DCullStats stats;
+} AC3DCuller;
+
+// 0 when the box is outside the frustum of m (clip = m * p), 2 when it
+// is inside and 1 when it crosses a plane
+static
+int test_ac3d_frustum(const float *m, const float *bbox)
+{
+    int result = 2;
+    int i, k;
+
+    // The planes are w+x, w-x, w+y, w-y, w+z and w-z >= 0, from the rows
+    // of m. A box is outside when its corner furthest along the normal
+    // is, and inside when its nearest corner is in for all of them.
+    for (i=0; i<6; i++) {
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        float far = m[15] + sign*m[12 + (i >> 1)];
+        float near = far;
+        for (k=0; k<3; k++) {
+            float a = m[k*4+3] + sign*m[k*4 + (i >> 1)];
+            far += a * bbox[a > 0.0 ? k+3 : k];
+            near += a * bbox[a > 0.0 ? k : k+3];
+        }
+        if (far < 0.0)
+            return 0;
+        if (near < 0.0)
+            result = 1;
+    }
+    return result;
+}
+
+// Returns 0 when node n and its subtree can be skipped. Objects without
+// a bbox have nothing to draw but may have kids, they are kept.
+static
+int is_ac3d_node_visible(AC3DCuller *c, AC3DDrawList *list, int n)
+{
+    AC3DDrawNode *node = &list->nodes[n];
+    float m[16];
+
+    if (!c->viewproj || n < c->inside || !node->obj->bbox)
+        return 1;
+
+    if (node->slot >= 0)
+        mult_ac3d_matrix(m, c->viewproj, list->slots[node->slot].m);
+    else
+        memcpy(m, c->viewproj, sizeof(m));
+
+    c->stats.tested++;
+    switch (test_ac3d_frustum(m, node->obj->bbox)) {
+        case 0:
+            c->stats.culled += node->next - n;
+            return 0;
+        case 2:
+            c->inside = node->next;
+            break;
+    }
+    return 1;
+}
+
+#ifndef AC3D_HEADLESS
+
+// The GL state the packets drawn so far left behind, only what differs
+// is set for the next one
+typedef struct {
+    const AC3DInstance *inst; // its textures and materials, NULL = none
+    int  lastType;
+    int  lastTex;
+    int  hadLighting;
+    bool unlit;
+    bool normalize;
+    bool normalArray;
+    bool texArray;
+} AC3DDrawState;
+
+static
+void begin_ac3d_draw(AC3DDrawState *st)
+{
+    st->inst = NULL;
+    st->lastType = -1;
+    st->lastTex = -2;
+    st->hadLighting = -1;
+    st->unlit = false;
+    st->normalize = false;
+    st->normalArray = false;
+    st->texArray = false;
+
+    glPushMatrix();
+    glEnableClientState(GL_VERTEX_ARRAY);
 }
 
-// ----------------------------------------------------------------------
 static
-void set_ac3d_material_priv(int idx, AC3DFile *file)
+void end_ac3d_draw(AC3DDrawState *st)
 {
-    static AC3DFile *lastFile = NULL;
-    
-    if (idx < 0 || idx >= file->nummats)
-        return;
+    if (st->unlit)
+        glEnable(GL_LIGHTING);
+    if (st->normalize)
+        glDisable(GL_NORMALIZE);
+    if (st->normalArray)
+        glDisableClientState(GL_NORMAL_ARRAY);
+    if (st->texArray)
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopMatrix();
 
-    if (lastMat == idx &&
-        lastFile == file)
-        return;
-    
-    lastMat = idx;
-    lastFile = file;
-    
-    glColor4f(file->mats[idx]->rgb[0],
-              file->mats[idx]->rgb[1],
-              file->mats[idx]->rgb[2],
-              file->mats[idx]->rgb[3]);
-    
-    glMaterialfv( GL_FRONT_AND_BACK, GL_DIFFUSE,   file->mats[idx]->rgb  );
-    glMaterialfv( GL_FRONT_AND_BACK, GL_AMBIENT,   file->mats[idx]->amb  );
-    glMaterialfv( GL_FRONT_AND_BACK, GL_EMISSION,  file->mats[idx]->emis );
-    glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR,  file->mats[idx]->spec );
-    glMaterialf(  GL_FRONT_AND_BACK, GL_SHININESS, file->mats[idx]->shi  );
+#ifdef USE_VBO
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
 }
 
-void draw_ac3d_object(AC3DObject *obj, AC3DFile *file)
+// Everything of pkt but the matrix and the draw call: texture, material,
+// lighting and the arrays
+static
+void set_ac3d_packet_state(AC3DDrawState *st, AC3DFile *file, AC3DObject *obj, 
+                           AC3DPacket *pkt, AC3DContext *ctx)
 {
-    int i, j;
+    int stride = pkt->stride * sizeof(AC3Doptcmd);
+    int texid = pkt->texid;
+    const char *base;
+    const char *vptr;
+
+    if (st->inst && st->inst->texids[obj->handle] != AC3D_TEXID_OF_FILE)
+        texid = st->inst->texids[obj->handle];
+    if (texid != st->lastTex) {
+        if (texid == -1) {
+            glDisable(GL_TEXTURE_2D);
+        } else {
+            glEnable(GL_TEXTURE_2D);
+            glBindTexture(GL_TEXTURE_2D, texid);
+        }
+        st->lastTex = texid;
+    }
+
+    // Materials of an instance are not remembered by ctx
+    if (st->inst && pkt->mat >= 0 && pkt->mat < file->nummats && st->inst->mats[pkt->mat]) {
+        apply_ac3d_material(st->inst->mats[pkt->mat]);
+        ctx->lastfile = NULL;
+    } else {
+        set_ac3d_material_priv(pkt->mat, file, ctx);
+    }
 
-    if (!obj->enabled) 
-        return;
-    
 #ifdef USE_VBO
-    if (!obj->vbo) {
-        glGenBuffers(1, &obj->vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(AC3Doptcmd)*obj->numcmds, obj->optcmds, GL_STATIC_DRAW); 
+    if (pkt->type & PACKET_INDEXED) {
+        glBindBuffer(GL_ARRAY_BUFFER, obj->ivbo[0]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->ivbo[1]);
     } else {
         glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
     }
+    base = NULL;
+#else
+    base = (const char*)((pkt->type & PACKET_INDEXED) ? obj->vertices : obj->optcmds);
 #endif
-    
-    if (!obj->texture_loaded) {
-        init_ac3d_textures();
-        load_textures_ac3d_object(file->obj, textures);
-    }
-    
-    if (obj->texid == -1) {
-        glDisable(GL_TEXTURE_2D);
-    } else {
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, obj->texid);
-    }
-    
-    if (obj->loc || obj->rot || obj->rotvec) {
-        glPushMatrix();
-        
-        if (obj->loc)
-            glTranslatef(obj->loc[0], obj->loc[1], obj->loc[2]);
+    if (pkt->type & PACKET_INDEXED)
+        vptr = base + pkt->base*stride;
+    else
+        vptr = base + pkt->offset*sizeof(AC3Doptcmd);
 
-        if (obj->rot) 
-            glMultMatrixf(obj->rot);
+    if ((pkt->type & 0x0f) != SURF_CLOSEDLINE &&
+        (pkt->type & 0x0f) != SURF_LINE &&
+        (pkt->type & 0x0f) != SURF_LINES) {
         
-        if (obj->rotvec) {
-            glTranslatef(obj->rotvec[3], obj->rotvec[4], obj->rotvec[5]);
-            glRotatef(obj->angle, obj->rotvec[0], obj->rotvec[1], obj->rotvec[2]);
-            glTranslatef(-obj->rotvec[3], -obj->rotvec[4], -obj->rotvec[5]);
+        if (st->unlit) {
+            glEnable(GL_LIGHTING);
+            st->unlit = false;
         }
-    }
-    
-    {
-        i=0;
-        AC3Doptcmd *ptr = obj->optcmds;
-        AC3Doptcmd *ptrNext;
-        while (i < obj->numcmds) {
-            int type;
-            int numrefs;
-            int mat;
-            int stride = 3;
-            bool useNormalArray = false;
-            
-            type = ptr->cmd[0];
-            numrefs = ptr->cmd[1];
-            ptr++; i++;
-            mat = ptr->cmd[0];
-            ptr++; i++;
-            
-            set_ac3d_material_priv(mat, file);
-#if 0
-/*
- 2009-08-10 00:46:44.722 AC3D test[2480:20b] 2
- 2009-08-10 00:46:44.723 AC3D test[2480:20b] 16
- 2009-08-10 00:46:44.735 AC3D test[2480:20b] 120
- 2009-08-10 00:46:44.736 AC3D test[2480:20b] 134
- 2009-08-10 00:46:44.739 AC3D test[2480:20b] 238
- 2009-08-10 00:46:44.743 AC3D test[2480:20b] 318
- 2009-08-10 00:46:44.745 AC3D test[2480:20b] 362
- 2009-08-10 00:46:44.748 AC3D test[2480:20b] 442
- 2009-08-10 00:46:44.749 AC3D test[2480:20b] 486
- 2009-08-10 00:46:44.750 AC3D test[2480:20b] 530
- 2009-08-10 00:46:44.751 AC3D test[2480:20b] 610
- 2009-08-10 00:46:44.752 AC3D test[2480:20b] 642
- 2009-08-10 00:46:44.753 AC3D test[2480:20b] 734
- 2009-08-10 00:46:44.753 AC3D test[2480:20b] 826
- 2009-08-10 00:46:44.754 AC3D test[2480:20b] 858
- 2009-08-10 00:46:44.755 AC3D test[2480:20b] 962
-            if (i==362) {
-                srand(ptr);
-                float rgb[4];
-                rgb[0] = (rand()%32768)/32768.0;
-                rgb[1] = (rand()%32768)/32768.0;
-                rgb[2] = (rand()%32768)/32768.0;            
-                rgb[3] = 1.0;
-                glMaterialfv( GL_FRONT_AND_BACK, GL_DIFFUSE,   rgb  );
+        if ((pkt->type & SURF_TWOSIDED) != (st->lastType & SURF_TWOSIDED) || st->lastType < 0) {
+            if (pkt->type & SURF_TWOSIDED) {
+                glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+                glDisable(GL_CULL_FACE);
+            } else {
+                glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+                glEnable(GL_CULL_FACE);
             }
- */
-#endif
-            if ((type & 0x0f) == SURF_POLYGON ||
-                (type & 0x0f) == SURF_TRI_STRIP) {
-                                
-                if (obj->texture)
-                    stride += 2;
-                
-                if (type & SURF_TWOSIDED) {
-                    glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
-                    glDisable(GL_CULL_FACE);
-                } else {
-                    glLightModelf(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
-                    glEnable(GL_CULL_FACE);
-                }
-                
-                if (type & SURF_SHADED) {
-                    stride += 3;
-                    glShadeModel(GL_SMOOTH);
-                    useNormalArray = true;
-                } else if ((type & 0x0f) == SURF_TRI_STRIP) {
-                    stride += 3;
-                    glShadeModel(GL_FLAT);
-                    useNormalArray = true;
-                } else {
-                    glShadeModel(GL_FLAT);
+        }
+        if ((pkt->type & SURF_SHADED) != (st->lastType & SURF_SHADED) || st->lastType < 0) 
+            glShadeModel((pkt->type & SURF_SHADED) ? GL_SMOOTH : GL_FLAT);
+        st->lastType = pkt->type;
+        
+        if (pkt->normal >= 0) {
 #ifdef USE_FLOATS
-                    glNormal3f(ptr[0].f, ptr[1].f, ptr[2].f);
+            glNormal3f(obj->optcmds[pkt->normal].f,
+                       obj->optcmds[pkt->normal+1].f,
+                       obj->optcmds[pkt->normal+2].f);
 #else
-                    glNormal3x(ptr[0].i, ptr[1].i, ptr[2].i);
+            glNormal3x(obj->optcmds[pkt->normal].i,
+                       obj->optcmds[pkt->normal+1].i,
+                       obj->optcmds[pkt->normal+2].i);
 #endif
-                    ptr+=3; i+=3;
-                }
+        }
+    } else {
+        // Ask for the lighting once per draw, lines are unlit
+        if (!st->unlit) {
+            if (st->hadLighting < 0)
+                st->hadLighting = glIsEnabled(GL_LIGHTING);
+            if (st->hadLighting) {
+                glDisable(GL_LIGHTING);
+                st->unlit = true;
             }
-            
-            ptrNext = &ptr[stride*numrefs];
-            j = i;
-            i += stride*numrefs;
-            stride *= sizeof(float);
+        }
+    }
+
+    if (!!(pkt->type & PACKET_NORMALS) != st->normalArray) {
+        if (pkt->type & PACKET_NORMALS)
+            glEnableClientState(GL_NORMAL_ARRAY);
+        else
+            glDisableClientState(GL_NORMAL_ARRAY);
+        st->normalArray = !st->normalArray;
+    }
+    if (!!(pkt->type & PACKET_TEXCOORDS) != st->texArray) {
+        if (pkt->type & PACKET_TEXCOORDS)
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        else
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        st->texArray = !st->texArray;
+    }
+
+    if (pkt->type & PACKET_INDEXED) {
+        set_ac3d_indexed_arrays(obj, vptr);
+        // Left on for the rest of the draw once needed
+        if ((pkt->type & PACKET_QUANTIZED) && !st->normalize && !glIsEnabled(GL_NORMALIZE)) {
+            glEnable(GL_NORMALIZE);
+            st->normalize = true;
+        }
+        return;
+    }
 
-            if ((type & 0x0f) == SURF_POLYGON ||
-                (type & 0x0f) == SURF_TRI_STRIP) {
-                //glEnable(GL_LIGHTING);
-                
-                glEnableClientState(GL_VERTEX_ARRAY);
 #ifdef USE_FLOATS
-                glVertexPointer(3, GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+    glVertexPointer(3, GL_FLOAT, stride, vptr);
 #else
-                glVertexPointer(3, GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+    glVertexPointer(3, GL_FIXED, stride, vptr);
 #endif
-                ptr+=3; j+=3;
-                
-                if (useNormalArray) {
-                    glEnableClientState(GL_NORMAL_ARRAY);
+    if (pkt->type & PACKET_NORMALS) {
 #ifdef USE_FLOATS
-                    glNormalPointer(GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+        glNormalPointer(GL_FLOAT, stride, vptr + 3*sizeof(AC3Doptcmd));
 #else
-                    glNormalPointer(GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+        glNormalPointer(GL_FIXED, stride, vptr + 3*sizeof(AC3Doptcmd));
 #endif
-                    ptr+=3; j+=3;
-                }
-
-                if (obj->texture) {
-                    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    if (pkt->type & PACKET_TEXCOORDS) {
+        const char *tptr = vptr + ((pkt->type & PACKET_NORMALS) ? 6 : 3)*sizeof(AC3Doptcmd);
 #ifdef USE_FLOATS
-                    glTexCoordPointer(2, GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+        glTexCoordPointer(2, GL_FLOAT, stride, tptr);
 #else
-                    glTexCoordPointer(2, GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+        glTexCoordPointer(2, GL_FIXED, stride, tptr);
 #endif
-                    ptr+=2; j+=2;
-                }
-                
-                if ((type & 0x0f) == SURF_TRI_STRIP)
-                    glDrawArrays(GL_TRIANGLE_STRIP, 0, numrefs);
-                else
-                    glDrawArrays(GL_TRIANGLE_FAN, 0, numrefs);
-                
-                glDisableClientState(GL_NORMAL_ARRAY);
-                glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-                
-            } else {
+    }
+}
 
-                glEnableClientState(GL_VERTEX_ARRAY);
-#ifdef USE_FLOATS
-                glVertexPointer(3, GL_FLOAT, stride, obj->vbo ? (void*)(j*4) : ptr);
+// The draw call of pkt, set up by set_ac3d_packet_state
+static
+void draw_ac3d_packet(AC3DObject *obj, AC3DPacket *pkt)
+{
+    if (pkt->type & PACKET_INDEXED) {
+#ifdef USE_VBO
+        const char *iptr = NULL;
 #else
-                glVertexPointer(3, GL_FIXED, stride, obj->vbo ? (void*)(j*4) : ptr);
+        const char *iptr = (const char*)obj->indices;
 #endif
-                ptr+=3; j+=3;
-                
-                GLboolean hadLighting = glIsEnabled(GL_LIGHTING);
-                if (hadLighting)
-                    glDisable(GL_LIGHTING);
-                switch (type & 0x0f) {
-                    case SURF_CLOSEDLINE:
-                        glDrawArrays(GL_LINE_LOOP, 0, numrefs);
-                        break;
-                        
-                    case SURF_LINE:
-                        glDrawArrays(GL_LINE_STRIP, 0, numrefs);
-                        break;
-                }
-                if (hadLighting)
-                    glEnable(GL_LIGHTING);
+        if (pkt->type & PACKET_QUANTIZED)
+            push_ac3d_quant(obj);
+        if (pkt->type & PACKET_INDEX32)
+            glDrawElements(GL_TRIANGLES, pkt->count, GL_UNSIGNED_INT, iptr + pkt->offset*4);
+        else
+            glDrawElements(GL_TRIANGLES, pkt->count, GL_UNSIGNED_SHORT, iptr + pkt->offset*2);
+        if (pkt->type & PACKET_QUANTIZED)
+            pop_ac3d_quant(obj);
+        return;
+    }
+
+    switch (pkt->type & 0x0f) {
+        case SURF_POLYGON:    glDrawArrays(GL_TRIANGLE_FAN, 0, pkt->count);   break;
+        case SURF_TRI_STRIP:  glDrawArrays(GL_TRIANGLE_STRIP, 0, pkt->count); break;
+        case SURF_TRI_LIST:   glDrawArrays(GL_TRIANGLES, 0, pkt->count);      break;
+        case SURF_CLOSEDLINE: glDrawArrays(GL_LINE_LOOP, 0, pkt->count);      break;
+        case SURF_LINE:       glDrawArrays(GL_LINE_STRIP, 0, pkt->count);     break;
+        case SURF_LINES:      glDrawArrays(GL_LINES, 0, pkt->count);          break;
+    }
+}
+
+// With the state of inst when not NULL
+static
+void draw_ac3d_drawlist(AC3DFile *file, AC3DCuller *culler, 
+                        const AC3DInstance *inst, AC3DContext *ctx)
+{
+    AC3DDrawList *list = file->drawlist;
+    AC3DDrawState st;
+    int lastSlot = -1;
+    int n, p;
+
+    update_ac3d_drawlist_slots(list, inst ? inst->angles : NULL);
+
+    begin_ac3d_draw(&st);
+    st.inst = inst;
+
+    for (n=0; n<list->numnodes;) {
+        AC3DDrawNode *node = &list->nodes[n];
+        AC3DObject *obj = node->obj;
+        bool enabled = inst ? inst->enabled[obj->handle] : obj->enabled;
+
+        if (!enabled || !is_ac3d_node_visible(culler, list, n)) {
+            n = node->next;
+            continue;
+        }
+        culler->stats.drawn++;
+        n++;
+
+#ifdef USE_VBO
+        upload_ac3d_object_buffers(obj);
+#endif
+
+        for (p=node->first; p<node->end; p++) {
+            AC3DPacket *pkt = &list->packets[p];
+
+            if (pkt->slot != lastSlot) {
+                glPopMatrix();
+                glPushMatrix();
+                if (pkt->slot >= 0)
+                    glMultMatrixf(list->slots[pkt->slot].m);
+                lastSlot = pkt->slot;
             }
-            glDisableClientState(GL_VERTEX_ARRAY);
-            ptr = ptrNext;
+
+            set_ac3d_packet_state(&st, file, obj, pkt, ctx);
+            draw_ac3d_packet(obj, pkt);
         }
     }
+
+    end_ac3d_draw(&st);
+}
+
+// ----------------------------------------------------------------------
+
+void draw_ac3d_file_ctx(AC3DContext *ctx, AC3DFile *file)
+{
+    AC3DCuller culler = {NULL};
+
+    if (!file->drawlist)
+        compile_ac3d_drawlist(file);
     
-    for (i=0; i<obj->numkids; i++) 
-        draw_ac3d_object(obj->kids[i], file);
-    
-    if (obj->loc || obj->rot || obj->rotvec) {
-        glPopMatrix();
-    }
+    // Walk the tree when there was no memory for the list
+    if (file->drawlist)
+        draw_ac3d_drawlist(file, &culler, NULL, ctx);
+    else
+        draw_ac3d_object(file->obj, file, ctx);
 }
 
 void draw_ac3d_file(AC3DFile *file)
 {
-    draw_ac3d_object(file->obj, file);
+    draw_ac3d_file_ctx(file->ctx, file);
+}
+
+// ----------------------------------------------------------------------
+
+int draw_ac3d_file_culled_ctx(AC3DContext *ctx, AC3DFile *file, const float *viewproj, AC3DCullStats *stats)
+{
+    AC3DCuller culler = {viewproj};
+
+    if (!file->drawlist)
+        compile_ac3d_drawlist(file);
+
+    // Without the list nothing is culled
+    if (file->drawlist)
+        draw_ac3d_drawlist(file, &culler, NULL, ctx);
+    else
+        draw_ac3d_object(file->obj, file, ctx);
+
+    if (stats)
+        *stats = culler.stats;
+    return culler.stats.culled;
+}
+
+int draw_ac3d_file_culled(AC3DFile *file, const float *viewproj, AC3DCullStats *stats)
+{
+    return draw_ac3d_file_culled_ctx(file->ctx, file, viewproj, stats);
+}
+
+// ----------------------------------------------------------------------
+
+// Marks the nodes drawn with the objects enabled as they are now
+static
+void mark_ac3d_live_nodes(AC3DDrawList *list)
+{
+    int n;
+
+    memset(list->live, 0, list->numnodes);
+    for (n=0; n<list->numnodes;) {
+        AC3DDrawNode *node = &list->nodes[n];
+
+        if (!node->obj->enabled) {
+            n = node->next;
+            continue;
+        }
+        list->live[n++] = 1;
+
+#ifdef USE_VBO
+        upload_ac3d_object_buffers(node->obj);
+#endif
+    }
+}
+
+void draw_ac3d_instances_ctx(AC3DContext *ctx, 
+                             AC3DFile *file, 
+                             const float *matrices, 
+                             int count,
+                             const float *colors,
+                             const unsigned char *enabled)
+{
+    AC3DDrawList *list;
+    AC3DDrawState st;
+    float view[16], m[16];
+    int i, p;
+
+    if (!file->drawlist)
+        compile_ac3d_drawlist(file);
+
+    // Without the list each instance walks the tree
+    if (!(list = file->drawlist)) {
+        for (i=0; i<count; i++) {
+            if (enabled && !enabled[i])
+                continue;
+            glPushMatrix();
+            glMultMatrixf(&matrices[i*16]);
+            draw_ac3d_object(file->obj, file, ctx);
+            glPopMatrix();
+        }
+        return;
+    }
+
+    update_ac3d_drawlist_slots(list, NULL);
+    mark_ac3d_live_nodes(list);
+
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    begin_ac3d_draw(&st);
+
+    for (p=0; p<list->numpackets; p++) {
+        AC3DPacketRef *ref = &list->order[p];
+        AC3DPacket *pkt = &list->packets[ref->packet];
+        AC3DObject *obj = list->nodes[ref->node].obj;
+
+        if (!list->live[ref->node])
+            continue;
+
+        set_ac3d_packet_state(&st, file, obj, pkt, ctx);
+
+        for (i=0; i<count; i++) {
+            if (enabled && !enabled[i])
+                continue;
+
+            mult_ac3d_matrix(m, view, &matrices[i*16]);
+            if (pkt->slot >= 0)
+                mult_ac3d_matrix(m, m, list->slots[pkt->slot].m);
+            glLoadMatrixf(m);
+
+            if (colors) {
+                glColor4f(colors[i*4], colors[i*4+1], colors[i*4+2], colors[i*4+3]);
+                glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, &colors[i*4]);
+            }
+
+            draw_ac3d_packet(obj, pkt);
+        }
+
+        // The diffuse is the one of the last instance, set it again
+        if (colors)
+            ctx->lastfile = NULL;
+    }
+
+    end_ac3d_draw(&st);
+}
+
+void draw_ac3d_instances(AC3DFile *file, 
+                         const float *matrices, 
+                         int count,
+                         const float *colors,
+                         const unsigned char *enabled)
+{
+    draw_ac3d_instances_ctx(file->ctx, file, matrices, count, colors, enabled);
+}
+
+// ----------------------------------------------------------------------
+
+int draw_ac3d_instance_culled_ctx(AC3DContext *ctx, AC3DInstance *inst, const float *viewproj, AC3DCullStats *stats)
+{
+    AC3DFile *file = inst->file;
+    AC3DCuller culler = {viewproj};
+
+    if (!file->drawlist)
+        compile_ac3d_drawlist(file);
+
+    // The tree has the state of the file, nothing is drawn without the list
+    if (file->drawlist)
+        draw_ac3d_drawlist(file, &culler, inst, ctx);
+
+    if (stats)
+        *stats = culler.stats;
+    return culler.stats.culled;
+}
+
+int draw_ac3d_instance_culled(AC3DInstance *inst, const float *viewproj, AC3DCullStats *stats)
+{
+    return draw_ac3d_instance_culled_ctx(inst->file->ctx, inst, viewproj, stats);
+}
+
+void draw_ac3d_instance_ctx(AC3DContext *ctx, AC3DInstance *inst)
+{
+    draw_ac3d_instance_culled_ctx(ctx, inst, NULL, NULL);
 }
 
+void draw_ac3d_instance(AC3DInstance *inst)
+{
+    draw_ac3d_instance_culled_ctx(inst->file->ctx, inst, NULL, NULL);
+}
+
+#endif // AC3D_HEADLESS
+
 float *get_ac3d_bbox(AC3DFile *file)
 {
     return file->bbox;
 }
 
+int get_ac3d_object_bounds(AC3DObject *obj, float *bbox, float *sphere)
+{
+    int i;
+
+    if (!obj || !obj->bbox)
+        return 0;
+
+    if (bbox)
+        memcpy(bbox, obj->bbox, sizeof(float)*6);
+
+    if (sphere) {
+        float r = 0.0;
+        for (i=0; i<3; i++) {
+            float d = (obj->bbox[i+3] - obj->bbox[i]) * 0.5;
+            sphere[i] = obj->bbox[i] + d;
+            r += d*d;
+        }
+        sphere[3] = sqrtf(r);
+    }
+    return 1;
+}
+
+#ifndef AC3D_HEADLESS
+
 void draw_ac3d_bbox(AC3DFile *file)
 {
     if (file->bbox) {
@@ -1719,3 +7658,954 @@ void draw_ac3d_bbox(AC3DFile *file)
           glEnable(GL_LIGHTING);
     }
 }
+
+#endif // AC3D_HEADLESS
+
+// ----------------------------------------------------------------------
+// Software rendering
+//
+// Renders the compiled draw list on the CPU, for machines without a GPU.
+// The vertices are lit like fixed function GL with one white directional
+// light, clipped against the near plane and binned into 64x64 pixel
+// tiles. The tiles are then rasterized on the worker threads, each with a
+// color and depth buffer of its own, evaluating the edge functions four
+// pixels at a time with the GCC vector extensions (SSE on x86, NEON on
+// ARM).
+
+#ifdef USE_RASTERIZER
+
+#define AC3D_TILE_SIZE 64
+
+typedef float   AC3Dv4f __attribute__((vector_size(16)));
+typedef int32_t AC3Dv4i __attribute__((vector_size(16)));
+
+typedef struct {
+    const unsigned char *rgba;
+    int                  width;
+    int                  height;
+} AC3DRasterTexture;
+
+// An atlas put together for one render_ac3d_file
+typedef struct {
+    const char    *name;
+    unsigned char *rgba;
+    int            width;
+    int            height;
+} AC3DRasterAtlas;
+
+typedef struct {
+    float pos[4];  // clip space
+    float rgba[4];
+    float back[4]; // lit from behind, two sided only
+    float uv[2];
+} AC3DRasterVertex;
+
+// A triangle, or a line when line is set
+typedef struct {
+    float                    edge[3][3]; // A,B,C, over the area, the one
+                                         // opposite vertex k is its weight
+    int                      topleft[3]; // -1 when pixels on the edge are in
+    float                    attr[8][3]; // at vertex 0 and the deltas to 1
+                                         // and 2: z, 1/w, rgba/w and uv/w
+    float                    line[2][3]; // x,y,z of the ends of a line, its
+                                         // color goes in attr[2..5][0]
+    const AC3DRasterTexture *tex;
+    short                    minx, miny, maxx, maxy;
+    short                    isline;
+} AC3DRasterPrim;
+
+typedef struct {
+    int *prims;
+    int  count;
+    int  size;
+} AC3DRasterBin;
+
+typedef struct {
+    const AC3DRenderOptions *opts;
+    AC3DRasterPrim          *prims;
+    int                      numprims;
+    int                      sizeprims;
+    AC3DRasterBin           *bins;
+    int                      tilesx;
+    int                      tilesy;
+    unsigned char           *rgba;
+    int                      next;  // tile, taken by the workers
+    int                      failed;
+} AC3DRaster;
+
+static
+AC3DRasterPrim *add_ac3d_raster_prim(AC3DRaster *r)
+{
+    if (r->numprims == r->sizeprims) {
+        int size = r->sizeprims ? r->sizeprims*2 : 1024;
+        AC3DRasterPrim *prims = (AC3DRasterPrim*)realloc(r->prims, sizeof(AC3DRasterPrim)*size);
+        if (!prims) {
+            r->failed = 1;
+            return NULL;
+        }
+        r->prims = prims;
+        r->sizeprims = size;
+    }
+    return &r->prims[r->numprims];
+}
+
+// Puts the last added prim in the bins of the tiles it touches
+static
+void bin_ac3d_raster_prim(AC3DRaster *r)
+{
+    AC3DRasterPrim *prim = &r->prims[r->numprims];
+    int tx, ty;
+
+    for (ty = prim->miny / AC3D_TILE_SIZE; ty <= prim->maxy / AC3D_TILE_SIZE; ty++) {
+        for (tx = prim->minx / AC3D_TILE_SIZE; tx <= prim->maxx / AC3D_TILE_SIZE; tx++) {
+            AC3DRasterBin *bin = &r->bins[ty*r->tilesx + tx];
+            if (bin->count == bin->size) {
+                int size = bin->size ? bin->size*2 : 64;
+                int *prims = (int*)realloc(bin->prims, sizeof(int)*size);
+                if (!prims) {
+                    r->failed = 1;
+                    return;
+                }
+                bin->prims = prims;
+                bin->size = size;
+            }
+            bin->prims[bin->count++] = r->numprims;
+        }
+    }
+    r->numprims++;
+}
+
+static
+void to_ac3d_screen(AC3DRaster *r, const AC3DRasterVertex *v, float *xyzw)
+{
+    float iw = 1.0 / v->pos[3];
+    xyzw[0] = (v->pos[0]*iw*0.5 + 0.5) * r->opts->width;
+    xyzw[1] = (0.5 - v->pos[1]*iw*0.5) * r->opts->height;
+    xyzw[2] = v->pos[2]*iw*0.5 + 0.5;
+    xyzw[3] = iw;
+}
+
+// Clamps the screen bounds to the image, returns 0 when outside of it
+static
+int clip_ac3d_raster_bounds(AC3DRaster *r, AC3DRasterPrim *prim,
+                            float minx, float miny, float maxx, float maxy)
+{
+    if (maxx < 0.0 || maxy < 0.0 || minx >= r->opts->width || miny >= r->opts->height)
+        return 0;
+    prim->minx = minx < 0.0 ? 0 : (int)minx;
+    prim->miny = miny < 0.0 ? 0 : (int)miny;
+    prim->maxx = maxx >= r->opts->width ? r->opts->width-1 : (int)maxx;
+    prim->maxy = maxy >= r->opts->height ? r->opts->height-1 : (int)maxy;
+    return 1;
+}
+
+static
+void setup_ac3d_raster_triangle(AC3DRaster *r,
+                                const AC3DRasterVertex *v0,
+                                const AC3DRasterVertex *v1,
+                                const AC3DRasterVertex *v2,
+                                int twosided,
+                                const AC3DRasterTexture *tex)
+{
+    const AC3DRasterVertex *v[3];
+    AC3DRasterPrim *prim;
+    float s[3][4], area, a[3][8];
+    int front, i, k;
+
+    to_ac3d_screen(r, v0, s[0]);
+    to_ac3d_screen(r, v1, s[1]);
+    to_ac3d_screen(r, v2, s[2]);
+
+    // Counter clockwise in GL is clockwise with y down
+    area = (s[1][0]-s[0][0])*(s[2][1]-s[0][1]) - (s[2][0]-s[0][0])*(s[1][1]-s[0][1]);
+    front = area < 0.0;
+    if (area == 0.0 || (!front && !twosided))
+        return;
+
+    prim = add_ac3d_raster_prim(r);
+    if (!prim)
+        return;
+
+    if (!clip_ac3d_raster_bounds(r, prim,
+                                 fminf(s[0][0], fminf(s[1][0], s[2][0])),
+                                 fminf(s[0][1], fminf(s[1][1], s[2][1])),
+                                 fmaxf(s[0][0], fmaxf(s[1][0], s[2][0])),
+                                 fmaxf(s[0][1], fmaxf(s[1][1], s[2][1]))))
+        return;
+
+    // Make the area positive, swap 1 and 2 for front faces
+    v[0] = v0;
+    v[1] = front ? v2 : v1;
+    v[2] = front ? v1 : v2;
+    if (front) {
+        float t[4];
+        memcpy(t, s[1], sizeof(t));
+        memcpy(s[1], s[2], sizeof(t));
+        memcpy(s[2], t, sizeof(t));
+        area = -area;
+    }
+
+    for (i=0; i<3; i++) {
+        const float *p = s[(i+1)%3], *q = s[(i+2)%3];
+        float A = (p[1] - q[1]) / area;
+        float B = (q[0] - p[0]) / area;
+        prim->edge[i][0] = A;
+        prim->edge[i][1] = B;
+        prim->edge[i][2] = -(A*p[0] + B*p[1]);
+        prim->topleft[i] = (A > 0.0 || (A == 0.0 && B > 0.0)) ? -1 : 0;
+    }
+
+    for (i=0; i<3; i++) {
+        const float *rgba = front || !twosided ? v[i]->rgba : v[i]->back;
+        a[i][0] = s[i][2];
+        a[i][1] = s[i][3];
+        for (k=0; k<4; k++)
+            a[i][2+k] = rgba[k] * s[i][3];
+        a[i][6] = v[i]->uv[0] * s[i][3];
+        a[i][7] = v[i]->uv[1] * s[i][3];
+    }
+    for (k=0; k<8; k++) {
+        prim->attr[k][0] = a[0][k];
+        prim->attr[k][1] = a[1][k] - a[0][k];
+        prim->attr[k][2] = a[2][k] - a[0][k];
+    }
+
+    prim->tex = tex;
+    prim->isline = 0;
+    bin_ac3d_raster_prim(r);
+}
+
+static
+void lerp_ac3d_raster_vertex(AC3DRasterVertex *dst,
+                             const AC3DRasterVertex *a,
+                             const AC3DRasterVertex *b,
+                             float t)
+{
+    const float *fa = (const float*)a, *fb = (const float*)b;
+    float *fd = (float*)dst;
+    int i;
+    for (i=0; i<(int)(sizeof(AC3DRasterVertex)/sizeof(float)); i++)
+        fd[i] = fa[i] + (fb[i] - fa[i]) * t;
+}
+
+// Clips against the near plane and sets up what is left as a fan
+static
+void add_ac3d_raster_triangle(AC3DRaster *r,
+                              const AC3DRasterVertex *v0,
+                              const AC3DRasterVertex *v1,
+                              const AC3DRasterVertex *v2,
+                              int twosided,
+                              const AC3DRasterTexture *tex)
+{
+    const AC3DRasterVertex *in[3];
+    AC3DRasterVertex out[4];
+    float d[3];
+    int i, n = 0, k;
+
+    in[0] = v0;
+    in[1] = v1;
+    in[2] = v2;
+
+    // All outside one side
+    for (k=0; k<3; k++) {
+        if (v0->pos[k] > v0->pos[3] && v1->pos[k] > v1->pos[3] && v2->pos[k] > v2->pos[3])
+            return;
+        if (v0->pos[k] < -v0->pos[3] && v1->pos[k] < -v1->pos[3] && v2->pos[k] < -v2->pos[3])
+            return;
+    }
+
+    for (i=0; i<3; i++)
+        d[i] = in[i]->pos[2] + in[i]->pos[3];
+
+    if (d[0] >= 0.0 && d[1] >= 0.0 && d[2] >= 0.0) {
+        setup_ac3d_raster_triangle(r, v0, v1, v2, twosided, tex);
+        return;
+    }
+
+    for (i=0; i<3; i++) {
+        int j = (i+1) % 3;
+        if (d[i] >= 0.0)
+            out[n++] = *in[i];
+        if ((d[i] >= 0.0) != (d[j] >= 0.0))
+            lerp_ac3d_raster_vertex(&out[n++], in[i], in[j], d[i] / (d[i] - d[j]));
+    }
+
+    for (i=2; i<n; i++)
+        setup_ac3d_raster_triangle(r, &out[0], &out[i-1], &out[i], twosided, tex);
+}
+
+static
+void add_ac3d_raster_line(AC3DRaster *r,
+                          const AC3DRasterVertex *v0,
+                          const AC3DRasterVertex *v1)
+{
+    AC3DRasterVertex a = *v0, b = *v1;
+    AC3DRasterPrim *prim;
+    float s[2][4];
+    float da = a.pos[2] + a.pos[3], db = b.pos[2] + b.pos[3];
+    int k;
+
+    if (da < 0.0 && db < 0.0)
+        return;
+    if (da < 0.0)
+        lerp_ac3d_raster_vertex(&a, v0, v1, da / (da - db));
+    else if (db < 0.0)
+        lerp_ac3d_raster_vertex(&b, v0, v1, da / (da - db));
+
+    to_ac3d_screen(r, &a, s[0]);
+    to_ac3d_screen(r, &b, s[1]);
+
+    prim = add_ac3d_raster_prim(r);
+    if (!prim)
+        return;
+    if (!clip_ac3d_raster_bounds(r, prim,
+                                 fminf(s[0][0], s[1][0]), fminf(s[0][1], s[1][1]),
+                                 fmaxf(s[0][0], s[1][0]), fmaxf(s[0][1], s[1][1])))
+        return;
+
+    for (k=0; k<3; k++) {
+        prim->line[0][k] = s[0][k];
+        prim->line[1][k] = s[1][k];
+    }
+    // Lines are unlit and flat
+    for (k=0; k<4; k++)
+        prim->attr[2+k][0] = a.rgba[k];
+    prim->tex = NULL;
+    prim->isline = 1;
+    bin_ac3d_raster_prim(r);
+}
+
+// One white directional light, as GL_LIGHT0 with the default light model
+static
+void light_ac3d_raster_vertex(const AC3DMaterial *mat, const float *n,
+                              const float *l, const float *h, float *rgba)
+{
+    float d = n[0]*l[0] + n[1]*l[1] + n[2]*l[2];
+    int k;
+
+    for (k=0; k<3; k++)
+        rgba[k] = mat->emis[k] + mat->amb[k]*0.2;
+    if (d > 0.0) {
+        float sp = n[0]*h[0] + n[1]*h[1] + n[2]*h[2];
+        sp = sp > 0.0 ? powf(sp, mat->shi) : 0.0;
+        for (k=0; k<3; k++)
+            rgba[k] += mat->rgb[k]*d + mat->spec[k]*sp;
+    }
+    for (k=0; k<3; k++)
+        rgba[k] = rgba[k] < 0.0 ? 0.0 : rgba[k] > 1.0 ? 1.0 : rgba[k];
+    rgba[3] = mat->rgb[3];
+}
+
+typedef struct {
+    AC3DRaster         *r;
+    AC3DObject         *obj;
+    const AC3DMaterial *mat;
+    const AC3Doptcmd   *base;
+    const AC3DPacket   *pkt;
+    float               mvp[16];
+    float               nm[9];
+    float               light[3];
+    float               half[3];
+    AC3DRasterVertex   *cache;
+    int                *stamps;
+    int                 stamp;
+} AC3DRasterPacket;
+
+static
+const AC3DRasterVertex *fetch_ac3d_raster_vertex(AC3DRasterPacket *rp, int idx)
+{
+    const AC3DPacket *pkt = rp->pkt;
+    const AC3Doptcmd *src = rp->base + idx*pkt->stride;
+    AC3DRasterVertex *v = &rp->cache[idx];
+    float p[3], n[3], e[3], uv[2], len;
+    int k;
+
+    if (rp->stamps[idx] == rp->stamp)
+        return v;
+    rp->stamps[idx] = rp->stamp;
+
+    if (pkt->type & PACKET_INDEXED) {
+        decode_ac3d_vertex(rp->obj, idx, p, n, uv);
+    } else {
+        for (k=0; k<3; k++)
+            p[k] = CMD_FLOAT(src[k]);
+        if (pkt->type & PACKET_NORMALS) {
+            for (k=0; k<3; k++)
+                n[k] = CMD_FLOAT(src[3+k]);
+        } else if (pkt->normal >= 0) {
+            for (k=0; k<3; k++)
+                n[k] = CMD_FLOAT(rp->obj->optcmds[pkt->normal + k]);
+        }
+        if (pkt->type & PACKET_TEXCOORDS) {
+            src += (pkt->type & PACKET_NORMALS) ? 6 : 3;
+            uv[0] = CMD_FLOAT(src[0]);
+            uv[1] = CMD_FLOAT(src[1]);
+        }
+    }
+    for (k=0; k<4; k++)
+        v->pos[k] = rp->mvp[k]*p[0] + rp->mvp[4+k]*p[1] + rp->mvp[8+k]*p[2] + rp->mvp[12+k];
+
+    if ((pkt->type & 0x0f) == SURF_CLOSEDLINE ||
+        (pkt->type & 0x0f) == SURF_LINE ||
+        (pkt->type & 0x0f) == SURF_LINES) {
+        memcpy(v->rgba, rp->mat->rgb, sizeof(float)*4);
+        return v;
+    }
+
+    for (k=0; k<3; k++)
+        e[k] = rp->nm[k]*n[0] + rp->nm[3+k]*n[1] + rp->nm[6+k]*n[2];
+    len = sqrtf(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+    if (len > 0.0)
+        for (k=0; k<3; k++)
+            e[k] /= len;
+
+    light_ac3d_raster_vertex(rp->mat, e, rp->light, rp->half, v->rgba);
+    if (pkt->type & SURF_TWOSIDED) {
+        for (k=0; k<3; k++)
+            e[k] = -e[k];
+        light_ac3d_raster_vertex(rp->mat, e, rp->light, rp->half, v->back);
+    }
+
+    if (pkt->type & PACKET_TEXCOORDS) {
+        v->uv[0] = uv[0];
+        v->uv[1] = uv[1];
+    } else {
+        v->uv[0] = v->uv[1] = 0.0;
+    }
+    return v;
+}
+
+static
+void emit_ac3d_raster_triangle(AC3DRasterPacket *rp, int i0, int i1, int i2,
+                               const AC3DRasterTexture *tex)
+{
+    const AC3DRasterVertex *v0 = fetch_ac3d_raster_vertex(rp, i0);
+    const AC3DRasterVertex *v1 = fetch_ac3d_raster_vertex(rp, i1);
+    const AC3DRasterVertex *v2 = fetch_ac3d_raster_vertex(rp, i2);
+    int twosided = (rp->pkt->type & SURF_TWOSIDED) != 0;
+
+    if (!(rp->pkt->type & SURF_SHADED)) {
+        // Flat shading takes the color of the last vertex
+        AC3DRasterVertex f[3];
+        int k;
+        f[0] = *v0;
+        f[1] = *v1;
+        f[2] = *v2;
+        for (k=0; k<2; k++) {
+            memcpy(f[k].rgba, v2->rgba, sizeof(float)*4);
+            memcpy(f[k].back, v2->back, sizeof(float)*4);
+        }
+        add_ac3d_raster_triangle(rp->r, &f[0], &f[1], &f[2], twosided, tex);
+    } else {
+        add_ac3d_raster_triangle(rp->r, v0, v1, v2, twosided, tex);
+    }
+}
+
+static
+void emit_ac3d_raster_packet(AC3DRasterPacket *rp, const AC3DRasterTexture *tex)
+{
+    const AC3DPacket *pkt = rp->pkt;
+    int i, n = pkt->count;
+
+    if (pkt->type & PACKET_INDEXED) {
+        const AC3DObject *obj = rp->obj;
+        int first = pkt->offset, base = pkt->base;
+        for (i=0; i+2<n; i+=3)
+            emit_ac3d_raster_triangle(rp,
+                                      base + AC3D_INDEX(obj, first+i),
+                                      base + AC3D_INDEX(obj, first+i+1),
+                                      base + AC3D_INDEX(obj, first+i+2), tex);
+        return;
+    }
+
+    switch (pkt->type & 0x0f) {
+        case SURF_POLYGON:
+            for (i=0; i+2<n; i++)
+                emit_ac3d_raster_triangle(rp, 0, i+1, i+2, tex);
+            break;
+        case SURF_TRI_STRIP:
+            for (i=0; i+2<n; i++) {
+                if (i & 1)
+                    emit_ac3d_raster_triangle(rp, i+1, i, i+2, tex);
+                else
+                    emit_ac3d_raster_triangle(rp, i, i+1, i+2, tex);
+            }
+            break;
+        case SURF_TRI_LIST:
+            for (i=0; i+2<n; i+=3)
+                emit_ac3d_raster_triangle(rp, i, i+1, i+2, tex);
+            break;
+        case SURF_CLOSEDLINE:
+            for (i=0; i<n && n>1; i++)
+                add_ac3d_raster_line(rp->r, fetch_ac3d_raster_vertex(rp, i),
+                                     fetch_ac3d_raster_vertex(rp, (i+1) % n));
+            break;
+        case SURF_LINE:
+            for (i=0; i+1<n; i++)
+                add_ac3d_raster_line(rp->r, fetch_ac3d_raster_vertex(rp, i),
+                                     fetch_ac3d_raster_vertex(rp, i+1));
+            break;
+        case SURF_LINES:
+            for (i=0; i+1<n; i+=2)
+                add_ac3d_raster_line(rp->r, fetch_ac3d_raster_vertex(rp, i),
+                                     fetch_ac3d_raster_vertex(rp, i+1));
+            break;
+    }
+}
+
+// Transforms, lights and bins everything in the draw list, in its order
+static
+void emit_ac3d_raster_list(AC3DRaster *r, AC3DFile *file, AC3DRasterTexture *texs)
+{
+    static const AC3DMaterial defmat = { NULL, {0.8,0.8,0.8,1.0}, {0.2,0.2,0.2,1.0}, {0,0,0,1}, {0,0,0,1}, 0.0 };
+    const AC3DRenderOptions *opts = r->opts;
+    AC3DDrawList *list = file->drawlist;
+    AC3DRasterPacket rp;
+    AC3DCuller culler = {NULL};
+    float viewproj[16];
+    int size = 0, n, p, k;
+    float len;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.r = r;
+
+    // Objects outside the view are not transformed at all
+    mult_ac3d_matrix(viewproj, opts->projection, opts->modelview);
+    culler.viewproj = viewproj;
+
+    memcpy(rp.light, opts->light, sizeof(rp.light));
+    len = sqrtf(rp.light[0]*rp.light[0] + rp.light[1]*rp.light[1] + rp.light[2]*rp.light[2]);
+    if (len > 0.0)
+        for (k=0; k<3; k++)
+            rp.light[k] /= len;
+    rp.half[0] = rp.light[0];
+    rp.half[1] = rp.light[1];
+    rp.half[2] = rp.light[2] + 1.0;
+    normalize(rp.half);
+
+    update_ac3d_drawlist_slots(list, NULL);
+
+    for (n=0; n<list->numnodes && !r->failed;) {
+        AC3DDrawNode *node = &list->nodes[n];
+        AC3DObject *obj = node->obj;
+        const AC3DRasterTexture *ntex = texs[n].rgba ? &texs[n] : NULL;
+        int numverts;
+
+        if (!obj->enabled || !is_ac3d_node_visible(&culler, list, n)) {
+            n = node->next;
+            continue;
+        }
+        n++;
+        rp.obj = obj;
+
+        for (p=node->first; p<node->end && !r->failed; p++) {
+            const AC3DPacket *pkt = &list->packets[p];
+            float mv[16], det;
+            const float *m = mv;
+
+            if (pkt->slot >= 0)
+                mult_ac3d_matrix(mv, opts->modelview, list->slots[pkt->slot].m);
+            else
+                memcpy(mv, opts->modelview, sizeof(mv));
+            mult_ac3d_matrix(rp.mvp, opts->projection, mv);
+
+            // Inverse transpose of the upper 3x3 for the normals
+            rp.nm[0] = m[5]*m[10] - m[6]*m[9];
+            rp.nm[1] = m[6]*m[8] - m[4]*m[10];
+            rp.nm[2] = m[4]*m[9] - m[5]*m[8];
+            rp.nm[3] = m[2]*m[9] - m[1]*m[10];
+            rp.nm[4] = m[0]*m[10] - m[2]*m[8];
+            rp.nm[5] = m[1]*m[8] - m[0]*m[9];
+            rp.nm[6] = m[1]*m[6] - m[2]*m[5];
+            rp.nm[7] = m[2]*m[4] - m[0]*m[6];
+            rp.nm[8] = m[0]*m[5] - m[1]*m[4];
+            det = m[0]*rp.nm[0] + m[1]*rp.nm[1] + m[2]*rp.nm[2];
+            if (det < 0.0)
+                for (k=0; k<9; k++)
+                    rp.nm[k] = -rp.nm[k];
+
+            rp.pkt = pkt;
+            rp.mat = pkt->mat >= 0 && pkt->mat < file->nummats ? file->mats[pkt->mat] : &defmat;
+            if (pkt->type & PACKET_INDEXED) {
+                rp.base = obj->vertices;
+                numverts = obj->numvertices;
+            } else {
+                rp.base = obj->optcmds + pkt->offset;
+                numverts = pkt->count;
+            }
+
+            if (numverts > size) {
+                AC3DRasterVertex *cache = (AC3DRasterVertex*)realloc(rp.cache, sizeof(AC3DRasterVertex)*numverts);
+                int *stamps = (int*)realloc(rp.stamps, sizeof(int)*numverts);
+                if (cache)
+                    rp.cache = cache;
+                if (stamps)
+                    rp.stamps = stamps;
+                if (!cache || !stamps) {
+                    r->failed = 1;
+                    break;
+                }
+                memset(rp.stamps + size, 0, sizeof(int)*(numverts - size));
+                size = numverts;
+            }
+            rp.stamp++;
+
+            emit_ac3d_raster_packet(&rp, (pkt->type & PACKET_TEXCOORDS) ? ntex : NULL);
+        }
+    }
+
+    free(rp.cache);
+    free(rp.stamps);
+}
+
+static
+void sample_ac3d_texture(const AC3DRasterTexture *tex, float u, float v, float *rgba)
+{
+    float x = u*tex->width - 0.5, y = v*tex->height - 0.5;
+    float fx = floorf(x), fy = floorf(y);
+    int x0 = (int)fx, y0 = (int)fy;
+    float ax = x - fx, ay = y - fy;
+    const unsigned char *t[4];
+    int k;
+
+    // Repeat, as GL_REPEAT
+    x0 %= tex->width;  if (x0 < 0) x0 += tex->width;
+    y0 %= tex->height; if (y0 < 0) y0 += tex->height;
+    t[0] = &tex->rgba[(y0*tex->width + x0)*4];
+    t[1] = &tex->rgba[(y0*tex->width + (x0+1) % tex->width)*4];
+    t[2] = &tex->rgba[(((y0+1) % tex->height)*tex->width + x0)*4];
+    t[3] = &tex->rgba[(((y0+1) % tex->height)*tex->width + (x0+1) % tex->width)*4];
+
+    for (k=0; k<4; k++)
+        rgba[k] = ((t[0][k]*(1.0-ax) + t[1][k]*ax)*(1.0-ay) +
+                   (t[2][k]*(1.0-ax) + t[3][k]*ax)*ay) * (1.0/255.0);
+}
+
+static
+void put_ac3d_raster_pixel(unsigned char *dst, const float *rgba)
+{
+    float a = rgba[3];
+    int k;
+
+    if (a >= 1.0) {
+        for (k=0; k<4; k++)
+            dst[k] = (unsigned char)(rgba[k]*255.0 + 0.5);
+    } else {
+        for (k=0; k<3; k++)
+            dst[k] = (unsigned char)((rgba[k]*a + dst[k]*(1.0/255.0)*(1.0-a))*255.0 + 0.5);
+        dst[3] = (unsigned char)((a + dst[3]*(1.0/255.0)*(1.0-a))*255.0 + 0.5);
+    }
+}
+
+static
+void raster_ac3d_triangle(const AC3DRasterPrim *prim, int tx, int ty,
+                          int x0, int y0, int x1, int y1,
+                          unsigned char *color, float *depth)
+{
+    const AC3Dv4f lane = { 0.5, 1.5, 2.5, 3.5 };
+    int x, y, k, l;
+
+    // Rows of four pixels, x0 is aligned to them
+    for (y=y0; y<=y1; y++) {
+        float py = ty + y + 0.5;
+        float *drow = &depth[y*AC3D_TILE_SIZE];
+        for (x=x0 & ~3; x<=x1; x+=4) {
+            AC3Dv4f px = lane + (float)(tx + x);
+            AC3Dv4f w[3], z, d;
+            AC3Dv4i mask = { -1, -1, -1, -1 };
+
+            for (k=0; k<3; k++) {
+                w[k] = px*prim->edge[k][0] + (py*prim->edge[k][1] + prim->edge[k][2]);
+                mask &= (w[k] > 0.0f) | ((w[k] == 0.0f) & prim->topleft[k]);
+            }
+            if (!(mask[0] | mask[1] | mask[2] | mask[3]))
+                continue;
+
+            z = prim->attr[0][0] + w[1]*prim->attr[0][1] + w[2]*prim->attr[0][2];
+            d = *(AC3Dv4f*)&drow[x];
+            mask &= z < d;
+            if (!(mask[0] | mask[1] | mask[2] | mask[3]))
+                continue;
+
+            for (l=0; l<4; l++) {
+                float rgba[4], iw, b1, b2;
+                if (!mask[l] || x+l < x0 || x+l > x1)
+                    continue;
+                b1 = w[1][l];
+                b2 = w[2][l];
+                iw = 1.0 / (prim->attr[1][0] + b1*prim->attr[1][1] + b2*prim->attr[1][2]);
+                for (k=0; k<4; k++)
+                    rgba[k] = (prim->attr[2+k][0] + b1*prim->attr[2+k][1] + b2*prim->attr[2+k][2]) * iw;
+                if (prim->tex) {
+                    float texel[4];
+                    float u = (prim->attr[6][0] + b1*prim->attr[6][1] + b2*prim->attr[6][2]) * iw;
+                    float v = (prim->attr[7][0] + b1*prim->attr[7][1] + b2*prim->attr[7][2]) * iw;
+                    sample_ac3d_texture(prim->tex, u, v, texel);
+                    for (k=0; k<4; k++)
+                        rgba[k] *= texel[k];
+                }
+                for (k=0; k<4; k++)
+                    rgba[k] = rgba[k] < 0.0 ? 0.0 : rgba[k] > 1.0 ? 1.0 : rgba[k];
+                drow[x+l] = z[l];
+                put_ac3d_raster_pixel(&color[(y*AC3D_TILE_SIZE + x+l)*4], rgba);
+            }
+        }
+    }
+}
+
+// Steps one pixel at a time along the longer axis, only over the part
+// of the line inside the tile
+static
+void raster_ac3d_line(const AC3DRasterPrim *prim, int tx, int ty,
+                      int x0, int y0, int x1, int y1,
+                      unsigned char *color, float *depth)
+{
+    const float *a = prim->line[0], *b = prim->line[1];
+    float dx = b[0] - a[0], dy = b[1] - a[1];
+    float steps = fmaxf(fabsf(dx), fabsf(dy));
+    float t0 = 0.0, t1 = 1.0;
+    float rgba[4];
+    int i, n, k;
+
+    if (steps < 1.0)
+        steps = 1.0;
+
+    // Liang-Barsky against the tile
+    {
+        float p[4] = { -dx, dx, -dy, dy };
+        float q[4] = { a[0] - (tx+x0), (tx+x1+1) - a[0], a[1] - (ty+y0), (ty+y1+1) - a[1] };
+        for (k=0; k<4; k++) {
+            if (p[k] == 0.0) {
+                if (q[k] < 0.0)
+                    return;
+            } else {
+                float t = q[k] / p[k];
+                if (p[k] < 0.0) {
+                    if (t > t0) t0 = t;
+                } else {
+                    if (t < t1) t1 = t;
+                }
+            }
+        }
+        if (t0 > t1)
+            return;
+    }
+
+    for (k=0; k<4; k++)
+        rgba[k] = prim->attr[2+k][0];
+
+    n = (int)ceilf(t1*steps);
+    for (i=(int)floorf(t0*steps); i<=n; i++) {
+        float t = i / steps, z;
+        int x, y;
+        if (t > 1.0)
+            break;
+        x = (int)floorf(a[0] + dx*t) - tx;
+        y = (int)floorf(a[1] + dy*t) - ty;
+        if (x < x0 || x > x1 || y < y0 || y > y1)
+            continue;
+        z = a[2] + (b[2] - a[2])*t;
+        if (z < depth[y*AC3D_TILE_SIZE + x]) {
+            depth[y*AC3D_TILE_SIZE + x] = z;
+            put_ac3d_raster_pixel(&color[(y*AC3D_TILE_SIZE + x)*4], rgba);
+        }
+    }
+}
+
+static
+void raster_ac3d_tile(AC3DRaster *r, int tile)
+{
+    unsigned char color[AC3D_TILE_SIZE*AC3D_TILE_SIZE*4];
+    float depth[AC3D_TILE_SIZE*AC3D_TILE_SIZE] __attribute__((aligned(16)));
+    const AC3DRenderOptions *opts = r->opts;
+    AC3DRasterBin *bin = &r->bins[tile];
+    int tx = (tile % r->tilesx) * AC3D_TILE_SIZE;
+    int ty = (tile / r->tilesx) * AC3D_TILE_SIZE;
+    int tw = opts->width - tx < AC3D_TILE_SIZE ? opts->width - tx : AC3D_TILE_SIZE;
+    int th = opts->height - ty < AC3D_TILE_SIZE ? opts->height - ty : AC3D_TILE_SIZE;
+    unsigned char clear[4];
+    int i, y;
+
+    for (i=0; i<4; i++) {
+        float c = opts->clear[i] < 0.0 ? 0.0 : opts->clear[i] > 1.0 ? 1.0 : opts->clear[i];
+        clear[i] = (unsigned char)(c*255.0 + 0.5);
+    }
+    for (i=0; i<AC3D_TILE_SIZE*AC3D_TILE_SIZE; i++) {
+        memcpy(&color[i*4], clear, 4);
+        depth[i] = 1.0;
+    }
+
+    for (i=0; i<bin->count; i++) {
+        const AC3DRasterPrim *prim = &r->prims[bin->prims[i]];
+        int x0 = prim->minx - tx, y0 = prim->miny - ty;
+        int x1 = prim->maxx - tx, y1 = prim->maxy - ty;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 >= tw) x1 = tw-1;
+        if (y1 >= th) y1 = th-1;
+        if (prim->isline)
+            raster_ac3d_line(prim, tx, ty, x0, y0, x1, y1, color, depth);
+        else
+            raster_ac3d_triangle(prim, tx, ty, x0, y0, x1, y1, color, depth);
+    }
+
+    for (y=0; y<th; y++)
+        memcpy(&r->rgba[((ty+y)*opts->width + tx)*4], &color[y*AC3D_TILE_SIZE*4], tw*4);
+}
+
+static
+void *run_ac3d_raster_tiles(void *arg)
+{
+    AC3DRaster *r = (AC3DRaster*)arg;
+    int numtiles = r->tilesx * r->tilesy;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&r->next, 1)) < numtiles)
+        raster_ac3d_tile(r, i);
+
+    return NULL;
+}
+
+int render_ac3d_file(AC3DFile *file, const AC3DRenderOptions *opts, unsigned char *rgba)
+{
+    AC3DRasterTexture *texs = NULL;
+    AC3DRasterAtlas *atlases = NULL;
+    int numatlases = 0;
+    pthread_t *workers = NULL;
+    AC3DRaster raster;
+    AC3DRaster *r = &raster;
+    int numworkers = 0, threads = opts->threads;
+    int i, ok = 0;
+
+    if (opts->width <= 0 || opts->height <= 0 || !file->obj)
+        return 0;
+    if (!file->drawlist && !compile_ac3d_drawlist(file))
+        return 0;
+
+    memset(r, 0, sizeof(AC3DRaster));
+    r->opts = opts;
+    r->rgba = rgba;
+    r->tilesx = (opts->width + AC3D_TILE_SIZE-1) / AC3D_TILE_SIZE;
+    r->tilesy = (opts->height + AC3D_TILE_SIZE-1) / AC3D_TILE_SIZE;
+    r->bins = (AC3DRasterBin*)calloc(r->tilesx * r->tilesy, sizeof(AC3DRasterBin));
+    texs = (AC3DRasterTexture*)calloc(file->drawlist->numnodes, sizeof(AC3DRasterTexture));
+    if (!r->bins || !texs)
+        goto done;
+
+    // Ask for each texture once per object, atlases are put together
+    // once per render
+    for (i=0; i<file->drawlist->numnodes; i++) {
+        AC3DObject *obj = file->drawlist->nodes[i].obj;
+        if (obj->texture && opts->texture && is_ac3d_atlas(obj->texture)) {
+            AC3DRasterAtlas *atlas = NULL;
+            int k;
+            for (k=0; k<numatlases && !atlas; k++)
+                if (!strcmp(atlases[k].name, obj->texture))
+                    atlas = &atlases[k];
+            if (!atlas) {
+                atlas = (AC3DRasterAtlas*)realloc(atlases, sizeof(AC3DRasterAtlas)*(numatlases+1));
+                if (!atlas)
+                    goto done;
+                atlases = atlas;
+                atlas = &atlases[numatlases++];
+                atlas->name = obj->texture;
+                atlas->rgba = compose_ac3d_atlas(obj->texture, opts->texture, opts->userdata, 
+                                                 &atlas->width, &atlas->height);
+            }
+            if (atlas->rgba) {
+                texs[i].rgba = atlas->rgba;
+                texs[i].width = atlas->width;
+                texs[i].height = atlas->height;
+            }
+        } else if (obj->texture && opts->texture) {
+            texs[i].rgba = opts->texture(obj->texture, &texs[i].width, &texs[i].height, opts->userdata);
+            if (texs[i].width <= 0 || texs[i].height <= 0)
+                texs[i].rgba = NULL;
+        }
+    }
+
+    emit_ac3d_raster_list(r, file, texs);
+    if (r->failed)
+        goto done;
+
+    if (threads < 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > r->tilesx * r->tilesy)
+        threads = r->tilesx * r->tilesy;
+
+    if (threads > 1)
+        workers = (pthread_t*)malloc(sizeof(pthread_t)*threads);
+    if (workers) {
+        for (i=1; i<threads; i++) {
+            if (pthread_create(&workers[numworkers], NULL, run_ac3d_raster_tiles, r))
+                break;
+            numworkers++;
+        }
+    }
+
+    run_ac3d_raster_tiles(r);
+
+    for (i=0; i<numworkers; i++)
+        pthread_join(workers[i], NULL);
+    ok = 1;
+
+done:
+
+    if (r->bins) {
+        for (i=0; i<r->tilesx * r->tilesy; i++)
+            free(r->bins[i].prims);
+        free(r->bins);
+    }
+    free(r->prims);
+    free(texs);
+    for (i=0; i<numatlases; i++)
+        free(atlases[i].rgba);
+    free(atlases);
+    free(workers);
+    return ok;
+}
+
+int write_ac3d_tga(const char *filename, const unsigned char *rgba, int width, int height)
+{
+    unsigned char header[18];
+    unsigned char *row;
+    FILE *f;
+    int x, y, ok = 1;
+
+    f = fopen(filename, "wb");
+    if (!f)
+        return 0;
+
+    // Uncompressed true color, 8 alpha bits, top row first
+    memset(header, 0, sizeof(header));
+    header[2] = 2;
+    header[12] = width & 0xff;
+    header[13] = width >> 8;
+    header[14] = height & 0xff;
+    header[15] = height >> 8;
+    header[16] = 32;
+    header[17] = 0x28;
+
+    row = (unsigned char*)malloc(width*4);
+    if (!row || fwrite(header, sizeof(header), 1, f) != 1)
+        ok = 0;
+
+    for (y=0; y<height && ok; y++) {
+        for (x=0; x<width; x++) {
+            const unsigned char *src = &rgba[(y*width + x)*4];
+            row[x*4+0] = src[2];
+            row[x*4+1] = src[1];
+            row[x*4+2] = src[0];
+            row[x*4+3] = src[3];
+        }
+        if (fwrite(row, width*4, 1, f) != 1)
+            ok = 0;
+    }
+
+    free(row);
+    if (fclose(f))
+        ok = 0;
+    return ok;
+}
+
+#endif // USE_RASTERIZER